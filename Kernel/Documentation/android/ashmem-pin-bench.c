@@ -0,0 +1,177 @@
+/*
+ * ashmem-pin-bench.c: measure concurrent ASHMEM_PIN/ASHMEM_UNPIN churn
+ *
+ * For 1, 2, 4, ... up to 64 threads, every thread repeatedly unpins and
+ * pins random page windows of an ashmem region for a few seconds, the way
+ * cursor windows and image caches do, and the total ioctls/s are printed
+ * for each thread count.  By default every thread has its own region; with
+ * -S all threads share one.
+ *
+ *	./ashmem-pin-bench [-s seconds] [-m max threads] [-p pages] [-S]
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -pthread \
+ *		-o ashmem-pin-bench ashmem-pin-bench.c
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/types.h>
+
+#include "../../include/linux/ashmem.h"
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	unsigned int seed;
+	unsigned long ops;
+};
+
+static int seconds = 2;
+static int max_threads = 64;
+static int pages = 256;
+static int shared;
+static long page_size;
+static volatile int running;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int region_create(void)
+{
+	void *map;
+	int fd;
+
+	fd = open("/dev/ashmem", O_RDWR);
+	if (fd < 0) {
+		perror("open /dev/ashmem");
+		exit(1);
+	}
+	if (ioctl(fd, ASHMEM_SET_SIZE, (size_t)pages * page_size) < 0) {
+		perror("ASHMEM_SET_SIZE");
+		exit(1);
+	}
+	/* the backing file is created by the first mmap and outlives it */
+	map = mmap(NULL, (size_t)pages * page_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	memset(map, 0, (size_t)pages * page_size);
+	munmap(map, (size_t)pages * page_size);
+	return fd;
+}
+
+static void pin_ioctl(int fd, int cmd, int first, int count)
+{
+	struct ashmem_pin pin;
+
+	pin.offset = first * page_size;
+	pin.len = count * page_size;
+	if (ioctl(fd, cmd, &pin) < 0) {
+		perror(cmd == ASHMEM_PIN ? "ASHMEM_PIN" : "ASHMEM_UNPIN");
+		exit(1);
+	}
+}
+
+static void *run_worker(void *arg)
+{
+	struct worker *w = arg;
+
+	while (running) {
+		int count = 1 + rand_r(&w->seed) % 8;
+		int first = rand_r(&w->seed) % (pages - count + 1);
+
+		pin_ioctl(w->fd, ASHMEM_UNPIN, first, count);
+		pin_ioctl(w->fd, ASHMEM_PIN, first, count);
+		w->ops += 2;
+	}
+	return NULL;
+}
+
+static void run(int threads)
+{
+	struct worker *w;
+	unsigned long total = 0;
+	uint64_t start, elapsed;
+	int i, shared_fd = -1;
+
+	w = calloc(threads, sizeof(*w));
+	if (shared)
+		shared_fd = region_create();
+	for (i = 0; i < threads; i++) {
+		w[i].fd = shared ? shared_fd : region_create();
+		w[i].seed = i + 1;
+	}
+
+	running = 1;
+	start = now_ns();
+	for (i = 0; i < threads; i++)
+		pthread_create(&w[i].thread, NULL, run_worker, &w[i]);
+	sleep(seconds);
+	running = 0;
+	for (i = 0; i < threads; i++)
+		pthread_join(w[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < threads; i++) {
+		total += w[i].ops;
+		if (!shared)
+			close(w[i].fd);
+	}
+	if (shared)
+		close(shared_fd);
+
+	printf("%d threads: %.0f ops/s\n", threads, total * 1e9 / elapsed);
+	free(w);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, threads;
+
+	while ((opt = getopt(argc, argv, "s:m:p:S")) != -1) {
+		switch (opt) {
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'm':
+			max_threads = atoi(optarg);
+			break;
+		case 'p':
+			pages = atoi(optarg);
+			break;
+		case 'S':
+			shared = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s seconds] [-m max threads] "
+				"[-p pages] [-S]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (pages < 8) {
+		fprintf(stderr, "need at least 8 pages\n");
+		return 1;
+	}
+	page_size = sysconf(_SC_PAGESIZE);
+
+	for (threads = 1; threads <= max_threads; threads *= 2)
+		run(threads);
+	return 0;
+}
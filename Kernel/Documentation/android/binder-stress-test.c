@@ -0,0 +1,433 @@
+/*
+ * binder-stress-test.c: run N client/server pairs through /dev/binder
+ *
+ * Every pair consists of a server process that publishes one binder node
+ * and a client process that sends synchronous transactions to it as fast
+ * as it can.  The pairs do not share any binder object, so with per-process
+ * locking in the driver they should scale with the number of CPUs.  At the
+ * end the total number of transactions per second and the p50/p99 round
+ * trip latency over all clients are reported.  Run it once on the old and
+ * once on the new kernel to compare.
+ *
+ * The parent process becomes the binder context manager to hand the server
+ * handles to the clients, so servicemanager must not be running:
+ *
+ *	stop; ./binder-stress-test -p 4 -s 10 -b 128
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -o binder-stress-test \
+ *		binder-stress-test.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../../drivers/staging/android/binder.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define MAX_SAMPLES	(1 << 20)
+
+enum {
+	CODE_PUBLISH = 1,	/* server -> manager: flat binder, pair index */
+	CODE_LOOKUP,		/* client -> manager: pair index, reply handle */
+	CODE_PING,		/* client -> server */
+};
+
+struct pair_result {
+	unsigned long count;
+	unsigned long nsamples;
+	unsigned int samples[MAX_SAMPLES];	/* latency in us */
+};
+
+static int pairs = 1;
+static int seconds = 5;
+static size_t payload = 64;
+static struct pair_result *results;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int binder_open_dev(void)
+{
+	struct binder_version vers;
+	int fd;
+
+	fd = open("/dev/binder", O_RDWR);
+	if (fd < 0) {
+		perror("open /dev/binder");
+		exit(1);
+	}
+	if (ioctl(fd, BINDER_VERSION, &vers) < 0 ||
+	    vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder: protocol version mismatch\n");
+		exit(1);
+	}
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED) {
+		perror("mmap /dev/binder");
+		exit(1);
+	}
+	return fd;
+}
+
+static int binder_write(int fd, void *data, size_t len)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (unsigned long)data;
+	return ioctl(fd, BINDER_WRITE_READ, &bwr);
+}
+
+static void binder_cmd(int fd, uint32_t cmd, uint32_t arg)
+{
+	uint32_t buf[2] = { cmd, arg };
+
+	if (binder_write(fd, buf, sizeof(buf)) < 0) {
+		perror("binder_write");
+		exit(1);
+	}
+}
+
+static void binder_cmd_ptr_cookie(int fd, uint32_t cmd, void *ptr,
+				  void *cookie)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_ptr_cookie pc;
+	} __attribute__((packed)) buf;
+
+	buf.cmd = cmd;
+	buf.pc.ptr = ptr;
+	buf.pc.cookie = cookie;
+	if (binder_write(fd, &buf, sizeof(buf)) < 0) {
+		perror("binder_write");
+		exit(1);
+	}
+}
+
+/*
+ * Reads until a BR_TRANSACTION or BR_REPLY arrives and copies it to *txn.
+ * Reference count requests on our own nodes are acknowledged on the way.
+ */
+static uint32_t binder_wait(int fd, struct binder_transaction_data *txn)
+{
+	uint32_t readbuf[64];
+	struct binder_write_read bwr;
+
+	for (;;) {
+		uint8_t *p, *end;
+
+		memset(&bwr, 0, sizeof(bwr));
+		bwr.read_size = sizeof(readbuf);
+		bwr.read_buffer = (unsigned long)readbuf;
+		if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("binder read");
+			exit(1);
+		}
+		p = (uint8_t *)readbuf;
+		end = p + bwr.read_consumed;
+		while (p < end) {
+			uint32_t cmd = *(uint32_t *)p;
+			struct binder_ptr_cookie *pc;
+
+			p += sizeof(uint32_t);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				pc = (struct binder_ptr_cookie *)p;
+				binder_cmd_ptr_cookie(fd, cmd == BR_INCREFS ?
+						      BC_INCREFS_DONE :
+						      BC_ACQUIRE_DONE,
+						      pc->ptr, pc->cookie);
+				p += sizeof(*pc);
+				break;
+			case BR_RELEASE:
+			case BR_DECREFS:
+				p += sizeof(struct binder_ptr_cookie);
+				break;
+			case BR_TRANSACTION:
+			case BR_REPLY:
+				memcpy(txn, p, sizeof(*txn));
+				return cmd;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				fprintf(stderr, "binder: transaction failed\n");
+				exit(1);
+			default:
+				fprintf(stderr, "binder: unexpected 0x%x\n", cmd);
+				exit(1);
+			}
+		}
+	}
+}
+
+static void binder_free(int fd, const void *buffer)
+{
+	struct {
+		uint32_t cmd;
+		const void *buffer;
+	} __attribute__((packed)) buf = { BC_FREE_BUFFER, buffer };
+
+	if (binder_write(fd, &buf, sizeof(buf)) < 0) {
+		perror("binder_free");
+		exit(1);
+	}
+}
+
+static void binder_send(int fd, uint32_t cmd, uint32_t handle, uint32_t code,
+			const void *data, size_t size, const size_t *offsets,
+			size_t offsets_size)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_transaction_data txn;
+	} __attribute__((packed)) buf;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.cmd = cmd;
+	buf.txn.target.handle = handle;
+	buf.txn.code = code;
+	buf.txn.data_size = size;
+	buf.txn.offsets_size = offsets_size;
+	buf.txn.data.ptr.buffer = data;
+	buf.txn.data.ptr.offsets = offsets;
+	if (binder_write(fd, &buf, sizeof(buf)) < 0) {
+		perror("binder_send");
+		exit(1);
+	}
+}
+
+static uint32_t *handles;
+
+/*
+ * Serves n transactions: CODE_PUBLISH stores the server handle of a pair,
+ * CODE_LOOKUP hands it out to the client of that pair.
+ */
+static void run_manager(int fd, int n)
+{
+	struct binder_transaction_data txn;
+	int served = 0;
+
+	while (served < n) {
+		const struct flat_binder_object *obj;
+		struct flat_binder_object reply;
+		size_t offset = 0;
+		uint32_t idx;
+
+		if (binder_wait(fd, &txn) != BR_TRANSACTION)
+			continue;
+		idx = *(const uint32_t *)txn.data.ptr.buffer;
+		if (txn.code == CODE_PUBLISH) {
+			obj = (const void *)((const uint8_t *)
+					     txn.data.ptr.buffer + sizeof(idx));
+			handles[idx] = obj->handle;
+			binder_cmd(fd, BC_ACQUIRE, handles[idx]);
+			binder_free(fd, txn.data.ptr.buffer);
+			binder_send(fd, BC_REPLY, 0, 0, &idx, sizeof(idx),
+				    NULL, 0);
+		} else {
+			memset(&reply, 0, sizeof(reply));
+			reply.type = BINDER_TYPE_HANDLE;
+			reply.handle = handles[idx];
+			binder_free(fd, txn.data.ptr.buffer);
+			binder_send(fd, BC_REPLY, 0, 0, &reply, sizeof(reply),
+				    &offset, sizeof(offset));
+		}
+		served++;
+	}
+}
+
+static void run_server(int idx)
+{
+	struct binder_transaction_data txn;
+	struct {
+		uint32_t idx;
+		struct flat_binder_object obj;
+	} __attribute__((packed)) pub;
+	size_t offset = sizeof(uint32_t);
+	int fd = binder_open_dev();
+	char *reply = calloc(1, payload);
+
+	memset(&pub, 0, sizeof(pub));
+	pub.idx = idx;
+	pub.obj.type = BINDER_TYPE_BINDER;
+	pub.obj.binder = &pub;
+	pub.obj.cookie = &pub;
+	binder_send(fd, BC_TRANSACTION, 0, CODE_PUBLISH, &pub, sizeof(pub),
+		    &offset, sizeof(offset));
+	while (binder_wait(fd, &txn) != BR_REPLY)
+		;
+	binder_free(fd, txn.data.ptr.buffer);
+
+	binder_cmd(fd, BC_ENTER_LOOPER, 0);
+	for (;;) {
+		if (binder_wait(fd, &txn) != BR_TRANSACTION)
+			continue;
+		binder_free(fd, txn.data.ptr.buffer);
+		binder_send(fd, BC_REPLY, 0, 0, reply, payload, NULL, 0);
+	}
+}
+
+static void run_client(int idx)
+{
+	struct pair_result *res = &results[idx];
+	struct binder_transaction_data txn;
+	const struct flat_binder_object *obj;
+	uint32_t handle, key = idx;
+	char *data = calloc(1, payload);
+	uint64_t start, end, t0, t1;
+	int fd = binder_open_dev();
+
+	binder_send(fd, BC_TRANSACTION, 0, CODE_LOOKUP, &key, sizeof(key),
+		    NULL, 0);
+	while (binder_wait(fd, &txn) != BR_REPLY)
+		;
+	obj = txn.data.ptr.buffer;
+	handle = obj->handle;
+	binder_cmd(fd, BC_ACQUIRE, handle);
+	binder_free(fd, txn.data.ptr.buffer);
+
+	start = now_ns();
+	end = start + (uint64_t)seconds * 1000000000ULL;
+	do {
+		t0 = now_ns();
+		binder_send(fd, BC_TRANSACTION, handle, CODE_PING, data,
+			    payload, NULL, 0);
+		while (binder_wait(fd, &txn) != BR_REPLY)
+			;
+		binder_free(fd, txn.data.ptr.buffer);
+		t1 = now_ns();
+		if (res->nsamples < MAX_SAMPLES)
+			res->samples[res->nsamples++] = (t1 - t0) / 1000;
+		res->count++;
+	} while (t1 < end);
+	exit(0);
+}
+
+static int cmp_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(void)
+{
+	unsigned long total = 0, n = 0, i;
+	unsigned int *all;
+	int p;
+
+	for (p = 0; p < pairs; p++) {
+		total += results[p].count;
+		n += results[p].nsamples;
+	}
+	all = malloc(n * sizeof(*all));
+	if (!all || !n) {
+		fprintf(stderr, "no samples\n");
+		return;
+	}
+	n = 0;
+	for (p = 0; p < pairs; p++)
+		for (i = 0; i < results[p].nsamples; i++)
+			all[n++] = results[p].samples[i];
+	qsort(all, n, sizeof(*all), cmp_uint);
+
+	printf("pairs %d payload %zu seconds %d\n", pairs, payload, seconds);
+	printf("transactions %lu (%lu/s)\n", total, total / seconds);
+	printf("latency us: p50 %u p99 %u max %u\n",
+	       all[n / 2], all[n * 99 / 100], all[n - 1]);
+	free(all);
+}
+
+int main(int argc, char **argv)
+{
+	pid_t *servers, *clients;
+	int fd, opt, i;
+
+	while ((opt = getopt(argc, argv, "p:s:b:")) != -1) {
+		switch (opt) {
+		case 'p':
+			pairs = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'b':
+			payload = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-p pairs] [-s seconds] "
+				"[-b payload bytes]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (pairs < 1 || seconds < 1 || payload < sizeof(uint32_t) ||
+	    payload > MAP_SIZE / 4) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	results = mmap(NULL, pairs * sizeof(*results), PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED) {
+		perror("mmap results");
+		return 1;
+	}
+
+	fd = binder_open_dev();
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		perror("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+		return 1;
+	}
+	binder_cmd(fd, BC_ENTER_LOOPER, 0);
+
+	handles = calloc(pairs, sizeof(*handles));
+	servers = calloc(pairs, sizeof(*servers));
+	clients = calloc(pairs, sizeof(*clients));
+	for (i = 0; i < pairs; i++) {
+		servers[i] = fork();
+		if (servers[i] == 0)
+			run_server(i);
+	}
+	run_manager(fd, pairs);
+	for (i = 0; i < pairs; i++) {
+		clients[i] = fork();
+		if (clients[i] == 0)
+			run_client(i);
+	}
+	run_manager(fd, pairs);
+
+	for (i = 0; i < pairs; i++)
+		waitpid(clients[i], NULL, 0);
+	for (i = 0; i < pairs; i++) {
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+	}
+	report();
+	return 0;
+}
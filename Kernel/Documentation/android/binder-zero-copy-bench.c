@@ -0,0 +1,280 @@
+/*
+ * binder-zero-copy-bench.c: compare copied and TF_ZERO_COPY transactions
+ *
+ * A client sends synchronous transactions with 4KB to 1MB of page aligned
+ * data to a server and reports, for each size, the throughput and the CPU
+ * time spent by client and server per KB, once with the normal copy path
+ * and once with TF_ZERO_COPY.  The zero_copy_min module parameter of the
+ * binder driver decides from which size on the pages are really mapped.
+ *
+ * The server becomes the binder context manager, so servicemanager must
+ * not be running:
+ *
+ *	stop; ./binder-zero-copy-bench -s 2
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -o binder-zero-copy-bench \
+ *		binder-zero-copy-bench.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../../drivers/staging/android/binder.h"
+
+#define MAP_SIZE	(4 * 1024 * 1024)
+#define MIN_SIZE	(4 * 1024)
+#define MAX_SIZE	(1024 * 1024)
+
+enum {
+	CODE_DATA = 1,
+	CODE_CPU_TIME,		/* reply carries the server's CPU time in ns */
+};
+
+static int seconds = 2;
+
+static uint64_t clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int binder_open_dev(void)
+{
+	int fd;
+
+	fd = open("/dev/binder", O_RDWR);
+	if (fd < 0) {
+		perror("open /dev/binder");
+		exit(1);
+	}
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED) {
+		perror("mmap /dev/binder");
+		exit(1);
+	}
+	return fd;
+}
+
+static void binder_write(int fd, void *data, size_t len)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (unsigned long)data;
+	if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0) {
+		perror("binder write");
+		exit(1);
+	}
+}
+
+/* Reads until a BR_TRANSACTION or BR_REPLY arrives and copies it to *txn. */
+static uint32_t binder_wait(int fd, struct binder_transaction_data *txn)
+{
+	uint32_t readbuf[64];
+	struct binder_write_read bwr;
+
+	for (;;) {
+		uint8_t *p, *end;
+
+		memset(&bwr, 0, sizeof(bwr));
+		bwr.read_size = sizeof(readbuf);
+		bwr.read_buffer = (unsigned long)readbuf;
+		if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("binder read");
+			exit(1);
+		}
+		p = (uint8_t *)readbuf;
+		end = p + bwr.read_consumed;
+		while (p < end) {
+			uint32_t cmd = *(uint32_t *)p;
+
+			p += sizeof(uint32_t);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_TRANSACTION:
+			case BR_REPLY:
+				memcpy(txn, p, sizeof(*txn));
+				return cmd;
+			default:
+				fprintf(stderr, "binder: unexpected 0x%x\n", cmd);
+				exit(1);
+			}
+		}
+	}
+}
+
+static void binder_free(int fd, const void *buffer)
+{
+	struct {
+		uint32_t cmd;
+		const void *buffer;
+	} __attribute__((packed)) buf = { BC_FREE_BUFFER, buffer };
+
+	binder_write(fd, &buf, sizeof(buf));
+}
+
+static void binder_send(int fd, uint32_t cmd, uint32_t code, uint32_t flags,
+			const void *data, size_t size)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_transaction_data txn;
+	} __attribute__((packed)) buf;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.cmd = cmd;
+	buf.txn.code = code;
+	buf.txn.flags = flags;
+	buf.txn.data_size = size;
+	buf.txn.data.ptr.buffer = data;
+	binder_write(fd, &buf, sizeof(buf));
+}
+
+static void run_server(int ready)
+{
+	struct binder_transaction_data txn;
+	uint32_t enter = BC_ENTER_LOOPER;
+	volatile uint8_t sink;
+	uint64_t cpu;
+	int fd;
+
+	fd = binder_open_dev();
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		perror("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+		exit(1);
+	}
+	binder_write(fd, &enter, sizeof(enter));
+	if (write(ready, "", 1) != 1)
+		exit(1);
+	close(ready);
+
+	for (;;) {
+		if (binder_wait(fd, &txn) != BR_TRANSACTION)
+			continue;
+		/* touch the data like a real receiver would */
+		if (txn.data_size)
+			sink = *(const uint8_t *)txn.data.ptr.buffer;
+		(void)sink;
+		binder_free(fd, txn.data.ptr.buffer);
+		if (txn.code == CODE_CPU_TIME) {
+			cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+			binder_send(fd, BC_REPLY, 0, 0, &cpu, sizeof(cpu));
+		} else
+			binder_send(fd, BC_REPLY, 0, 0, NULL, 0);
+	}
+}
+
+static uint64_t call(int fd, uint32_t code, uint32_t flags, const void *data,
+		     size_t size)
+{
+	struct binder_transaction_data txn;
+	uint64_t ret = 0;
+
+	binder_send(fd, BC_TRANSACTION, code, flags, data, size);
+	while (binder_wait(fd, &txn) != BR_REPLY)
+		;
+	if (txn.data_size == sizeof(ret))
+		memcpy(&ret, txn.data.ptr.buffer, sizeof(ret));
+	binder_free(fd, txn.data.ptr.buffer);
+	return ret;
+}
+
+static void run_size(int fd, void *data, size_t size, uint32_t flags)
+{
+	uint64_t start, end, now, cpu, server_cpu;
+	unsigned long count = 0;
+	double mb, kb;
+
+	server_cpu = call(fd, CODE_CPU_TIME, 0, NULL, 0);
+	cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	start = clock_ns(CLOCK_MONOTONIC);
+	end = start + (uint64_t)seconds * 1000000000ULL;
+	do {
+		call(fd, CODE_DATA, flags, data, size);
+		count++;
+		now = clock_ns(CLOCK_MONOTONIC);
+	} while (now < end);
+	cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	server_cpu = call(fd, CODE_CPU_TIME, 0, NULL, 0) - server_cpu;
+
+	mb = (double)count * size / (1024 * 1024);
+	kb = (double)count * size / 1024;
+	printf("%-9s %7zuK %8lu %10.1f %12.0f %12.0f\n",
+	       flags & TF_ZERO_COPY ? "zerocopy" : "copy", size / 1024, count,
+	       mb * 1e9 / (now - start), cpu / kb, server_cpu / kb);
+}
+
+int main(int argc, char **argv)
+{
+	pid_t server;
+	void *data;
+	size_t size;
+	int fd, opt, ready[2];
+	char c;
+
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s seconds per size]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if (pipe(ready) < 0) {
+		perror("pipe");
+		return 1;
+	}
+	server = fork();
+	if (server == 0) {
+		close(ready[0]);
+		run_server(ready[1]);
+	}
+	close(ready[1]);
+	if (read(ready[0], &c, 1) != 1) {
+		waitpid(server, NULL, 0);
+		return 1;
+	}
+	close(ready[0]);
+
+	fd = binder_open_dev();
+	if (posix_memalign(&data, 4096, MAX_SIZE)) {
+		perror("posix_memalign");
+		return 1;
+	}
+	memset(data, 0x5a, MAX_SIZE);
+
+	printf("%-9s %8s %8s %10s %12s %12s\n", "mode", "size", "calls",
+	       "MB/s", "client ns/KB", "server ns/KB");
+	for (size = MIN_SIZE; size <= MAX_SIZE; size *= 2) {
+		run_size(fd, data, size, 0);
+		run_size(fd, data, size, TF_ZERO_COPY);
+	}
+
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+	return 0;
+}
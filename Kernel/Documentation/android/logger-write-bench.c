@@ -0,0 +1,174 @@
+/*
+ * logger-write-bench.c: measure concurrent writers on an Android log device
+ *
+ * For 1, 2, 4, ... up to 64 writer threads, every thread writes log entries
+ * shaped like liblog's (priority, tag, message) to the log device for a few
+ * seconds.  The total entries/s and a histogram of the time a single
+ * writev() took are printed for each thread count.
+ *
+ *	./logger-write-bench [-d /dev/log/main] [-s seconds] [-m max threads]
+ *		[-l message length]
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -pthread \
+ *		-o logger-write-bench logger-write-bench.c
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/* bucket i counts writes that took less than 2^i microseconds */
+#define BUCKETS		16
+
+struct writer {
+	pthread_t thread;
+	unsigned long count;
+	unsigned long hist[BUCKETS];
+	uint64_t max_ns;
+};
+
+static const char *device = "/dev/log/main";
+static int seconds = 2;
+static int max_threads = 64;
+static int msg_len = 80;
+static volatile int running;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *run_writer(void *arg)
+{
+	struct writer *w = arg;
+	unsigned char prio = 3;	/* ANDROID_LOG_DEBUG */
+	char tag[] = "logbench";
+	struct iovec iov[3];
+	char *msg;
+	int fd;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	msg = malloc(msg_len + 1);
+	memset(msg, 'x', msg_len);
+	msg[msg_len] = '\0';
+
+	iov[0].iov_base = &prio;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = tag;
+	iov[1].iov_len = sizeof(tag);
+	iov[2].iov_base = msg;
+	iov[2].iov_len = msg_len + 1;
+
+	while (running) {
+		uint64_t start, ns;
+		int b;
+
+		start = now_ns();
+		if (writev(fd, iov, 3) < 0) {
+			perror("writev");
+			exit(1);
+		}
+		ns = now_ns() - start;
+
+		for (b = 0; b < BUCKETS - 1 && ns / 1000 >= (1ULL << b); b++)
+			;
+		w->hist[b]++;
+		if (ns > w->max_ns)
+			w->max_ns = ns;
+		w->count++;
+	}
+
+	free(msg);
+	close(fd);
+	return NULL;
+}
+
+static void run(int threads)
+{
+	struct writer *w;
+	unsigned long total = 0, hist[BUCKETS];
+	uint64_t start, elapsed, max_ns = 0;
+	int i, b;
+
+	w = calloc(threads, sizeof(*w));
+	memset(hist, 0, sizeof(hist));
+
+	running = 1;
+	start = now_ns();
+	for (i = 0; i < threads; i++)
+		pthread_create(&w[i].thread, NULL, run_writer, &w[i]);
+	sleep(seconds);
+	running = 0;
+	for (i = 0; i < threads; i++)
+		pthread_join(w[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < threads; i++) {
+		total += w[i].count;
+		for (b = 0; b < BUCKETS; b++)
+			hist[b] += w[i].hist[b];
+		if (w[i].max_ns > max_ns)
+			max_ns = w[i].max_ns;
+	}
+
+	printf("%d threads: %.0f entries/s, max %llu us\n", threads,
+	       total * 1e9 / elapsed, (unsigned long long)max_ns / 1000);
+	for (b = 0; b < BUCKETS; b++) {
+		if (!hist[b])
+			continue;
+		if (b == BUCKETS - 1)
+			printf("  >= %6u us %10lu %5.1f%%\n", 1u << (b - 1),
+			       hist[b], 100.0 * hist[b] / total);
+		else
+			printf("  <  %6u us %10lu %5.1f%%\n", 1u << b,
+			       hist[b], 100.0 * hist[b] / total);
+	}
+
+	free(w);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, threads;
+
+	while ((opt = getopt(argc, argv, "d:s:m:l:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'm':
+			max_threads = atoi(optarg);
+			break;
+		case 'l':
+			msg_len = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-s seconds] "
+				"[-m max threads] [-l message length]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	for (threads = 1; threads <= max_threads; threads *= 2)
+		run(threads);
+	return 0;
+}
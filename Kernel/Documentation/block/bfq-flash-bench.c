@@ -0,0 +1,311 @@
+/*
+ * bfq-flash-bench.c: read latency of an interactive reader next to heavy
+ * writers
+ *
+ * A small fio-like job mix.  One process reads 4 KiB at random offsets of
+ * a file, with a pause between reads, the way an application being
+ * started or scrolled through reads.  It does so first on an idle device
+ * and then while writer processes copy large files sequentially.  For
+ * both phases it prints the latency of the reads (minimum, average,
+ * percentiles and maximum) and how much the writers wrote.
+ *
+ * The reads bypass the page cache with O_DIRECT, or if the filesystem
+ * does not support it, by dropping the file from the cache before each
+ * read.  The writers go through the page cache by default, so that the
+ * writes reach the device from writeback like those of a download or a
+ * copy; with -D they use O_DIRECT too.
+ *
+ * Compare schedulers, and BFQ with and without flash mode, e.g.
+ *
+ *	echo bfq > /sys/block/mmcblk0/queue/scheduler
+ *	./bfq-flash-bench -f /data/bench -d mmcblk0
+ *	echo 0 > /sys/block/mmcblk0/queue/iosched/flash
+ *	./bfq-flash-bench -f /data/bench -d mmcblk0
+ *	echo cfq > /sys/block/mmcblk0/queue/scheduler
+ *	./bfq-flash-bench -f /data/bench -d mmcblk0
+ *
+ * then
+ *
+ *	./bfq-flash-bench [-f dir] [-d device] [-s read MiB] [-w write MiB]
+ *		[-b write KiB] [-j writers] [-n reads] [-t think ms]
+ *		[-W warmup s] [-D]
+ *
+ * The files are created in the directory given with -f, which must be on
+ * the device being measured and have room for them; they are left there
+ * for the next run.
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -o bfq-flash-bench \
+ *		bfq-flash-bench.c
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static const char *dir = "/data/bench";
+static const char *device;
+static long read_mb = 64;
+static long write_mb = 256;
+static long block_kb = 1024;
+static int nwriters = 1;
+static long nreads = 1000;
+static long think_ms = 10;
+static long warmup_s = 2;
+static int direct_writes;
+
+/* bytes written by each writer, shared with the parent */
+static volatile long long *written;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void show_sysfs(const char *name)
+{
+	char path[128], line[256];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/queue/%s", device, name);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (fgets(line, sizeof(line), f))
+		printf("%s: %s", name, line);
+	fclose(f);
+}
+
+/* Create @path with @mb MiB of data, unless it is there already. */
+static void make_file(const char *path, long mb, char *buf)
+{
+	struct stat st;
+	long n;
+	int fd;
+
+	if (!stat(path, &st) && st.st_size == (off_t)mb << 20)
+		return;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die(path);
+	for (n = 0; n < mb; n++)
+		if (write(fd, buf, 1 << 20) != 1 << 20)
+			die("write");
+	if (fsync(fd))
+		die("fsync");
+	close(fd);
+}
+
+static void writer(int id, char *buf)
+{
+	long long off = 0, size = (long long)write_mb << 20;
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/write-%d", dir, id);
+	fd = open(path, O_WRONLY | O_CREAT | (direct_writes ? O_DIRECT : 0),
+		  0644);
+	if (fd < 0)
+		die(path);
+	for (;;) {
+		if (pwrite(fd, buf, block_kb * 1024, off) != block_kb * 1024)
+			die("pwrite");
+		written[id] += block_kb * 1024;
+		off += block_kb * 1024;
+		if (off + block_kb * 1024 > size) {
+			if (fsync(fd))
+				die("fsync");
+			off = 0;
+		}
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct(const uint64_t *lat, long n, int p)
+{
+	return lat[(n - 1) * p / 100] / 1e6;
+}
+
+static void reader(const char *phase, int fd, int direct, char *buf,
+		   uint64_t *lat)
+{
+	long long blocks = ((long long)read_mb << 20) / 4096;
+	long long bytes = 0;
+	unsigned int seed = 1;
+	uint64_t start, t, sum = 0;
+	long n;
+	int i;
+
+	for (i = 0; i < nwriters; i++)
+		bytes -= written[i];
+	start = now_ns();
+	for (n = 0; n < nreads; n++) {
+		off_t off = (off_t)(rand_r(&seed) % blocks) * 4096;
+
+		if (!direct)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		t = now_ns();
+		if (pread(fd, buf, 4096, off) != 4096)
+			die("pread");
+		lat[n] = now_ns() - t;
+		sum += lat[n];
+		if (think_ms)
+			usleep(think_ms * 1000);
+	}
+	t = now_ns() - start;
+	for (i = 0; i < nwriters; i++)
+		bytes += written[i];
+
+	qsort(lat, nreads, sizeof(*lat), cmp_u64);
+	printf("%-18s read ms: min %.2f avg %.2f p50 %.2f p90 %.2f "
+	       "p99 %.2f max %.2f\n", phase, lat[0] / 1e6,
+	       sum / 1e6 / nreads, pct(lat, nreads, 50), pct(lat, nreads, 90),
+	       pct(lat, nreads, 99), lat[nreads - 1] / 1e6);
+	if (bytes)
+		printf("%-18s written %.1f MB, %.2f MB/s\n", "", bytes / 1e6,
+		       bytes / 1e3 / (t / 1e6));
+}
+
+int main(int argc, char **argv)
+{
+	char path[256], *buf;
+	uint64_t *lat;
+	pid_t *pids;
+	long bufsz;
+	int fd, direct = 1, opt, i;
+
+	while ((opt = getopt(argc, argv, "f:d:s:w:b:j:n:t:W:D")) != -1) {
+		switch (opt) {
+		case 'f':
+			dir = optarg;
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 's':
+			read_mb = atol(optarg);
+			break;
+		case 'w':
+			write_mb = atol(optarg);
+			break;
+		case 'b':
+			block_kb = atol(optarg);
+			break;
+		case 'j':
+			nwriters = atoi(optarg);
+			break;
+		case 'n':
+			nreads = atol(optarg);
+			break;
+		case 't':
+			think_ms = atol(optarg);
+			break;
+		case 'W':
+			warmup_s = atol(optarg);
+			break;
+		case 'D':
+			direct_writes = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-f dir] [-d device] "
+				"[-s read MiB] [-w write MiB] [-b write KiB] "
+				"[-j writers] [-n reads] [-t think ms] "
+				"[-W warmup s] [-D]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (read_mb <= 0 || write_mb <= 0 || block_kb <= 0 ||
+	    block_kb > write_mb * 1024 || nwriters <= 0 || nreads <= 0 ||
+	    think_ms < 0 || warmup_s < 0) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	if (device) {
+		show_sysfs("scheduler");
+		show_sysfs("rotational");
+		show_sysfs("iosched/flash");
+		show_sysfs("iosched/flash_batch_kb");
+	}
+
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		die(dir);
+	/* large enough for a write and for a MiB of make_file() */
+	bufsz = block_kb * 1024 > 1 << 20 ? block_kb * 1024 : 1 << 20;
+	if (posix_memalign((void **)&buf, 4096, bufsz))
+		die("posix_memalign");
+	memset(buf, 0x5a, bufsz);
+	lat = malloc(nreads * sizeof(*lat));
+	pids = malloc(nwriters * sizeof(*pids));
+	written = mmap(NULL, nwriters * sizeof(*written),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		       -1, 0);
+	if (!lat || !pids || written == MAP_FAILED)
+		die("alloc");
+
+	snprintf(path, sizeof(path), "%s/read", dir);
+	make_file(path, read_mb, buf);
+	fd = open(path, O_RDONLY | O_DIRECT);
+	if (fd < 0 && errno == EINVAL) {
+		direct = 0;
+		fd = open(path, O_RDONLY);
+	}
+	if (fd < 0)
+		die(path);
+	if (!direct)
+		printf("no O_DIRECT, dropping the cache before each read\n");
+
+	sync();
+	reader("idle", fd, direct, buf, lat);
+
+	for (i = 0; i < nwriters; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0)
+			die("fork");
+		if (!pids[i]) {
+			writer(i, buf);
+			_exit(0);
+		}
+	}
+	sleep(warmup_s);
+	snprintf(path, sizeof(path), "%d writer%s", nwriters,
+		 nwriters > 1 ? "s" : "");
+	reader(path, fd, direct, buf, lat);
+
+	for (i = 0; i < nwriters; i++) {
+		kill(pids[i], SIGTERM);
+		waitpid(pids[i], NULL, 0);
+	}
+	close(fd);
+	free(buf);
+	free(lat);
+	free(pids);
+	return 0;
+}
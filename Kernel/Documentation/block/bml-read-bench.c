@@ -0,0 +1,240 @@
+/*
+ * bml-read-bench.c: measure read throughput and latency of a block device
+ *
+ * Written for the TinyFSR bml devices (/dev/tfsrN), but works on any block
+ * device.  For 1, 2, 4, ... up to 64 reader threads, every thread reads
+ * blocks of the given size with O_DIRECT for a few seconds, either
+ * sequentially from its own slice of the device or at random offsets with
+ * -r.  The total MB/s and a histogram of the time a single pread() took are
+ * printed for each thread count.  Compare the output with the driver's own
+ * accounting in /proc/tinyFSR/bml-latency to see how many requests were
+ * merged into one BML read.
+ *
+ * With CONFIG_TINY_FSR_RAMSIM, -V checks every read against the RAM-backed
+ * volume, whose 32-bit words hold their own byte offset divided by four;
+ * the argument is the offset of the device in the volume (0 for tfsr0/c
+ * and tfsr1, 8388608 for tfsr2 with the default ramsim_units).
+ *
+ *	./bml-read-bench [-d /dev/tfsr1] [-s seconds] [-m max threads]
+ *		[-b block size] [-r] [-V offset]
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -pthread \
+ *		-o bml-read-bench bml-read-bench.c
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+/* bucket i counts reads that took less than 2^i microseconds */
+#define BUCKETS		16
+
+struct reader {
+	pthread_t thread;
+	int index;
+	unsigned int seed;
+	unsigned long count;
+	unsigned long hist[BUCKETS];
+	uint64_t max_ns;
+};
+
+static const char *device = "/dev/tfsr1";
+static int seconds = 2;
+static int max_threads = 64;
+static size_t block_size = 4096;
+static int random_io;
+static int verify;
+static uint64_t verify_base;
+static uint64_t dev_size;
+static int nthreads;
+static volatile int running;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void check_block(const uint32_t *buf, uint64_t offset)
+{
+	size_t i;
+
+	for (i = 0; i < block_size / 4; i++) {
+		if (buf[i] != (uint32_t)((offset + i * 4) / 4)) {
+			fprintf(stderr, "bad data at %llu: %#x\n",
+				(unsigned long long)(offset + i * 4), buf[i]);
+			exit(1);
+		}
+	}
+}
+
+static void *run_reader(void *arg)
+{
+	struct reader *r = arg;
+	uint64_t blocks = dev_size / block_size;
+	uint64_t first, slice, pos = 0;
+	void *buf;
+	int fd;
+
+	fd = open(device, O_RDONLY | O_DIRECT);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	if (posix_memalign(&buf, 4096, block_size)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	slice = blocks / nthreads;
+	if (!slice)
+		slice = 1;
+	first = (r->index * slice) % blocks;
+
+	while (running) {
+		uint64_t start, ns, blk;
+		int b;
+
+		if (random_io)
+			blk = ((uint64_t)rand_r(&r->seed) << 16 ^
+			       rand_r(&r->seed)) % blocks;
+		else
+			blk = (first + pos++ % slice) % blocks;
+
+		start = now_ns();
+		if (pread(fd, buf, block_size, blk * block_size) !=
+		    (ssize_t)block_size) {
+			perror("pread");
+			exit(1);
+		}
+		ns = now_ns() - start;
+		if (verify)
+			check_block(buf, verify_base + blk * block_size);
+
+		for (b = 0; b < BUCKETS - 1 && ns / 1000 >= (1ULL << b); b++)
+			;
+		r->hist[b]++;
+		if (ns > r->max_ns)
+			r->max_ns = ns;
+		r->count++;
+	}
+
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static void run(int threads)
+{
+	struct reader *r;
+	unsigned long total = 0, hist[BUCKETS];
+	uint64_t start, elapsed, max_ns = 0;
+	int i, b;
+
+	r = calloc(threads, sizeof(*r));
+	memset(hist, 0, sizeof(hist));
+	nthreads = threads;
+
+	running = 1;
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		r[i].index = i;
+		r[i].seed = i + 1;
+		pthread_create(&r[i].thread, NULL, run_reader, &r[i]);
+	}
+	sleep(seconds);
+	running = 0;
+	for (i = 0; i < threads; i++)
+		pthread_join(r[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < threads; i++) {
+		total += r[i].count;
+		for (b = 0; b < BUCKETS; b++)
+			hist[b] += r[i].hist[b];
+		if (r[i].max_ns > max_ns)
+			max_ns = r[i].max_ns;
+	}
+
+	printf("%d threads: %.2f MB/s, %.0f reads/s, max %llu us\n", threads,
+	       (double)total * block_size * 1e3 / elapsed,
+	       total * 1e9 / elapsed, (unsigned long long)max_ns / 1000);
+	for (b = 0; b < BUCKETS; b++) {
+		if (!hist[b])
+			continue;
+		if (b == BUCKETS - 1)
+			printf("  >= %6u us %10lu %5.1f%%\n", 1u << (b - 1),
+			       hist[b], 100.0 * hist[b] / total);
+		else
+			printf("  <  %6u us %10lu %5.1f%%\n", 1u << b,
+			       hist[b], 100.0 * hist[b] / total);
+	}
+
+	free(r);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, threads, fd;
+
+	while ((opt = getopt(argc, argv, "d:s:m:b:rV:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'm':
+			max_threads = atoi(optarg);
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			random_io = 1;
+			break;
+		case 'V':
+			verify = 1;
+			verify_base = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-s seconds] "
+				"[-m max threads] [-b block size] [-r] "
+				"[-V offset]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (!block_size || block_size % 512) {
+		fprintf(stderr, "block size must be a multiple of 512\n");
+		return 1;
+	}
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0 || ioctl(fd, BLKGETSIZE64, &dev_size) < 0) {
+		perror(device);
+		return 1;
+	}
+	close(fd);
+	if (dev_size < block_size) {
+		fprintf(stderr, "%s is smaller than one block\n", device);
+		return 1;
+	}
+
+	for (threads = 1; threads <= max_threads; threads *= 2)
+		run(threads);
+	return 0;
+}
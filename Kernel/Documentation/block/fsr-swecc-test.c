@@ -0,0 +1,353 @@
+/*
+ * fsr-swecc-test.c: check and time the FSR OneNAND spare area software ECC
+ *
+ * FSR_OND_ECC_GenS() and FSR_OND_ECC_CompS() from
+ * drivers/tfsr/LLD/OND/FSR_LLD_SWEcc.c are compared with the byte at a
+ * time routines they replaced, copied below:
+ *
+ *  - the ECC of random and of patterned data must be the same,
+ *  - every single bit error in the data must be found and corrected the
+ *    same way, every single bit error in the ECC reported the same way,
+ *  - random double and triple bit errors must give the same result and
+ *    leave the same data behind.
+ *
+ * Then both versions are timed generating and checking ECC.
+ *
+ * Build and run on the host from the top of the kernel tree:
+ *
+ *	gcc -O2 -I drivers/tfsr/Inc -I drivers/tfsr/LLD/OND \
+ *		-o fsr-swecc-test Documentation/block/fsr-swecc-test.c \
+ *		drivers/tfsr/LLD/OND/FSR_LLD_SWEcc.c
+ *	./fsr-swecc-test [-n random buffers] [-b benchmark iterations]
+ *
+ * or with a static cross toolchain to time it on the target, e.g.
+ * arm-none-linux-gnueabi-gcc instead of gcc, adding -static.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define N_ERROR		0
+#define E_ERROR		1
+#define C_ERROR		-1
+#define U_ERROR		-2
+#define R_ERROR		-3
+
+/* from FSR_LLD_SWEcc.c */
+void FSR_OND_ECC_GenS(volatile uint16_t *pEcc, uint8_t *pBuf);
+int32_t FSR_OND_ECC_CompS(uint8_t *pEcc2, uint8_t *pBuf, uint32_t nSectNum);
+
+/* what FSR_LLD_SWEcc.c needs from the rest of FSR */
+volatile uint32_t gnFSRDbgZoneMask;
+
+void FSR_OAM_DbgMsg(void *pStr, ...)
+{
+}
+
+static int nrandom = 1000000;
+static int nbench = 10000000;
+static unsigned int seed = 1;
+static int failures;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the byte at a time FSR_OND_ECC_GenS() */
+static void ref_gen(uint16_t *pEcc, uint8_t *pDat8)
+{
+	uint32_t nTmp, nEcc = 0, nXorT, nP8, nP16, nP32;
+
+	nXorT = (uint8_t)(pDat8[0] ^ pDat8[1] ^ pDat8[2] ^ pDat8[3] ^
+			  pDat8[4] ^ pDat8[5] ^ pDat8[6] ^ pDat8[7]);
+	nP8 = (uint8_t)(pDat8[1] ^ pDat8[3] ^ pDat8[5] ^ pDat8[7]);
+	nP16 = (uint8_t)(pDat8[2] ^ pDat8[3] ^ pDat8[6] ^ pDat8[7]);
+	nP32 = (uint8_t)(pDat8[4] ^ pDat8[5] ^ pDat8[6] ^ pDat8[7]);
+
+	nTmp = (nP32 << 4) ^ nP32;
+	nTmp = (nTmp << 2) ^ nTmp;
+	nTmp = (nTmp << 1) ^ nTmp;
+	nEcc |= (nTmp << 4) & 0x800;
+
+	nTmp = (nP16 << 4) ^ nP16;
+	nTmp = (nTmp << 2) ^ nTmp;
+	nTmp = (nTmp << 1) ^ nTmp;
+	nEcc |= (nTmp << 2) & 0x200;
+
+	nTmp = (nP8 << 4) ^ nP8;
+	nTmp = (nTmp << 2) ^ nTmp;
+	nEcc |= ((nTmp << 1) ^ nTmp) & 0x80;
+
+	nTmp = nXorT & 0xF0;
+	nTmp ^= nTmp >> 2;
+	nEcc |= ((nTmp << 1) ^ nTmp) & 0x20;
+
+	nTmp = nXorT & 0xCC;
+	nTmp ^= nTmp >> 4;
+	nEcc |= ((nTmp << 1) ^ nTmp) & 0x08;
+
+	nTmp = nXorT & 0xAA;
+	nTmp ^= nTmp >> 4;
+	nTmp ^= nTmp >> 2;
+	nEcc |= nTmp & 0x02;
+
+	nXorT ^= nXorT >> 4;
+	nXorT ^= nXorT >> 2;
+	nXorT = (uint8_t)(((nXorT >> 1) ^ nXorT) & 0x01);
+
+	if (nXorT)
+		nEcc |= (nEcc ^ 0xAAAA) >> 1;
+	else
+		nEcc |= nEcc >> 1;
+
+	*pEcc = (uint16_t)(~nEcc | 0xF000);
+}
+
+/* the byte at a time FSR_OND_ECC_CompS(), without the messages */
+static int32_t ref_comp(uint8_t *pEcc2, uint8_t *pBuf)
+{
+	uint16_t nEccFN901, nEccFN902;
+	uint32_t nEccComp = 0, nEccSum = 0, nEBit, nEByte;
+	uint32_t nXorT1 = 0, nXorT2 = 0;
+	uint8_t *pEcc1;
+	int i;
+
+	ref_gen(&nEccFN901, pBuf);
+	pEcc1 = (uint8_t *)&nEccFN901;
+	nEccFN902 = (pEcc2[1] << 8) | pEcc2[0];
+
+	if ((nEccFN901 & 0x0FFF) == (nEccFN902 & 0x0FFF))
+		return N_ERROR;
+
+	nXorT1 ^= *pEcc1 & 0x01;
+	nXorT1 ^= (*pEcc1 >> 1) & 0x01;
+	nXorT2 ^= *pEcc2 & 0x01;
+	nXorT2 ^= (*pEcc2 >> 1) & 0x01;
+
+	nEccComp |= (~pEcc1[0] ^ ~pEcc2[0]);
+	nEccComp |= (uint16_t)(~pEcc1[1] ^ ~pEcc2[1]) << 8;
+
+	for (i = 0; i < 12; i++)
+		nEccSum += (nEccComp >> i) & 0x01;
+
+	switch (nEccSum) {
+	case 0:
+		return N_ERROR;
+	case 1:
+		return E_ERROR;
+	case 6:
+		if (nXorT1 == nXorT2)
+			return U_ERROR;
+		nEByte = (uint8_t)((nEccComp >> 9) & 0x04) +
+			 ((nEccComp >> 8) & 0x02) + ((nEccComp >> 7) & 0x01);
+		nEBit = (uint8_t)(((nEccComp >> 3) & 0x04) +
+			 ((nEccComp >> 2) & 0x02) + ((nEccComp >> 1) & 0x01));
+		pBuf[nEByte] = (uint8_t)(pBuf[nEByte] ^ (1 << nEBit));
+		if (pBuf[nEByte] & (1 << nEBit))
+			return R_ERROR;
+		return C_ERROR;
+	default:
+		return U_ERROR;
+	}
+}
+
+/* the ECC as the LLD stores it in the spare area: low byte first */
+static void store_ecc(uint8_t *ecc, uint16_t v)
+{
+	ecc[0] = (uint8_t)v;
+	ecc[1] = (uint8_t)(v >> 8);
+}
+
+static void fail(const char *what, const uint8_t *buf, const uint8_t *ecc)
+{
+	int i;
+
+	if (++failures > 20)
+		return;
+	printf("FAIL %s: data", what);
+	for (i = 0; i < 8; i++)
+		printf(" %02x", buf[i]);
+	printf(" ecc %02x %02x\n", ecc[0], ecc[1]);
+}
+
+static void check_gen(uint8_t *buf)
+{
+	volatile uint16_t ecc;
+	uint16_t ref;
+	uint8_t e[2];
+
+	ref_gen(&ref, buf);
+	FSR_OND_ECC_GenS(&ecc, buf);
+	if (ecc != ref) {
+		store_ecc(e, ref);
+		fail("gen", buf, e);
+	}
+}
+
+/* corrupt data and ECC with the given bit masks and compare both checks */
+static void check_comp(const uint8_t *good, const uint8_t *dflip,
+		       uint16_t eflip)
+{
+	uint8_t b1[8], b2[8], e1[2], e2[2];
+	uint16_t ecc;
+	int32_t r1, r2;
+	int i;
+
+	ref_gen(&ecc, (uint8_t *)good);
+	ecc ^= eflip;
+	for (i = 0; i < 8; i++)
+		b1[i] = b2[i] = good[i] ^ dflip[i];
+	store_ecc(e1, ecc);
+	store_ecc(e2, ecc);
+
+	r1 = ref_comp(e1, b1);
+	r2 = FSR_OND_ECC_CompS(e2, b2, 0);
+	if (r1 != r2 || memcmp(b1, b2, 8))
+		fail("comp", good, e1);
+}
+
+static void check_buffer(uint8_t *buf)
+{
+	uint8_t flip[8];
+	int i, j, n;
+
+	check_gen(buf);
+
+	/* no error, every single bit error in the data and in the ECC */
+	memset(flip, 0, 8);
+	check_comp(buf, flip, 0);
+	for (i = 0; i < 64; i++) {
+		flip[i / 8] = 1 << (i % 8);
+		check_comp(buf, flip, 0);
+		flip[i / 8] = 0;
+	}
+	for (i = 0; i < 16; i++)
+		check_comp(buf, flip, 1 << i);
+
+	/* a few random double and triple errors anywhere */
+	for (n = 2; n <= 3; n++) {
+		uint16_t eflip = 0;
+
+		for (j = 0; j < n; j++) {
+			i = rand_r(&seed) % 76;
+			if (i < 64)
+				flip[i / 8] ^= 1 << (i % 8);
+			else
+				eflip ^= 1 << (i - 64);
+		}
+		check_comp(buf, flip, eflip);
+		memset(flip, 0, 8);
+	}
+}
+
+static void run_tests(void)
+{
+	uint8_t buf[8];
+	int i, j;
+
+	memset(buf, 0x00, 8);
+	check_buffer(buf);
+	memset(buf, 0xff, 8);
+	check_buffer(buf);
+	for (i = 0; i < 64; i++) {
+		memset(buf, 0, 8);
+		buf[i / 8] = 1 << (i % 8);
+		check_buffer(buf);
+		memset(buf, 0xff, 8);
+		buf[i / 8] &= ~(1 << (i % 8));
+		check_buffer(buf);
+	}
+	for (i = 0; i < nrandom; i++) {
+		for (j = 0; j < 8; j++)
+			buf[j] = rand_r(&seed);
+		check_buffer(buf);
+	}
+}
+
+static void bench(void)
+{
+	static uint8_t bufs[256][8];
+	volatile uint16_t ecc;
+	uint16_t ref;
+	uint64_t t, ref_gen_ns, gen_ns, ref_comp_ns, comp_ns;
+	uint8_t e[2];
+	int i, j;
+
+	for (i = 0; i < 256; i++)
+		for (j = 0; j < 8; j++)
+			bufs[i][j] = rand_r(&seed);
+
+	t = now_ns();
+	for (i = 0; i < nbench; i++)
+		ref_gen(&ref, bufs[i & 255]);
+	ref_gen_ns = now_ns() - t;
+
+	t = now_ns();
+	for (i = 0; i < nbench; i++)
+		FSR_OND_ECC_GenS(&ecc, bufs[i & 255]);
+	gen_ns = now_ns() - t;
+
+	/* a good ECC for every check, so that no data gets corrected */
+	t = now_ns();
+	for (i = 0; i < nbench; i++) {
+		ref_gen(&ref, bufs[i & 255]);
+		store_ecc(e, ref);
+		ref_comp(e, bufs[i & 255]);
+	}
+	ref_comp_ns = now_ns() - t;
+
+	t = now_ns();
+	for (i = 0; i < nbench; i++) {
+		FSR_OND_ECC_GenS(&ecc, bufs[i & 255]);
+		store_ecc(e, ecc);
+		FSR_OND_ECC_CompS(e, bufs[i & 255], 0);
+	}
+	comp_ns = now_ns() - t;
+
+	printf("generate:         byte %6.1f ns  word %6.1f ns\n",
+	       (double)ref_gen_ns / nbench, (double)gen_ns / nbench);
+	printf("generate + check: byte %6.1f ns  word %6.1f ns\n",
+	       (double)ref_comp_ns / nbench, (double)comp_ns / nbench);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nrandom = atoi(optarg);
+			break;
+		case 'b':
+			nbench = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n random buffers] "
+				"[-b benchmark iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nrandom < 0 || nbench < 1) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	run_tests();
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("%d random buffers: ECC and corrections identical\n", nrandom);
+
+	bench();
+	return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * ramzswap-bench.c: swap out to ramzswap and back in under memory pressure
+ *
+ * Maps more anonymous memory than is free and fills it page by page, so
+ * that the first pages are swapped out to make room for the last ones.
+ * The contents look like an application heap: some pages are all zero,
+ * and the rest are words from a small dictionary mixed with random ones.
+ * Then the memory is read back, first in order and then at random, with
+ * every page checked.  For each phase it prints the time taken, the pages
+ * swapped in and out (pswpin and pswpout from /proc/vmstat), and the
+ * counters of the device in /sys/block/<dev>/.
+ *
+ * Set up the device first, e.g.
+ *
+ *	modprobe ramzswap disksize_kb=131072
+ *	mkswap /dev/ramzswap0
+ *	swapon /dev/ramzswap0
+ *
+ * then
+ *
+ *	./ramzswap-bench [-d ramzswap0] [-m MiB] [-z zero %] [-e random %]
+ *		[-r random reads]
+ *
+ * -m defaults to 1.5 times MemFree.  The lowmemorykiller may kill this
+ * process if it runs with a high oom_adj; run it with a low one.
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -o ramzswap-bench \
+ *		ramzswap-bench.c
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static const char *device = "ramzswap0";
+static long size_mb;
+static int zero_percent = 30;
+static int random_percent = 10;
+static long nrandom = 20000;
+static long page_size;
+static long npages;
+
+static const uint64_t dictionary[16] = {
+	0x0000000000000000ULL, 0x00000000ffffffffULL, 0x0000000100000000ULL,
+	0x4d4f425f54494e49ULL, 0x2e6469726f646e61ULL, 0x7765697674786574ULL,
+	0x0000000000000001ULL, 0x00000000c0ffee00ULL, 0xbeef0000beef0000ULL,
+	0x6e6f747475426761ULL, 0x0000004000000040ULL, 0x6c6c756e00000000ULL,
+	0xffffffffffffffffULL, 0x000000000000ff00ULL, 0x7463656a624f6176ULL,
+	0x0000000800000000ULL,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static long meminfo_kb(const char *name)
+{
+	char line[128];
+	long kb = -1;
+	FILE *f = fopen("/proc/meminfo", "r");
+
+	if (!f)
+		die("/proc/meminfo");
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, name, strlen(name)) &&
+		    line[strlen(name)] == ':')
+			kb = atol(line + strlen(name) + 1);
+	fclose(f);
+	return kb;
+}
+
+static long long vmstat(const char *name)
+{
+	char key[64];
+	long long val, ret = -1;
+	FILE *f = fopen("/proc/vmstat", "r");
+
+	if (!f)
+		return -1;
+	while (fscanf(f, "%63s %lld", key, &val) == 2)
+		if (!strcmp(key, name))
+			ret = val;
+	fclose(f);
+	return ret;
+}
+
+static long long dev_stat(const char *name)
+{
+	char path[128];
+	long long val = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s", device, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%lld", &val) != 1)
+		val = -1;
+	fclose(f);
+	return val;
+}
+
+/* The contents of page i, always the same for the same i */
+static void fill_page(uint64_t *p, long i)
+{
+	unsigned int seed = i * 2654435761u + 1;
+	size_t w, words = page_size / sizeof(*p);
+
+	if (rand_r(&seed) % 100 < zero_percent) {
+		memset(p, 0, page_size);
+		return;
+	}
+	for (w = 0; w < words; w++) {
+		if (rand_r(&seed) % 100 < random_percent)
+			p[w] = (uint64_t)rand_r(&seed) << 32 | rand_r(&seed);
+		else
+			p[w] = dictionary[rand_r(&seed) % 16];
+	}
+	/* so that a page swapped in from the wrong slot is noticed */
+	p[0] = i + 1;
+}
+
+static void check_page(const uint64_t *p, long i, uint64_t *scratch)
+{
+	fill_page(scratch, i);
+	if (memcmp(scratch, p, page_size)) {
+		fprintf(stderr, "page %ld has the wrong contents\n", i);
+		exit(1);
+	}
+}
+
+struct snapshot {
+	uint64_t ns;
+	long long pswpin, pswpout;
+};
+
+static void snap(struct snapshot *s)
+{
+	s->ns = now_ns();
+	s->pswpin = vmstat("pswpin");
+	s->pswpout = vmstat("pswpout");
+}
+
+static void report(const char *name, const struct snapshot *s, long pages)
+{
+	struct snapshot e;
+	double sec;
+
+	snap(&e);
+	sec = (e.ns - s->ns) / 1e9;
+	printf("%-18s %8.2f s %8.1f MB/s  pswpin %8lld  pswpout %8lld\n",
+	       name, sec, pages * (double)page_size / 1e6 / sec,
+	       e.pswpin - s->pswpin, e.pswpout - s->pswpout);
+}
+
+static void show_device(void)
+{
+	static const char *const names[] = {
+		"num_reads", "num_writes", "failed_writes", "notify_free",
+		"discarded", "zero_pages", "incompressible_pages",
+	};
+	long long orig = dev_stat("orig_data_size");
+	long long compr = dev_stat("compr_data_size");
+	long long used = dev_stat("mem_used_total");
+	size_t i;
+
+	if (orig < 0) {
+		printf("  no stats in /sys/block/%s\n", device);
+		return;
+	}
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		printf("  %-22s %lld\n", names[i], dev_stat(names[i]));
+	printf("  %-22s %lld KiB\n", "orig_data_size", orig >> 10);
+	printf("  %-22s %lld KiB\n", "compr_data_size", compr >> 10);
+	printf("  %-22s %lld KiB\n", "mem_used_total", used >> 10);
+	if (used > 0)
+		printf("  %-22s %.2f\n", "ratio", (double)orig / used);
+}
+
+int main(int argc, char **argv)
+{
+	struct snapshot s;
+	uint64_t *scratch;
+	unsigned int seed = 1;
+	char *mem;
+	long i, n;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:m:z:e:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'm':
+			size_mb = atol(optarg);
+			break;
+		case 'z':
+			zero_percent = atoi(optarg);
+			break;
+		case 'e':
+			random_percent = atoi(optarg);
+			break;
+		case 'r':
+			nrandom = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-m MiB] "
+				"[-z zero %%] [-e random %%] [-r random reads]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (size_mb < 0 || zero_percent < 0 || zero_percent > 100 ||
+	    random_percent < 0 || random_percent > 100 || nrandom < 0) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (!size_mb)
+		size_mb = meminfo_kb("MemFree") * 3 / 2 / 1024;
+	npages = (size_mb << 20) / page_size;
+	printf("%ld MiB, MemFree %ld MiB, SwapFree %ld MiB\n", size_mb,
+	       meminfo_kb("MemFree") / 1024, meminfo_kb("SwapFree") / 1024);
+
+	mem = mmap(NULL, npages * page_size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		die("mmap");
+	scratch = malloc(page_size);
+
+	snap(&s);
+	for (i = 0; i < npages; i++)
+		fill_page((uint64_t *)(mem + i * page_size), i);
+	report("fill (swap out)", &s, npages);
+
+	snap(&s);
+	for (i = 0; i < npages; i++)
+		check_page((uint64_t *)(mem + i * page_size), i, scratch);
+	report("sequential read", &s, npages);
+
+	snap(&s);
+	for (n = 0; n < nrandom; n++) {
+		i = rand_r(&seed) % npages;
+		check_page((uint64_t *)(mem + i * page_size), i, scratch);
+	}
+	report("random read", &s, nrandom);
+
+	printf("%s:\n", device);
+	show_device();
+
+	munmap(mem, npages * page_size);
+	free(scratch);
+	return 0;
+}
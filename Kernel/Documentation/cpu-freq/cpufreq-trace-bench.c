@@ -0,0 +1,505 @@
+/*
+ * cpufreq-trace-bench.c: replay a CPU load trace and see how the cpufreq
+ * governor follows it
+ *
+ * A trace is a list of segments, one per line:
+ *
+ *	<ms> <percent busy>
+ *
+ * Each segment is replayed by spinning for the given share of every
+ * period (-p, 10 ms by default) and sleeping for the rest; 0 sleeps for
+ * the whole segment.  Lines starting with '#' are skipped.  Without -t a
+ * built-in trace is used: taps, a scroll, an application start and the
+ * pauses between them.  With -R the load of the running system is
+ * recorded into a trace instead, e.g. while using the phone, in periods
+ * of a few jiffies at least:
+ *
+ *	./cpufreq-trace-bench -R 60 -p 50 > /data/use.trace
+ *
+ * A burst is a run of segments at least -b percent busy (50) after a
+ * segment that is not.  For each burst the time from its start until
+ * the CPU runs at -m kHz (scaling_max_freq by default) is measured, by
+ * reading scaling_cur_freq every millisecond while spinning.  The
+ * frequency residency over the replay comes from cpufreq_stats
+ * (CONFIG_CPU_FREQ_STAT) and is printed as a histogram, with an energy
+ * proxy: the sum of time x frequency x voltage^2 over the speeds, with
+ * the voltages given with -v (the victory table by default).  The work
+ * done by the spinning, in millions of loops, shows what was given up
+ * for it.
+ *
+ * Compare governors and tunables, e.g.
+ *
+ *	cd /sys/devices/system/cpu/cpu0/cpufreq
+ *	echo conservative > scaling_governor
+ *	./cpufreq-trace-bench -t /data/use.trace
+ *	echo interactive > scaling_governor
+ *	./cpufreq-trace-bench -t /data/use.trace
+ *
+ * then
+ *
+ *	./cpufreq-trace-bench [-t trace] [-r repeats] [-p period ms]
+ *		[-b burst percent] [-m kHz] [-v kHz:mV,...] [-c cpu]
+ *		[-R record s]
+ *
+ * Run it with nothing else busy: the measurement is of the whole CPU.
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -o cpufreq-trace-bench \
+ *		cpufreq-trace-bench.c
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SEGS	65536
+#define MAX_FREQS	32
+
+struct seg {
+	long ms;
+	int pct;
+};
+
+/* taps, a scroll and an application start, with pauses between */
+static const struct seg builtin[] = {
+	{ 2000, 0 },
+	{ 40, 100 }, { 500, 0 }, { 40, 100 }, { 500, 0 }, { 40, 100 },
+	{ 1000, 0 },
+	{ 1500, 70 }, { 300, 20 },
+	{ 1000, 0 },
+	{ 800, 100 }, { 400, 60 },
+	{ 2000, 0 },
+	{ 20, 100 }, { 300, 0 }, { 20, 100 }, { 300, 0 }, { 20, 100 },
+	{ 2000, 5 },
+};
+
+/* kHz and ARM mV of the victory table */
+static long volt_table[MAX_FREQS][2] = {
+	{ 1280000, 1300 }, { 1000000, 1250 }, { 800000, 1175 },
+	{ 400000, 1100 }, { 200000, 925 }, { 100000, 925 },
+};
+static int nvolts = 6;
+
+static struct seg *segs;
+static int nsegs;
+static int repeats = 1;
+static long period_ms = 10;
+static int burst_pct = 50;
+static long target_khz;
+static int cpu;
+static long record_s;
+
+static char cpufreq_dir[64];
+static int cur_fd = -1;
+static volatile unsigned long sink;
+static unsigned long long loops;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void sleep_ns(uint64_t ns)
+{
+	struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+	while (nanosleep(&ts, &ts))
+		;
+}
+
+static long read_long(const char *name)
+{
+	char path[128], line[64];
+	long val = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", cpufreq_dir, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fgets(line, sizeof(line), f))
+		val = atol(line);
+	fclose(f);
+	return val;
+}
+
+static void show(const char *name)
+{
+	char path[128], line[64];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", cpufreq_dir, name);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (fgets(line, sizeof(line), f))
+		printf("%s: %s", name, line);
+	fclose(f);
+}
+
+static long cur_freq(void)
+{
+	char buf[32];
+	ssize_t n;
+
+	n = pread(cur_fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+	return atol(buf);
+}
+
+/* time_in_state, in 10 ms units, and the number of transitions */
+static int read_stats(long *freq, long long *time, long long *trans)
+{
+	char path[128];
+	FILE *f;
+	int n = 0;
+
+	snprintf(path, sizeof(path), "%s/stats/time_in_state", cpufreq_dir);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (n < MAX_FREQS && fscanf(f, "%ld %lld", &freq[n], &time[n]) == 2)
+		n++;
+	fclose(f);
+	*trans = read_long("stats/total_trans");
+	return n;
+}
+
+static void load_trace(const char *path)
+{
+	char line[128];
+	FILE *f;
+	long ms;
+	int pct;
+
+	f = fopen(path, "r");
+	if (!f)
+		die(path);
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%ld %d", &ms, &pct) != 2)
+			continue;
+		if (ms <= 0 || pct < 0 || pct > 100) {
+			fprintf(stderr, "bad segment: %s", line);
+			exit(1);
+		}
+		if (nsegs == MAX_SEGS) {
+			fprintf(stderr, "trace too long\n");
+			exit(1);
+		}
+		segs[nsegs].ms = ms;
+		segs[nsegs].pct = pct;
+		nsegs++;
+	}
+	fclose(f);
+	if (!nsegs) {
+		fprintf(stderr, "%s: empty trace\n", path);
+		exit(1);
+	}
+}
+
+static void parse_volts(char *arg)
+{
+	char *tok;
+
+	nvolts = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (nvolts == MAX_FREQS ||
+		    sscanf(tok, "%ld:%ld", &volt_table[nvolts][0],
+			   &volt_table[nvolts][1]) != 2) {
+			fprintf(stderr, "bad voltage table\n");
+			exit(1);
+		}
+		nvolts++;
+	}
+}
+
+static double volts(long khz)
+{
+	int i;
+
+	for (i = 0; i < nvolts; i++)
+		if (volt_table[i][0] == khz)
+			return volt_table[i][1] / 1000.0;
+	return 0;
+}
+
+/* Print the busy percentage of the CPU every period, as a trace. */
+static void record(void)
+{
+	unsigned long long v[8], busy, total, pbusy = 0, ptotal = 0;
+	uint64_t end = now_ns() + record_s * 1000000000ULL;
+	char line[256], name[16];
+	FILE *f;
+	int i, first = 1;
+
+	snprintf(name, sizeof(name), "cpu%d", cpu);
+	printf("# recorded from /proc/stat, %s, %ld ms periods\n", name,
+	       period_ms);
+	while (now_ns() < end) {
+		f = fopen("/proc/stat", "r");
+		if (!f)
+			die("/proc/stat");
+		busy = total = 0;
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, name, strlen(name)) ||
+			    line[strlen(name)] != ' ')
+				continue;
+			memset(v, 0, sizeof(v));
+			sscanf(line + strlen(name), "%llu %llu %llu %llu %llu "
+			       "%llu %llu %llu", &v[0], &v[1], &v[2], &v[3],
+			       &v[4], &v[5], &v[6], &v[7]);
+			for (i = 0; i < 8; i++)
+				total += v[i];
+			/* all but idle and iowait */
+			busy = total - v[3] - v[4];
+		}
+		fclose(f);
+		if (!first && total > ptotal)
+			printf("%ld %llu\n", period_ms,
+			       100 * (busy - pbusy) / (total - ptotal));
+		first = 0;
+		pbusy = busy;
+		ptotal = total;
+		fflush(stdout);
+		sleep_ns(period_ms * 1000000ULL);
+	}
+}
+
+/*
+ * Spin until @end, polling the speed every millisecond.  Returns the
+ * time at which the target speed was seen, or 0.
+ */
+static uint64_t spin(uint64_t end, int watch)
+{
+	uint64_t t, next_poll = 0;
+	int k;
+
+	while ((t = now_ns()) < end) {
+		if (watch && t >= next_poll) {
+			if (cur_freq() >= target_khz)
+				watch = 0;
+			next_poll = t + 1000000;
+			if (!watch)
+				return t;
+		}
+		for (k = 0; k < 1000; k++)
+			sink++;
+		loops += 1000;
+	}
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+	long freq[MAX_FREQS], freq2[MAX_FREQS];
+	long long time[MAX_FREQS], time2[MAX_FREQS], trans, trans2, total;
+	uint64_t *ramp, start, burst_start = 0, seg_end, t, sum;
+	int nramp = 0, nbursts = 0, in_burst = 0, reached = 0;
+	int nstats, r, i, j, opt;
+	const char *trace = NULL;
+	double energy = 0, mean = 0;
+	char path[128];
+
+	while ((opt = getopt(argc, argv, "t:r:p:b:m:v:c:R:")) != -1) {
+		switch (opt) {
+		case 't':
+			trace = optarg;
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		case 'p':
+			period_ms = atol(optarg);
+			break;
+		case 'b':
+			burst_pct = atoi(optarg);
+			break;
+		case 'm':
+			target_khz = atol(optarg);
+			break;
+		case 'v':
+			parse_volts(optarg);
+			break;
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'R':
+			record_s = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t trace] [-r repeats] "
+				"[-p period ms] [-b burst percent] [-m kHz] "
+				"[-v kHz:mV,...] [-c cpu] [-R record s]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (repeats <= 0 || period_ms <= 0 || burst_pct <= 0 ||
+	    burst_pct > 100 || target_khz < 0 || cpu < 0 || record_s < 0) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	if (record_s) {
+		record();
+		return 0;
+	}
+
+	snprintf(cpufreq_dir, sizeof(cpufreq_dir),
+		 "/sys/devices/system/cpu/cpu%d/cpufreq", cpu);
+	segs = malloc(MAX_SEGS * sizeof(*segs));
+	if (!segs)
+		die("malloc");
+	if (trace) {
+		load_trace(trace);
+	} else {
+		nsegs = sizeof(builtin) / sizeof(builtin[0]);
+		memcpy(segs, builtin, sizeof(builtin));
+	}
+	for (i = 0; i < nsegs; i++)
+		nbursts += segs[i].pct >= burst_pct &&
+			(!i || segs[i - 1].pct < burst_pct);
+	ramp = malloc((nbursts * repeats + 1) * sizeof(*ramp));
+	if (!ramp)
+		die("malloc");
+
+	snprintf(path, sizeof(path), "%s/scaling_cur_freq", cpufreq_dir);
+	cur_fd = open(path, O_RDONLY);
+	if (cur_fd < 0)
+		die(path);
+	if (!target_khz)
+		target_khz = read_long("scaling_max_freq");
+	show("scaling_governor");
+	printf("target: %ld kHz, %d segments, %d bursts, %d repeats\n",
+	       target_khz, nsegs, nbursts, repeats);
+
+	nstats = read_stats(freq, time, &trans);
+	start = now_ns();
+	t = start;
+	for (r = 0; r < repeats; r++) {
+		for (i = 0; i < nsegs; i++) {
+			int busy = segs[i].pct >= burst_pct;
+
+			if (busy && !in_burst) {
+				burst_start = t;
+				in_burst = 1;
+				reached = 0;
+			} else if (!busy && in_burst) {
+				in_burst = 0;
+				if (!reached)
+					ramp[nramp++] = 0;	/* never got there */
+			}
+
+			seg_end = t + segs[i].ms * 1000000ULL;
+			if (!segs[i].pct) {
+				t = now_ns();
+				if (t < seg_end)
+					sleep_ns(seg_end - t);
+			} else {
+				uint64_t p = t, busy_ns;
+
+				busy_ns = period_ms * 1000000ULL *
+					segs[i].pct / 100;
+				while (p < seg_end) {
+					uint64_t pend = p + period_ms * 1000000ULL;
+					uint64_t got;
+
+					if (pend > seg_end)
+						pend = seg_end;
+					got = spin(p + busy_ns < pend ?
+						   p + busy_ns : pend,
+						   in_burst && !reached);
+					if (got && in_burst && !reached) {
+						reached = 1;
+						ramp[nramp++] = got - burst_start;
+					}
+					t = now_ns();
+					if (t < pend)
+						sleep_ns(pend - t);
+					p = pend;
+				}
+			}
+			t = seg_end;
+		}
+	}
+	if (in_burst && !reached)
+		ramp[nramp++] = 0;
+	t = now_ns() - start;
+
+	printf("replayed %.2f s, work %.1f Mloops\n", t / 1e9, loops / 1e6);
+
+	/* leave out the bursts that never got there */
+	for (i = 0, j = 0; i < nramp; i++)
+		if (ramp[i])
+			ramp[j++] = ramp[i];
+	if (j) {
+		qsort(ramp, j, sizeof(*ramp), cmp_u64);
+		for (i = 0, sum = 0; i < j; i++)
+			sum += ramp[i];
+		printf("time to %ld kHz: %d of %d bursts, ms: min %.1f "
+		       "avg %.1f p50 %.1f p90 %.1f max %.1f\n", target_khz, j,
+		       nbursts * repeats, ramp[0] / 1e6, sum / 1e6 / j,
+		       ramp[(j - 1) / 2] / 1e6, ramp[(j - 1) * 9 / 10] / 1e6,
+		       ramp[j - 1] / 1e6);
+	} else {
+		printf("time to %ld kHz: never reached in %d bursts\n",
+		       target_khz, nbursts * repeats);
+	}
+
+	if (!nstats || read_stats(freq2, time2, &trans2) != nstats) {
+		printf("no cpufreq_stats, no residency\n");
+		return 0;
+	}
+	for (i = 0, total = 0; i < nstats; i++) {
+		time2[i] -= time[i];
+		total += time2[i];
+	}
+	if (!total)
+		return 0;
+	printf("transitions: %lld\nresidency:\n", trans2 - trans);
+	energy = 0;
+	for (i = 0; i < nstats; i++) {
+		double share = (double)time2[i] / total, v = volts(freq2[i]);
+		char bar[51];
+
+		memset(bar, '#', sizeof(bar) - 1);
+		bar[(int)(share * 50 + 0.5)] = 0;
+		printf("  %8ld kHz %6.1f%% %s\n", freq2[i], share * 100, bar);
+		mean += share * freq2[i];
+		/* time_in_state is in 10 ms units */
+		energy += time2[i] / 100.0 * freq2[i] / 1e6 * v * v;
+	}
+	printf("mean %.0f MHz", mean / 1000);
+	if (nvolts)
+		printf(", energy proxy %.3f GHz*V^2*s", energy);
+	printf("\n");
+
+	close(cur_fd);
+	free(ramp);
+	free(segs);
+	return 0;
+}
@@ -0,0 +1,322 @@
+/*
+ * yaffs2-concurrency-bench.c: measure how much a streaming writer slows
+ * down readers on the same yaffs2 partition
+ *
+ * A set of small files is created in <dir>/bench.  Then, for 1, 2, 4, ...
+ * up to 64 reader threads, every thread does a mix of page reads of those
+ * files (after dropping them from the page cache, so every read goes
+ * through yaffs readpage), lookups of names that are not in the dcache and
+ * readdirs of the bench directory for a few seconds.  Each thread count
+ * is run twice: once alone and once next to a writer thread that streams
+ * large writes into another file on the same partition.  Reads/s, lookups/s
+ * and readdirs/s are printed for both runs, with a histogram of the time a
+ * single page read took while the writer was running.
+ *
+ * Any MTD simulator will do, e.g. on the nandsim:
+ *
+ *	modprobe nandsim first_id_byte=0xec second_id_byte=0xd3 \
+ *		third_id_byte=0x51 fourth_id_byte=0x95
+ *	mount -t yaffs2 /dev/mtdblock0 /mnt/yaffs
+ *
+ * or mount the onenand_sim partition instead, then
+ *
+ *	./yaffs2-concurrency-bench [-d /mnt/yaffs] [-s seconds]
+ *		[-m max threads] [-n files] [-b write size] [-W max MB]
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -pthread \
+ *		-o yaffs2-concurrency-bench yaffs2-concurrency-bench.c
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* bucket i counts reads that took less than 2^i microseconds */
+#define BUCKETS		16
+
+#define FILE_SIZE	(64 * 1024)
+
+struct reader {
+	pthread_t thread;
+	int index;
+	unsigned int seed;
+	unsigned long reads, lookups, readdirs;
+	unsigned long hist[BUCKETS];
+};
+
+static const char *dir = "/mnt/yaffs";
+static int seconds = 2;
+static int max_threads = 64;
+static int nfiles = 64;
+static size_t write_size = 256 * 1024;
+static int max_write_mb = 8;
+static long page_size;
+static volatile int running;
+static uint64_t written;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void create_files(void)
+{
+	char path[256], *buf;
+	int i, fd;
+
+	snprintf(path, sizeof(path), "%s/bench", dir);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		die(path);
+
+	buf = malloc(FILE_SIZE);
+	memset(buf, 0x5a, FILE_SIZE);
+	for (i = 0; i < nfiles; i++) {
+		snprintf(path, sizeof(path), "%s/bench/f%d", dir, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, buf, FILE_SIZE) != FILE_SIZE)
+			die(path);
+		close(fd);
+	}
+	free(buf);
+	sync();
+}
+
+static void read_page(struct reader *r, char *buf)
+{
+	char path[256];
+	uint64_t start, ns;
+	off_t off;
+	int fd, b;
+
+	snprintf(path, sizeof(path), "%s/bench/f%d", dir,
+		 rand_r(&r->seed) % nfiles);
+	off = (rand_r(&r->seed) % (FILE_SIZE / page_size)) * page_size;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die(path);
+	/* the pages are clean, so this makes the next read call readpage */
+	posix_fadvise(fd, off, page_size, POSIX_FADV_DONTNEED);
+
+	start = now_ns();
+	if (pread(fd, buf, page_size, off) != page_size)
+		die("pread");
+	ns = now_ns() - start;
+	close(fd);
+
+	for (b = 0; b < BUCKETS - 1 && ns / 1000 >= (1ULL << b); b++)
+		;
+	r->hist[b]++;
+	r->reads++;
+}
+
+static void lookup(struct reader *r)
+{
+	char path[256];
+	struct stat st;
+
+	/* a fresh name every time, so the dcache can't answer */
+	snprintf(path, sizeof(path), "%s/bench/missing-%d-%lu", dir, r->index,
+		 r->lookups);
+	if (stat(path, &st) == 0 || errno != ENOENT)
+		die(path);
+	r->lookups++;
+}
+
+static void list_dir(struct reader *r)
+{
+	char path[256];
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/bench", dir);
+	d = opendir(path);
+	if (!d)
+		die(path);
+	while (readdir(d))
+		;
+	closedir(d);
+	r->readdirs++;
+}
+
+static void *run_reader(void *arg)
+{
+	struct reader *r = arg;
+	char *buf = malloc(page_size);
+
+	while (running) {
+		int op = rand_r(&r->seed) % 8;
+
+		if (op < 5)
+			read_page(r, buf);
+		else if (op < 7)
+			lookup(r);
+		else
+			list_dir(r);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void *run_writer(void *arg)
+{
+	char path[256], *buf;
+	uint64_t size = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/stream", dir);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die(path);
+	buf = malloc(write_size);
+	memset(buf, 0xa5, write_size);
+
+	while (running) {
+		if (write(fd, buf, write_size) != (ssize_t)write_size)
+			die("write");
+		written += write_size;
+		size += write_size;
+		if (size >= (uint64_t)max_write_mb << 20) {
+			/* start over, which also gives the gc work to do */
+			fsync(fd);
+			if (ftruncate(fd, 0) < 0)
+				die("ftruncate");
+			lseek(fd, 0, SEEK_SET);
+			size = 0;
+		}
+	}
+
+	fsync(fd);
+	close(fd);
+	unlink(path);
+	free(buf);
+	return NULL;
+}
+
+static void run(int threads, int with_writer)
+{
+	struct reader *r;
+	unsigned long reads = 0, lookups = 0, readdirs = 0, hist[BUCKETS];
+	uint64_t start, elapsed;
+	pthread_t writer;
+	int i, b;
+
+	r = calloc(threads, sizeof(*r));
+	memset(hist, 0, sizeof(hist));
+	written = 0;
+
+	running = 1;
+	start = now_ns();
+	if (with_writer)
+		pthread_create(&writer, NULL, run_writer, NULL);
+	for (i = 0; i < threads; i++) {
+		r[i].index = i;
+		r[i].seed = i + 1;
+		pthread_create(&r[i].thread, NULL, run_reader, &r[i]);
+	}
+	sleep(seconds);
+	running = 0;
+	for (i = 0; i < threads; i++)
+		pthread_join(r[i].thread, NULL);
+	elapsed = now_ns() - start;
+	if (with_writer)
+		pthread_join(writer, NULL);
+
+	for (i = 0; i < threads; i++) {
+		reads += r[i].reads;
+		lookups += r[i].lookups;
+		readdirs += r[i].readdirs;
+		for (b = 0; b < BUCKETS; b++)
+			hist[b] += r[i].hist[b];
+	}
+
+	printf("%d readers, %s: %.0f reads/s, %.0f lookups/s, %.0f readdirs/s",
+	       threads, with_writer ? "writer" : "no writer",
+	       reads * 1e9 / elapsed, lookups * 1e9 / elapsed,
+	       readdirs * 1e9 / elapsed);
+	if (with_writer)
+		printf(", writer %.2f MB/s", written * 1e3 / elapsed);
+	printf("\n");
+
+	if (with_writer && reads) {
+		for (b = 0; b < BUCKETS; b++) {
+			if (!hist[b])
+				continue;
+			if (b == BUCKETS - 1)
+				printf("  >= %6u us %10lu %5.1f%%\n",
+				       1u << (b - 1), hist[b],
+				       100.0 * hist[b] / reads);
+			else
+				printf("  <  %6u us %10lu %5.1f%%\n", 1u << b,
+				       hist[b], 100.0 * hist[b] / reads);
+		}
+	}
+
+	free(r);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, threads;
+
+	while ((opt = getopt(argc, argv, "d:s:m:n:b:W:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'm':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			nfiles = atoi(optarg);
+			break;
+		case 'b':
+			write_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			max_write_mb = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d dir] [-s seconds] "
+				"[-m max threads] [-n files] [-b write size] "
+				"[-W max MB]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nfiles < 1 || !write_size || max_write_mb < 1) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+	page_size = sysconf(_SC_PAGESIZE);
+
+	create_files();
+
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		run(threads, 0);
+		run(threads, 1);
+	}
+	return 0;
+}
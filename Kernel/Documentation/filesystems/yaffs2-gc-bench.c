@@ -0,0 +1,250 @@
+/*
+ * yaffs2-gc-bench.c: measure how much garbage collection costs writers
+ *
+ * The partition is first aged: it is filled to the given percentage with
+ * small files, and every other one is deleted, so that most blocks are half
+ * garbage.  Then a writer rewrites random files for a few seconds with pauses
+ * in between, once with the background collector off and once with it on
+ * (written to /sys/module/yaffs/parameters/yaffs_bg_gc_free_blocks).  For
+ * each run, the histogram of the time a single write+fsync took is printed,
+ * together with the gc counters from /proc/yaffs.
+ *
+ * Any MTD simulator will do, e.g. on the nandsim:
+ *
+ *	modprobe nandsim first_id_byte=0xec second_id_byte=0xd3 \
+ *		third_id_byte=0x51 fourth_id_byte=0x95
+ *	mount -t yaffs2 /dev/mtdblock0 /mnt/yaffs
+ *
+ * or mount the onenand_sim partition instead, then
+ *
+ *	./yaffs2-gc-bench [-d /mnt/yaffs] [-s seconds] [-f fill %]
+ *		[-p pause ms] [-b free blocks]
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -o yaffs2-gc-bench \
+ *		yaffs2-gc-bench.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+
+#define GC_FREE_BLOCKS_PARAM "/sys/module/yaffs/parameters/yaffs_bg_gc_free_blocks"
+
+/* bucket i counts writes that took less than 2^i microseconds */
+#define BUCKETS		16
+
+#define FILE_SIZE	(32 * 1024)
+
+static const char *dir = "/mnt/yaffs";
+static int seconds = 10;
+static int fill_percent = 80;
+static int pause_ms = 5;
+static int free_blocks = 8;
+static int nfiles;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void file_path(char *path, size_t len, int i)
+{
+	snprintf(path, len, "%s/gc/f%d", dir, i);
+}
+
+static void write_file(int i, const char *buf)
+{
+	char path[256];
+	int fd;
+
+	file_path(path, sizeof(path), i);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die(path);
+	if (write(fd, buf, FILE_SIZE) != FILE_SIZE)
+		die("write");
+	if (fsync(fd) < 0)
+		die("fsync");
+	close(fd);
+}
+
+static void age(const char *buf)
+{
+	char path[256];
+	struct statfs st;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/gc", dir);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		die(path);
+
+	if (statfs(dir, &st) < 0)
+		die("statfs");
+	nfiles = (uint64_t)st.f_bavail * st.f_bsize / 100 * fill_percent /
+		FILE_SIZE;
+	if (nfiles < 2) {
+		fprintf(stderr, "partition too small\n");
+		exit(1);
+	}
+
+	for (i = 0; i < nfiles; i++)
+		write_file(i, buf);
+	for (i = 0; i < nfiles; i += 2) {
+		file_path(path, sizeof(path), i);
+		if (unlink(path) < 0)
+			die(path);
+	}
+	sync();
+}
+
+static int set_free_blocks(int n)
+{
+	FILE *f = fopen(GC_FREE_BLOCKS_PARAM, "w");
+
+	if (!f)
+		return -1;
+	fprintf(f, "%d\n", n);
+	return fclose(f);
+}
+
+/* print the gc lines of the first device in /proc/yaffs */
+static void show_counters(void)
+{
+	static const char *const names[] = {
+		"nGCCopies", "garbageCollections", "passiveGCs", "bgGCs",
+		"bgGCCopies", "fgGCStalls",
+	};
+	char line[256];
+	FILE *f = fopen("/proc/yaffs", "r");
+	int devs = 0;
+	size_t i;
+
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "Device ", 7) && ++devs > 1)
+			break;
+		for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+			if (!strncmp(line, names[i], strlen(names[i])) &&
+			    line[strlen(names[i])] == '.')
+				printf("  %s", line);
+	}
+	fclose(f);
+}
+
+static void run(const char *name, const char *buf)
+{
+	unsigned long writes = 0, hist[BUCKETS];
+	uint64_t start, end, t, ns, max = 0;
+	struct timespec pause;
+	unsigned int seed = 1;
+	int b;
+
+	memset(hist, 0, sizeof(hist));
+	pause.tv_sec = pause_ms / 1000;
+	pause.tv_nsec = (pause_ms % 1000) * 1000000L;
+
+	printf("%s, before:\n", name);
+	show_counters();
+
+	start = now_ns();
+	end = start + (uint64_t)seconds * 1000000000ULL;
+	while ((t = now_ns()) < end) {
+		/* only the odd files survived the ageing */
+		write_file((rand_r(&seed) % (nfiles / 2)) * 2 + 1, buf);
+		ns = now_ns() - t;
+		if (ns > max)
+			max = ns;
+		for (b = 0; b < BUCKETS - 1 && ns / 1000 >= (1ULL << b); b++)
+			;
+		hist[b]++;
+		writes++;
+		if (pause_ms)
+			nanosleep(&pause, NULL);
+	}
+
+	printf("%s: %lu writes, max %.1f ms\n", name, writes, max / 1e6);
+	for (b = 0; b < BUCKETS; b++) {
+		if (!hist[b])
+			continue;
+		if (b == BUCKETS - 1)
+			printf("  >= %6u us %10lu %5.1f%%\n", 1u << (b - 1),
+			       hist[b], 100.0 * hist[b] / writes);
+		else
+			printf("  <  %6u us %10lu %5.1f%%\n", 1u << b,
+			       hist[b], 100.0 * hist[b] / writes);
+	}
+	printf("%s, after:\n", name);
+	show_counters();
+}
+
+int main(int argc, char **argv)
+{
+	char *buf;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:s:f:p:b:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'f':
+			fill_percent = atoi(optarg);
+			break;
+		case 'p':
+			pause_ms = atoi(optarg);
+			break;
+		case 'b':
+			free_blocks = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d dir] [-s seconds] "
+				"[-f fill %%] [-p pause ms] [-b free blocks]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (seconds < 1 || fill_percent < 1 || fill_percent > 95 ||
+	    pause_ms < 0 || free_blocks < 1) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	buf = malloc(FILE_SIZE);
+	memset(buf, 0x5a, FILE_SIZE);
+	age(buf);
+
+	if (set_free_blocks(0) < 0)
+		die(GC_FREE_BLOCKS_PARAM);
+	run("inline gc", buf);
+
+	if (set_free_blocks(free_blocks) < 0)
+		die(GC_FREE_BLOCKS_PARAM);
+	/* give the collector a head start, like an idle phone would */
+	sleep(2);
+	run("background gc", buf);
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * yaffs2-mount-bench.c: measure how long a yaffs2 mount takes
+ *
+ * The partition is first filled with files if asked to.  Then the time
+ * mount(2) takes is measured a few times with the checkpoint, and a few
+ * times with "no-checkpoint-read", which forces the full backwards scan,
+ * once for every number of scan read-ahead threads given with -t (written
+ * to /sys/module/yaffs/parameters/yaffs_scan_threads).  The partition is
+ * unmounted after every mount.
+ *
+ * Use a 1GB simulated part, e.g. the nandsim
+ *
+ *	modprobe nandsim first_id_byte=0xec second_id_byte=0xd3 \
+ *		third_id_byte=0x51 fourth_id_byte=0x95
+ *
+ * or onenand_sim built with CONFIG_ONENAND_SIM_DEVICE_ID set for a 1GB
+ * part, then
+ *
+ *	./yaffs2-mount-bench [-d /dev/mtdblock0] [-m /mnt/yaffs] [-n runs]
+ *		[-f files] [-t "0 1 2 4"]
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -o yaffs2-mount-bench \
+ *		yaffs2-mount-bench.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#define SCAN_THREADS_PARAM "/sys/module/yaffs/parameters/yaffs_scan_threads"
+#define FILE_SIZE	(64 * 1024)
+
+static const char *device = "/dev/mtdblock0";
+static const char *mountpoint = "/mnt/yaffs";
+static int runs = 3;
+static int nfiles;
+static const char *thread_counts = "0 1 2 4";
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t do_mount(const char *options)
+{
+	uint64_t start, ns;
+
+	start = now_ns();
+	if (mount(device, mountpoint, "yaffs2", 0, options) < 0)
+		die("mount");
+	ns = now_ns() - start;
+	if (umount(mountpoint) < 0)
+		die("umount");
+	return ns;
+}
+
+static void fill(void)
+{
+	char path[256], *buf;
+	int i, fd;
+
+	if (mount(device, mountpoint, "yaffs2", 0, NULL) < 0)
+		die("mount");
+
+	buf = malloc(FILE_SIZE);
+	memset(buf, 0x5a, FILE_SIZE);
+	for (i = 0; i < nfiles; i++) {
+		if (i % 100 == 0) {
+			snprintf(path, sizeof(path), "%s/d%d", mountpoint,
+				 i / 100);
+			if (mkdir(path, 0755) < 0 && errno != EEXIST)
+				die(path);
+		}
+		snprintf(path, sizeof(path), "%s/d%d/f%d", mountpoint,
+			 i / 100, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die(path);
+		if (write(fd, buf, FILE_SIZE) != FILE_SIZE) {
+			fprintf(stderr, "partition full after %d files\n", i);
+			close(fd);
+			break;
+		}
+		close(fd);
+	}
+	free(buf);
+
+	if (umount(mountpoint) < 0)
+		die("umount");
+}
+
+static void run(const char *name, const char *options)
+{
+	uint64_t ns, min = ~0ULL, total = 0;
+	int i;
+
+	for (i = 0; i < runs; i++) {
+		ns = do_mount(options);
+		total += ns;
+		if (ns < min)
+			min = ns;
+	}
+	printf("%-24s min %8.1f ms  avg %8.1f ms\n", name, min / 1e6,
+	       total / 1e6 / runs);
+}
+
+static int set_scan_threads(int n)
+{
+	FILE *f = fopen(SCAN_THREADS_PARAM, "w");
+
+	if (!f)
+		return -1;
+	fprintf(f, "%d\n", n);
+	return fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	char name[64], *list, *tok;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:m:n:f:t:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'm':
+			mountpoint = optarg;
+			break;
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		case 'f':
+			nfiles = atoi(optarg);
+			break;
+		case 't':
+			thread_counts = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-m mountpoint] "
+				"[-n runs] [-f files] [-t \"threads ...\"]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (runs < 1) {
+		fprintf(stderr, "need at least one run\n");
+		return 1;
+	}
+
+	if (nfiles)
+		fill();
+
+	/* the first mount after filling may still have to scan */
+	do_mount(NULL);
+	run("checkpoint", NULL);
+
+	list = strdup(thread_counts);
+	for (tok = strtok(list, " ,"); tok; tok = strtok(NULL, " ,")) {
+		if (set_scan_threads(atoi(tok)) < 0) {
+			perror(SCAN_THREADS_PARAM);
+			break;
+		}
+		snprintf(name, sizeof(name), "scan, %s threads", tok);
+		run(name, "no-checkpoint-read");
+	}
+	free(list);
+	return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * mmc-queue-bench.c: throughput and per-request latency of an MMC card
+ *
+ * Reads the card sequentially and at random, and with -w writes it
+ * first, with O_DIRECT so that the page cache stays out of the way.  The
+ * sequential transfers are larger than the queue takes in one request,
+ * so several requests are queued at a time and the queue can prepare one
+ * while another is on the bus.  For each phase it prints the throughput,
+ * the per-request latencies the block driver keeps in
+ * /sys/block/<dev>/latency, and, with the simulated host, how busy the
+ * bus was and the gaps between transfers from /proc/mmc_sim.
+ *
+ * With the simulated host, e.g.
+ *
+ *	insmod mmc_sim.ko size_mb=128 max_segs=1
+ *	./mmc-queue-bench -d mmcblk1 -w
+ *	echo 0 > /sys/module/mmc_block/parameters/pipeline
+ *	./mmc-queue-bench -d mmcblk1 -w
+ *
+ * then
+ *
+ *	./mmc-queue-bench [-d mmcblk0] [-s MiB] [-b KiB] [-r random reads] [-w]
+ *
+ * -w overwrites the start of the card: do not use it on the moviNAND.
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -o mmc-queue-bench \
+ *		mmc-queue-bench.c
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *device = "mmcblk0";
+static long size_mb = 32;
+static long block_kb = 1024;
+static long nrandom = 2000;
+static int do_write;
+
+struct lat {
+	unsigned long requests, overlapped;
+	unsigned long prep, wait, bus, total, max;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void reset_stats(void)
+{
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/latency", device);
+	f = fopen(path, "w");
+	if (f) {
+		fputs("0\n", f);
+		fclose(f);
+	}
+	f = fopen("/proc/mmc_sim", "w");
+	if (f) {
+		fputs("0\n", f);
+		fclose(f);
+	}
+}
+
+static int read_lat(const char *dir, struct lat *l)
+{
+	char path[128], line[256], name[16];
+	int found = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/latency", device);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "%15s requests %lu overlapped %lu prep %lu "
+			   "wait %lu bus %lu total %lu max %lu", name,
+			   &l->requests, &l->overlapped, &l->prep, &l->wait,
+			   &l->bus, &l->total, &l->max) == 8 &&
+		    !strcmp(name, dir))
+			found = 1;
+	fclose(f);
+	return found;
+}
+
+static long long sim_stat(const char *name)
+{
+	char line[128];
+	long long val = -1;
+	FILE *f = fopen("/proc/mmc_sim", "r");
+
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, name, strlen(name)) &&
+		    line[strlen(name)] == '.')
+			val = atoll(strrchr(line, ' ') + 1);
+	fclose(f);
+	return val;
+}
+
+static void report(const char *phase, const char *dir, uint64_t start,
+		   long long bytes)
+{
+	double sec = (now_ns() - start) / 1e9;
+	long long busy = sim_stat("busyUs");
+	long long gaps = sim_stat("turnarounds");
+	long long gap_us = sim_stat("turnaroundUs");
+	struct lat l;
+
+	printf("%-16s %8.2f s %8.2f MB/s\n", phase, sec, bytes / 1e6 / sec);
+	if (read_lat(dir, &l))
+		printf("  requests %lu, %lu prepared during a transfer; "
+		       "avg us: prep %lu wait %lu bus %lu total %lu; "
+		       "max %lu us\n", l.requests, l.overlapped, l.prep,
+		       l.wait, l.bus, l.total, l.max);
+	if (busy >= 0)
+		printf("  bus busy %.1f%%, %lld gaps of %.1f us avg\n",
+		       busy / 1e4 / sec, gaps,
+		       gaps > 0 ? (double)gap_us / gaps : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+	char path[64];
+	long long bytes, off, blocks;
+	unsigned int seed = 1;
+	uint64_t start;
+	char *buf;
+	long n;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "d:s:b:r:w")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 's':
+			size_mb = atol(optarg);
+			break;
+		case 'b':
+			block_kb = atol(optarg);
+			break;
+		case 'r':
+			nrandom = atol(optarg);
+			break;
+		case 'w':
+			do_write = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-s MiB] "
+				"[-b KiB] [-r random reads] [-w]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (size_mb <= 0 || block_kb <= 0 || block_kb > size_mb * 1024 ||
+	    nrandom < 0) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "/dev/block/%s", device);
+	fd = open(path, (do_write ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd < 0)
+		die(path);
+	if (posix_memalign((void **)&buf, 4096, block_kb * 1024))
+		die("posix_memalign");
+	memset(buf, 0x5a, block_kb * 1024);
+	bytes = (long long)size_mb << 20;
+	blocks = bytes / (block_kb * 1024);
+
+	if (do_write) {
+		reset_stats();
+		start = now_ns();
+		for (n = 0; n < blocks; n++)
+			if (pwrite(fd, buf, block_kb * 1024,
+				   n * block_kb * 1024LL) != block_kb * 1024)
+				die("pwrite");
+		if (fsync(fd))
+			die("fsync");
+		report("sequential write", "write", start,
+		       blocks * block_kb * 1024);
+	}
+
+	reset_stats();
+	start = now_ns();
+	for (n = 0; n < blocks; n++)
+		if (pread(fd, buf, block_kb * 1024,
+			  n * block_kb * 1024LL) != block_kb * 1024)
+			die("pread");
+	report("sequential read", "read", start, blocks * block_kb * 1024);
+
+	reset_stats();
+	start = now_ns();
+	for (n = 0; n < nrandom; n++) {
+		off = (long long)(rand_r(&seed) % (bytes / 4096)) * 4096;
+		if (pread(fd, buf, 4096, off) != 4096)
+			die("pread");
+	}
+	report("random 4k read", "read", start, nrandom * 4096LL);
+
+	close(fd);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * onenand-read-bench.c: measure OneNAND read throughput through /dev/mtdN
+ *
+ * Reads the device sequentially, a page, four pages and 64KiB per read(2),
+ * then sequentially a page at a time with some work done between reads (as
+ * a filesystem does with every page it gets), then a page at a time at
+ * random.  Every pattern is run with the OneNAND read-ahead on and off
+ * (written to /sys/module/onenand/parameters/prefetch), and MB/s is printed
+ * with, when the simulator is loaded, how long the host spent waiting for
+ * array loads (hostWaitUs in /proc/onenand_sim).
+ *
+ * Use the simulator with its timing model, e.g. for a 1GB part
+ *
+ *	modprobe onenand_sim timing=1
+ *
+ * with CONFIG_ONENAND_SIM_DEVICE_ID set accordingly, then
+ *
+ *	./onenand-read-bench [-d /dev/mtd0] [-s MiB] [-n random reads]
+ *		[-w work us]
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -o onenand-read-bench \
+ *		onenand-read-bench.c
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <mtd/mtd-user.h>
+
+#define PREFETCH_PARAM	"/sys/module/onenand/parameters/prefetch"
+#define SIM_PROC	"/proc/onenand_sim"
+
+static const char *device = "/dev/mtd0";
+static int size_mb = 16;
+static int nrandom = 4096;
+static int work_us = 50;
+static struct mtd_info_user info;
+static unsigned char *buf;
+static int fd;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int set_prefetch(int on)
+{
+	FILE *f = fopen(PREFETCH_PARAM, "w");
+
+	if (!f)
+		return -1;
+	fprintf(f, "%d\n", on);
+	return fclose(f);
+}
+
+/* hostWaitUs from the simulator, or -1 without it */
+static long long host_wait_us(void)
+{
+	char line[128];
+	long long us = -1;
+	FILE *f = fopen(SIM_PROC, "r");
+
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, "hostWaitUs.", 11))
+			us = strtoll(strrchr(line, ' ') + 1, NULL, 10);
+	fclose(f);
+	return us;
+}
+
+/* busy, like a filesystem copying and checking what it read */
+static void work(void)
+{
+	uint64_t end = now_ns() + work_us * 1000ULL;
+
+	while (now_ns() < end)
+		;
+}
+
+static void read_at(off_t off, size_t len)
+{
+	if (pread(fd, buf, len, off) != (ssize_t)len)
+		die("pread");
+}
+
+static void report(const char *name, uint64_t bytes, uint64_t ns,
+		   long long wait0)
+{
+	long long wait1 = host_wait_us();
+
+	printf("  %-28s %8.2f MB/s", name, bytes * 1e3 / ns);
+	if (wait0 >= 0 && wait1 >= 0)
+		printf("  waited %8.1f ms", (wait1 - wait0) / 1e3);
+	printf("\n");
+}
+
+static void sequential(const char *name, size_t len, int with_work)
+{
+	uint64_t total = (uint64_t)size_mb << 20, start;
+	long long wait0 = host_wait_us();
+	off_t off;
+
+	start = now_ns();
+	for (off = 0; off + len <= total; off += len) {
+		read_at(off, len);
+		if (with_work)
+			work();
+	}
+	report(name, total, now_ns() - start, wait0);
+}
+
+static void random_pages(void)
+{
+	uint64_t pages = ((uint64_t)size_mb << 20) / info.writesize, start;
+	long long wait0 = host_wait_us();
+	unsigned int seed = 1;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < nrandom; i++)
+		read_at((off_t)(rand_r(&seed) % pages) * info.writesize,
+			info.writesize);
+	report("random pages", (uint64_t)nrandom * info.writesize,
+	       now_ns() - start, wait0);
+}
+
+int main(int argc, char **argv)
+{
+	char name[64];
+	int opt, on;
+
+	while ((opt = getopt(argc, argv, "d:s:n:w:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 's':
+			size_mb = atoi(optarg);
+			break;
+		case 'n':
+			nrandom = atoi(optarg);
+			break;
+		case 'w':
+			work_us = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-s MiB] "
+				"[-n random reads] [-w work us]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (size_mb < 1 || nrandom < 1 || work_us < 0) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0)
+		die(device);
+	if (ioctl(fd, MEMGETINFO, &info) < 0)
+		die("MEMGETINFO");
+	if ((uint64_t)size_mb << 20 > info.size)
+		size_mb = info.size >> 20;
+	buf = malloc(64 * 1024);
+
+	for (on = 1; on >= 0; on--) {
+		if (set_prefetch(on) < 0)
+			die(PREFETCH_PARAM);
+		printf("prefetch %s:\n", on ? "on" : "off");
+
+		sequential("sequential, 1 page", info.writesize, 0);
+		sequential("sequential, 4 pages", 4 * info.writesize, 0);
+		sequential("sequential, 64KiB", 64 * 1024, 0);
+		snprintf(name, sizeof(name), "sequential, 1 page + %d us",
+			 work_us);
+		sequential(name, info.writesize, 1);
+		random_pages();
+	}
+
+	set_prefetch(1);
+	close(fd);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * wakelock-bench.c: cost of taking and releasing wake locks from userspace
+ *
+ * Several threads take and release user wake locks through
+ * /sys/power/wake_lock and /sys/power/wake_unlock as fast as they can,
+ * the way a busy system server and its apps do.  Each thread cycles
+ * through its own set of lock names; with more names in all than
+ * /sys/module/userwakelock/parameters/max_locks, the kernel keeps
+ * freeing and creating user wake locks.  With -T the locks are taken
+ * with a timeout, so they go through the expiry tree as well.
+ *
+ * It prints the rate of lock/unlock pairs, their latency (minimum,
+ * average, percentiles and maximum), and how long a read of
+ * /proc/wakelocks takes while the threads are running.
+ *
+ *	./wakelock-bench [-j threads] [-n pairs per thread]
+ *		[-u names per thread] [-T timeout ns]
+ *
+ * Run it as root with the screen on, so the main lock is held and the
+ * phone does not suspend between runs.
+ *
+ * Build with a static cross toolchain, e.g.
+ *
+ *	arm-none-linux-gnueabi-gcc -O2 -static -o wakelock-bench \
+ *		wakelock-bench.c -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int nthreads = 4;
+static long npairs = 100000;
+static int nnames = 8;
+static long long timeout_ns;
+
+static volatile int running;
+
+struct thread {
+	pthread_t tid;
+	int id;
+	uint64_t *lat;
+	uint64_t sum;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void show_param(const char *path, const char *name)
+{
+	char line[64];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (fgets(line, sizeof(line), f))
+		printf("%s: %s", name, line);
+	fclose(f);
+}
+
+static void *storm(void *arg)
+{
+	struct thread *t = arg;
+	char buf[64];
+	int lock_fd, unlock_fd, len;
+	uint64_t start;
+	long n;
+
+	lock_fd = open("/sys/power/wake_lock", O_WRONLY);
+	unlock_fd = open("/sys/power/wake_unlock", O_WRONLY);
+	if (lock_fd < 0 || unlock_fd < 0)
+		die("/sys/power/wake_lock");
+
+	for (n = 0; n < npairs; n++) {
+		len = snprintf(buf, sizeof(buf), "bench-%d-%ld", t->id,
+			       n % nnames);
+		if (timeout_ns)
+			snprintf(buf + len, sizeof(buf) - len, " %lld",
+				 timeout_ns);
+		start = now_ns();
+		if (pwrite(lock_fd, buf, strlen(buf), 0) < 0)
+			die("wake_lock");
+		if (pwrite(unlock_fd, buf, len, 0) < 0)
+			die("wake_unlock");
+		t->lat[n] = now_ns() - start;
+		t->sum += t->lat[n];
+	}
+
+	close(lock_fd);
+	close(unlock_fd);
+	return NULL;
+}
+
+/* Time reads of /proc/wakelocks until the threads are done. */
+static void *read_stats(void *arg)
+{
+	static char buf[1 << 16];
+	uint64_t t, sum = 0, max = 0;
+	long reads = 0;
+	ssize_t len;
+	int fd;
+
+	(void)arg;
+	while (running) {
+		fd = open("/proc/wakelocks", O_RDONLY);
+		if (fd < 0)
+			return NULL;
+		t = now_ns();
+		while ((len = read(fd, buf, sizeof(buf))) > 0)
+			;
+		t = now_ns() - t;
+		close(fd);
+		sum += t;
+		if (t > max)
+			max = t;
+		reads++;
+		usleep(10000);
+	}
+	if (reads)
+		printf("/proc/wakelocks read ms: avg %.2f max %.2f "
+		       "(%ld reads)\n", sum / 1e6 / reads, max / 1e6, reads);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct(const uint64_t *lat, long n, int p)
+{
+	return lat[(n - 1) * p / 100] / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+	struct thread *threads;
+	pthread_t reader;
+	uint64_t *lat, start, sum = 0;
+	long total;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "j:n:u:T:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'n':
+			npairs = atol(optarg);
+			break;
+		case 'u':
+			nnames = atoi(optarg);
+			break;
+		case 'T':
+			timeout_ns = atoll(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-j threads] "
+				"[-n pairs per thread] [-u names per thread] "
+				"[-T timeout ns]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nthreads <= 0 || npairs <= 0 || nnames <= 0 || timeout_ns < 0) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	show_param("/sys/module/userwakelock/parameters/max_locks",
+		   "max_locks");
+	printf("%d threads, %d names each, %s\n", nthreads, nnames,
+	       timeout_ns ? "with timeout" : "no timeout");
+
+	total = nthreads * npairs;
+	lat = malloc(total * sizeof(*lat));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!lat || !threads)
+		die("alloc");
+
+	running = 1;
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		threads[i].id = i;
+		threads[i].lat = lat + i * npairs;
+		errno = pthread_create(&threads[i].tid, NULL, storm,
+				       &threads[i]);
+		if (errno)
+			die("pthread_create");
+	}
+	errno = pthread_create(&reader, NULL, read_stats, NULL);
+	if (errno)
+		die("pthread_create");
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		sum += threads[i].sum;
+	}
+	start = now_ns() - start;
+	running = 0;
+	pthread_join(reader, NULL);
+
+	qsort(lat, total, sizeof(*lat), cmp_u64);
+	printf("%.0f pairs/s\n", total / (start / 1e9));
+	printf("lock+unlock us: min %.1f avg %.1f p50 %.1f p90 %.1f "
+	       "p99 %.1f max %.1f\n", lat[0] / 1e3, sum / 1e3 / total,
+	       pct(lat, total, 50), pct(lat, total, 90),
+	       pct(lat, total, 99), lat[total - 1] / 1e3);
+	return 0;
+}
@@ -0,0 +1,23 @@
+/*
+ *  arch/arm/include/asm/idle.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __ASM_ARM_IDLE_H
+#define __ASM_ARM_IDLE_H
+
+/*
+ * Reason codes for the idle notifier, called by cpu_idle() around each
+ * call to pm_idle(): IDLE_START with interrupts off, IDLE_END once they
+ * are back on.
+ */
+#define IDLE_START 1
+#define IDLE_END 2
+
+struct notifier_block;
+void idle_notifier_register(struct notifier_block *n);
+void idle_notifier_unregister(struct notifier_block *n);
+
+#endif /* __ASM_ARM_IDLE_H */
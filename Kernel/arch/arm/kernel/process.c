@@ -24,12 +24,14 @@
 #include <linux/kallsyms.h>
 #include <linux/init.h>
 #include <linux/cpu.h>
+#include <linux/notifier.h>
 #include <linux/elfcore.h>
 #include <linux/pm.h>
 #include <linux/tick.h>
 #include <linux/utsname.h>
 #include <linux/uaccess.h>
 
+#include <asm/idle.h>
 #include <asm/leds.h>
 #include <asm/processor.h>
 #include <asm/system.h>
@@ -148,6 +150,24 @@ static void default_idle(void)
 void (*pm_idle)(void) = default_idle;
 EXPORT_SYMBOL(pm_idle);
 
+/*
+ * Lets drivers see the CPU go idle and come back whatever pm_idle is at
+ * the time, cpuidle and its drivers swap it around as they please.
+ */
+static ATOMIC_NOTIFIER_HEAD(idle_notifier);
+
+void idle_notifier_register(struct notifier_block *n)
+{
+	atomic_notifier_chain_register(&idle_notifier, n);
+}
+EXPORT_SYMBOL_GPL(idle_notifier_register);
+
+void idle_notifier_unregister(struct notifier_block *n)
+{
+	atomic_notifier_chain_unregister(&idle_notifier, n);
+}
+EXPORT_SYMBOL_GPL(idle_notifier_unregister);
+
 /*
  * The idle thread, has rather strange semantics for calling pm_idle,
  * but this is what x86 does and we need to do the same, so that
@@ -173,6 +193,8 @@ void cpu_idle(void)
 				local_irq_enable();
 				cpu_relax();
 			} else {
+				atomic_notifier_call_chain(&idle_notifier,
+							   IDLE_START, NULL);
 				stop_critical_timings();
 				pm_idle();
 				start_critical_timings();
@@ -183,6 +205,8 @@ void cpu_idle(void)
 				 */
 				WARN_ON(irqs_disabled());
 				local_irq_enable();
+				atomic_notifier_call_chain(&idle_notifier,
+							   IDLE_END, NULL);
 			}
 		}
 		leds_event(led_idle_end);
@@ -8,6 +8,7 @@
  */
 
 #include <linux/cpufreq.h>
+#include <mach/dvfs-qos.h>
 
 //extern void s5pc110_lock_power_domain(unsigned int nToken);
 
@@ -48,6 +49,7 @@ extern unsigned int S5PC11X_FREQ_TAB;
 extern unsigned int S5PC11X_MAXFREQLEVEL;
 
 extern unsigned int s5pc11x_target_frq(unsigned int pred_freq, int flag);
+extern unsigned int s5pc11x_jump_frq(unsigned int freq);
 extern int s5pc110_pm_target(unsigned int target_freq);
 extern int is_conservative_gov(void);
 extern int is_userspace_gov(void);
@@ -58,20 +60,10 @@ extern int set_voltage_dvs(enum perf_level p_lv);
 extern int s5pc110_dvfs_lock_high_hclk(unsigned int dToken);
 extern int s5pc110_dvfs_unlock_high_hclk(unsigned int dToken);
 
-#define NUMBER_OF_LOCKTOKEN 9
-
-#define DVFS_LOCK_TOKEN_1	 0
-#define DVFS_LOCK_TOKEN_2	 1
-#define DVFS_LOCK_TOKEN_3	 2
-#define DVFS_LOCK_TOKEN_4	 3
-#define DVFS_LOCK_TOKEN_5	 4
-#define DVFS_LOCK_TOKEN_6	 5
-#define DVFS_LOCK_TOKEN_7	 6
-#define DVFS_LOCK_TOKEN_8	 7
-#define DVFS_LOCK_TOKEN_9	 8
-
-void s5pc110_lock_dvfs_high_level(unsigned int nToken, enum freq_level_states freq_level);
-void s5pc110_unlock_dvfs_high_level(unsigned int nToken);
+/* for dvfs-qos.c */
+extern int s5pc11x_freq_to_level(unsigned int freq, int below);
+extern unsigned int s5pc11x_level_to_freq(int level);
+extern void s5pc11x_dvfs_qos_changed(void);
 
 #define CLK_OUT_PROBING	//TP80 on SMDKC100 board
 
@@ -0,0 +1,85 @@
+/* arch/arm/mach-s5pv210/include/mach/dvfs-qos.h
+ *
+ * S5PV210 - DVFS QoS, named minimum and maximum CPU frequency requests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+*/
+
+#ifndef __ASM_ARCH_DVFS_QOS_H
+#define __ASM_ARCH_DVFS_QOS_H
+
+#include <linux/list.h>
+#include <linux/timer.h>
+
+/*
+ * One client's constraint on the CPU frequency.  Frequencies are in kHz
+ * and 0 means no constraint; they are rounded to levels of the DVFS
+ * table, a minimum up and a maximum down.  All fields are private to
+ * dvfs-qos.c; define requests with DEFINE_DVFS_QOS_REQUEST() or
+ * dvfs_qos_init_request().
+ */
+struct dvfs_qos_request {
+	const char *name;
+	unsigned int min_freq;
+	unsigned int max_freq;
+	int min_level;			/* -1 when not counted */
+	int max_level;
+	unsigned long expires;		/* jiffies, 0 for no timeout */
+	struct timer_list timer;
+	struct list_head list;		/* on dvfs_qos_list once used */
+	unsigned long since;		/* jiffies, when it became active */
+	unsigned long held;		/* jiffies active, earlier periods */
+	unsigned int count;		/* times it became active */
+};
+
+#ifdef CONFIG_S5PV210_DVFS_QOS
+extern void dvfs_qos_timeout(unsigned long data);
+
+#define DVFS_QOS_REQUEST_INIT(_req, _name) {				\
+	.name		= _name,					\
+	.min_level	= -1,						\
+	.max_level	= -1,						\
+	.timer		= TIMER_INITIALIZER(dvfs_qos_timeout, 0,	\
+					(unsigned long)&(_req)),	\
+	.list		= LIST_HEAD_INIT((_req).list),			\
+}
+
+extern void dvfs_qos_init_request(struct dvfs_qos_request *req,
+				  const char *name);
+extern void dvfs_qos_update_request(struct dvfs_qos_request *req,
+				    unsigned int min_freq,
+				    unsigned int max_freq,
+				    unsigned int timeout_ms);
+extern void dvfs_qos_remove_request(struct dvfs_qos_request *req);
+extern int dvfs_qos_clip_level(int level);
+#else
+/* dvfs-qos.o is only built for Victory with cpufreq */
+#define DVFS_QOS_REQUEST_INIT(_req, _name) {				\
+	.name		= _name,					\
+	.min_level	= -1,						\
+	.max_level	= -1,						\
+	.list		= LIST_HEAD_INIT((_req).list),			\
+}
+
+static inline void dvfs_qos_init_request(struct dvfs_qos_request *req,
+					 const char *name) { }
+static inline void dvfs_qos_update_request(struct dvfs_qos_request *req,
+					   unsigned int min_freq,
+					   unsigned int max_freq,
+					   unsigned int timeout_ms) { }
+static inline void dvfs_qos_remove_request(struct dvfs_qos_request *req) { }
+static inline int dvfs_qos_clip_level(int level) { return level; }
+#endif
+
+#define DEFINE_DVFS_QOS_REQUEST(_req, _name)				\
+	struct dvfs_qos_request _req = DVFS_QOS_REQUEST_INIT(_req, _name)
+
+/* drop all constraints of @req; it keeps its statistics */
+static inline void dvfs_qos_release_request(struct dvfs_qos_request *req)
+{
+	dvfs_qos_update_request(req, 0, 0, 0);
+}
+
+#endif /* __ASM_ARCH_DVFS_QOS_H */
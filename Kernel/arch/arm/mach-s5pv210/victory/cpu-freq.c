@@ -35,7 +35,6 @@
 #include <linux/suspend.h>
 #endif
 
-#define ENABLE_DVFS_LOCK_HIGH 1
 #define USE_DVS
 #define GPIO_BASED_DVS
 
@@ -53,9 +52,14 @@ static spinlock_t g_dvfslock = SPIN_LOCK_UNLOCKED;
 static unsigned int s5pc11x_cpufreq_level = 3;
 unsigned int s5pc11x_cpufreq_index = 0;
 
+#ifdef CONFIG_CPU_FREQ_DEFAULT_GOV_INTERACTIVE
+static char cpufreq_governor_name[CPUFREQ_NAME_LEN] = "interactive";// default governor
+#else
 static char cpufreq_governor_name[CPUFREQ_NAME_LEN] = "conservative";// default governor
+#endif
 static char userspace_governor[CPUFREQ_NAME_LEN] = "userspace";
 static char conservative_governor[CPUFREQ_NAME_LEN] = "conservative";
+static char interactive_governor[CPUFREQ_NAME_LEN] = "interactive";
 int s5pc11x_clk_dsys_psys_change(int index);
 int s5pc11x_armclk_set_rate(struct clk *clk, unsigned long rate);
 
@@ -66,14 +70,6 @@ static struct clk * mpu_clk;
 static void inform_dvfs_clock_status(struct work_struct *work);
 static DECLARE_DELAYED_WORK(dvfs_info_print_work, inform_dvfs_clock_status);
 #endif
-#if ENABLE_DVFS_LOCK_HIGH
-unsigned int g_dvfs_high_lock_token = 0;
-static DEFINE_MUTEX(dvfs_high_lock);
-unsigned int g_dvfs_high_lock_limit = 4;
-unsigned int g_dvfslockval[NUMBER_OF_LOCKTOKEN];
-bool g_dvfs_fix_lock_limit = false; // global variable to avoid up frequency scaling 
-
-#endif //ENABLE_DVFS_LOCK_HIGH
 
 extern int store_up_down_threshold(unsigned int down_threshold_value,
 				unsigned int up_threshold_value);
@@ -199,6 +195,9 @@ static int get_dvfs_perf_level(enum freq_level_states freq_level, unsigned int *
 static int dvfs_perf_lock = 0;
 int dvfs_change_quick = 0;
 
+// set by the governor once it samples, see dvfslock_ctrl()
+int g_dbs_timer_started = 0;
+
 // jump to the given performance level
 static void set_dvfs_perf_level(unsigned int perf_level) 
 {
@@ -226,59 +225,58 @@ void set_dvfs_target_level(enum freq_level_states freq_level)
 	return;
 }
 
-#if ENABLE_DVFS_LOCK_HIGH
-//Lock and jump to the given frequency level 
-void s5pc110_lock_dvfs_high_level(unsigned int nToken, enum freq_level_states freq_level) 
+/*
+ * Level of the lowest frequency at or above @freq, or with @below of the
+ * highest one at or below it, clamped to the table.
+ */
+int s5pc11x_freq_to_level(unsigned int freq, int below)
 {
-	unsigned int nLevel, ret, perf_level=0;
-	//printk("dvfs lock with token %d\n",nToken);
-	ret = get_dvfs_perf_level(freq_level, &perf_level);
-	if(ret)
-		return;
-	nLevel = perf_level;	
-	if (nToken == DVFS_LOCK_TOKEN_6 ) nLevel--; // token for launcher , this can use 1GHz
-	// check lock corruption
-	if (g_dvfs_high_lock_token & (1 << nToken) ) printk ("\n\n[DVFSLOCK] lock token %d is already used!\n\n", nToken);
-	//mutex_lock(&dvfs_high_lock);
-	g_dvfs_high_lock_token |= (1 << nToken);
-	g_dvfslockval[nToken] = nLevel;
-	if (nLevel <  g_dvfs_high_lock_limit)
-		g_dvfs_high_lock_limit = nLevel;
-	//mutex_unlock(&dvfs_high_lock);
-	set_dvfs_perf_level(nLevel);
+	int index = 0;
+
+	struct cpufreq_frequency_table *freq_tab = s5pc110_freq_table[S5PC11X_FREQ_TAB];
+
+	if (below) {
+		while ((freq_tab[index + 1].frequency != CPUFREQ_TABLE_END) &&
+				(freq_tab[index].frequency > freq))
+			index++;
+	} else {
+		while ((freq_tab[index + 1].frequency != CPUFREQ_TABLE_END) &&
+				(freq_tab[index + 1].frequency >= freq))
+			index++;
+	}
+	return index;
 }
-EXPORT_SYMBOL(s5pc110_lock_dvfs_high_level);
 
-void s5pc110_unlock_dvfs_high_level(unsigned int nToken) 
+unsigned int s5pc11x_level_to_freq(int level)
 {
-	unsigned int i;
-	//printk("dvfs unlock with token %d\n",nToken);
-	//mutex_lock(&dvfs_high_lock);
-	g_dvfs_high_lock_token &= ~(1 << nToken);
-	g_dvfslockval[nToken] = MAXFREQ_LEVEL_SUPPORTED-1;
-	g_dvfs_high_lock_limit = MAXFREQ_LEVEL_SUPPORTED-1;
-
-	if (g_dvfs_high_lock_token) {
-		for (i=0;i<NUMBER_OF_LOCKTOKEN;i++) {
-			if (g_dvfslockval[i] < g_dvfs_high_lock_limit)  g_dvfs_high_lock_limit = g_dvfslockval[i];
-		}
-	}
+	return s5pc110_freq_table[S5PC11X_FREQ_TAB][level].frequency;
+}
 
-	//mutex_unlock(&dvfs_high_lock);
+// move into the DVFS QoS bounds on the next governor sample
+void s5pc11x_dvfs_qos_changed(void)
+{
+	unsigned long irqflags;
+	unsigned int index;
+
+	spin_lock_irqsave(&g_dvfslock, irqflags);
+	index = dvfs_qos_clip_level(s5pc11x_cpufreq_index);
+	if (index != s5pc11x_cpufreq_index) {
+		s5pc11x_cpufreq_index = index;
+		dvfs_change_quick = 1;
+	}
+	spin_unlock_irqrestore(&g_dvfslock, irqflags);
 }
-EXPORT_SYMBOL(s5pc110_unlock_dvfs_high_level);
-#endif //ENABLE_DVFS_LOCK_HIGH
 
 unsigned int s5pc11x_target_frq(unsigned int pred_freq, 
 				int flag)
 {
 	int index;
-	//unsigned long irqflags;
+	unsigned long irqflags;
 	unsigned int freq;
 
 	struct cpufreq_frequency_table *freq_tab = s5pc110_freq_table[S5PC11X_FREQ_TAB];
 	
-	spin_lock(&g_dvfslock);
+	spin_lock_irqsave(&g_dvfslock, irqflags);
 	if(freq_tab[0].frequency < pred_freq) {
 	   index = 0;	
 	   goto s5pc11x_target_frq_end;
@@ -299,26 +297,39 @@ unsigned int s5pc11x_target_frq(unsigned int pred_freq,
 	/*else {
 		index = 0; 
 	}*/
-
-	if (g_dvfs_high_lock_token) {
-		 if(g_dvfs_fix_lock_limit == true) {
-			 index = g_dvfs_high_lock_limit;// use the same level
-		 }
-		 else {
-			if (index > g_dvfs_high_lock_limit)
-				index = g_dvfs_high_lock_limit;
-		 }
-	}
 	//printk("s5pc11x_target_frq index = %d\n",index);
 
 s5pc11x_target_frq_end:
+	index = dvfs_qos_clip_level(index);
 	//spin_lock_irqsave(&g_cpufreq_lock, irqflags);
 	index = CLIP_LEVEL(index, s5pc11x_cpufreq_level);
 	s5pc11x_cpufreq_index = index;
 	//spin_unlock_irqrestore(&g_cpufreq_lock, irqflags);
 	
 	freq = freq_tab[index].frequency;
-	spin_unlock(&g_dvfslock);
+	spin_unlock_irqrestore(&g_dvfslock, irqflags);
+	return freq;
+}
+
+/*
+ * Jump straight to the lowest level at or above @freq, kept within the
+ * DVFS QoS bounds like s5pc11x_target_frq().  For governors that pick
+ * the level themselves instead of stepping through transition_state.
+ */
+unsigned int s5pc11x_jump_frq(unsigned int freq)
+{
+	int index;
+	unsigned long irqflags;
+
+	struct cpufreq_frequency_table *freq_tab = s5pc110_freq_table[S5PC11X_FREQ_TAB];
+
+	spin_lock_irqsave(&g_dvfslock, irqflags);
+	index = dvfs_qos_clip_level(s5pc11x_freq_to_level(freq, 0));
+	index = CLIP_LEVEL(index, s5pc11x_cpufreq_level);
+	s5pc11x_cpufreq_index = index;
+
+	freq = freq_tab[index].frequency;
+	spin_unlock_irqrestore(&g_dvfslock, irqflags);
 	return freq;
 }
 
@@ -326,7 +337,7 @@ s5pc11x_target_frq_end:
 int s5pc11x_target_freq_index(unsigned int freq)
 {
 	int index = 0;
-	//unsigned long irqflags;
+	unsigned long irqflags;
 	
 	struct cpufreq_frequency_table *freq_tab = s5pc110_freq_table[S5PC11X_FREQ_TAB];
 
@@ -356,10 +367,10 @@ int s5pc11x_target_freq_index(unsigned int freq)
 	}
 
 s5pc11x_target_freq_index_end:
-	spin_lock(&g_dvfslock);
+	spin_lock_irqsave(&g_dvfslock, irqflags);
 	index = CLIP_LEVEL(index, s5pc11x_cpufreq_level);
 	s5pc11x_cpufreq_index = index;
-	spin_unlock(&g_dvfslock);
+	spin_unlock_irqrestore(&g_dvfslock, irqflags);
 	
 	return index;
 } 
@@ -423,6 +434,10 @@ int is_conservative_gov(void)
         if(!strnicmp(cpufreq_governor_name, conservative_governor, CPUFREQ_NAME_LEN)) {
                 ret = 1;
         }
+        /* interactive goes through the same DVFS QoS bounds */
+        if(!strnicmp(cpufreq_governor_name, interactive_governor, CPUFREQ_NAME_LEN)) {
+                ret = 1;
+        }
        // spin_unlock_irqrestore(&g_cpufreq_lock, irqflags);
         return ret;
 }
@@ -693,7 +708,6 @@ unsigned int get_min_cpufreq(void)
 
 static int __init s5pc110_cpu_init(struct cpufreq_policy *policy)
 {
-	u32 i;
 	//unsigned long irqflags;
 
 	mpu_clk = clk_get(NULL, MPU_CLK);
@@ -711,12 +725,10 @@ static int __init s5pc110_cpu_init(struct cpufreq_policy *policy)
 		S5PC11X_FREQ_TAB = 1;
 		S5PC11X_MAXFREQLEVEL = 5;
 		MAXFREQ_LEVEL_SUPPORTED = 6;
-		g_dvfs_high_lock_limit = 5;
 #else
 		S5PC11X_FREQ_TAB = 0;
 		S5PC11X_MAXFREQLEVEL = 5;
 		MAXFREQ_LEVEL_SUPPORTED = 6;
-		g_dvfs_high_lock_limit = 5;
 #endif
 	
 	printk("S5PC11X_FREQ_TAB=%d , S5PC11X_MAXFREQLEVEL=%d\n",S5PC11X_FREQ_TAB,S5PC11X_MAXFREQLEVEL);
@@ -741,12 +753,6 @@ static int __init s5pc110_cpu_init(struct cpufreq_policy *policy)
 //	register_early_suspend(&s5pc11x_freq_suspend);	
 #endif
 
-	#if ENABLE_DVFS_LOCK_HIGH
-	/*initialise the dvfs lock level table*/
-	for(i = 0; i < NUMBER_OF_LOCKTOKEN; i++)
-		g_dvfslockval[i] = MAXFREQ_LEVEL_SUPPORTED-1;
-	#endif
-
 
 	return cpufreq_frequency_table_cpuinfo(policy, s5pc110_freq_table[S5PC11X_FREQ_TAB]);
 }
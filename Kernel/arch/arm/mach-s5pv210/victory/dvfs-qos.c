@@ -0,0 +1,270 @@
+/*
+ *  linux/arch/arm/mach-s5pv210/victory/dvfs-qos.c
+ *
+ *  DVFS QoS: named minimum and maximum CPU frequency requests, with an
+ *  optional timeout, applied by s5pc11x_target_frq() and
+ *  s5pc11x_jump_frq().
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/spinlock.h>
+#include <linux/jiffies.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include <mach/cpu-freq-v210.h>
+
+#define DVFS_QOS_LEVELS		(L7 + 1)
+
+/*
+ * Requests are counted per level of the DVFS table.  The floor in force
+ * is the lowest level, i.e. the highest frequency, some minimum asks for,
+ * and the ceiling the highest level some maximum allows; each is one bit
+ * search on the mask of levels with a count, so an update costs the same
+ * however many requests there are.  A floor wins over a lower ceiling.
+ */
+static DEFINE_SPINLOCK(dvfs_qos_lock);
+static unsigned int dvfs_qos_min_count[DVFS_QOS_LEVELS];
+static unsigned int dvfs_qos_max_count[DVFS_QOS_LEVELS];
+static unsigned long dvfs_qos_min_mask;
+static unsigned long dvfs_qos_max_mask;
+
+/* every request updated at least once, for debugfs */
+static LIST_HEAD(dvfs_qos_list);
+
+static void dvfs_qos_count(int level, unsigned int *count,
+			   unsigned long *mask, int delta)
+{
+	if (level < 0)
+		return;
+	count[level] += delta;
+	if (count[level])
+		*mask |= 1UL << level;
+	else
+		*mask &= ~(1UL << level);
+}
+
+static inline int dvfs_qos_active(struct dvfs_qos_request *req)
+{
+	return req->min_level >= 0 || req->max_level >= 0;
+}
+
+/*
+ * Move @req to its new levels and keep its statistics.  Called with
+ * dvfs_qos_lock held; returns whether the masks changed.
+ */
+static int dvfs_qos_set(struct dvfs_qos_request *req, int min_level,
+			int max_level)
+{
+	unsigned long min_mask = dvfs_qos_min_mask;
+	unsigned long max_mask = dvfs_qos_max_mask;
+	int was_active = dvfs_qos_active(req);
+
+	dvfs_qos_count(req->min_level, dvfs_qos_min_count,
+		       &dvfs_qos_min_mask, -1);
+	dvfs_qos_count(req->max_level, dvfs_qos_max_count,
+		       &dvfs_qos_max_mask, -1);
+	req->min_level = min_level;
+	req->max_level = max_level;
+	dvfs_qos_count(min_level, dvfs_qos_min_count, &dvfs_qos_min_mask, 1);
+	dvfs_qos_count(max_level, dvfs_qos_max_count, &dvfs_qos_max_mask, 1);
+
+	if (dvfs_qos_active(req) && !was_active) {
+		req->since = jiffies;
+		req->count++;
+	} else if (!dvfs_qos_active(req) && was_active) {
+		req->held += jiffies - req->since;
+	}
+
+	return min_mask != dvfs_qos_min_mask || max_mask != dvfs_qos_max_mask;
+}
+
+/**
+ * dvfs_qos_clip_level - apply the requests to a DVFS level
+ * @level: level the governor picked
+ *
+ * Returns @level raised to the ceiling and then lowered to the floor.
+ */
+int dvfs_qos_clip_level(int level)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dvfs_qos_lock, flags);
+	if (dvfs_qos_max_mask && level < __fls(dvfs_qos_max_mask))
+		level = __fls(dvfs_qos_max_mask);
+	if (dvfs_qos_min_mask && level > __ffs(dvfs_qos_min_mask))
+		level = __ffs(dvfs_qos_min_mask);
+	spin_unlock_irqrestore(&dvfs_qos_lock, flags);
+
+	return level;
+}
+
+/**
+ * dvfs_qos_init_request - set up a request at run time
+ * @req: the request, e.g. in a driver's private data
+ * @name: shown in debugfs; must outlive the request
+ *
+ * The run-time counterpart of DEFINE_DVFS_QOS_REQUEST().  The request
+ * constrains nothing until it is updated.
+ */
+void dvfs_qos_init_request(struct dvfs_qos_request *req, const char *name)
+{
+	memset(req, 0, sizeof(*req));
+	req->name = name;
+	req->min_level = -1;
+	req->max_level = -1;
+	setup_timer(&req->timer, dvfs_qos_timeout, (unsigned long)req);
+	INIT_LIST_HEAD(&req->list);
+}
+EXPORT_SYMBOL(dvfs_qos_init_request);
+
+/**
+ * dvfs_qos_update_request - set the constraints of a request
+ * @req: the request
+ * @min_freq: lowest CPU frequency in kHz, 0 for none
+ * @max_freq: highest CPU frequency in kHz, 0 for none
+ * @timeout_ms: drop both constraints after this long, 0 to keep them
+ *
+ * Replaces what @req asked for before, and restarts or cancels its
+ * timeout.  The CPU is moved into the new bounds on the next governor
+ * sample.  May be called from any context.
+ */
+void dvfs_qos_update_request(struct dvfs_qos_request *req,
+			     unsigned int min_freq, unsigned int max_freq,
+			     unsigned int timeout_ms)
+{
+	int min_level = min_freq ? s5pc11x_freq_to_level(min_freq, 0) : -1;
+	int max_level = max_freq ? s5pc11x_freq_to_level(max_freq, 1) : -1;
+	unsigned long flags;
+	int changed;
+
+	spin_lock_irqsave(&dvfs_qos_lock, flags);
+	if (list_empty(&req->list))
+		list_add_tail(&req->list, &dvfs_qos_list);
+	req->min_freq = min_freq;
+	req->max_freq = max_freq;
+	changed = dvfs_qos_set(req, min_level, max_level);
+
+	if (timeout_ms && dvfs_qos_active(req)) {
+		req->expires = (jiffies + msecs_to_jiffies(timeout_ms)) ?: 1;
+		mod_timer(&req->timer, req->expires);
+	} else {
+		req->expires = 0;
+		del_timer(&req->timer);
+	}
+	spin_unlock_irqrestore(&dvfs_qos_lock, flags);
+
+	if (changed)
+		s5pc11x_dvfs_qos_changed();
+}
+EXPORT_SYMBOL(dvfs_qos_update_request);
+
+/**
+ * dvfs_qos_remove_request - drop a request for good
+ * @req: the request
+ *
+ * Like dvfs_qos_release_request(), and also takes @req off the debugfs
+ * list, so it may be freed or its module unloaded afterwards.
+ */
+void dvfs_qos_remove_request(struct dvfs_qos_request *req)
+{
+	unsigned long flags;
+	int changed;
+
+	del_timer_sync(&req->timer);
+
+	spin_lock_irqsave(&dvfs_qos_lock, flags);
+	req->expires = 0;
+	changed = dvfs_qos_set(req, -1, -1);
+	list_del_init(&req->list);
+	spin_unlock_irqrestore(&dvfs_qos_lock, flags);
+
+	if (changed)
+		s5pc11x_dvfs_qos_changed();
+}
+EXPORT_SYMBOL(dvfs_qos_remove_request);
+
+void dvfs_qos_timeout(unsigned long data)
+{
+	struct dvfs_qos_request *req = (struct dvfs_qos_request *)data;
+	unsigned long flags;
+	int changed = 0;
+
+	spin_lock_irqsave(&dvfs_qos_lock, flags);
+	/* unless updated again while the timer was firing */
+	if (req->expires && !time_before(jiffies, req->expires)) {
+		req->expires = 0;
+		req->min_freq = 0;
+		req->max_freq = 0;
+		changed = dvfs_qos_set(req, -1, -1);
+	}
+	spin_unlock_irqrestore(&dvfs_qos_lock, flags);
+
+	if (changed)
+		s5pc11x_dvfs_qos_changed();
+}
+EXPORT_SYMBOL(dvfs_qos_timeout);
+
+#ifdef CONFIG_DEBUG_FS
+static int dvfs_qos_show(struct seq_file *s, void *unused)
+{
+	struct dvfs_qos_request *req;
+	unsigned long flags, now;
+	unsigned int left, held;
+
+	seq_printf(s, "%-16s %8s %8s %8s %10s %10s %6s\n", "name",
+		   "min kHz", "max kHz", "left ms", "active ms", "total ms",
+		   "count");
+
+	spin_lock_irqsave(&dvfs_qos_lock, flags);
+	now = jiffies;
+	list_for_each_entry(req, &dvfs_qos_list, list) {
+		left = req->expires ? jiffies_to_msecs(req->expires - now) : 0;
+		held = dvfs_qos_active(req) ? now - req->since : 0;
+		seq_printf(s, "%-16s %8u %8u %8u %10u %10u %6u\n", req->name,
+			   req->min_freq, req->max_freq, left,
+			   jiffies_to_msecs(held),
+			   jiffies_to_msecs(req->held + held), req->count);
+	}
+
+	if (dvfs_qos_min_mask)
+		seq_printf(s, "floor: %u kHz\n",
+			   s5pc11x_level_to_freq(__ffs(dvfs_qos_min_mask)));
+	else
+		seq_printf(s, "floor: none\n");
+	if (dvfs_qos_max_mask)
+		seq_printf(s, "ceiling: %u kHz\n",
+			   s5pc11x_level_to_freq(__fls(dvfs_qos_max_mask)));
+	else
+		seq_printf(s, "ceiling: none\n");
+	spin_unlock_irqrestore(&dvfs_qos_lock, flags);
+
+	return 0;
+}
+
+static int dvfs_qos_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dvfs_qos_show, inode->i_private);
+}
+
+static const struct file_operations dvfs_qos_fops = {
+	.open		= dvfs_qos_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init dvfs_qos_debug_init(void)
+{
+	debugfs_create_file("dvfs_qos", S_IRUGO, NULL, NULL, &dvfs_qos_fops);
+	return 0;
+}
+late_initcall(dvfs_qos_debug_init);
+#endif /* CONFIG_DEBUG_FS */
@@ -91,6 +91,12 @@ static const int bfq_async_charge_factor = 10;
 static const int bfq_timeout_sync = HZ / 8;
 static int bfq_timeout_async = HZ / 25;
 
+/*
+ * Async writes to flash are dispatched in chunks of this many sectors,
+ * aligned to it; a power of two, ideally the erase block of the device.
+ */
+static const int bfq_flash_batch = 512;
+
 struct kmem_cache *bfq_pool;
 struct kmem_cache *bfq_ioc_pool;
 
@@ -129,6 +135,19 @@ static DEFINE_SPINLOCK(bfq_ioc_gone_lock);
 
 #define bfq_sample_valid(samples)	((samples) > 80)
 
+/*
+ * Flash mode: on a device without seek cost there is nothing to gain by
+ * idling or by sorting requests around the head position, while reads
+ * stuck behind writes are what the user notices.  So do not idle, let
+ * sync requests go before async ones, and give async writes to the
+ * device an erase block at a time.  It is used on the devices whose
+ * queue/rotational is 0, unless disabled through the flash tunable.
+ */
+static inline int bfq_flash(struct bfq_data *bfqd)
+{
+	return bfqd->flash && blk_queue_nonrot(bfqd->queue);
+}
+
 /*
  * We regard a request as SYNC, if either it's a read or has the SYNC bit
  * set (in which case it could also be a direct WRITE).
@@ -192,6 +211,10 @@ static struct request *bfq_choose_req(struct bfq_data *bfqd,
 	s1 = blk_rq_pos(rq1);
 	s2 = blk_rq_pos(rq2);
 
+	/* No seeks on flash: go in ascending order, writes stay sequential. */
+	if (bfq_flash(bfqd))
+		return s1 <= s2 ? rq1 : rq2;
+
 	last = bfqd->last_position;
 
 	/*
@@ -289,6 +312,8 @@ static void bfq_del_rq_rb(struct request *rq)
 	BUG_ON(bfqq->queued[sync] == 0);
 	bfqq->queued[sync]--;
 	bfqd->queued--;
+	if (sync)
+		bfqd->sync_queued--;
 
 	elv_rb_del(&bfqq->sort_list, rq);
 
@@ -354,6 +379,8 @@ static void bfq_add_rq_rb(struct request *rq)
 	bfq_log_bfqq(bfqd, bfqq, "add_rq_rb %d", rq_is_sync(rq));
 	bfqq->queued[rq_is_sync(rq)]++;
 	bfqd->queued++;
+	if (rq_is_sync(rq))
+		bfqd->sync_queued++;
 
 	/*
 	 * Looks a little odd, but the first insert might return an alias,
@@ -400,6 +427,8 @@ static void bfq_reposition_rq_rb(struct bfq_queue *bfqq, struct request *rq)
 	elv_rb_del(&bfqq->sort_list, rq);
 	bfqq->queued[rq_is_sync(rq)]--;
 	bfqq->bfqd->queued--;
+	if (rq_is_sync(rq))
+		bfqq->bfqd->sync_queued--;
 	bfq_add_rq_rb(rq);
 }
 
@@ -578,8 +607,12 @@ static void bfq_arm_slice_timer(struct bfq_data *bfqd)
 
 	WARN_ON(!RB_EMPTY_ROOT(&bfqq->sort_list));
 
-	/* Idling is disabled, either manually or by past process history. */
-	if (bfqd->bfq_slice_idle == 0 || !bfq_bfqq_idle_window(bfqq))
+	/*
+	 * Idling is disabled, either manually, by past process history
+	 * or because the device is flash.
+	 */
+	if (bfqd->bfq_slice_idle == 0 || !bfq_bfqq_idle_window(bfqq) ||
+	    bfq_flash(bfqd))
 		return;
 
 	/* Tasks have exited, don't wait. */
@@ -914,6 +947,10 @@ static int bfq_update_peak_rate(struct bfq_data *bfqd, struct bfq_queue *bfqq,
 	if (bfqq->entity.budget <= bfq_max_budget(bfqd) / 8)
 		return 0;
 
+	/* Flash does not seek, so nobody is slow because of seeking. */
+	if (bfq_flash(bfqd))
+		return 0;
+
 	/*
 	 * A process is considered ``slow'' (i.e., seeky, so that we
 	 * cannot treat it fairly in the service domain, as it would
@@ -1072,7 +1109,8 @@ static struct bfq_queue *bfq_select_queue(struct bfq_data *bfqd)
 	 * requests in flight or is idling for a new request, then keep it.
 	 */
 	if (timer_pending(&bfqd->idle_slice_timer) ||
-	    (bfqq->dispatched != 0 && bfq_bfqq_idle_window(bfqq))) {
+	    (bfqq->dispatched != 0 && bfq_bfqq_idle_window(bfqq) &&
+	     !bfq_flash(bfqd))) {
 		bfqq = NULL;
 		goto keep_queue;
 	}
@@ -1087,6 +1125,65 @@ keep_queue:
 	return bfqq;
 }
 
+/*
+ * Async writes to flash are dispatched in chunks, each made of the
+ * requests of @bfqq falling in the same @bfq_flash_batch aligned area.
+ */
+static inline int bfq_flash_chunks(struct bfq_data *bfqd,
+				   struct bfq_queue *bfqq)
+{
+	return !bfq_bfqq_sync(bfqq) && bfqd->bfq_flash_batch != 0 &&
+		bfq_flash(bfqd);
+}
+
+/*
+ * Return the first request of the chunk @rq belongs to, and set @end to
+ * the first sector past it.
+ */
+static struct request *bfq_flash_chunk_start(struct bfq_data *bfqd,
+					     struct request *rq,
+					     sector_t *end)
+{
+	sector_t start = blk_rq_pos(rq) &
+			 ~((sector_t)bfqd->bfq_flash_batch - 1);
+	struct rb_node *prev;
+
+	while ((prev = rb_prev(&rq->rb_node)) != NULL &&
+	       blk_rq_pos(rb_entry_rq(prev)) >= start)
+		rq = rb_entry_rq(prev);
+
+	*end = start + bfqd->bfq_flash_batch;
+	return rq;
+}
+
+/* Return the request after @rq in its chunk, or NULL if it is the last. */
+static struct request *bfq_flash_chunk_next(struct request *rq, sector_t end)
+{
+	struct rb_node *next = rb_next(&rq->rb_node);
+
+	if (next == NULL || blk_rq_pos(rb_entry_rq(next)) >= end)
+		return NULL;
+
+	return rb_entry_rq(next);
+}
+
+/*
+ * Return true if the oldest write of @bfqq has waited so long that it
+ * must go, even if sync requests are waiting too.
+ */
+static int bfq_flash_write_expired(struct bfq_data *bfqd,
+				   struct bfq_queue *bfqq)
+{
+	struct request *rq;
+
+	if (list_empty(&bfqq->fifo))
+		return 0;
+
+	rq = rq_entry_fifo(bfqq->fifo.next);
+	return time_after(jiffies,
+			  rq->start_time + bfqd->bfq_fifo_expire[ASYNC]);
+}
+
 /*
  * Dispatch some requests from bfqq, moving them to the request queue
  * dispatch list.
@@ -1095,6 +1192,9 @@ static int __bfq_dispatch_requests(struct bfq_data *bfqd,
 				   struct bfq_queue *bfqq,
 				   int max_dispatch)
 {
+	int chunks = bfq_flash_chunks(bfqd, bfqq);
+	struct request *chunk_next = NULL;
+	sector_t chunk_end = 0;
 	int dispatched = 0;
 
 	BUG_ON(RB_EMPTY_ROOT(&bfqq->sort_list));
@@ -1103,10 +1203,17 @@ static int __bfq_dispatch_requests(struct bfq_data *bfqd,
 		struct request *rq;
 		bfq_service_t service_to_charge;
 
-		/* Follow expired path, else get first next available. */
-		rq = bfq_check_fifo(bfqq);
-		if (rq == NULL)
-			rq = bfqq->next_rq;
+		if (chunk_next != NULL)
+			rq = chunk_next;
+		else {
+			/* Follow expired path, else get first next available. */
+			rq = bfq_check_fifo(bfqq);
+			if (rq == NULL)
+				rq = bfqq->next_rq;
+			if (chunks)
+				rq = bfq_flash_chunk_start(bfqd, rq,
+							   &chunk_end);
+		}
 		service_to_charge = bfq_serv_to_charge(rq, bfqq);
 
 		if (service_to_charge > bfq_bfqq_budget_left(bfqq)) {
@@ -1120,6 +1227,9 @@ static int __bfq_dispatch_requests(struct bfq_data *bfqd,
 			goto expire;
 		}
 
+		if (chunks)
+			chunk_next = bfq_flash_chunk_next(rq, chunk_end);
+
 		/* Finally, insert request into driver dispatch list. */
 		bfq_bfqq_served(bfqq, service_to_charge);
 		bfq_dispatch_insert(bfqd->queue, rq);
@@ -1165,12 +1275,14 @@ static int __bfq_dispatch_requests(struct bfq_data *bfqd,
 
 		if (RB_EMPTY_ROOT(&bfqq->sort_list))
 			break;
+		if (chunks && chunk_next == NULL)
+			break;
 	} while (dispatched < max_dispatch);
 
 	bfq_log_bfqq(bfqd, bfqq, "dispatched %d reqs", dispatched);
 
 	if (bfqd->busy_queues > 1 && ((!bfq_bfqq_sync(bfqq) &&
-	    dispatched >= bfqd->bfq_max_budget_async_rq) ||
+	    (chunks || dispatched >= bfqd->bfq_max_budget_async_rq)) ||
 	    bfq_class_idle(bfqq)))
 		goto expire;
 
@@ -1231,7 +1343,7 @@ static int bfq_dispatch_requests(struct request_queue *q, int force)
 {
 	struct bfq_data *bfqd = q->elevator->elevator_data;
 	struct bfq_queue *bfqq;
-	int dispatched;
+	int dispatched, deferred = 0;
 
 	bfq_log(bfqd, "dispatch requests: %d busy queues", bfqd->busy_queues);
 	if (bfqd->busy_queues == 0)
@@ -1251,14 +1363,41 @@ static int bfq_dispatch_requests(struct request_queue *q, int force)
 		if (!bfq_bfqq_sync(bfqq))
 			max_dispatch = bfqd->bfq_max_budget_async_rq;
 
-		if (bfqq->dispatched >= max_dispatch) {
+		if (!bfq_bfqq_sync(bfqq) && bfq_flash(bfqd) &&
+		    !bfq_flash_write_expired(bfqd, bfqq)) {
+			/*
+			 * Sync requests go first on flash: put the async
+			 * queue back, charging it a full budget so that the
+			 * scheduler moves on to the sync ones.  The scheduler
+			 * may keep choosing async queues, so give up after
+			 * trying each busy queue once.
+			 */
+			if (bfqd->sync_queued != 0 &&
+			    deferred++ < bfqd->busy_queues) {
+				bfq_log_bfqq(bfqd, bfqq, "flash: sync first");
+				bfq_bfqq_expire(bfqd, bfqq, 0,
+						BFQ_BFQQ_BUDGET_TIMEOUT);
+				continue;
+			}
+		}
+
+		if (bfq_flash_chunks(bfqd, bfqq)) {
+			/*
+			 * One chunk at a time, so that a read never has
+			 * more than one to wait for.
+			 */
+			if (bfqq->dispatched != 0)
+				break;
+			max_dispatch = INT_MAX;
+		} else if (bfqq->dispatched >= max_dispatch) {
 			if (bfqd->busy_queues > 1)
 				break;
 			if (bfqq->dispatched >= 4 * max_dispatch)
 				break;
 		}
 
-		if (bfqd->sync_flight != 0 && !bfq_bfqq_sync(bfqq))
+		if (bfqd->sync_flight != 0 && !bfq_bfqq_sync(bfqq) &&
+		    !(bfq_flash(bfqd) && bfq_flash_write_expired(bfqd, bfqq)))
 			break;
 
 		bfq_clear_bfqq_wait_request(bfqq);
@@ -1580,7 +1719,8 @@ static void bfq_update_idle_window(struct bfq_data *bfqd,
 	enable_idle = bfq_bfqq_idle_window(bfqq);
 
 	if (atomic_read(&cic->ioc->nr_tasks) == 0 ||
-	    bfqd->bfq_slice_idle == 0 || (bfqd->hw_tag && BFQQ_SEEKY(bfqq)))
+	    bfqd->bfq_slice_idle == 0 || bfq_flash(bfqd) ||
+	    (bfqd->hw_tag && BFQQ_SEEKY(bfqq)))
 		enable_idle = 0;
 	else if (bfq_sample_valid(cic->ttime_samples)) {
 		if (cic->ttime_mean > bfqd->bfq_slice_idle)
@@ -2038,6 +2178,9 @@ static void *bfq_init_queue(struct request_queue *q)
 
 	bfqd->low_latency = true;
 
+	bfqd->flash = true;
+	bfqd->bfq_flash_batch = bfq_flash_batch;
+
 	return bfqd;
 }
 
@@ -2101,6 +2244,8 @@ SHOW_FUNCTION(bfq_max_budget_async_rq_show, bfqd->bfq_max_budget_async_rq, 0);
 SHOW_FUNCTION(bfq_timeout_sync_show, bfqd->bfq_timeout[SYNC], 1);
 SHOW_FUNCTION(bfq_timeout_async_show, bfqd->bfq_timeout[ASYNC], 1);
 SHOW_FUNCTION(bfq_low_latency_show, bfqd->low_latency, 0);
+SHOW_FUNCTION(bfq_flash_show, bfqd->flash, 0);
+SHOW_FUNCTION(bfq_flash_batch_kb_show, bfqd->bfq_flash_batch / 2, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -2198,6 +2343,37 @@ static ssize_t bfq_low_latency_store(struct elevator_queue *e,
 	return ret;
 }
 
+static ssize_t bfq_flash_store(struct elevator_queue *e,
+			       const char *page, size_t count)
+{
+	struct bfq_data *bfqd = e->elevator_data;
+	unsigned int __data;
+	int ret = bfq_var_store(&__data, (page), count);
+
+	if (__data > 1)
+		__data = 1;
+	bfqd->flash = __data;
+
+	return ret;
+}
+
+static ssize_t bfq_flash_batch_kb_store(struct elevator_queue *e,
+					const char *page, size_t count)
+{
+	struct bfq_data *bfqd = e->elevator_data;
+	unsigned int __data;
+	int ret = bfq_var_store(&__data, (page), count);
+
+	/* Chunks are aligned to their size, which must be a power of two. */
+	if (__data > 64 * 1024)
+		__data = 64 * 1024;
+	if (__data != 0)
+		__data = rounddown_pow_of_two(__data);
+	bfqd->bfq_flash_batch = __data * 2;
+
+	return ret;
+}
+
 #define BFQ_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, bfq_##name##_show, bfq_##name##_store)
 
@@ -2213,6 +2389,8 @@ static struct elv_fs_entry bfq_attrs[] = {
 	BFQ_ATTR(timeout_sync),
 	BFQ_ATTR(timeout_async),
 	BFQ_ATTR(low_latency),
+	BFQ_ATTR(flash),
+	BFQ_ATTR(flash_batch_kb),
 	__ATTR_NULL
 };
 
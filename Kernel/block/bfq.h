@@ -180,6 +180,7 @@ struct bfq_group;
  * @busy_queues: number of bfq_queues containing requests (including the
  *		 queue under service, even if it is idling).
  * @queued: number of queued requests.
+ * @sync_queued: number of queued sync requests.
  * @rq_in_driver: number of requests dispatched and waiting for completion.
  * @sync_flight: number of sync requests in the driver.
  * @max_rq_in_driver: max number of reqs in driver in the last @hw_tag_samples
@@ -218,6 +219,12 @@ struct bfq_group;
  *               they are charged for the whole allocated budget, to try
  *               to preserve a behavior reasonably fair among them, but
  *               without service-domain guarantees).
+ * @low_latency: if set to true, low-latency heuristics are enabled.
+ * @flash: if set to true, non-rotational devices are served in flash mode
+ *         (see bfq_flash()).
+ * @bfq_flash_batch: size, in sectors, of the erase-block-aligned chunks
+ *                   async writes are dispatched in while in flash mode
+ *                   (0 to dispatch them like on other devices).
  *
  * All the fields are protected by the @queue lock.
  */
@@ -228,6 +235,7 @@ struct bfq_data {
 
 	int busy_queues;
 	int queued;
+	int sync_queued;
 	int rq_in_driver;
 	int sync_flight;
 
@@ -267,6 +275,9 @@ struct bfq_data {
 	unsigned int bfq_timeout[2];
 
 	bool low_latency;
+
+	bool flash;
+	unsigned int bfq_flash_batch;
 };
 
 /**
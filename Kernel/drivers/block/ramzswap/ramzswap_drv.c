@@ -0,0 +1,567 @@
+/*
+ * Compressed RAM based swap device
+ *
+ * Creates RAM based block devices, /dev/ramzswapX, meant to be used as
+ * swap.  Every page written is compressed with LZO and kept in memory, so
+ * that pages that would otherwise have been lost with their process when
+ * memory runs short stay around at a fraction of their size.  Zero pages
+ * take no memory at all.
+ *
+ * The swap code tells the device as soon as a slot is no longer used
+ * (swap_slot_free_notify), and discard requests are honoured too, so the
+ * memory of stale pages is given back straight away.
+ *
+ * Statistics are in /sys/block/ramzswapX/.
+ *
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "ramzswap"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/device.h>
+#include <linux/genhd.h>
+#include <linux/highmem.h>
+#include <linux/lzo.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/swap.h>
+#include <linux/vmalloc.h>
+
+#include "ramzswap_drv.h"
+
+static int ramzswap_major;
+static struct ramzswap *devices;
+
+static unsigned int num_devices = 1;
+module_param(num_devices, uint, 0);
+MODULE_PARM_DESC(num_devices, "Number of ramzswap devices");
+
+static unsigned long disksize_kb;
+module_param(disksize_kb, ulong, 0);
+MODULE_PARM_DESC(disksize_kb, "Size of each device in KiB "
+		"(default: " __stringify(DEFAULT_DISKSIZE_PERC_RAM) "% of RAM)");
+
+static int rzs_test_flag(struct rzs_slot *slot, enum rzs_slot_flags flag)
+{
+	return slot->flags & BIT(flag);
+}
+
+static void rzs_set_flag(struct rzs_slot *slot, enum rzs_slot_flags flag)
+{
+	slot->flags |= BIT(flag);
+}
+
+static void rzs_stat64_add(struct ramzswap *rzs, u64 *v, s64 inc)
+{
+	spin_lock(&rzs->stat64_lock);
+	*v += inc;
+	spin_unlock(&rzs->stat64_lock);
+}
+
+static void rzs_stat64_inc(struct ramzswap *rzs, u64 *v)
+{
+	rzs_stat64_add(rzs, v, 1);
+}
+
+static u64 rzs_stat64_read(struct ramzswap *rzs, u64 *v)
+{
+	u64 val;
+
+	spin_lock(&rzs->stat64_lock);
+	val = *v;
+	spin_unlock(&rzs->stat64_lock);
+	return val;
+}
+
+static int page_zero_filled(void *ptr)
+{
+	unsigned long *page = ptr;
+	unsigned int pos;
+
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++)
+		if (page[pos])
+			return 0;
+	return 1;
+}
+
+/*
+ * Forget what was stored for a slot, with table_lock held for writing, or
+ * once the slot can no longer be seen by readers.  Never sleeps.
+ */
+static void ramzswap_free_slot(struct ramzswap *rzs, struct rzs_slot *slot)
+{
+	if (rzs_test_flag(slot, RZS_ZERO)) {
+		rzs_stat64_add(rzs, &rzs->stats.pages_zero, -1);
+	} else if (slot->page) {
+		if (rzs_test_flag(slot, RZS_UNCOMPRESSED)) {
+			__free_page(slot->page);
+			rzs_stat64_add(rzs, &rzs->stats.pages_expand, -1);
+		} else {
+			xv_free(rzs->mem_pool, slot->page, slot->offset);
+		}
+		rzs_stat64_add(rzs, &rzs->stats.pages_stored, -1);
+		rzs_stat64_add(rzs, &rzs->stats.compr_size, -(s64)slot->size);
+	}
+
+	memset(slot, 0, sizeof(*slot));
+}
+
+static void ramzswap_free_index(struct ramzswap *rzs, u32 index)
+{
+	write_lock(&rzs->table_lock);
+	ramzswap_free_slot(rzs, &rzs->table[index]);
+	write_unlock(&rzs->table_lock);
+}
+
+static int ramzswap_read_page(struct ramzswap *rzs, struct page *page,
+				u32 index)
+{
+	struct rzs_slot *slot;
+	unsigned char *src, *dst;
+	size_t clen = PAGE_SIZE;
+	int ret = LZO_E_OK;
+
+	read_lock(&rzs->table_lock);
+	slot = &rzs->table[index];
+	dst = kmap_atomic(page, KM_USER1);
+
+	if (!slot->page) {
+		/* all zero, or never written */
+		clear_page(dst);
+	} else {
+		src = kmap_atomic(slot->page, KM_USER0);
+		if (rzs_test_flag(slot, RZS_UNCOMPRESSED))
+			copy_page(dst, src);
+		else
+			ret = lzo1x_decompress_safe(src + slot->offset,
+						slot->size, dst, &clen);
+		kunmap_atomic(src, KM_USER0);
+	}
+
+	kunmap_atomic(dst, KM_USER1);
+	read_unlock(&rzs->table_lock);
+
+	if (unlikely(ret != LZO_E_OK || clen != PAGE_SIZE)) {
+		pr_err("decompression failed, err=%d, page=%u\n", ret, index);
+		return -EIO;
+	}
+
+	flush_dcache_page(page);
+	return 0;
+}
+
+static int ramzswap_write_page(struct ramzswap *rzs, struct page *page,
+				u32 index)
+{
+	struct rzs_slot slot, old;
+	unsigned char *src, *dst;
+	size_t clen;
+	u32 offset;
+	int ret;
+
+	memset(&slot, 0, sizeof(slot));
+
+	mutex_lock(&rzs->lock);
+
+	src = kmap_atomic(page, KM_USER0);
+	if (page_zero_filled(src)) {
+		kunmap_atomic(src, KM_USER0);
+		rzs_set_flag(&slot, RZS_ZERO);
+		rzs_stat64_inc(rzs, &rzs->stats.pages_zero);
+		goto out_store;
+	}
+
+	ret = lzo1x_1_compress(src, PAGE_SIZE, rzs->compress_buffer, &clen,
+				rzs->compress_workmem);
+	kunmap_atomic(src, KM_USER0);
+
+	if (unlikely(ret != LZO_E_OK)) {
+		mutex_unlock(&rzs->lock);
+		pr_err("compression failed, err=%d, page=%u\n", ret, index);
+		return -EIO;
+	}
+
+	if (unlikely(clen > max_zpage_size)) {
+		slot.page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!slot.page))
+			goto out_nomem;
+
+		src = kmap_atomic(page, KM_USER0);
+		dst = kmap_atomic(slot.page, KM_USER1);
+		copy_page(dst, src);
+		kunmap_atomic(dst, KM_USER1);
+		kunmap_atomic(src, KM_USER0);
+
+		clen = PAGE_SIZE;
+		rzs_set_flag(&slot, RZS_UNCOMPRESSED);
+		rzs_stat64_inc(rzs, &rzs->stats.pages_expand);
+	} else {
+		if (xv_malloc(rzs->mem_pool, clen, &slot.page, &offset,
+				GFP_NOIO | __GFP_HIGHMEM))
+			goto out_nomem;
+
+		dst = kmap_atomic(slot.page, KM_USER0);
+		memcpy(dst + offset, rzs->compress_buffer, clen);
+		kunmap_atomic(dst, KM_USER0);
+		slot.offset = offset;
+	}
+
+	slot.size = clen;
+	rzs_stat64_inc(rzs, &rzs->stats.pages_stored);
+	rzs_stat64_add(rzs, &rzs->stats.compr_size, clen);
+
+out_store:
+	/* readers of the old contents are gone once we have the lock */
+	write_lock(&rzs->table_lock);
+	old = rzs->table[index];
+	rzs->table[index] = slot;
+	write_unlock(&rzs->table_lock);
+
+	ramzswap_free_slot(rzs, &old);
+
+	mutex_unlock(&rzs->lock);
+	return 0;
+
+out_nomem:
+	mutex_unlock(&rzs->lock);
+	if (printk_ratelimit())
+		pr_info("no memory for page %u, compressed size %zu\n",
+			index, clen);
+	return -ENOMEM;
+}
+
+static void ramzswap_discard(struct ramzswap *rzs, struct bio *bio)
+{
+	sector_t sector = ALIGN(bio->bi_sector, SECTORS_PER_PAGE);
+	sector_t end = bio->bi_sector + (bio->bi_size >> SECTOR_SHIFT);
+	struct rzs_slot *slot;
+	u64 discarded = 0;
+
+	if (end > rzs->disksize >> SECTOR_SHIFT)
+		end = rzs->disksize >> SECTOR_SHIFT;
+
+	/* only the pages that are discarded whole */
+	write_lock(&rzs->table_lock);
+	for (; sector + SECTORS_PER_PAGE <= end; sector += SECTORS_PER_PAGE) {
+		slot = &rzs->table[sector >> SECTORS_PER_PAGE_SHIFT];
+		if (slot->page || rzs_test_flag(slot, RZS_ZERO)) {
+			ramzswap_free_slot(rzs, slot);
+			discarded++;
+		}
+	}
+	write_unlock(&rzs->table_lock);
+
+	rzs_stat64_add(rzs, &rzs->stats.discarded, discarded);
+}
+
+/* Only whole, page aligned pages */
+static int valid_io_request(struct ramzswap *rzs, struct bio *bio)
+{
+	struct bio_vec *bvec;
+	int i;
+
+	if (unlikely(bio->bi_sector & (SECTORS_PER_PAGE - 1) ||
+		     bio->bi_size & (PAGE_SIZE - 1) ||
+		     ((u64)bio->bi_sector << SECTOR_SHIFT) + bio->bi_size >
+				rzs->disksize))
+		return 0;
+
+	bio_for_each_segment(bvec, bio, i)
+		if (unlikely(bvec->bv_offset || bvec->bv_len != PAGE_SIZE))
+			return 0;
+
+	return 1;
+}
+
+static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
+{
+	struct ramzswap *rzs = queue->queuedata;
+	struct bio_vec *bvec;
+	u32 index;
+	int i, err = 0;
+
+	if (bio_rw_flagged(bio, BIO_RW_DISCARD)) {
+		ramzswap_discard(rzs, bio);
+		bio_endio(bio, 0);
+		return 0;
+	}
+
+	if (!valid_io_request(rzs, bio)) {
+		rzs_stat64_inc(rzs, &rzs->stats.invalid_io);
+		bio_io_error(bio);
+		return 0;
+	}
+
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	bio_for_each_segment(bvec, bio, i) {
+		if (bio_data_dir(bio) == READ) {
+			rzs_stat64_inc(rzs, &rzs->stats.num_reads);
+			err = ramzswap_read_page(rzs, bvec->bv_page, index);
+			if (err)
+				rzs_stat64_inc(rzs, &rzs->stats.failed_reads);
+		} else {
+			rzs_stat64_inc(rzs, &rzs->stats.num_writes);
+			err = ramzswap_write_page(rzs, bvec->bv_page, index);
+			if (err)
+				rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
+		}
+		if (err)
+			break;
+		index++;
+	}
+
+	bio_endio(bio, err);
+	return 0;
+}
+
+/* Called with swap_lock held: must not sleep */
+static void ramzswap_slot_free_notify(struct block_device *bdev,
+					unsigned long index)
+{
+	struct ramzswap *rzs = bdev->bd_disk->private_data;
+
+	ramzswap_free_index(rzs, index);
+	rzs_stat64_inc(rzs, &rzs->stats.notify_free);
+}
+
+static struct block_device_operations ramzswap_devops = {
+	.swap_slot_free_notify = ramzswap_slot_free_notify,
+	.owner = THIS_MODULE,
+};
+
+static struct ramzswap *dev_to_rzs(struct device *dev)
+{
+	return dev_to_disk(dev)->private_data;
+}
+
+#define RZS_STAT_ATTR(name, field, shift)				\
+static ssize_t name##_show(struct device *dev,				\
+			struct device_attribute *attr, char *buf)	\
+{									\
+	struct ramzswap *rzs = dev_to_rzs(dev);				\
+									\
+	return sprintf(buf, "%llu\n", (unsigned long long)		\
+		rzs_stat64_read(rzs, &rzs->stats.field) << (shift));	\
+}									\
+static DEVICE_ATTR(name, S_IRUGO, name##_show, NULL)
+
+RZS_STAT_ATTR(num_reads, num_reads, 0);
+RZS_STAT_ATTR(num_writes, num_writes, 0);
+RZS_STAT_ATTR(failed_reads, failed_reads, 0);
+RZS_STAT_ATTR(failed_writes, failed_writes, 0);
+RZS_STAT_ATTR(invalid_io, invalid_io, 0);
+RZS_STAT_ATTR(notify_free, notify_free, 0);
+RZS_STAT_ATTR(discarded, discarded, 0);
+RZS_STAT_ATTR(zero_pages, pages_zero, 0);
+RZS_STAT_ATTR(incompressible_pages, pages_expand, 0);
+RZS_STAT_ATTR(orig_data_size, pages_stored, PAGE_SHIFT);
+RZS_STAT_ATTR(compr_data_size, compr_size, 0);
+
+static ssize_t disksize_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n",
+			(unsigned long long)dev_to_rzs(dev)->disksize);
+}
+static DEVICE_ATTR(disksize, S_IRUGO, disksize_show, NULL);
+
+/* The pool and the pages stored uncompressed */
+static ssize_t mem_used_total_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	struct ramzswap *rzs = dev_to_rzs(dev);
+
+	return sprintf(buf, "%llu\n", (unsigned long long)
+		(xv_get_total_size_bytes(rzs->mem_pool) +
+		 (rzs_stat64_read(rzs, &rzs->stats.pages_expand) << PAGE_SHIFT)));
+}
+static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+
+static struct attribute *ramzswap_attrs[] = {
+	&dev_attr_disksize.attr,
+	&dev_attr_num_reads.attr,
+	&dev_attr_num_writes.attr,
+	&dev_attr_failed_reads.attr,
+	&dev_attr_failed_writes.attr,
+	&dev_attr_invalid_io.attr,
+	&dev_attr_notify_free.attr,
+	&dev_attr_discarded.attr,
+	&dev_attr_zero_pages.attr,
+	&dev_attr_incompressible_pages.attr,
+	&dev_attr_orig_data_size.attr,
+	&dev_attr_compr_data_size.attr,
+	&dev_attr_mem_used_total.attr,
+	NULL,
+};
+
+static struct attribute_group ramzswap_attr_group = {
+	.attrs = ramzswap_attrs,
+};
+
+static void destroy_device(struct ramzswap *rzs)
+{
+	size_t index, num_pages = rzs->disksize >> PAGE_SHIFT;
+
+	if (rzs->disk) {
+		sysfs_remove_group(&disk_to_dev(rzs->disk)->kobj,
+				   &ramzswap_attr_group);
+		del_gendisk(rzs->disk);
+		put_disk(rzs->disk);
+	}
+
+	if (rzs->queue)
+		blk_cleanup_queue(rzs->queue);
+
+	if (rzs->table) {
+		for (index = 0; index < num_pages; index++)
+			ramzswap_free_slot(rzs, &rzs->table[index]);
+		vfree(rzs->table);
+	}
+
+	if (rzs->mem_pool)
+		xv_destroy_pool(rzs->mem_pool);
+
+	free_pages((unsigned long)rzs->compress_buffer, 1);
+	kfree(rzs->compress_workmem);
+}
+
+static int create_device(struct ramzswap *rzs, int device_id)
+{
+	size_t num_pages = rzs->disksize >> PAGE_SHIFT;
+	int ret;
+
+	mutex_init(&rzs->lock);
+	rwlock_init(&rzs->table_lock);
+	spin_lock_init(&rzs->stat64_lock);
+
+	/* lzo1x_worst_compress(PAGE_SIZE) fits in two pages */
+	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+	rzs->compress_buffer = (void *)__get_free_pages(GFP_KERNEL, 1);
+	rzs->table = vmalloc(num_pages * sizeof(*rzs->table));
+	rzs->mem_pool = xv_create_pool();
+	if (!rzs->compress_workmem || !rzs->compress_buffer || !rzs->table ||
+	    !rzs->mem_pool) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
+
+	rzs->queue = blk_alloc_queue(GFP_KERNEL);
+	if (!rzs->queue) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	blk_queue_make_request(rzs->queue, ramzswap_make_request);
+	rzs->queue->queuedata = rzs;
+	blk_queue_logical_block_size(rzs->queue, PAGE_SIZE);
+	blk_queue_max_discard_sectors(rzs->queue, UINT_MAX);
+	/* no seeks: the swap code spreads its clusters accordingly */
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, rzs->queue);
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, rzs->queue);
+
+	rzs->disk = alloc_disk(1);
+	if (!rzs->disk) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	rzs->disk->major = ramzswap_major;
+	rzs->disk->first_minor = device_id;
+	rzs->disk->fops = &ramzswap_devops;
+	rzs->disk->queue = rzs->queue;
+	rzs->disk->private_data = rzs;
+	snprintf(rzs->disk->disk_name, 16, "ramzswap%d", device_id);
+	set_capacity(rzs->disk, rzs->disksize >> SECTOR_SHIFT);
+	add_disk(rzs->disk);
+
+	ret = sysfs_create_group(&disk_to_dev(rzs->disk)->kobj,
+				 &ramzswap_attr_group);
+	if (ret < 0) {
+		pr_warning("failed to create sysfs attributes\n");
+		ret = 0;
+	}
+	return 0;
+
+out:
+	return ret;
+}
+
+static int __init ramzswap_init(void)
+{
+	u64 disksize;
+	int ret;
+	unsigned int dev_id;
+
+	BUILD_BUG_ON(lzo1x_worst_compress(PAGE_SIZE) > 2 * PAGE_SIZE);
+
+	if (!num_devices || num_devices > 32) {
+		pr_err("invalid number of devices: %u\n", num_devices);
+		return -EINVAL;
+	}
+
+	if (disksize_kb)
+		disksize = (u64)disksize_kb << 10;
+	else
+		disksize = ((u64)totalram_pages << PAGE_SHIFT) *
+				DEFAULT_DISKSIZE_PERC_RAM / 100;
+	disksize &= PAGE_MASK;
+	if (disksize < 2 * PAGE_SIZE) {
+		pr_err("disk size of %llu bytes is too small\n",
+			(unsigned long long)disksize);
+		return -EINVAL;
+	}
+
+	ramzswap_major = register_blkdev(0, "ramzswap");
+	if (ramzswap_major <= 0) {
+		pr_warning("unable to get major number\n");
+		return -EBUSY;
+	}
+
+	devices = kzalloc(num_devices * sizeof(*devices), GFP_KERNEL);
+	if (!devices) {
+		ret = -ENOMEM;
+		goto unregister;
+	}
+
+	for (dev_id = 0; dev_id < num_devices; dev_id++) {
+		devices[dev_id].disksize = disksize;
+		ret = create_device(&devices[dev_id], dev_id);
+		if (ret)
+			goto free_devices;
+	}
+
+	pr_info("%u devices of %llu KiB\n", num_devices,
+		(unsigned long long)disksize >> 10);
+	return 0;
+
+free_devices:
+	do
+		destroy_device(&devices[dev_id]);
+	while (dev_id--);
+	kfree(devices);
+unregister:
+	unregister_blkdev(ramzswap_major, "ramzswap");
+	return ret;
+}
+
+static void __exit ramzswap_exit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_devices; i++)
+		destroy_device(&devices[i]);
+
+	unregister_blkdev(ramzswap_major, "ramzswap");
+	kfree(devices);
+}
+
+module_init(ramzswap_init);
+module_exit(ramzswap_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Compressed RAM based swap device");
@@ -0,0 +1,71 @@
+/*
+ * Compressed RAM based swap device
+ *
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _RAMZSWAP_DRV_H_
+#define _RAMZSWAP_DRV_H_
+
+#include <linux/blkdev.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+
+#include "xvmalloc.h"
+
+/* Default size of each device, as a share of RAM */
+#define DEFAULT_DISKSIZE_PERC_RAM	25
+
+/*
+ * Pages that compress to more than this are stored as they are, in a page
+ * of their own: xvmalloc could not put much else next to them anyway.
+ */
+static const u32 max_zpage_size = PAGE_SIZE / 4 * 3;
+
+#define SECTOR_SHIFT		9
+#define SECTORS_PER_PAGE_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
+#define SECTORS_PER_PAGE	(1 << SECTORS_PER_PAGE_SHIFT)
+
+/* Flags of a slot */
+enum rzs_slot_flags {
+	RZS_ZERO,		/* all zero, nothing stored */
+	RZS_UNCOMPRESSED,	/* stored as it is, in a page of its own */
+};
+
+/* What is stored for every page of the device */
+struct rzs_slot {
+	struct page *page;
+	u16 offset;
+	u16 size;		/* compressed size */
+	u8 flags;
+} __attribute__((aligned(4)));
+
+struct ramzswap_stats {
+	u64 num_reads;
+	u64 num_writes;
+	u64 failed_reads;
+	u64 failed_writes;
+	u64 invalid_io;		/* not page aligned, or past the end */
+	u64 notify_free;	/* slots freed by the swap code */
+	u64 discarded;		/* pages freed by discard requests */
+	u64 pages_zero;
+	u64 pages_stored;	/* not counting the zero pages */
+	u64 pages_expand;	/* stored uncompressed */
+	u64 compr_size;		/* of all the pages stored */
+};
+
+struct ramzswap {
+	struct xv_pool *mem_pool;
+	void *compress_workmem;
+	void *compress_buffer;
+	struct rzs_slot *table;
+	struct mutex lock;		/* for the compression buffers */
+	rwlock_t table_lock;		/* slots, and what they point to */
+	spinlock_t stat64_lock;		/* 64-bit stats on 32-bit hosts */
+	struct request_queue *queue;
+	struct gendisk *disk;
+	u64 disksize;			/* bytes */
+	struct ramzswap_stats stats;
+};
+
+#endif
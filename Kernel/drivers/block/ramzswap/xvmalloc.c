@@ -0,0 +1,388 @@
+/*
+ * xvmalloc memory allocator
+ *
+ * Every page of the pool is cut into blocks, each a small header followed
+ * by the object, laid out one after the other.  Free blocks are kept on
+ * segregated free lists, one per FL_DELTA bytes of size, with a two level
+ * bitmap of the lists that are not empty, so finding a block that fits is
+ * a couple of __ffs() whatever the state of the pool (TLSF).  A block that
+ * is freed is merged with the free blocks next to it in its page, and the
+ * page goes back to the system once it is all free.
+ *
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "xvmalloc.h"
+
+/* Every block starts XV_ALIGN aligned, with its header */
+#define XV_ALIGN_SHIFT		2
+#define XV_ALIGN		(1 << XV_ALIGN_SHIFT)
+#define XV_ALIGN_MASK		(XV_ALIGN - 1)
+
+/* A free block must be able to hold its struct link_free */
+#define XV_MIN_ALLOC_SIZE	32
+#define XV_MAX_ALLOC_SIZE	(PAGE_SIZE - XV_ALIGN)
+
+/* Free lists are FL_DELTA bytes of block size apart */
+#define FL_DELTA_SHIFT		3
+#define FL_DELTA		(1 << FL_DELTA_SHIFT)
+#define NUM_FREE_LISTS		(((XV_MAX_ALLOC_SIZE - XV_MIN_ALLOC_SIZE) \
+					>> FL_DELTA_SHIFT) + 1)
+#define MAX_FLI			DIV_ROUND_UP(NUM_FREE_LISTS, BITS_PER_LONG)
+
+/* In the low bits of block_header.size, which is XV_ALIGN aligned */
+#define BLOCK_FREE		1
+
+struct block_header {
+	u16 size;		/* of what follows the header, and flags */
+	u16 prev;		/* offset of the block before, in the page */
+};
+
+/* Where the object of a free block would be */
+struct link_free {
+	struct page *prev_page;
+	struct page *next_page;
+	u16 prev_offset;
+	u16 next_offset;
+};
+
+struct freelist_entry {
+	struct page *page;
+	u16 offset;
+};
+
+struct xv_pool {
+	ulong flbitmap;
+	ulong slbitmap[MAX_FLI];
+	spinlock_t lock;
+	u64 total_pages;
+	struct freelist_entry freelist[NUM_FREE_LISTS];
+};
+
+static inline u32 block_size(struct block_header *block)
+{
+	return block->size & ~XV_ALIGN_MASK;
+}
+
+static inline struct link_free *block_link(struct block_header *block)
+{
+	return (struct link_free *)((char *)block + XV_ALIGN);
+}
+
+/* The list a free block of the given size goes on */
+static inline u32 insert_index(u32 size)
+{
+	return (size - XV_MIN_ALLOC_SIZE) >> FL_DELTA_SHIFT;
+}
+
+/*
+ * The first list whose blocks are all big enough.  Rounding up can go one
+ * past the last list, which only ever holds whole free pages: anything
+ * sharing a page leaves less than its smallest size.
+ */
+static inline u32 search_index(u32 size)
+{
+	u32 index = (size - XV_MIN_ALLOC_SIZE + FL_DELTA - 1) >> FL_DELTA_SHIFT;
+
+	return min_t(u32, index, NUM_FREE_LISTS - 1);
+}
+
+static struct block_header *map_block(struct page *page, u32 offset,
+					enum km_type type)
+{
+	return (struct block_header *)((char *)kmap_atomic(page, type) +
+					offset);
+}
+
+static void unmap_block(struct block_header *block, enum km_type type)
+{
+	kunmap_atomic(block, type);
+}
+
+/*
+ * Find a free block of at least size bytes, returning its list index, or
+ * -1 when every list that could hold one is empty.
+ */
+static int find_block(struct xv_pool *pool, u32 size, struct page **page,
+			u32 *offset)
+{
+	ulong flbitmap, slbitmap;
+	u32 flindex, slindex;
+
+	slindex = search_index(size);
+	flindex = slindex / BITS_PER_LONG;
+
+	slbitmap = pool->slbitmap[flindex] &
+			~((1UL << (slindex % BITS_PER_LONG)) - 1);
+	if (!slbitmap) {
+		flbitmap = pool->flbitmap & ~((1UL << (flindex + 1)) - 1);
+		if (!flbitmap)
+			return -1;
+		flindex = __ffs(flbitmap);
+		slbitmap = pool->slbitmap[flindex];
+	}
+	slindex = flindex * BITS_PER_LONG + __ffs(slbitmap);
+
+	*page = pool->freelist[slindex].page;
+	*offset = pool->freelist[slindex].offset;
+	return slindex;
+}
+
+/* Put a free block, mapped at block, at the head of its list */
+static void insert_block(struct xv_pool *pool, struct page *page, u32 offset,
+			struct block_header *block)
+{
+	u32 slindex = insert_index(block_size(block));
+	struct freelist_entry *head = &pool->freelist[slindex];
+	struct link_free *link = block_link(block);
+
+	link->prev_page = NULL;
+	link->prev_offset = 0;
+	link->next_page = head->page;
+	link->next_offset = head->offset;
+
+	if (head->page) {
+		struct block_header *next;
+
+		next = map_block(head->page, head->offset, KM_USER1);
+		block_link(next)->prev_page = page;
+		block_link(next)->prev_offset = offset;
+		unmap_block(next, KM_USER1);
+	}
+
+	head->page = page;
+	head->offset = offset;
+
+	__set_bit(slindex / BITS_PER_LONG, &pool->flbitmap);
+	__set_bit(slindex % BITS_PER_LONG,
+		  &pool->slbitmap[slindex / BITS_PER_LONG]);
+}
+
+/* Take a free block, mapped at block, off its list */
+static void remove_block(struct xv_pool *pool, struct page *page, u32 offset,
+			struct block_header *block)
+{
+	u32 slindex = insert_index(block_size(block));
+	struct freelist_entry *head = &pool->freelist[slindex];
+	struct link_free *link = block_link(block);
+	struct block_header *tmp;
+
+	if (link->prev_page) {
+		tmp = map_block(link->prev_page, link->prev_offset, KM_USER1);
+		block_link(tmp)->next_page = link->next_page;
+		block_link(tmp)->next_offset = link->next_offset;
+		unmap_block(tmp, KM_USER1);
+	}
+
+	if (link->next_page) {
+		tmp = map_block(link->next_page, link->next_offset, KM_USER1);
+		block_link(tmp)->prev_page = link->prev_page;
+		block_link(tmp)->prev_offset = link->prev_offset;
+		unmap_block(tmp, KM_USER1);
+	}
+
+	if (head->page != page || head->offset != offset)
+		return;
+
+	head->page = link->next_page;
+	head->offset = link->next_offset;
+	if (head->page)
+		return;
+
+	__clear_bit(slindex % BITS_PER_LONG,
+		    &pool->slbitmap[slindex / BITS_PER_LONG]);
+	if (!pool->slbitmap[slindex / BITS_PER_LONG])
+		__clear_bit(slindex / BITS_PER_LONG, &pool->flbitmap);
+}
+
+/* Add a page to the pool, as a single free block */
+static int grow_pool(struct xv_pool *pool, gfp_t flags)
+{
+	struct block_header *block;
+	struct page *page;
+
+	page = alloc_page(flags);
+	if (unlikely(!page))
+		return -ENOMEM;
+
+	block = map_block(page, 0, KM_USER0);
+	block->size = XV_MAX_ALLOC_SIZE | BLOCK_FREE;
+	block->prev = 0;
+
+	spin_lock(&pool->lock);
+	insert_block(pool, page, 0, block);
+	pool->total_pages++;
+	spin_unlock(&pool->lock);
+
+	unmap_block(block, KM_USER0);
+	return 0;
+}
+
+/**
+ * xv_malloc - allocate an object from the pool
+ * @pool: pool to allocate from
+ * @size: size of the object, up to PAGE_SIZE - 4 bytes
+ * @page: returns the page the object is in
+ * @offset: returns the offset of the object in that page
+ * @flags: for a new page, when the pool has no room for the object
+ *
+ * Returns 0 or -ENOMEM.  The object is reached with kmap_atomic(*page) +
+ * *offset; it is 4 byte aligned.
+ */
+int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
+		u32 *offset, gfp_t flags)
+{
+	struct block_header *block, *tmp;
+	u32 free_size, tmp_offset, next_offset;
+	int error;
+
+	if (unlikely(!size || size > XV_MAX_ALLOC_SIZE))
+		return -ENOMEM;
+
+	size = ALIGN(size, XV_ALIGN);
+	if (size < XV_MIN_ALLOC_SIZE)
+		size = XV_MIN_ALLOC_SIZE;
+
+	spin_lock(&pool->lock);
+	if (find_block(pool, size, page, offset) < 0) {
+		spin_unlock(&pool->lock);
+		error = grow_pool(pool, flags);
+		if (unlikely(error))
+			return error;
+
+		spin_lock(&pool->lock);
+		if (find_block(pool, size, page, offset) < 0) {
+			spin_unlock(&pool->lock);
+			return -ENOMEM;
+		}
+	}
+
+	block = map_block(*page, *offset, KM_USER0);
+	remove_block(pool, *page, *offset, block);
+
+	/* give what is left back to the pool, if it is worth a block */
+	free_size = block_size(block) - size;
+	if (free_size >= XV_ALIGN + XV_MIN_ALLOC_SIZE) {
+		block->size = size;
+
+		tmp_offset = *offset + XV_ALIGN + size;
+		tmp = (struct block_header *)((char *)block + XV_ALIGN + size);
+		tmp->size = (free_size - XV_ALIGN) | BLOCK_FREE;
+		tmp->prev = *offset;
+
+		next_offset = tmp_offset + free_size;
+		if (next_offset < PAGE_SIZE)
+			((struct block_header *)((char *)tmp + free_size))->prev =
+					tmp_offset;
+
+		insert_block(pool, *page, tmp_offset, tmp);
+	} else {
+		block->size &= ~BLOCK_FREE;
+	}
+
+	unmap_block(block, KM_USER0);
+	spin_unlock(&pool->lock);
+
+	*offset += XV_ALIGN;
+	return 0;
+}
+
+/**
+ * xv_free - give an object back to the pool
+ * @pool: pool it came from
+ * @page: page of the object, as returned by xv_malloc()
+ * @offset: offset of the object, as returned by xv_malloc()
+ *
+ * Never sleeps.
+ */
+void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
+{
+	struct block_header *block, *tmp;
+	char *base;
+	u32 size, next_offset;
+
+	offset -= XV_ALIGN;
+
+	spin_lock(&pool->lock);
+	base = kmap_atomic(page, KM_USER0);
+	block = (struct block_header *)(base + offset);
+	size = block_size(block);
+
+	/* merge with the block after it */
+	next_offset = offset + XV_ALIGN + size;
+	if (next_offset < PAGE_SIZE) {
+		tmp = (struct block_header *)(base + next_offset);
+		if (tmp->size & BLOCK_FREE) {
+			remove_block(pool, page, next_offset, tmp);
+			size += XV_ALIGN + block_size(tmp);
+		}
+	}
+
+	/* and the one before it */
+	if (offset) {
+		tmp = (struct block_header *)(base + block->prev);
+		if (tmp->size & BLOCK_FREE) {
+			remove_block(pool, page, block->prev, tmp);
+			size += XV_ALIGN + block_size(tmp);
+			offset = block->prev;
+			block = tmp;
+		}
+	}
+
+	if (size == XV_MAX_ALLOC_SIZE) {
+		kunmap_atomic(base, KM_USER0);
+		pool->total_pages--;
+		spin_unlock(&pool->lock);
+		__free_page(page);
+		return;
+	}
+
+	block->size = size | BLOCK_FREE;
+	next_offset = offset + XV_ALIGN + size;
+	if (next_offset < PAGE_SIZE)
+		((struct block_header *)(base + next_offset))->prev = offset;
+
+	insert_block(pool, page, offset, block);
+
+	kunmap_atomic(base, KM_USER0);
+	spin_unlock(&pool->lock);
+}
+
+struct xv_pool *xv_create_pool(void)
+{
+	struct xv_pool *pool;
+
+	BUILD_BUG_ON(sizeof(struct link_free) > XV_MIN_ALLOC_SIZE);
+	BUILD_BUG_ON(sizeof(struct block_header) != XV_ALIGN);
+	BUILD_BUG_ON(MAX_FLI >= BITS_PER_LONG);
+	BUILD_BUG_ON(PAGE_SIZE > 65536);
+
+	pool = vmalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	memset(pool, 0, sizeof(*pool));
+	spin_lock_init(&pool->lock);
+	return pool;
+}
+
+/* Every object must have been freed */
+void xv_destroy_pool(struct xv_pool *pool)
+{
+	WARN_ON(pool->total_pages);
+	vfree(pool);
+}
+
+u64 xv_get_total_size_bytes(struct xv_pool *pool)
+{
+	return pool->total_pages << PAGE_SHIFT;
+}
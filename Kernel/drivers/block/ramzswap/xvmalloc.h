@@ -0,0 +1,27 @@
+/*
+ * xvmalloc memory allocator
+ *
+ * Packs variable sized objects, such as compressed pages, into pages that
+ * may come from highmem.  An object never spans two pages, so it can be
+ * reached through a single kmap.
+ *
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _XV_MALLOC_H_
+#define _XV_MALLOC_H_
+
+#include <linux/types.h>
+
+struct xv_pool;
+
+struct xv_pool *xv_create_pool(void);
+void xv_destroy_pool(struct xv_pool *pool);
+
+int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
+			u32 *offset, gfp_t flags);
+void xv_free(struct xv_pool *pool, struct page *page, u32 offset);
+
+u64 xv_get_total_size_bytes(struct xv_pool *pool);
+
+#endif
@@ -0,0 +1,793 @@
+/*
+ *  drivers/cpufreq/victory/cpufreq_interactive.c
+ *
+ *  Based on the conservative governor in this directory.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * The "interactive" governor goes straight to hispeed_freq when a CPU
+ * comes out of idle into a burst of work, or when an input event
+ * arrives, rather than climbing a step per sampling period.  It then
+ * holds that speed for min_sample_time and comes down a step per
+ * timer_rate while the load allows it.
+ *
+ * Each CPU samples its load from a deferrable timer, so an idle CPU is
+ * not woken up to sample.  The timer is restarted when the CPU leaves
+ * idle to run a task, so that the first sample covers only the new
+ * burst.  A CPU left above the minimum speed while idle is woken up
+ * after timer_slack to let it come down.  Frequency changes are made
+ * from a realtime workqueue.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/cpufreq.h>
+#include <linux/cpu.h>
+#include <linux/input.h>
+#include <linux/jiffies.h>
+#include <linux/kernel_stat.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/tick.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <asm/idle.h>
+
+#define DEF_HISPEED_FREQ		(1000000)
+#define DEF_GO_HISPEED_LOAD		(85)
+#define DEF_MIN_SAMPLE_TIME		(80 * 1000)
+#define DEF_TIMER_RATE			(20 * 1000)
+#define DEF_TIMER_SLACK			(80 * 1000)
+#define TRANSITION_LATENCY_LIMIT	(10 * 1000 * 1000)
+
+#ifdef CONFIG_CPU_S5PV210
+extern unsigned int s5pc11x_target_frq(unsigned int pred_freq, int flag);
+extern unsigned int s5pc11x_jump_frq(unsigned int freq);
+extern int dvfs_change_quick;
+extern int g_dbs_timer_started;
+#endif
+
+struct cpu_interactive_info_s {
+	struct cpufreq_policy *cur_policy;
+	struct timer_list timer;
+	/* only there to wake up an idle CPU left above policy->min */
+	struct timer_list slack_timer;
+	struct work_struct work;
+	u64 prev_cpu_idle;
+	u64 prev_cpu_wall;
+	unsigned int load;
+	/* jiffies of the last raise, no decay until min_sample_time after */
+	unsigned long floor_time;
+	/* set from the input handler */
+	int boost;
+	int cpu;
+	int enable;
+	/*
+	 * serializes the frequency changes of the work with governor
+	 * stop and limit changes
+	 */
+	struct mutex timer_mutex;
+};
+static DEFINE_PER_CPU(struct cpu_interactive_info_s, cpu_interactive_info);
+
+static unsigned int interactive_enable;	/* number of CPUs using this policy */
+
+/*
+ * interactive_mutex protects interactive_tuners_ins from concurrent
+ * changes, and interactive_enable in governor start/stop.
+ */
+static DEFINE_MUTEX(interactive_mutex);
+
+static struct workqueue_struct *kinteractive_wq;
+
+static struct interactive_tuners {
+	unsigned int hispeed_freq;
+	unsigned int go_hispeed_load;
+	unsigned int min_sample_time;
+	unsigned int timer_rate;
+	unsigned int timer_slack;
+	unsigned int input_boost;
+} interactive_tuners_ins = {
+	.hispeed_freq = DEF_HISPEED_FREQ,
+	.go_hispeed_load = DEF_GO_HISPEED_LOAD,
+	.min_sample_time = DEF_MIN_SAMPLE_TIME,
+	.timer_rate = DEF_TIMER_RATE,
+	.timer_slack = DEF_TIMER_SLACK,
+	.input_boost = 1,
+};
+
+static inline u64 get_cpu_idle_time_jiffy(unsigned int cpu, u64 *wall)
+{
+	cputime64_t idle_time;
+	cputime64_t cur_wall_time;
+	cputime64_t busy_time;
+
+	cur_wall_time = jiffies64_to_cputime64(get_jiffies_64());
+	busy_time = cputime64_add(kstat_cpu(cpu).cpustat.user,
+			kstat_cpu(cpu).cpustat.system);
+
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.irq);
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.softirq);
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.steal);
+	busy_time = cputime64_add(busy_time, kstat_cpu(cpu).cpustat.nice);
+
+	idle_time = cputime64_sub(cur_wall_time, busy_time);
+	if (wall)
+		*wall = (u64)jiffies_to_usecs(cur_wall_time);
+
+	return (u64)jiffies_to_usecs(idle_time);
+}
+
+static inline u64 get_cpu_idle_time(unsigned int cpu, u64 *wall)
+{
+	u64 idle_time = get_cpu_idle_time_us(cpu, wall);
+
+	if (idle_time == -1ULL)
+		return get_cpu_idle_time_jiffy(cpu, wall);
+
+	return idle_time;
+}
+
+/*
+ * The next table frequency above (@dir > 0) or below @freq within the
+ * policy, or @freq if there is none.
+ */
+static unsigned int interactive_next_freq(struct cpufreq_policy *policy,
+					  unsigned int freq, int dir)
+{
+	struct cpufreq_frequency_table *table;
+	unsigned int best = freq, f;
+	int i;
+
+	table = cpufreq_frequency_get_table(policy->cpu);
+	if (!table)
+		return dir > 0 ? policy->max : policy->min;
+
+	for (i = 0; table[i].frequency != CPUFREQ_TABLE_END; i++) {
+		f = table[i].frequency;
+		if (f == CPUFREQ_ENTRY_INVALID || f < policy->min ||
+		    f > policy->max)
+			continue;
+		if (dir > 0 && f > freq && (best == freq || f < best))
+			best = f;
+		if (dir < 0 && f < freq && (best == freq || f > best))
+			best = f;
+	}
+	return best;
+}
+
+/*
+ * On the S5PV210 the steps go through the transition_state tables of the
+ * platform driver, and every change is held at the level of the DVFS
+ * locks.  Each of these moves the driver's current index, so the result
+ * must always be handed to __cpufreq_driver_target().
+ */
+#ifdef CONFIG_CPU_S5PV210
+static unsigned int interactive_step(struct cpufreq_policy *policy,
+				     unsigned int freq, int dir)
+{
+	return s5pc11x_target_frq(freq, dir);
+}
+
+static unsigned int interactive_jump(struct cpufreq_policy *policy,
+				     unsigned int freq)
+{
+	return s5pc11x_jump_frq(freq);
+}
+#else
+static unsigned int interactive_step(struct cpufreq_policy *policy,
+				     unsigned int freq, int dir)
+{
+	return interactive_next_freq(policy, freq, dir);
+}
+
+static unsigned int interactive_jump(struct cpufreq_policy *policy,
+				     unsigned int freq)
+{
+	return freq;
+}
+#endif
+
+/************************** sysfs interface ************************/
+#define show_one(file_name, object)					\
+static ssize_t show_##file_name						\
+(struct cpufreq_policy *unused, char *buf)				\
+{									\
+	return sprintf(buf, "%u\n", interactive_tuners_ins.object);	\
+}
+show_one(hispeed_freq, hispeed_freq);
+show_one(go_hispeed_load, go_hispeed_load);
+show_one(min_sample_time, min_sample_time);
+show_one(timer_rate, timer_rate);
+show_one(timer_slack, timer_slack);
+show_one(input_boost, input_boost);
+
+static ssize_t store_hispeed_freq(struct cpufreq_policy *policy,
+		const char *buf, size_t count)
+{
+	unsigned int input;
+	int ret;
+	ret = sscanf(buf, "%u", &input);
+
+	if (ret != 1 || input < policy->cpuinfo.min_freq ||
+			input > policy->cpuinfo.max_freq)
+		return -EINVAL;
+
+	mutex_lock(&interactive_mutex);
+	interactive_tuners_ins.hispeed_freq = input;
+	mutex_unlock(&interactive_mutex);
+
+	return count;
+}
+
+static ssize_t store_go_hispeed_load(struct cpufreq_policy *unused,
+		const char *buf, size_t count)
+{
+	unsigned int input;
+	int ret;
+	ret = sscanf(buf, "%u", &input);
+
+	if (ret != 1 || input < 1 || input > 100)
+		return -EINVAL;
+
+	mutex_lock(&interactive_mutex);
+	interactive_tuners_ins.go_hispeed_load = input;
+	mutex_unlock(&interactive_mutex);
+
+	return count;
+}
+
+static ssize_t store_min_sample_time(struct cpufreq_policy *unused,
+		const char *buf, size_t count)
+{
+	unsigned int input;
+	int ret;
+	ret = sscanf(buf, "%u", &input);
+
+	if (ret != 1)
+		return -EINVAL;
+
+	mutex_lock(&interactive_mutex);
+	interactive_tuners_ins.min_sample_time = input;
+	mutex_unlock(&interactive_mutex);
+
+	return count;
+}
+
+static ssize_t store_timer_rate(struct cpufreq_policy *unused,
+		const char *buf, size_t count)
+{
+	unsigned int input;
+	int ret;
+	ret = sscanf(buf, "%u", &input);
+
+	if (ret != 1)
+		return -EINVAL;
+
+	mutex_lock(&interactive_mutex);
+	/* no finer than a jiffy, the timers can't do better */
+	interactive_tuners_ins.timer_rate = max(input, jiffies_to_usecs(1));
+	mutex_unlock(&interactive_mutex);
+
+	return count;
+}
+
+static ssize_t store_timer_slack(struct cpufreq_policy *unused,
+		const char *buf, size_t count)
+{
+	unsigned int input;
+	int ret;
+	ret = sscanf(buf, "%u", &input);
+
+	if (ret != 1)
+		return -EINVAL;
+
+	mutex_lock(&interactive_mutex);
+	interactive_tuners_ins.timer_slack = input;
+	mutex_unlock(&interactive_mutex);
+
+	return count;
+}
+
+static ssize_t store_input_boost(struct cpufreq_policy *unused,
+		const char *buf, size_t count)
+{
+	unsigned int input;
+	int ret;
+	ret = sscanf(buf, "%u", &input);
+
+	if (ret != 1)
+		return -EINVAL;
+
+	mutex_lock(&interactive_mutex);
+	interactive_tuners_ins.input_boost = !!input;
+	mutex_unlock(&interactive_mutex);
+
+	return count;
+}
+
+#define define_one_rw(_name) \
+static struct freq_attr _name = \
+__ATTR(_name, 0644, show_##_name, store_##_name)
+
+define_one_rw(hispeed_freq);
+define_one_rw(go_hispeed_load);
+define_one_rw(min_sample_time);
+define_one_rw(timer_rate);
+define_one_rw(timer_slack);
+define_one_rw(input_boost);
+
+static struct attribute *interactive_attributes[] = {
+	&hispeed_freq.attr,
+	&go_hispeed_load.attr,
+	&min_sample_time.attr,
+	&timer_rate.attr,
+	&timer_slack.attr,
+	&input_boost.attr,
+	NULL
+};
+
+static struct attribute_group interactive_attr_group = {
+	.attrs = interactive_attributes,
+	.name = "interactive",
+};
+
+/************************** sysfs end ************************/
+
+/*
+ * Whether the last sample or a boost may change the speed, checked from
+ * the timer so that the work only runs when there is something to do.
+ */
+static int interactive_needs_work(struct cpu_interactive_info_s *info)
+{
+	struct cpufreq_policy *policy = info->cur_policy;
+	unsigned long floor_end;
+
+	if (info->boost)
+		return 1;
+#ifdef CONFIG_CPU_S5PV210
+	if (dvfs_change_quick)
+		return 1;
+#endif
+	if (info->load >= interactive_tuners_ins.go_hispeed_load)
+		return policy->cur < policy->max;
+
+	floor_end = info->floor_time +
+		usecs_to_jiffies(interactive_tuners_ins.min_sample_time);
+	return policy->cur > policy->min && time_after_eq(jiffies, floor_end);
+}
+
+/*
+ * Pick the next speed.  A boost or a load of go_hispeed_load takes the
+ * CPU straight to hispeed_freq, or a step further up if it is there
+ * already and still that busy.  Otherwise the CPU comes down a step once
+ * min_sample_time has passed since the last raise, if the load would
+ * stay under go_hispeed_load at the lower speed.  Returns 0 to stay.
+ */
+static unsigned int interactive_target(struct cpu_interactive_info_s *info)
+{
+	struct cpufreq_policy *policy = info->cur_policy;
+	unsigned int cur = policy->cur, load = info->load;
+	unsigned int hispeed, lower, new_freq = 0;
+	unsigned long floor_end;
+	int boost;
+
+	boost = xchg(&info->boost, 0);
+	hispeed = min(interactive_tuners_ins.hispeed_freq, policy->max);
+
+#ifdef CONFIG_CPU_S5PV210
+	/*
+	 * A driver asked for a level with set_dvfs_target_level(), which
+	 * moved the current index: s5pc11x_target_frq() hands it out.
+	 */
+	if (dvfs_change_quick) {
+		dvfs_change_quick = 0;
+		new_freq = s5pc11x_target_frq(cur, 1);
+		boost = 1;
+	}
+#endif
+
+	if (boost || load >= interactive_tuners_ins.go_hispeed_load) {
+		info->floor_time = jiffies;
+		if (cur < hispeed && new_freq < hispeed)
+			new_freq = interactive_jump(policy, hispeed);
+		else if (!new_freq && load >= interactive_tuners_ins.go_hispeed_load)
+			new_freq = interactive_step(policy, cur, 1);
+		else if (new_freq && new_freq < cur)
+			/* never down on a boost, but put the index back */
+			new_freq = interactive_jump(policy, cur);
+		return new_freq;
+	}
+
+	floor_end = info->floor_time +
+		usecs_to_jiffies(interactive_tuners_ins.min_sample_time);
+	if (cur <= policy->min || time_before(jiffies, floor_end))
+		return 0;
+
+	lower = interactive_next_freq(policy, cur, -1);
+	if (lower == cur ||
+	    load * cur >= interactive_tuners_ins.go_hispeed_load * lower)
+		return 0;
+
+	return interactive_step(policy, cur, -1);
+}
+
+static void do_interactive_work(struct work_struct *work)
+{
+	struct cpu_interactive_info_s *info =
+		container_of(work, struct cpu_interactive_info_s, work);
+	struct cpufreq_policy *policy;
+	unsigned int new_freq;
+
+	mutex_lock(&info->timer_mutex);
+	if (!info->enable)
+		goto out;
+
+	policy = info->cur_policy;
+	new_freq = interactive_target(info);
+	if (!new_freq)
+		goto out;
+
+	if (new_freq > policy->max)
+		new_freq = policy->max;
+	if (new_freq < policy->min)
+		new_freq = policy->min;
+
+	__cpufreq_driver_target(policy, new_freq, CPUFREQ_RELATION_H);
+out:
+	mutex_unlock(&info->timer_mutex);
+}
+
+static void interactive_timer_restart(struct cpu_interactive_info_s *info)
+{
+	mod_timer(&info->timer, jiffies +
+		  usecs_to_jiffies(interactive_tuners_ins.timer_rate));
+}
+
+static void do_interactive_timer(unsigned long data)
+{
+	struct cpu_interactive_info_s *info =
+		&per_cpu(cpu_interactive_info, data);
+	unsigned int idle_time, wall_time;
+	u64 cur_idle_time, cur_wall_time;
+
+	if (!info->enable)
+		return;
+
+	cur_idle_time = get_cpu_idle_time(data, &cur_wall_time);
+	wall_time = (unsigned int)(cur_wall_time - info->prev_cpu_wall);
+	idle_time = (unsigned int)(cur_idle_time - info->prev_cpu_idle);
+	info->prev_cpu_wall = cur_wall_time;
+	info->prev_cpu_idle = cur_idle_time;
+
+	if (!wall_time || wall_time < idle_time)
+		info->load = 0;
+	else
+		info->load = 100 * (wall_time - idle_time) / wall_time;
+
+	if (interactive_needs_work(info))
+		queue_work_on(data, kinteractive_wq, &info->work);
+
+	interactive_timer_restart(info);
+#ifdef CONFIG_CPU_S5PV210
+	g_dbs_timer_started = 1;
+#endif
+}
+
+static void do_interactive_slack_timer(unsigned long data)
+{
+	/* the deferred sampling timer runs now that the CPU is awake */
+}
+
+static void interactive_idle_start(struct cpu_interactive_info_s *info)
+{
+	unsigned int slack = interactive_tuners_ins.timer_slack;
+
+	if (slack && info->cur_policy->cur > info->cur_policy->min &&
+	    !timer_pending(&info->slack_timer))
+		mod_timer(&info->slack_timer,
+			  jiffies + usecs_to_jiffies(slack));
+}
+
+/*
+ * When the CPU leaves idle to run a task, it goes to hispeed_freq at once
+ * from the work, as on an input event, rather than waiting for a sample
+ * to see the load.  If its sample is overdue, the sample restarts from
+ * now, so that the load it sees is that of the burst that woke the CPU
+ * and not the idle time before it.
+ */
+static void interactive_idle_end(struct cpu_interactive_info_s *info)
+{
+	struct cpufreq_policy *policy = info->cur_policy;
+
+	if (!need_resched())
+		return;
+
+	del_timer(&info->slack_timer);
+	if (policy->cur < min(interactive_tuners_ins.hispeed_freq,
+			      policy->max)) {
+		info->boost = 1;
+		queue_work_on(info->cpu, kinteractive_wq, &info->work);
+	}
+
+	if (!timer_pending(&info->timer) ||
+	    time_after_eq(jiffies, info->timer.expires)) {
+		info->prev_cpu_idle = get_cpu_idle_time(info->cpu,
+							&info->prev_cpu_wall);
+		interactive_timer_restart(info);
+	}
+}
+
+/*
+ * Called by the idle loop around pm_idle, whichever cpuidle state or
+ * idle routine it runs.
+ */
+static int interactive_idle_notifier(struct notifier_block *nb,
+				     unsigned long val, void *data)
+{
+	struct cpu_interactive_info_s *info =
+		&per_cpu(cpu_interactive_info, smp_processor_id());
+
+	if (!info->enable)
+		return NOTIFY_OK;
+
+	switch (val) {
+	case IDLE_START:
+		interactive_idle_start(info);
+		break;
+	case IDLE_END:
+		interactive_idle_end(info);
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block interactive_idle_nb = {
+	.notifier_call = interactive_idle_notifier,
+};
+
+/*
+ * Touchscreens and keys.  Other devices with absolute axes, like the
+ * sensors, would keep the CPU at speed for nothing.
+ */
+static void interactive_input_event(struct input_handle *handle,
+				    unsigned int type, unsigned int code,
+				    int value)
+{
+	unsigned int cpu;
+
+	if (!interactive_tuners_ins.input_boost ||
+	    (type != EV_KEY && type != EV_ABS))
+		return;
+
+	for_each_online_cpu(cpu) {
+		struct cpu_interactive_info_s *info =
+			&per_cpu(cpu_interactive_info, cpu);
+
+		if (!info->enable)
+			continue;
+		/* already there, just hold it */
+		if (info->cur_policy->cur >= interactive_tuners_ins.hispeed_freq) {
+			info->floor_time = jiffies;
+			continue;
+		}
+		info->boost = 1;
+		queue_work_on(cpu, kinteractive_wq, &info->work);
+	}
+}
+
+static int interactive_input_connect(struct input_handler *handler,
+				     struct input_dev *dev,
+				     const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_interactive";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_free;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_unregister;
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return error;
+}
+
+static void interactive_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id interactive_input_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] = BIT_MASK(ABS_X) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler interactive_input_handler = {
+	.event		= interactive_input_event,
+	.connect	= interactive_input_connect,
+	.disconnect	= interactive_input_disconnect,
+	.name		= "cpufreq_interactive",
+	.id_table	= interactive_input_ids,
+};
+
+static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
+					unsigned int event)
+{
+	unsigned int cpu = policy->cpu;
+	struct cpu_interactive_info_s *this_info;
+	unsigned int j;
+	int rc;
+
+	this_info = &per_cpu(cpu_interactive_info, cpu);
+
+	switch (event) {
+	case CPUFREQ_GOV_START:
+		if ((!cpu_online(cpu)) || (!policy->cur))
+			return -EINVAL;
+
+		mutex_lock(&interactive_mutex);
+
+		rc = sysfs_create_group(&policy->kobj, &interactive_attr_group);
+		if (rc) {
+			mutex_unlock(&interactive_mutex);
+			return rc;
+		}
+
+		for_each_cpu(j, policy->cpus) {
+			struct cpu_interactive_info_s *j_info;
+
+			j_info = &per_cpu(cpu_interactive_info, j);
+			j_info->cur_policy = policy;
+			j_info->cpu = j;
+			j_info->boost = 0;
+			j_info->floor_time = jiffies;
+			j_info->prev_cpu_idle = get_cpu_idle_time(j,
+						&j_info->prev_cpu_wall);
+			mutex_init(&j_info->timer_mutex);
+			INIT_WORK(&j_info->work, do_interactive_work);
+			init_timer_deferrable(&j_info->timer);
+			j_info->timer.function = do_interactive_timer;
+			j_info->timer.data = j;
+			setup_timer(&j_info->slack_timer,
+				    do_interactive_slack_timer, j);
+			j_info->enable = 1;
+			j_info->timer.expires = jiffies +
+			    usecs_to_jiffies(interactive_tuners_ins.timer_rate);
+			add_timer_on(&j_info->timer, j);
+		}
+
+		interactive_enable++;
+		/*
+		 * Hook idle and input when this governor is used for the
+		 * first time
+		 */
+		if (interactive_enable == 1) {
+			idle_notifier_register(&interactive_idle_nb);
+			rc = input_register_handler(&interactive_input_handler);
+			if (rc)
+				printk(KERN_WARNING "cpufreq_interactive: no "
+				       "input boost, error %d\n", rc);
+		}
+		mutex_unlock(&interactive_mutex);
+
+		break;
+
+	case CPUFREQ_GOV_STOP:
+		mutex_lock(&interactive_mutex);
+		interactive_enable--;
+		if (interactive_enable == 0) {
+			input_unregister_handler(&interactive_input_handler);
+			idle_notifier_unregister(&interactive_idle_nb);
+		}
+
+		for_each_cpu(j, policy->cpus) {
+			struct cpu_interactive_info_s *j_info;
+
+			j_info = &per_cpu(cpu_interactive_info, j);
+			mutex_lock(&j_info->timer_mutex);
+			j_info->enable = 0;
+			mutex_unlock(&j_info->timer_mutex);
+			del_timer_sync(&j_info->timer);
+			del_timer_sync(&j_info->slack_timer);
+			cancel_work_sync(&j_info->work);
+			mutex_destroy(&j_info->timer_mutex);
+		}
+
+		sysfs_remove_group(&policy->kobj, &interactive_attr_group);
+		mutex_unlock(&interactive_mutex);
+
+		break;
+
+	case CPUFREQ_GOV_LIMITS:
+		mutex_lock(&this_info->timer_mutex);
+		if (policy->max < this_info->cur_policy->cur)
+			__cpufreq_driver_target(
+					this_info->cur_policy,
+					policy->max, CPUFREQ_RELATION_H);
+		else if (policy->min > this_info->cur_policy->cur)
+			__cpufreq_driver_target(
+					this_info->cur_policy,
+					policy->min, CPUFREQ_RELATION_L);
+		mutex_unlock(&this_info->timer_mutex);
+
+		break;
+	}
+	return 0;
+}
+
+#ifndef CONFIG_CPU_FREQ_DEFAULT_GOV_INTERACTIVE
+static
+#endif
+struct cpufreq_governor cpufreq_gov_interactive = {
+	.name			= "interactive",
+	.governor		= cpufreq_governor_interactive,
+	.max_transition_latency	= TRANSITION_LATENCY_LIMIT,
+	.owner			= THIS_MODULE,
+};
+
+static int __init cpufreq_gov_interactive_init(void)
+{
+	int err;
+
+	kinteractive_wq = create_rt_workqueue("kinteractive");
+	if (!kinteractive_wq) {
+		printk(KERN_ERR "Creation of kinteractive failed\n");
+		return -EFAULT;
+	}
+
+	err = cpufreq_register_governor(&cpufreq_gov_interactive);
+	if (err)
+		destroy_workqueue(kinteractive_wq);
+
+	return err;
+}
+
+MODULE_DESCRIPTION("'cpufreq_interactive' - A cpufreq governor that goes "
+		"straight to speed on idle exit and input, for latency "
+		"sensitive interactive use");
+MODULE_LICENSE("GPL");
+
+#ifdef CONFIG_CPU_FREQ_DEFAULT_GOV_INTERACTIVE
+fs_initcall(cpufreq_gov_interactive_init);
+#else
+module_init(cpufreq_gov_interactive_init);
+#endif
@@ -314,6 +314,9 @@ static void melfas_touchkey_early_resume(struct early_suspend *h)
     }
 
 }
+
+/* the touch screen powers the keys and is told about usb and ta */
+static const char *const melfas_touchkey_depends[] = { "qt602240", NULL };
 #endif	// End of CONFIG_HAS_EARLYSUSPEND
 extern void keypad_led_onoff(int OnOff);  //suik_check
 
@@ -382,6 +385,9 @@ static int i2c_touchkey_probe(struct i2c_client *client,const struct i2c_device_
 	#ifdef CONFIG_HAS_EARLYSUSPEND
 	touchkey_driver->early_suspend.suspend = melfas_touchkey_early_suspend;
 	touchkey_driver->early_suspend.resume = melfas_touchkey_early_resume;
+	touchkey_driver->early_suspend.name = "melfas-touchkey";
+	touchkey_driver->early_suspend.depends = melfas_touchkey_depends;
+	touchkey_driver->early_suspend.async = 1;
 	register_early_suspend(&touchkey_driver->early_suspend);
 	#endif /* CONFIG_HAS_EARLYSUSPEND */ 
 
@@ -30,6 +30,9 @@
 #ifdef CONFIG_CPU_FREQ
 #include <mach/cpu-freq-v210.h>
 #endif
+#include <mach/dvfs-qos.h>
+
+static DEFINE_DVFS_QOS_REQUEST(qt602240_qos, "qt602240");
 
 #include <mach/atlas/gpio-aries.h>
 
@@ -3257,7 +3260,7 @@ void  get_message(struct work_struct * p)
 						if ( fingerInfo[i].pressure == -1 ) continue;
 
 						if(i == 0){
-							s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_4);
+							dvfs_qos_release_request(&qt602240_qos);
 							//set_dvfs_perf_level();
 							touch_state_val=0;
 							}
@@ -3372,7 +3375,7 @@ void  get_message(struct work_struct * p)
 			#ifdef CONFIG_CPU_FREQ
 			#if USE_PERF_LEVEL_TS
 				if(id == 0){
-					s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_4);
+					dvfs_qos_release_request(&qt602240_qos);
 					//set_dvfs_perf_level();
 					touch_state_val=0;
 					}
@@ -3391,7 +3394,7 @@ void  get_message(struct work_struct * p)
 			#if USE_PERF_LEVEL_TS
 				if(id == 0){
 					//set_dvfs_perf_level();
-					s5pc110_lock_dvfs_high_level(DVFS_LOCK_TOKEN_4, LEV_800MHZ);
+					dvfs_qos_update_request(&qt602240_qos, 800000, 0, 0);
 					touch_state_val=1;
 					}
 			#endif
@@ -3425,7 +3428,7 @@ void  get_message(struct work_struct * p)
 			#if USE_PERF_LEVEL_TS
 			if(id == 0){
 				//set_dvfs_perf_level();
-				s5pc110_lock_dvfs_high_level(DVFS_LOCK_TOKEN_4, LEV_800MHZ);
+				dvfs_qos_update_request(&qt602240_qos, 800000, 0, 0);
 				}
 			#endif
 			#endif
@@ -3446,7 +3449,7 @@ void  get_message(struct work_struct * p)
 			#ifdef CONFIG_CPU_FREQ
 			#if USE_PERF_LEVEL_TS
 				if(id == 0){
-				s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_4);
+				dvfs_qos_release_request(&qt602240_qos);
 				//set_dvfs_perf_level();
 					}
 			#endif
@@ -6355,6 +6358,7 @@ void __exit qt602240_exit(void)
 	i2c_del_driver(&qt602240_i2c_driver);
 	if (qt602240_wq)
 		destroy_workqueue(qt602240_wq);
+	dvfs_qos_remove_request(&qt602240_qos);
 }
 late_initcall(qt602240_init);
 module_exit(qt602240_exit);
@@ -28,6 +28,8 @@
 
 #ifdef CONFIG_CPU_FREQ
 #include <mach/cpu-freq-v210.h>
+
+static DEFINE_DVFS_QOS_REQUEST(qt602240_qos, "qt602240");
 #endif
 
 #include <mach/gpio.h>
@@ -2996,7 +2998,7 @@ void  get_message(struct work_struct * p)
 						if ( fingerInfo[i].pressure == -1 ) continue;
 
 						if(i == 0){
-							s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_4);
+							dvfs_qos_release_request(&qt602240_qos);
 							//set_dvfs_perf_level();
 							touch_state_val=0;
 							}
@@ -3093,7 +3095,7 @@ void  get_message(struct work_struct * p)
 			#ifdef CONFIG_CPU_FREQ
 			#if USE_PERF_LEVEL_TS
 				if(id == 0){
-					s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_4);
+					dvfs_qos_release_request(&qt602240_qos);
 					//set_dvfs_perf_level();
 					touch_state_val=0;
 					}
@@ -3112,7 +3114,7 @@ void  get_message(struct work_struct * p)
 			#if USE_PERF_LEVEL_TS
 				if(id == 0){
 					//set_dvfs_perf_level();
-					s5pc110_lock_dvfs_high_level(DVFS_LOCK_TOKEN_4, LEV_800MHZ);
+					dvfs_qos_update_request(&qt602240_qos, 800000, 0, 0);
 					touch_state_val=1;
 					}
 			#endif
@@ -3146,7 +3148,7 @@ void  get_message(struct work_struct * p)
 			#if USE_PERF_LEVEL_TS
 			if(id == 0){
 				//set_dvfs_perf_level();
-				s5pc110_lock_dvfs_high_level(DVFS_LOCK_TOKEN_4, LEV_800MHZ);
+				dvfs_qos_update_request(&qt602240_qos, 800000, 0, 0);
 				}
 			#endif
 			#endif
@@ -3167,7 +3169,7 @@ void  get_message(struct work_struct * p)
 			#ifdef CONFIG_CPU_FREQ
 			#if USE_PERF_LEVEL_TS
 				if(id == 0){
-				s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_4);
+				dvfs_qos_release_request(&qt602240_qos);
 				//set_dvfs_perf_level();
 					}
 			#endif
@@ -3609,6 +3611,8 @@ int qt602240_probe(struct i2c_client *client,
 	qt602240->early_suspend.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 1;
 	qt602240->early_suspend.suspend = qt602240_early_suspend;
 	qt602240->early_suspend.resume = qt602240_late_resume;
+	qt602240->early_suspend.name = "qt602240";
+	qt602240->early_suspend.async = 1;
 	register_early_suspend(&qt602240->early_suspend);
 #endif	/* CONFIG_HAS_EARLYSUSPEND */
 
@@ -5837,6 +5841,9 @@ void __exit qt602240_exit(void)
 	i2c_del_driver(&qt602240_i2c_driver);
 	if (qt602240_wq)
 		destroy_workqueue(qt602240_wq);
+#ifdef CONFIG_CPU_FREQ
+	dvfs_qos_remove_request(&qt602240_qos);
+#endif
 }
 late_initcall(qt602240_init);
 module_exit(qt602240_exit);
@@ -39,6 +39,9 @@
 #define CLEAR_FIMC2_BUFF
 
 struct fimc_global *fimc_dev;
+#ifdef CONFIG_CPU_FREQ
+static DEFINE_DVFS_QOS_REQUEST(fimc_qos, "fimc0");
+#endif
 
 int fimc_dma_alloc(struct fimc_control *ctrl, struct fimc_buf_set *bs,
 							int i, int align)
@@ -932,7 +935,7 @@ static int fimc_open(struct file *filp)
 
 #ifdef CONFIG_CPU_FREQ
 	if (0 == ctrl->id)
-    		s5pc110_lock_dvfs_high_level(DVFS_LOCK_TOKEN_2, LEV_200MHZ);
+		dvfs_qos_update_request(&fimc_qos, 200000, 0, 0);
 #endif 
 
 	mutex_unlock(&ctrl->lock);
@@ -1109,7 +1112,7 @@ static int fimc_release(struct file *filp)
 	}
 #ifdef CONFIG_CPU_FREQ
 	if (0 == ctrl->id)
-		s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_2);
+		dvfs_qos_release_request(&fimc_qos);
 #endif
 
 	fimc_info1("%s released.\n", ctrl->name);
@@ -1709,6 +1712,9 @@ static int fimc_register(void)
 static void fimc_unregister(void)
 {
 	platform_driver_unregister(&fimc_driver);
+#ifdef CONFIG_CPU_FREQ
+	dvfs_qos_remove_request(&fimc_qos);
+#endif
 }
 
 late_initcall(fimc_register);
@@ -73,6 +73,9 @@
 static struct resource *mfc_mem;
 static struct mutex mfc_mutex;
 static struct clk *mfc_clk;
+#ifdef CONFIG_CPU_FREQ
+static DEFINE_DVFS_QOS_REQUEST(mfc_qos, "mfc");
+#endif
 
 static int mfc_open(struct inode *inode, struct file *file)
 {
@@ -89,10 +92,10 @@ static int mfc_open(struct inode *inode, struct file *file)
 	{
 #ifdef CONFIG_CPU_FREQ
 #if defined(CONFIG_MACH_S5PC110_P1)
-		s5pc110_lock_dvfs_high_level(DVFS_LOCK_TOKEN_1, 2); // DVFS Limit 200Mhz when mfc is running
+		dvfs_qos_update_request(&mfc_qos, 800000, 0, 0); // keep at least 800MHz while mfc is running
 #endif
 #if defined(CONFIG_MACH_S5PC110_ARIES)
-		s5pc110_lock_dvfs_high_level(DVFS_LOCK_TOKEN_1, LEV_400MHZ);
+		dvfs_qos_update_request(&mfc_qos, 400000, 0, 0);
 #endif // CONFIG_MACH_S5PC110_P1
 #endif
 #ifdef CONFIG_S5PC11X_LPAUDIO
@@ -215,7 +218,7 @@ out_release:
 	if (!mfc_is_running())
 	{
 #ifdef CONFIG_CPU_FREQ
-		s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_1);
+		dvfs_qos_release_request(&mfc_qos);
 #endif
 #ifdef CONFIG_PM_PWR_GATING
 		s5pc110_unlock_power_domain(MFC_DOMAIN_LOCK_TOKEN);
@@ -846,6 +849,9 @@ static int __init mfc_init(void)
 static void __exit mfc_exit(void)
 {
 	platform_driver_unregister(&mfc_driver);
+#ifdef CONFIG_CPU_FREQ
+	dvfs_qos_remove_request(&mfc_qos);
+#endif
 	mfc_info("S5PC110 MFC Driver exit.\n");
 }
 
@@ -23,12 +23,15 @@
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
 #include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include <asm/cacheflush.h>
 
 #define PMEM_MAX_DEVICES 10
-#define PMEM_MAX_ORDER 128
+/* orders of the free lists, a block of order n is 2^n entries */
+#define PMEM_NR_ORDERS BITS_PER_LONG
 #define PMEM_MIN_ALLOC PAGE_SIZE
 
 #define PMEM_DEBUG 1
@@ -82,6 +85,7 @@ struct pmem_data {
 struct pmem_bits {
 	unsigned allocated:1;		/* 1 if allocated, 0 if free */
 	unsigned order:7;		/* size of the region in pmem space */
+	struct list_head free;		/* entry in the free list of its order */
 };
 
 struct pmem_region_node {
@@ -116,6 +120,14 @@ struct pmem_info {
 	/* the bitmap for the region indicating which entries are allocated
 	 * and which are free */
 	struct pmem_bits *bitmap;
+	/* the free blocks of each order, and a bit for each order whose list
+	 * is not empty, so allocation does not have to scan the bitmap */
+	struct list_head free_list[PMEM_NR_ORDERS];
+	unsigned long free_mask;
+	/* freed blocks are merged with their buddies later, see
+	 * pmem_coalesce() */
+	unsigned coalesce_pending;
+	struct work_struct coalesce_work;
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -131,7 +143,7 @@ struct pmem_info {
 	 * needed */
 	struct semaphore data_list_sem;
 	struct list_head data_list;
-	/* pmem_sem protects the bitmap array
+	/* pmem_sem protects the bitmap array and the free lists
 	 * a write lock should be held when modifying entries in bitmap
 	 * a read lock should be held when reading data from bits or
 	 * dereferencing a pointer into bitmap
@@ -153,6 +165,8 @@ static struct pmem_info pmem[PMEM_MAX_DEVICES];
 static int id_count;
 
 #define PMEM_IS_FREE(id, index) !(pmem[id].bitmap[index].allocated)
+#define PMEM_FREE_INDEX(id, entry) \
+	(list_entry(entry, struct pmem_bits, free) - pmem[id].bitmap)
 #define PMEM_ORDER(id, index) pmem[id].bitmap[index].order
 #define PMEM_BUDDY_INDEX(id, index) (index ^ (1 << PMEM_ORDER(id, index)))
 #define PMEM_NEXT_INDEX(id, index) (index + (1 << PMEM_ORDER(id, index)))
@@ -232,33 +246,92 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+static void pmem_free_list_add(int id, int index)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	int order = PMEM_ORDER(id, index);
+
+	pmem[id].bitmap[index].allocated = 0;
+	list_add(&pmem[id].bitmap[index].free, &pmem[id].free_list[order]);
+	pmem[id].free_mask |= 1UL << order;
+}
+
+static void pmem_free_list_del(int id, int index)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	int order = PMEM_ORDER(id, index);
+
+	list_del(&pmem[id].bitmap[index].free);
+	if (list_empty(&pmem[id].free_list[order]))
+		pmem[id].free_mask &= ~(1UL << order);
+}
+
+/* pmem_free only puts blocks back on their free list, so a buffer that is
+ * freed and allocated again at the same size is not merged and split every
+ * time.  Merging the buddies of freed blocks is done here, from a work item
+ * or when an allocation finds no block that is large enough.
+ */
+static void pmem_coalesce(int id)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	LIST_HEAD(pending);
+	int order;
+
+	for (order = 0; order < PMEM_NR_ORDERS - 1; order++) {
+		struct list_head *head = &pmem[id].free_list[order];
+
+		/* blocks merged here go to order + 1, which comes next */
+		list_splice_init(head, &pending);
+		while (!list_empty(&pending)) {
+			int index = PMEM_FREE_INDEX(id, pending.next);
+			int buddy = index ^ (1 << order);
+
+			list_del(pending.next);
+			/* the buddy is on 'pending' if it is free and of the
+			 * same order, blocks that failed to merge are not */
+			if (buddy + (1 << order) <= pmem[id].num_entries &&
+			    PMEM_IS_FREE(id, buddy) &&
+			    PMEM_ORDER(id, buddy) == order) {
+				list_del(&pmem[id].bitmap[buddy].free);
+				index = min(index, buddy);
+				PMEM_ORDER(id, index) = order + 1;
+				pmem_free_list_add(id, index);
+			} else {
+				list_add(&pmem[id].bitmap[index].free, head);
+			}
+		}
+		if (list_empty(head))
+			pmem[id].free_mask &= ~(1UL << order);
+	}
+	pmem[id].coalesce_pending = 0;
+}
+
+static void pmem_coalesce_work(struct work_struct *work)
+{
+	struct pmem_info *info = container_of(work, struct pmem_info,
+					      coalesce_work);
+	int id = info - pmem;
+
+	down_write(&pmem[id].bitmap_sem);
+	if (pmem[id].coalesce_pending)
+		pmem_coalesce(id);
+	up_write(&pmem[id].bitmap_sem);
+}
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
-	int buddy, curr = index;
 	DLOG("index %d\n", index);
 
 	if (pmem[id].no_allocator) {
 		pmem[id].allocated = 0;
 		return 0;
 	}
-	/* clean up the bitmap, merging any buddies */
-	pmem[id].bitmap[curr].allocated = 0;
-	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
-	 * if the buddy is also free merge them
-	 * repeat until the buddy is not free or end of the bitmap is reached
-	 */
-	do {
-		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (PMEM_IS_FREE(id, buddy) &&
-				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
-			PMEM_ORDER(id, buddy)++;
-			PMEM_ORDER(id, curr)++;
-			curr = min(buddy, curr);
-		} else {
-			break;
-		}
-	} while (curr < pmem[id].num_entries);
+	pmem_free_list_add(id, index);
+	if (!pmem[id].coalesce_pending) {
+		pmem[id].coalesce_pending = 1;
+		schedule_work(&pmem[id].coalesce_work);
+	}
 
 	return 0;
 }
@@ -380,10 +453,9 @@ static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
-	int best_fit = -1;
+	int best_fit;
 	unsigned long order = pmem_order(len);
+	unsigned long curr, mask;
 
 	if (pmem[id].no_allocator) {
 		DLOG("no allocator");
@@ -393,47 +465,38 @@ static int pmem_allocate(int id, unsigned long len)
 		return len;
 	}
 
-	if (order > PMEM_MAX_ORDER)
+	if (order >= PMEM_NR_ORDERS)
 		return -1;
 	DLOG("order %lx\n", order);
 
-	/* look through the bitmap:
-	 * 	if you find a free slot of the correct order use it
-	 * 	otherwise, use the best fit (smallest with size > order) slot
+	/* take a block from the smallest non-empty free list of at least
+	 * the requested order, merging freed buddies first if there is none
 	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
-		}
-		curr = PMEM_NEXT_INDEX(id, curr);
+	mask = pmem[id].free_mask & ~((1UL << order) - 1);
+	if (!mask && pmem[id].coalesce_pending) {
+		pmem_coalesce(id);
+		mask = pmem[id].free_mask & ~((1UL << order) - 1);
 	}
-
-	/* if best_fit < 0, there are no suitable slots,
-	 * return an error
-	 */
-	if (best_fit < 0) {
+	if (!mask) {
 		printk("pmem: no space left to allocate!\n");
 		return -1;
 	}
+	curr = __ffs(mask);
+	best_fit = PMEM_FREE_INDEX(id, pmem[id].free_list[curr].next);
+	pmem_free_list_del(id, best_fit);
 
 	/* now partition the best fit:
-	 * 	split the slot into 2 buddies of order - 1
-	 * 	repeat until the slot is of the correct order
+	 * 	split the slot into 2 buddies of order - 1 and free the upper
+	 * 	one, repeat until the slot is of the correct order
 	 */
-	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
+	while (curr > order) {
 		int buddy;
-		PMEM_ORDER(id, best_fit) -= 1;
-		buddy = PMEM_BUDDY_INDEX(id, best_fit);
-		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
+		curr--;
+		buddy = best_fit + (1 << curr);
+		PMEM_ORDER(id, buddy) = curr;
+		pmem_free_list_add(id, buddy);
 	}
+	PMEM_ORDER(id, best_fit) = order;
 	pmem[id].bitmap[best_fit].allocated = 1;
 	return best_fit;
 }
@@ -1180,6 +1243,37 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 }
 
 #if PMEM_DEBUG
+/* prints the free blocks per order, merging freed buddies first so that
+ * the fragmentation is not overstated */
+static int pmem_fragmentation(int id, char *buffer, int size)
+{
+	unsigned long free = 0, largest = 0, count;
+	struct list_head *elt;
+	int order, n;
+
+	down_write(&pmem[id].bitmap_sem);
+	if (pmem[id].coalesce_pending)
+		pmem_coalesce(id);
+	n = scnprintf(buffer, size, "free blocks: order count\n");
+	for (order = 0; order < PMEM_NR_ORDERS; order++) {
+		count = 0;
+		list_for_each(elt, &pmem[id].free_list[order])
+			count++;
+		if (!count)
+			continue;
+		n += scnprintf(buffer + n, size - n, "%d %lu\n", order, count);
+		free += count << order;
+		largest = 1UL << order;
+	}
+	up_write(&pmem[id].bitmap_sem);
+
+	n += scnprintf(buffer + n, size - n,
+		       "free %lu of %lu pages, largest block %lu pages, "
+		       "fragmentation %lu%%\n", free, pmem[id].num_entries,
+		       largest, free ? 100 - largest * 100 / free : 0);
+	return n;
+}
+
 static ssize_t debug_open(struct inode *inode, struct file *file)
 {
 	file->private_data = inode->i_private;
@@ -1220,8 +1314,10 @@ static ssize_t debug_read(struct file *file, char __user *buf, size_t count,
 	}
 	up(&pmem[id].data_list_sem);
 
-	n++;
-	buffer[n] = 0;
+	if (!pmem[id].no_allocator)
+		n += pmem_fragmentation(id, buffer + n, debug_bufmax - n);
+
+	/* scnprintf() has terminated it, and n stays below debug_bufmax */
 	return simple_read_from_buffer(buf, count, ppos, buffer, n);
 }
 
@@ -1238,12 +1334,39 @@ static struct miscdevice pmem_dev = {
 };
 #endif
 
+/* sets up the free lists for a region of pmem[id].num_entries entries, laid
+ * out as blocks of decreasing power of two sizes */
+static int pmem_init_allocator(int id)
+{
+	int i, index = 0;
+
+	pmem[id].bitmap = vmalloc(pmem[id].num_entries *
+				  sizeof(struct pmem_bits));
+	if (!pmem[id].bitmap)
+		return -ENOMEM;
+
+	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
+					  pmem[id].num_entries);
+	for (i = 0; i < PMEM_NR_ORDERS; i++)
+		INIT_LIST_HEAD(&pmem[id].free_list[i]);
+	pmem[id].free_mask = 0;
+	pmem[id].coalesce_pending = 0;
+
+	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
+		if ((pmem[id].num_entries) &  1<<i) {
+			PMEM_ORDER(id, index) = i;
+			pmem_free_list_add(id, index);
+			index = PMEM_NEXT_INDEX(id, index);
+		}
+	}
+	return 0;
+}
+
 int pmem_setup(struct android_pmem_platform_data *pdata,
 	       long (*ioctl)(struct file *, unsigned int, unsigned long),
 	       int (*release)(struct inode *, struct file *))
 {
 	int err = 0;
-	int i, index = 0;
 	int id = id_count;
 	id_count++;
 
@@ -1255,6 +1378,7 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	pmem[id].ioctl = ioctl;
 	pmem[id].release = release;
 	init_rwsem(&pmem[id].bitmap_sem);
+	INIT_WORK(&pmem[id].coalesce_work, pmem_coalesce_work);
 	init_MUTEX(&pmem[id].data_list_sem);
 	INIT_LIST_HEAD(&pmem[id].data_list);
 	pmem[id].dev.name = pdata->name;
@@ -1269,21 +1393,9 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	}
 	pmem[id].num_entries = pmem[id].size / PMEM_MIN_ALLOC;
 
-	pmem[id].bitmap = kmalloc(pmem[id].num_entries *
-				  sizeof(struct pmem_bits), GFP_KERNEL);
-	if (!pmem[id].bitmap)
+	if (pmem_init_allocator(id))
 		goto err_no_mem_for_metadata;
 
-	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
-					  pmem[id].num_entries);
-
-	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
-		if ((pmem[id].num_entries) &  1<<i) {
-			PMEM_ORDER(id, index) = i;
-			index = PMEM_NEXT_INDEX(id, index);
-		}
-	}
-
 	if (pmem[id].cached)
 		pmem[id].vbase = ioremap_cached(pmem[id].base,
 						pmem[id].size);
@@ -1308,13 +1420,208 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 #endif
 	return 0;
 error_cant_remap:
-	kfree(pmem[id].bitmap);
+	vfree(pmem[id].bitmap);
 err_no_mem_for_metadata:
 	misc_deregister(&pmem[id].dev);
 err_cant_register_device:
 	return -1;
 }
 
+#ifdef CONFIG_ANDROID_PMEM_SELFTEST
+#define PMEM_TEST_ENTRIES 4096
+#define PMEM_TEST_OPS 20000
+#define PMEM_TEST_LIVE 64
+
+struct pmem_test_stats {
+	unsigned long allocs, failed;
+	u64 alloc_ns, alloc_ns_max, free_ns;
+	unsigned long largest;
+};
+
+static unsigned long pmem_test_seed;
+
+static unsigned long pmem_test_random(void)
+{
+	pmem_test_seed = pmem_test_seed * 1103515245 + 12345;
+	return pmem_test_seed >> 16;
+}
+
+/* the allocator pmem used before the free lists: a linear scan of the
+ * bitmap for the best fit, and eager merging on free */
+static int pmem_test_linear_alloc(struct pmem_bits *bits, int end, int order)
+{
+	int curr = 0, best_fit = -1;
+
+	while (curr < end) {
+		if (!bits[curr].allocated) {
+			if (bits[curr].order == order) {
+				best_fit = curr;
+				break;
+			}
+			if (bits[curr].order > order && (best_fit < 0 ||
+			    bits[curr].order < bits[best_fit].order))
+				best_fit = curr;
+		}
+		curr += 1 << bits[curr].order;
+	}
+	if (best_fit < 0)
+		return -1;
+	while (bits[best_fit].order > order) {
+		bits[best_fit].order--;
+		bits[best_fit ^ (1 << bits[best_fit].order)].order =
+			bits[best_fit].order;
+	}
+	bits[best_fit].allocated = 1;
+	return best_fit;
+}
+
+static void pmem_test_linear_free(struct pmem_bits *bits, int end, int curr)
+{
+	int buddy;
+
+	bits[curr].allocated = 0;
+	for (;;) {
+		buddy = curr ^ (1 << bits[curr].order);
+		if (buddy + (1 << bits[curr].order) > end ||
+		    bits[buddy].allocated ||
+		    bits[buddy].order != bits[curr].order)
+			break;
+		bits[buddy].order++;
+		bits[curr].order++;
+		curr = min(buddy, curr);
+	}
+}
+
+/* runs the same random trace through either allocator, returns the number
+ * of overlapping allocations found */
+static int pmem_test_run(int id, struct pmem_bits *linear,
+			 struct pmem_test_stats *st)
+{
+	static int live[PMEM_TEST_LIVE], live_order[PMEM_TEST_LIVE];
+	int nlive = 0, errors = 0;
+	int i, j, index, order, end = PMEM_TEST_ENTRIES;
+	ktime_t start;
+	u64 ns;
+
+	memset(st, 0, sizeof(*st));
+	pmem_test_seed = 1;
+	for (i = 0; i < PMEM_TEST_OPS; i++) {
+		if (nlive == 0 || (nlive < PMEM_TEST_LIVE &&
+				   pmem_test_random() % 3)) {
+			order = pmem_order((1 + pmem_test_random() % 32) *
+					   PMEM_MIN_ALLOC);
+			start = ktime_get();
+			if (linear)
+				index = pmem_test_linear_alloc(linear, end,
+							       order);
+			else
+				index = pmem_allocate(id, PMEM_MIN_ALLOC <<
+						      order);
+			ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+			st->allocs++;
+			st->alloc_ns += ns;
+			if (ns > st->alloc_ns_max)
+				st->alloc_ns_max = ns;
+			if (index < 0) {
+				st->failed++;
+				continue;
+			}
+			for (j = 0; j < nlive; j++)
+				if (index < live[j] + (1 << live_order[j]) &&
+				    live[j] < index + (1 << order))
+					errors++;
+			live[nlive] = index;
+			live_order[nlive++] = order;
+		} else {
+			j = pmem_test_random() % nlive;
+			start = ktime_get();
+			if (linear)
+				pmem_test_linear_free(linear, end, live[j]);
+			else
+				pmem_free(id, live[j]);
+			st->free_ns += ktime_to_ns(ktime_sub(ktime_get(),
+							     start));
+			live[j] = live[--nlive];
+			live_order[j] = live_order[nlive];
+		}
+	}
+
+	/* the largest block that could be allocated at the end */
+	if (linear) {
+		for (i = 0; i < end; i += 1 << linear[i].order)
+			if (!linear[i].allocated)
+				st->largest = max(st->largest,
+						  1UL << linear[i].order);
+	} else {
+		pmem_coalesce(id);
+		if (pmem[id].free_mask)
+			st->largest = 1UL << __fls(pmem[id].free_mask);
+	}
+	return errors;
+}
+
+static void pmem_test_report(const char *name, struct pmem_test_stats *st,
+			     unsigned long frees)
+{
+	u64 alloc_avg = st->alloc_ns, free_avg = st->free_ns;
+
+	do_div(alloc_avg, st->allocs);
+	if (frees)
+		do_div(free_avg, frees);
+	printk(KERN_INFO "pmem selftest: %s: %lu allocs (%lu failed) avg %llu "
+	       "max %llu ns, free avg %llu ns, largest free %lu pages\n",
+	       name, st->allocs, st->failed, (unsigned long long)alloc_avg,
+	       (unsigned long long)st->alloc_ns_max,
+	       (unsigned long long)free_avg, st->largest);
+}
+
+/* uses the last pmem slot for a region that only has metadata */
+static int __init pmem_selftest(void)
+{
+	int id = PMEM_MAX_DEVICES - 1;
+	struct pmem_test_stats buddy, linear;
+	struct pmem_bits *bits;
+	int errors;
+
+	if (id_count >= id)
+		return 0;
+
+	bits = vmalloc(PMEM_TEST_ENTRIES * sizeof(*bits));
+	if (!bits)
+		return -ENOMEM;
+	memset(bits, 0, PMEM_TEST_ENTRIES * sizeof(*bits));
+	bits[0].order = __fls(PMEM_TEST_ENTRIES);
+
+	pmem[id].num_entries = PMEM_TEST_ENTRIES;
+	init_rwsem(&pmem[id].bitmap_sem);
+	INIT_WORK(&pmem[id].coalesce_work, pmem_coalesce_work);
+	if (pmem_init_allocator(id)) {
+		vfree(bits);
+		return -ENOMEM;
+	}
+
+	down_write(&pmem[id].bitmap_sem);
+	errors = pmem_test_run(id, NULL, &buddy);
+	up_write(&pmem[id].bitmap_sem);
+	pmem_test_run(id, bits, &linear);
+	flush_work(&pmem[id].coalesce_work);
+
+	pmem_test_report("free lists", &buddy,
+			 PMEM_TEST_OPS - buddy.allocs);
+	pmem_test_report("linear scan", &linear,
+			 PMEM_TEST_OPS - linear.allocs);
+	if (errors)
+		printk(KERN_ERR "pmem selftest: FAILED, %d overlapping "
+		       "allocations\n", errors);
+
+	vfree(pmem[id].bitmap);
+	memset(&pmem[id], 0, sizeof(pmem[id]));
+	vfree(bits);
+	return 0;
+}
+late_initcall(pmem_selftest);
+#endif
+
 static int pmem_probe(struct platform_device *pdev)
 {
 	struct android_pmem_platform_data *pdata;
@@ -51,6 +51,14 @@ MODULE_ALIAS("mmc:block");
 
 static DECLARE_BITMAP(dev_use, MMC_NUM_MINORS);
 
+/*
+ * Prepare the next request while the current one is on the bus.  Clear
+ * to do one request at a time, to compare.
+ */
+static int pipeline = 1;
+module_param(pipeline, bool, 0644);
+MODULE_PARM_DESC(pipeline, "Overlap preparing a request with the last one");
+
 /*
  * There is one mmc_blk_data per slot.
  */
@@ -144,13 +152,6 @@ static const struct block_device_operations mmc_bdops = {
 	.owner			= THIS_MODULE,
 };
 
-struct mmc_blk_request {
-	struct mmc_request	mrq;
-	struct mmc_command	cmd;
-	struct mmc_command	stop;
-	struct mmc_data		data;
-};
-
 static u32 mmc_sd_num_wr_blocks(struct mmc_card *card)
 {
 	int err;
@@ -268,108 +269,156 @@ mmc_blk_set_blksize(struct mmc_blk_data *md, struct mmc_card *card)
 }
 
 
-static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
+static void mmc_blk_req_done(struct mmc_request *mrq)
 {
-	struct mmc_blk_data *md = mq->data;
-	struct mmc_card *card = md->queue.card;
-	struct mmc_blk_request brq;
-	int ret = 1, disable_multi = 0;
+	struct mmc_queue_req *mqrq = mrq->done_data;
 
-#ifdef CONFIG_MMC_BLOCK_DEFERRED_RESUME
-	if (mmc_bus_needs_resume(card->host)) {
-		mmc_resume_bus(card->host);
-		mmc_blk_set_blksize(md, card);
-	}
-#endif
+	mqrq->t_done = ktime_get();
+	complete(&mqrq->done);
+}
 
-	mmc_claim_host(card->host);
+/*
+ * Build the next chunk of mqrq->req, map it and bounce it.  None of this
+ * touches the host, so it can be done while another request is on the bus.
+ */
+static void mmc_blk_rw_rq_prep(struct mmc_queue_req *mqrq,
+			       struct mmc_card *card, int disable_multi,
+			       struct mmc_queue *mq)
+{
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	u32 readcmd, writecmd;
+
+	memset(brq, 0, sizeof(struct mmc_blk_request));
+	brq->mrq.cmd = &brq->cmd;
+	brq->mrq.data = &brq->data;
+	brq->mrq.done = mmc_blk_req_done;
+	brq->mrq.done_data = mqrq;
+
+	brq->cmd.arg = blk_rq_pos(req);
+	if (!mmc_card_blockaddr(card))
+		brq->cmd.arg <<= 9;
+	brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	brq->data.blksz = 512;
+	brq->stop.opcode = MMC_STOP_TRANSMISSION;
+	brq->stop.arg = 0;
+	brq->stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	brq->data.blocks = blk_rq_sectors(req);
 
-	do {
-		struct mmc_command cmd;
-		u32 readcmd, writecmd, status = 0;
-
-		memset(&brq, 0, sizeof(struct mmc_blk_request));
-		brq.mrq.cmd = &brq.cmd;
-		brq.mrq.data = &brq.data;
-
-		brq.cmd.arg = blk_rq_pos(req);
-		if (!mmc_card_blockaddr(card))
-			brq.cmd.arg <<= 9;
-		brq.cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-		brq.data.blksz = 512;
-		brq.stop.opcode = MMC_STOP_TRANSMISSION;
-		brq.stop.arg = 0;
-		brq.stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-		brq.data.blocks = blk_rq_sectors(req);
+	/*
+	 * The block layer doesn't support all sector count
+	 * restrictions, so we need to be prepared for too big
+	 * requests.
+	 */
+	if (brq->data.blocks > card->host->max_blk_count)
+		brq->data.blocks = card->host->max_blk_count;
 
-		/*
-		 * The block layer doesn't support all sector count
-		 * restrictions, so we need to be prepared for too big
-		 * requests.
-		 */
-		if (brq.data.blocks > card->host->max_blk_count)
-			brq.data.blocks = card->host->max_blk_count;
+	/*
+	 * After a read error, we redo the request one sector at a time
+	 * in order to accurately determine which sectors can be read
+	 * successfully.
+	 */
+	if (disable_multi && brq->data.blocks > 1)
+		brq->data.blocks = 1;
 
-		/*
-		 * After a read error, we redo the request one sector at a time
-		 * in order to accurately determine which sectors can be read
-		 * successfully.
+	if (brq->data.blocks > 1) {
+		/* SPI multiblock writes terminate using a special
+		 * token, not a STOP_TRANSMISSION request.
 		 */
-		if (disable_multi && brq.data.blocks > 1)
-			brq.data.blocks = 1;
-
-		if (brq.data.blocks > 1) {
-			/* SPI multiblock writes terminate using a special
-			 * token, not a STOP_TRANSMISSION request.
-			 */
-			if (!mmc_host_is_spi(card->host)
-					|| rq_data_dir(req) == READ)
-				brq.mrq.stop = &brq.stop;
-			readcmd = MMC_READ_MULTIPLE_BLOCK;
-			writecmd = MMC_WRITE_MULTIPLE_BLOCK;
-		} else {
-			brq.mrq.stop = NULL;
-			readcmd = MMC_READ_SINGLE_BLOCK;
-			writecmd = MMC_WRITE_BLOCK;
-		}
+		if (!mmc_host_is_spi(card->host)
+				|| rq_data_dir(req) == READ)
+			brq->mrq.stop = &brq->stop;
+		readcmd = MMC_READ_MULTIPLE_BLOCK;
+		writecmd = MMC_WRITE_MULTIPLE_BLOCK;
+	} else {
+		brq->mrq.stop = NULL;
+		readcmd = MMC_READ_SINGLE_BLOCK;
+		writecmd = MMC_WRITE_BLOCK;
+	}
 
-		if (rq_data_dir(req) == READ) {
-			brq.cmd.opcode = readcmd;
-			brq.data.flags |= MMC_DATA_READ;
-		} else {
-			brq.cmd.opcode = writecmd;
-			brq.data.flags |= MMC_DATA_WRITE;
-		}
+	if (rq_data_dir(req) == READ) {
+		brq->cmd.opcode = readcmd;
+		brq->data.flags |= MMC_DATA_READ;
+	} else {
+		brq->cmd.opcode = writecmd;
+		brq->data.flags |= MMC_DATA_WRITE;
+	}
 
-		mmc_set_data_timeout(&brq.data, card);
+	mmc_set_data_timeout(&brq->data, card);
 
-		brq.data.sg = mq->sg;
-		brq.data.sg_len = mmc_queue_map_sg(mq);
+	brq->data.sg = mqrq->sg;
+	brq->data.sg_len = mmc_queue_map_sg(mq, mqrq);
 
-		/*
-		 * Adjust the sg list so it is the same size as the
-		 * request.
-		 */
-		if (brq.data.blocks != blk_rq_sectors(req)) {
-			int i, data_size = brq.data.blocks << 9;
-			struct scatterlist *sg;
-
-			for_each_sg(brq.data.sg, sg, brq.data.sg_len, i) {
-				data_size -= sg->length;
-				if (data_size <= 0) {
-					sg->length += data_size;
-					i++;
-					break;
-				}
+	/*
+	 * Adjust the sg list so it is the same size as the
+	 * request.
+	 */
+	if (brq->data.blocks != blk_rq_sectors(req)) {
+		int i, data_size = brq->data.blocks << 9;
+		struct scatterlist *sg;
+
+		for_each_sg(brq->data.sg, sg, brq->data.sg_len, i) {
+			data_size -= sg->length;
+			if (data_size <= 0) {
+				sg->length += data_size;
+				i++;
+				break;
 			}
-			brq.data.sg_len = i;
 		}
+		brq->data.sg_len = i;
+	}
+
+	mmc_queue_bounce_pre(mqrq);
+}
+
+static void mmc_blk_rw_rq_start(struct mmc_card *card,
+				struct mmc_queue_req *mqrq)
+{
+	init_completion(&mqrq->done);
+	mqrq->t_issue = ktime_get();
+	if (!mqrq->t_start.tv64)
+		mqrq->t_start = mqrq->t_issue;
+	mmc_start_req(card->host, &mqrq->brq.mrq);
+}
+
+/*
+ * Wait for the request on the bus to finish and see the rest of it
+ * through, one chunk at a time as before.  If there is a next request,
+ * it has been prepared: it is started as soon as the card is ready for
+ * it, before this one is ended, and always before returning.
+ */
+static int mmc_blk_finish_rq(struct mmc_queue *mq, struct mmc_queue_req *mqrq,
+			     struct mmc_queue_req *next)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	int rw = rq_data_dir(req);
+	int ret = 1, disable_multi = 0, issued = 1;
+
+	/*
+	 * Each request gets its own CRC retries: left over from the ones
+	 * before, a single CRC error could fail a whole write.
+	 */
+	mq->rx_retries = 0;
+	mq->tx_retries = 0;
+
+	do {
+		struct mmc_command cmd;
+		u32 status = 0;
 
-		mmc_queue_bounce_pre(mq);
+		if (!issued) {
+			mmc_blk_rw_rq_prep(mqrq, card, disable_multi, mq);
+			mmc_blk_rw_rq_start(card, mqrq);
+		}
+		issued = 0;
 
-		mmc_wait_for_req(card->host, &brq.mrq);
+		wait_for_completion(&mqrq->done);
+		mqrq->bus_ns += ktime_to_ns(ktime_sub(mqrq->t_done,
+						      mqrq->t_issue));
 
-		mmc_queue_bounce_post(mq);
+		mmc_queue_bounce_post(mqrq);
 #if defined(CONFIG_ARIES_NTT) // Modify NTTS1
 #ifdef	MMC_SECTOR_DEBUG_JAPAN_SYSTEM
 		if(!strcmp(md->disk->disk_name, "mmcblk0")) // mmcblk0 : movinand , mmcblk1 : sdcard
@@ -390,12 +439,12 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 		 * until later as we need to wait for the card to leave
 		 * programming mode even when things go wrong.
 		 */
-		if (brq.cmd.error || brq.data.error || brq.stop.error) {
-			if (brq.data.blocks > 1 && rq_data_dir(req) == READ) {
+		if (brq->cmd.error || brq->data.error || brq->stop.error) {
+			if (brq->data.blocks > 1 && rq_data_dir(req) == READ) {
 				/* Redo read one sector at a time */
 				printk(KERN_DEBUG "%s: retrying using single "
 				       "block read\n", req->rq_disk->disk_name);
-				if(brq.data.error == -EILSEQ) {
+				if(brq->data.error == -EILSEQ) {
 					mq->rx_retries++;
 					if(mq->rx_retries == 3) {
 						mq->rx_retries = 0;
@@ -414,29 +463,29 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 			disable_multi = 0;
 		}
 
-		if (brq.cmd.error) {
+		if (brq->cmd.error) {
 			printk(KERN_DEBUG "%s: error %d sending read/write "
 			       "command, response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.cmd.error,
-			       brq.cmd.resp[0], status);
+			       req->rq_disk->disk_name, brq->cmd.error,
+			       brq->cmd.resp[0], status);
 		}
 
-		if (brq.data.error) {
-			if (brq.data.error == -ETIMEDOUT && brq.mrq.stop)
+		if (brq->data.error) {
+			if (brq->data.error == -ETIMEDOUT && brq->mrq.stop)
 				/* 'Stop' response contains card status */
-				status = brq.mrq.stop->resp[0];
+				status = brq->mrq.stop->resp[0];
 			printk(KERN_DEBUG "%s: error %d transferring data,"
 			       " sector %u, nr %u, card status %#x\n",
-			       req->rq_disk->disk_name, brq.data.error,
+			       req->rq_disk->disk_name, brq->data.error,
 			       (unsigned)blk_rq_pos(req),
 			       (unsigned)blk_rq_sectors(req), status);
 		}
 
-		if (brq.stop.error) {
+		if (brq->stop.error) {
 			printk(KERN_DEBUG "%s: error %d sending stop command, "
 			       "response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.stop.error,
-			       brq.stop.resp[0], status);
+			       req->rq_disk->disk_name, brq->stop.error,
+			       brq->stop.resp[0], status);
 		}
 
 		if (!mmc_host_is_spi(card->host) && rq_data_dir(req) != READ) {
@@ -469,7 +518,7 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 #endif
 		}
 
-		if (brq.cmd.error || brq.stop.error || brq.data.error) {
+		if (brq->cmd.error || brq->stop.error || brq->data.error) {
 			if (rq_data_dir(req) == READ) {
 				/*
 				 * After an error, we redo I/O one sector at a
@@ -477,12 +526,12 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 				 * read a single sector.
 				 */
 				spin_lock_irq(&md->lock);
-				ret = __blk_end_request(req, -EIO, brq.data.blksz);
+				ret = __blk_end_request(req, -EIO, brq->data.blksz);
 				spin_unlock_irq(&md->lock);
 				continue;
 			}
 			else {
-				if(brq.data.error == -EILSEQ) {
+				if(brq->data.error == -EILSEQ) {
 					mq->tx_retries++;
 					mmc_card_adjust_cfg(card->host, WRITE);
 					if(mq->tx_retries < 3)
@@ -495,14 +544,23 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 		}
 
 		/*
-		 * A block was successfully transferred.
+		 * A block was successfully transferred.  If that was the
+		 * last of it, the card is free for the next request: start
+		 * it before ending this one.
 		 */
+		if (next && brq->data.bytes_xfered >= blk_rq_bytes(req)) {
+			mmc_blk_rw_rq_start(card, next);
+			next = NULL;
+		}
+
 		spin_lock_irq(&md->lock);
-		ret = __blk_end_request(req, 0, brq.data.bytes_xfered);
+		ret = __blk_end_request(req, 0, brq->data.bytes_xfered);
 		spin_unlock_irq(&md->lock);
 	} while (ret);
 
-	mmc_release_host(card->host);
+	mmc_queue_account(mq, mqrq, rw);
+	if (next)
+		mmc_blk_rw_rq_start(card, next);
 
 	return 1;
 
@@ -526,20 +584,149 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 		}
 	} else {
 		spin_lock_irq(&md->lock);
-		ret = __blk_end_request(req, 0, brq.data.bytes_xfered);
+		ret = __blk_end_request(req, 0, brq->data.bytes_xfered);
 		spin_unlock_irq(&md->lock);
 	}
 
-	mmc_release_host(card->host);
+	if (next)
+		mmc_blk_rw_rq_start(card, next);
 
 	spin_lock_irq(&md->lock);
 	while (ret)
 		ret = __blk_end_request(req, -EIO, blk_rq_cur_bytes(req));
 	spin_unlock_irq(&md->lock);
+	mmc_queue_account(mq, mqrq, rw);
 
 	return 0;
 }
 
+/*
+ * Called by the queue thread with the request it has just fetched, if
+ * any, in mq->mqrq_cur, and the one it started last time, if any, still
+ * on the bus in mq->mqrq_prev.  The new request is mapped and bounced
+ * while the old one is transferred (unless pipeline is off), then the
+ * old one is finished and the new one started.  The host stays claimed
+ * while a request is on the bus.
+ */
+static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	struct mmc_queue_req *cur = mq->mqrq_cur;
+	struct mmc_queue_req *prev = mq->mqrq_prev;
+	int ret = 1;
+
+	if (!prev->req) {
+#ifdef CONFIG_MMC_BLOCK_DEFERRED_RESUME
+		if (mmc_bus_needs_resume(card->host)) {
+			mmc_resume_bus(card->host);
+			mmc_blk_set_blksize(md, card);
+		}
+#endif
+		mmc_claim_host(card->host);
+	}
+
+	if (req && prev->req && !pipeline) {
+		ret = mmc_blk_finish_rq(mq, prev, NULL);
+		prev->req = NULL;
+	}
+
+	if (req) {
+		ktime_t t = ktime_get();
+
+		cur->overlapped = prev->req != NULL;
+		cur->t_start.tv64 = 0;
+		cur->bus_ns = 0;
+		mmc_blk_rw_rq_prep(cur, card, 0, mq);
+		cur->prep_ns = ktime_to_ns(ktime_sub(ktime_get(), t));
+	}
+
+	if (prev->req) {
+		ret = mmc_blk_finish_rq(mq, prev, req ? cur : NULL);
+		prev->req = NULL;
+	} else if (req) {
+		mmc_blk_rw_rq_start(card, cur);
+	}
+
+	if (!req)
+		mmc_release_host(card->host);
+
+	return ret;
+}
+
+/*
+ * Per-request latency, from when the queue thread takes a request to
+ * when it is ended, in microseconds.  Write to "latency" to reset.
+ */
+static u64 avg_us(u64 ns, unsigned long count)
+{
+	return count ? div_u64(div_u64(ns, count), NSEC_PER_USEC) : 0;
+}
+
+static ssize_t latency_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mmc_blk_data *md = dev_to_disk(dev)->private_data;
+	struct mmc_queue_lat lat;
+	ssize_t n = 0;
+	int rw;
+
+	for (rw = READ; rw <= WRITE; rw++) {
+		mmc_queue_get_lat(&md->queue, rw, &lat);
+		n += sprintf(buf + n, "%s requests %lu overlapped %lu "
+			     "prep %llu wait %llu bus %llu total %llu max %llu\n",
+			     rw == READ ? "read" : "write",
+			     lat.count, lat.overlapped,
+			     avg_us(lat.prep_ns, lat.count),
+			     avg_us(lat.wait_ns, lat.count),
+			     avg_us(lat.bus_ns, lat.count),
+			     avg_us(lat.total_ns, lat.count),
+			     div_u64(lat.max_ns, NSEC_PER_USEC));
+	}
+	return n;
+}
+
+static ssize_t latency_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct mmc_blk_data *md = dev_to_disk(dev)->private_data;
+
+	mmc_queue_reset_lat(&md->queue);
+	return len;
+}
+
+static DEVICE_ATTR(latency, S_IRUGO | S_IWUSR, latency_show, latency_store);
+
+/* Requests ended within 2^(i-1) to 2^i us, for i = 0 .. 19 */
+static ssize_t latency_hist_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mmc_blk_data *md = dev_to_disk(dev)->private_data;
+	struct mmc_queue_lat lat;
+	ssize_t n = 0;
+	int rw, i;
+
+	for (rw = READ; rw <= WRITE; rw++) {
+		mmc_queue_get_lat(&md->queue, rw, &lat);
+		n += sprintf(buf + n, "%s", rw == READ ? "read" : "write");
+		for (i = 0; i < MMC_QUEUE_LAT_BUCKETS; i++)
+			n += sprintf(buf + n, " %lu", lat.hist[i]);
+		n += sprintf(buf + n, "\n");
+	}
+	return n;
+}
+
+static DEVICE_ATTR(latency_hist, S_IRUGO, latency_hist_show, NULL);
+
+static struct attribute *mmc_blk_attrs[] = {
+	&dev_attr_latency.attr,
+	&dev_attr_latency_hist.attr,
+	NULL,
+};
+
+static struct attribute_group mmc_blk_attr_group = {
+	.attrs = mmc_blk_attrs,
+};
 
 static inline int mmc_blk_readonly(struct mmc_card *card)
 {
@@ -665,6 +852,10 @@ static int mmc_blk_probe(struct mmc_card *card)
 	mmc_set_bus_resume_policy(card->host, 1);
 #endif
 	add_disk(md->disk);
+	if (sysfs_create_group(&disk_to_dev(md->disk)->kobj,
+			       &mmc_blk_attr_group))
+		printk(KERN_WARNING "%s: failed to create latency "
+		       "attributes\n", md->disk->disk_name);
 	return 0;
 
  out:
@@ -679,6 +870,9 @@ static void mmc_blk_remove(struct mmc_card *card)
 	struct mmc_blk_data *md = mmc_get_drvdata(card);
 
 	if (md) {
+		sysfs_remove_group(&disk_to_dev(md->disk)->kobj,
+				   &mmc_blk_attr_group);
+
 		/* Stop new requests from getting into the queue */
 		del_gendisk(md->disk);
 
@@ -10,6 +10,7 @@
  *
  */
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/blkdev.h>
 #include <linux/freezer.h>
 #include <linux/kthread.h>
@@ -19,10 +20,17 @@
 #include <linux/mmc/host.h>
 #include "queue.h"
 
-#define MMC_QUEUE_BOUNCESZ	65536
-
 #define MMC_QUEUE_SUSPENDED	(1 << 0)
 
+/*
+ * Size of each of the two bounce buffers for hosts that can't do
+ * scatter-gather, capped by what the host can take in one command.
+ * Bigger buffers mean fewer, bigger commands to the card.
+ */
+static unsigned int bouncesz_kb = 64;
+module_param(bouncesz_kb, uint, 0444);
+MODULE_PARM_DESC(bouncesz_kb, "Size of each bounce buffer in KiB, 0 = none");
+
 /*
  * Prepare a MMC request. This just filters out odd stuff.
  */
@@ -51,15 +59,16 @@ static int mmc_queue_thread(void *d)
 	down(&mq->thread_sem);
 	do {
 		struct request *req = NULL;
+		struct mmc_queue_req *tmp;
 
 		spin_lock_irq(q->queue_lock);
 		set_current_state(TASK_INTERRUPTIBLE);
 		if (!blk_queue_plugged(q))
 			req = blk_fetch_request(q);
-		mq->req = req;
+		mq->mqrq_cur->req = req;
 		spin_unlock_irq(q->queue_lock);
 
-		if (!req) {
+		if (!req && !mq->mqrq_prev->req) {
 			if (kthread_should_stop()) {
 				set_current_state(TASK_RUNNING);
 				break;
@@ -71,7 +80,17 @@ static int mmc_queue_thread(void *d)
 		}
 		set_current_state(TASK_RUNNING);
 
+		/*
+		 * Prepare req, finish the request on the bus and start req.
+		 * With no req, just finish the one on the bus.
+		 */
+		if (req)
+			mq->mqrq_cur->t_fetch = ktime_get();
 		mq->issue_fn(mq, req);
+
+		tmp = mq->mqrq_prev;
+		mq->mqrq_prev = mq->mqrq_cur;
+		mq->mqrq_cur = tmp;
 	} while (1);
 	up(&mq->thread_sem);
 
@@ -97,10 +116,74 @@ static void mmc_request(struct request_queue *q)
 		return;
 	}
 
-	if (!mq->req)
+	if (!mq->mqrq_cur->req && !mq->mqrq_prev->req)
 		wake_up_process(mq->thread);
 }
 
+static void mmc_queue_free(struct mmc_queue *mq)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+		struct mmc_queue_req *mqrq = &mq->mqrq[i];
+
+		kfree(mqrq->bounce_sg);
+		mqrq->bounce_sg = NULL;
+		kfree(mqrq->sg);
+		mqrq->sg = NULL;
+		kfree(mqrq->bounce_buf);
+		mqrq->bounce_buf = NULL;
+	}
+}
+
+#ifdef CONFIG_MMC_BLOCK_BOUNCE
+/*
+ * Get a bounce buffer for each request, halving the size until they
+ * can be had.  Returns the size, or 0.
+ */
+static unsigned int mmc_queue_alloc_bounce_bufs(struct mmc_queue *mq,
+						unsigned int bouncesz)
+{
+	int i;
+
+	for (; bouncesz > 512; bouncesz >>= 1) {
+		for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+			mq->mqrq[i].bounce_buf = kmalloc(bouncesz,
+						GFP_KERNEL | __GFP_NOWARN);
+			if (!mq->mqrq[i].bounce_buf)
+				break;
+		}
+		if (i == ARRAY_SIZE(mq->mqrq))
+			return bouncesz;
+		mmc_queue_free(mq);
+	}
+	return 0;
+}
+#endif
+
+static int mmc_queue_alloc_sgs(struct mmc_queue *mq, int n, int bounce_n)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+		struct mmc_queue_req *mqrq = &mq->mqrq[i];
+
+		mqrq->sg = kmalloc(sizeof(struct scatterlist) * n, GFP_KERNEL);
+		if (!mqrq->sg)
+			return -ENOMEM;
+		sg_init_table(mqrq->sg, n);
+
+		if (!bounce_n)
+			continue;
+		mqrq->bounce_sg = kmalloc(sizeof(struct scatterlist) *
+					  bounce_n, GFP_KERNEL);
+		if (!mqrq->bounce_sg)
+			return -ENOMEM;
+		sg_init_table(mqrq->bounce_sg, bounce_n);
+	}
+	return 0;
+}
+
 /**
  * mmc_init_queue - initialise a queue structure.
  * @mq: mmc queue
@@ -113,6 +196,7 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 {
 	struct mmc_host *host = card->host;
 	u64 limit = BLK_BOUNCE_HIGH;
+	unsigned int bouncesz = 0;
 	int ret;
 
 	if (mmc_dev(host)->dma_mask && *mmc_dev(host)->dma_mask)
@@ -124,17 +208,22 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 		return -ENOMEM;
 
 	mq->queue->queuedata = mq;
-	mq->req = NULL;
+	mq->mqrq_cur = &mq->mqrq[0];
+	mq->mqrq_prev = &mq->mqrq[1];
+	mq->bounce_pfn = limit >> PAGE_SHIFT;
+	spin_lock_init(&mq->lat_lock);
 
 	blk_queue_prep_rq(mq->queue, mmc_prep_request);
 	blk_queue_ordered(mq->queue, QUEUE_ORDERED_DRAIN, NULL);
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, mq->queue);
 
 #ifdef CONFIG_MMC_BLOCK_BOUNCE
-	if (host->max_hw_segs == 1) {
-		unsigned int bouncesz;
-
-		bouncesz = MMC_QUEUE_BOUNCESZ;
+	/*
+	 * Hosts that can do scatter-gather need no bouncing: the pages go
+	 * to the host as they are.
+	 */
+	if (host->max_hw_segs == 1 && bouncesz_kb) {
+		bouncesz = bouncesz_kb << 10;
 
 		if (bouncesz > host->max_req_size)
 			bouncesz = host->max_req_size;
@@ -143,42 +232,28 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 		if (bouncesz > (host->max_blk_count * 512))
 			bouncesz = host->max_blk_count * 512;
 
-		if (bouncesz > 512) {
-			mq->bounce_buf = kmalloc(bouncesz, GFP_KERNEL);
-			if (!mq->bounce_buf) {
-				printk(KERN_WARNING "%s: unable to "
-					"allocate bounce buffer\n",
-					mmc_card_name(card));
-			}
+		bouncesz = mmc_queue_alloc_bounce_bufs(mq, bouncesz);
+		if (!bouncesz) {
+			printk(KERN_WARNING "%s: unable to "
+				"allocate bounce buffer\n",
+				mmc_card_name(card));
 		}
 
-		if (mq->bounce_buf) {
+		if (bouncesz) {
 			blk_queue_bounce_limit(mq->queue, BLK_BOUNCE_ANY);
 			blk_queue_max_sectors(mq->queue, bouncesz / 512);
 			blk_queue_max_phys_segments(mq->queue, bouncesz / 512);
 			blk_queue_max_hw_segments(mq->queue, bouncesz / 512);
 			blk_queue_max_segment_size(mq->queue, bouncesz);
 
-			mq->sg = kmalloc(sizeof(struct scatterlist),
-				GFP_KERNEL);
-			if (!mq->sg) {
-				ret = -ENOMEM;
-				goto cleanup_queue;
-			}
-			sg_init_table(mq->sg, 1);
-
-			mq->bounce_sg = kmalloc(sizeof(struct scatterlist) *
-				bouncesz / 512, GFP_KERNEL);
-			if (!mq->bounce_sg) {
-				ret = -ENOMEM;
+			ret = mmc_queue_alloc_sgs(mq, 1, bouncesz / 512);
+			if (ret)
 				goto cleanup_queue;
-			}
-			sg_init_table(mq->bounce_sg, bouncesz / 512);
 		}
 	}
 #endif
 
-	if (!mq->bounce_buf) {
+	if (!bouncesz) {
 		blk_queue_bounce_limit(mq->queue, limit);
 		blk_queue_max_sectors(mq->queue,
 			min(host->max_blk_count, host->max_req_size / 512));
@@ -186,13 +261,9 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 		blk_queue_max_hw_segments(mq->queue, host->max_hw_segs);
 		blk_queue_max_segment_size(mq->queue, host->max_seg_size);
 
-		mq->sg = kmalloc(sizeof(struct scatterlist) *
-			host->max_phys_segs, GFP_KERNEL);
-		if (!mq->sg) {
-			ret = -ENOMEM;
+		ret = mmc_queue_alloc_sgs(mq, host->max_phys_segs, 0);
+		if (ret)
 			goto cleanup_queue;
-		}
-		sg_init_table(mq->sg, host->max_phys_segs);
 	}
 
 	init_MUTEX(&mq->thread_sem);
@@ -200,21 +271,12 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 	mq->thread = kthread_run(mmc_queue_thread, mq, "mmcqd");
 	if (IS_ERR(mq->thread)) {
 		ret = PTR_ERR(mq->thread);
-		goto free_bounce_sg;
+		goto cleanup_queue;
 	}
 
 	return 0;
- free_bounce_sg:
- 	if (mq->bounce_sg)
- 		kfree(mq->bounce_sg);
- 	mq->bounce_sg = NULL;
  cleanup_queue:
- 	if (mq->sg)
-		kfree(mq->sg);
-	mq->sg = NULL;
-	if (mq->bounce_buf)
-		kfree(mq->bounce_buf);
-	mq->bounce_buf = NULL;
+	mmc_queue_free(mq);
 	blk_cleanup_queue(mq->queue);
 	return ret;
 }
@@ -236,16 +298,7 @@ void mmc_cleanup_queue(struct mmc_queue *mq)
 	blk_start_queue(q);
 	spin_unlock_irqrestore(q->queue_lock, flags);
 
- 	if (mq->bounce_sg)
- 		kfree(mq->bounce_sg);
- 	mq->bounce_sg = NULL;
-
-	kfree(mq->sg);
-	mq->sg = NULL;
-
-	if (mq->bounce_buf)
-		kfree(mq->bounce_buf);
-	mq->bounce_buf = NULL;
+	mmc_queue_free(mq);
 
 	mq->card = NULL;
 }
@@ -298,27 +351,38 @@ void mmc_queue_resume(struct mmc_queue *mq)
 /*
  * Prepare the sg list(s) to be handed of to the host driver
  */
-unsigned int mmc_queue_map_sg(struct mmc_queue *mq)
+unsigned int mmc_queue_map_sg(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
 {
 	unsigned int sg_len;
 	size_t buflen;
 	struct scatterlist *sg;
 	int i;
 
-	if (!mq->bounce_buf)
-		return blk_rq_map_sg(mq->queue, mq->req, mq->sg);
+	if (!mqrq->bounce_buf)
+		return blk_rq_map_sg(mq->queue, mqrq->req, mqrq->sg);
 
-	BUG_ON(!mq->bounce_sg);
+	BUG_ON(!mqrq->bounce_sg);
 
-	sg_len = blk_rq_map_sg(mq->queue, mq->req, mq->bounce_sg);
+	sg_len = blk_rq_map_sg(mq->queue, mqrq->req, mqrq->bounce_sg);
+
+	/*
+	 * A request that is contiguous already, like a single page, can
+	 * go to the host as it is.
+	 */
+	sg = mqrq->bounce_sg;
+	if (sg_len == 1 && page_to_pfn(sg_page(sg)) <= mq->bounce_pfn) {
+		mqrq->bounce_sg_len = 0;
+		sg_set_page(mqrq->sg, sg_page(sg), sg->length, sg->offset);
+		return 1;
+	}
 
-	mq->bounce_sg_len = sg_len;
+	mqrq->bounce_sg_len = sg_len;
 
 	buflen = 0;
-	for_each_sg(mq->bounce_sg, sg, sg_len, i)
+	for_each_sg(mqrq->bounce_sg, sg, sg_len, i)
 		buflen += sg->length;
 
-	sg_init_one(mq->sg, mq->bounce_buf, buflen);
+	sg_init_one(mqrq->sg, mqrq->bounce_buf, buflen);
 
 	return 1;
 }
@@ -327,19 +391,19 @@ unsigned int mmc_queue_map_sg(struct mmc_queue *mq)
  * If writing, bounce the data to the buffer before the request
  * is sent to the host driver
  */
-void mmc_queue_bounce_pre(struct mmc_queue *mq)
+void mmc_queue_bounce_pre(struct mmc_queue_req *mqrq)
 {
 	unsigned long flags;
 
-	if (!mq->bounce_buf)
+	if (!mqrq->bounce_sg_len)
 		return;
 
-	if (rq_data_dir(mq->req) != WRITE)
+	if (rq_data_dir(mqrq->req) != WRITE)
 		return;
 
 	local_irq_save(flags);
-	sg_copy_to_buffer(mq->bounce_sg, mq->bounce_sg_len,
-		mq->bounce_buf, mq->sg[0].length);
+	sg_copy_to_buffer(mqrq->bounce_sg, mqrq->bounce_sg_len,
+		mqrq->bounce_buf, mqrq->sg[0].length);
 	local_irq_restore(flags);
 }
 
@@ -347,19 +411,68 @@ void mmc_queue_bounce_pre(struct mmc_queue *mq)
  * If reading, bounce the data from the buffer after the request
  * has been handled by the host driver
  */
-void mmc_queue_bounce_post(struct mmc_queue *mq)
+void mmc_queue_bounce_post(struct mmc_queue_req *mqrq)
 {
 	unsigned long flags;
 
-	if (!mq->bounce_buf)
+	if (!mqrq->bounce_sg_len)
 		return;
 
-	if (rq_data_dir(mq->req) != READ)
+	if (rq_data_dir(mqrq->req) != READ)
 		return;
 
 	local_irq_save(flags);
-	sg_copy_from_buffer(mq->bounce_sg, mq->bounce_sg_len,
-		mq->bounce_buf, mq->sg[0].length);
+	sg_copy_from_buffer(mqrq->bounce_sg, mqrq->bounce_sg_len,
+		mqrq->bounce_buf, mqrq->sg[0].length);
 	local_irq_restore(flags);
 }
 
+/*
+ * Account for a request that has just been ended, in direction rw.  The
+ * times are taken from when the queue thread fetched it, so they leave
+ * out the time it waited in the elevator.
+ */
+void mmc_queue_account(struct mmc_queue *mq, struct mmc_queue_req *mqrq,
+		       int rw)
+{
+	struct mmc_queue_lat *lat = &mq->lat[rw];
+	s64 total = ktime_to_ns(ktime_sub(ktime_get(), mqrq->t_fetch));
+	unsigned long flags;
+	int bucket;
+
+	bucket = fls64(div_s64(total, NSEC_PER_USEC));
+	if (bucket >= MMC_QUEUE_LAT_BUCKETS)
+		bucket = MMC_QUEUE_LAT_BUCKETS - 1;
+
+	spin_lock_irqsave(&mq->lat_lock, flags);
+	lat->count++;
+	lat->overlapped += mqrq->overlapped;
+	lat->prep_ns += mqrq->prep_ns;
+	lat->wait_ns += ktime_to_ns(ktime_sub(mqrq->t_start, mqrq->t_fetch)) -
+			mqrq->prep_ns;
+	lat->bus_ns += mqrq->bus_ns;
+	lat->total_ns += total;
+	if (total > lat->max_ns)
+		lat->max_ns = total;
+	lat->hist[bucket]++;
+	spin_unlock_irqrestore(&mq->lat_lock, flags);
+}
+
+void mmc_queue_get_lat(struct mmc_queue *mq, int rw, struct mmc_queue_lat *lat)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&mq->lat_lock, flags);
+	*lat = mq->lat[rw];
+	spin_unlock_irqrestore(&mq->lat_lock, flags);
+}
+
+void mmc_queue_reset_lat(struct mmc_queue *mq)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&mq->lat_lock, flags);
+	memset(mq->lat, 0, sizeof(mq->lat));
+	spin_unlock_irqrestore(&mq->lat_lock, flags);
+}
+
@@ -10,23 +10,70 @@
 #ifndef MMC_QUEUE_H
 #define MMC_QUEUE_H
 
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/mmc/core.h>
+
 struct request;
 struct task_struct;
 
+struct mmc_blk_request {
+	struct mmc_request	mrq;
+	struct mmc_command	cmd;
+	struct mmc_command	stop;
+	struct mmc_data		data;
+};
+
+/*
+ * A request on its way through the queue.  There are two, so that one
+ * can be mapped and bounced while the other is on the bus.
+ */
+struct mmc_queue_req {
+	struct request		*req;
+	struct mmc_blk_request	brq;
+	struct completion	done;
+	struct scatterlist	*sg;
+	char			*bounce_buf;
+	struct scatterlist	*bounce_sg;
+	unsigned int		bounce_sg_len;	/* 0: not bounced */
+	int			overlapped;	/* prepared during a transfer */
+	ktime_t			t_fetch;	/* taken off the queue */
+	s64			prep_ns;	/* mapping and bouncing */
+	ktime_t			t_start;	/* first command sent */
+	ktime_t			t_issue;	/* this chunk sent */
+	ktime_t			t_done;		/* this chunk done */
+	s64			bus_ns;		/* all chunks, and retries */
+};
+
+/* Buckets of 2^(i-1) to 2^i us, the last one open ended */
+#define MMC_QUEUE_LAT_BUCKETS	20
+
+struct mmc_queue_lat {
+	unsigned long		count;
+	unsigned long		overlapped;
+	u64			prep_ns;	/* mapping and bouncing */
+	u64			wait_ns;	/* the rest until on the bus */
+	u64			bus_ns;
+	u64			total_ns;	/* fetch to end of request */
+	u64			max_ns;
+	unsigned long		hist[MMC_QUEUE_LAT_BUCKETS];
+};
+
 struct mmc_queue {
 	struct mmc_card		*card;
 	struct task_struct	*thread;
 	struct semaphore	thread_sem;
 	unsigned int		flags;
-	struct request		*req;
 	int			(*issue_fn)(struct mmc_queue *, struct request *);
 	void			*data;
 	struct request_queue	*queue;
-	struct scatterlist	*sg;
-	char			*bounce_buf;
-	struct scatterlist	*bounce_sg;
-	unsigned int		bounce_sg_len;
+	struct mmc_queue_req	mqrq[2];
+	struct mmc_queue_req	*mqrq_cur;	/* being prepared */
+	struct mmc_queue_req	*mqrq_prev;	/* on the bus */
+	unsigned long		bounce_pfn;	/* highest page to DMA to */
 	unsigned int		rx_retries, tx_retries;
+	spinlock_t		lat_lock;
+	struct mmc_queue_lat	lat[2];		/* READ and WRITE */
 };
 
 extern int mmc_init_queue(struct mmc_queue *, struct mmc_card *, spinlock_t *);
@@ -34,8 +81,15 @@ extern void mmc_cleanup_queue(struct mmc_queue *);
 extern void mmc_queue_suspend(struct mmc_queue *);
 extern void mmc_queue_resume(struct mmc_queue *);
 
-extern unsigned int mmc_queue_map_sg(struct mmc_queue *);
-extern void mmc_queue_bounce_pre(struct mmc_queue *);
-extern void mmc_queue_bounce_post(struct mmc_queue *);
+extern unsigned int mmc_queue_map_sg(struct mmc_queue *,
+				     struct mmc_queue_req *);
+extern void mmc_queue_bounce_pre(struct mmc_queue_req *);
+extern void mmc_queue_bounce_post(struct mmc_queue_req *);
+
+extern void mmc_queue_account(struct mmc_queue *, struct mmc_queue_req *,
+			      int);
+extern void mmc_queue_get_lat(struct mmc_queue *, int,
+			      struct mmc_queue_lat *);
+extern void mmc_queue_reset_lat(struct mmc_queue *);
 
 #endif
@@ -225,6 +225,26 @@ void mmc_wait_for_req(struct mmc_host *host, struct mmc_request *mrq)
 
 EXPORT_SYMBOL(mmc_wait_for_req);
 
+/**
+ *	mmc_start_req - start a request without waiting for it
+ *	@host: MMC host to start the request on
+ *	@mrq: MMC request to start
+ *
+ *	Start a request and return at once.  The caller's mrq->done is
+ *	called when the request is done, possibly from interrupt context.
+ *	The host must stay claimed until then, and nothing else may be
+ *	started on it in between.  This lets the caller get the next
+ *	request ready while this one is on the bus.
+ */
+void mmc_start_req(struct mmc_host *host, struct mmc_request *mrq)
+{
+	BUG_ON(!mrq->done);
+
+	mmc_start_request(host, mrq);
+}
+
+EXPORT_SYMBOL(mmc_start_req);
+
 /**
  *	mmc_wait_for_cmd - start a command and wait for completion
  *	@host: MMC host to start command
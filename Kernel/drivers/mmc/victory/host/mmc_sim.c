@@ -0,0 +1,583 @@
+/*
+ *  linux/drivers/mmc/host/mmc_sim.c - Simulated MMC host and card
+ *
+ * A host controller with an eMMC 4.3 card behind it, kept in RAM.  The
+ * card goes through the normal MMC initialisation and is picked up by
+ * mmc_block, so the block queue can be exercised and measured without
+ * the hardware.
+ *
+ * Data transfers take the time the bus and the card would: a command
+ * overhead, the card's access or programming time, and the bytes at the
+ * clock and bus width the core has set up.  They complete from a timer,
+ * as a DMA interrupt would, so the caller can do other work meanwhile.
+ * The scatter-gather limits can be those of an ADMA host or of one that
+ * only takes a single segment, and CRC errors can be injected.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/platform_device.h>
+#include <linux/vmalloc.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/proc_fs.h>
+#include <linux/scatterlist.h>
+#include <linux/mmc/host.h>
+#include <linux/mmc/card.h>
+#include <linux/mmc/mmc.h>
+
+#define DRIVER_NAME	"mmc_sim"
+
+static unsigned int size_mb = 64;
+module_param(size_mb, uint, 0444);
+MODULE_PARM_DESC(size_mb, "Card size (MiB)");
+
+static unsigned int max_segs = 128;
+module_param(max_segs, uint, 0444);
+MODULE_PARM_DESC(max_segs, "Scatter-gather segments, 1 for a host without");
+
+static unsigned int bus_width = 4;
+module_param(bus_width, uint, 0444);
+MODULE_PARM_DESC(bus_width, "Data lines, 1, 4 or 8");
+
+static int cmd_us = 20;
+module_param(cmd_us, int, 0644);
+MODULE_PARM_DESC(cmd_us, "Command, response and controller setup (us)");
+
+static int read_us = 150;
+module_param(read_us, int, 0644);
+MODULE_PARM_DESC(read_us, "Card access time before read data (us)");
+
+static int write_us = 300;
+module_param(write_us, int, 0644);
+MODULE_PARM_DESC(write_us, "Card busy time after each write command (us)");
+
+static int write_kbps = 8000;
+module_param(write_kbps, int, 0644);
+MODULE_PARM_DESC(write_kbps, "Card programming rate (KB/s), 0 = bus bound");
+
+static int crc_rate;
+module_param(crc_rate, int, 0644);
+MODULE_PARM_DESC(crc_rate, "Fail 1 in N data transfers with a CRC error");
+
+/* Card states, as in R1_CURRENT_STATE */
+#define SIM_STATE_IDLE		0
+#define SIM_STATE_IDENT		2
+#define SIM_STATE_STBY		3
+#define SIM_STATE_TRAN		4
+
+#define SIM_OCR			0x00ff8080	/* 2.7-3.6V and 1.7-1.95V */
+#define SIM_RCA_NONE		0
+
+/* A gap longer than this between transfers is taken as idle */
+#define SIM_TURNAROUND_MAX_NS	(1000 * NSEC_PER_USEC)
+
+struct mmc_sim_stats {
+	unsigned long cmds;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long long read_bytes;
+	unsigned long long write_bytes;
+	unsigned long long busy_ns;	/* modelled data transfers */
+	unsigned long long turnaround_ns;
+	unsigned long turnarounds;
+	unsigned long crc_errors;
+	unsigned long range_errors;
+};
+
+struct mmc_sim_host {
+	struct mmc_host		*mmc;
+	struct mmc_request	*mrq;		/* data request in flight */
+	struct hrtimer		timer;
+	u8			*store;
+	unsigned long		sectors;
+	u8			ext_csd[512];
+	int			state;
+	u16			rca;
+	u64			last_done;	/* ns, last transfer ended */
+	struct mmc_sim_stats	stats;
+};
+
+static struct platform_device *mmc_sim_device;
+
+static inline u64 sim_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static inline int sim_inject(int rate)
+{
+	return rate > 0 && (random32() % rate) == 0;
+}
+
+static inline u32 sim_status(struct mmc_sim_host *host)
+{
+	return R1_READY_FOR_DATA | host->state << 9;
+}
+
+/*
+ * Set a field of a CID or CSD, numbered from bit 0 of resp[3] the way
+ * UNSTUFF_BITS() reads it back.
+ */
+static void sim_stuff_bits(u32 *resp, int start, int size, u32 val)
+{
+	int i;
+
+	for (i = 0; i < size; i++, start++)
+		if (val & (1 << i))
+			resp[3 - start / 32] |= 1 << (start % 32);
+}
+
+static void mmc_sim_cid(u32 *resp)
+{
+	memset(resp, 0, 4 * sizeof(u32));
+	sim_stuff_bits(resp, 120, 8, 0x15);		/* manfid */
+	sim_stuff_bits(resp, 104, 16, 0x0100);		/* oemid */
+	sim_stuff_bits(resp, 96, 8, 'S');		/* product name */
+	sim_stuff_bits(resp, 88, 8, 'I');
+	sim_stuff_bits(resp, 80, 8, 'M');
+	sim_stuff_bits(resp, 72, 8, 'M');
+	sim_stuff_bits(resp, 64, 8, 'M');
+	sim_stuff_bits(resp, 56, 8, 'C');
+	sim_stuff_bits(resp, 16, 32, 0x12345678);	/* serial */
+	sim_stuff_bits(resp, 12, 4, 1);			/* month */
+	sim_stuff_bits(resp, 8, 4, 13);			/* 2010 */
+}
+
+static void mmc_sim_csd(u32 *resp)
+{
+	memset(resp, 0, 4 * sizeof(u32));
+	sim_stuff_bits(resp, 126, 2, 2);	/* CSD structure v1.2 */
+	sim_stuff_bits(resp, 122, 4, 4);	/* MMC v4 */
+	sim_stuff_bits(resp, 112, 8, 0x26);	/* TAAC, 1.5 ms */
+	sim_stuff_bits(resp, 104, 8, 1);	/* NSAC */
+	sim_stuff_bits(resp, 96, 8, 0x32);	/* TRAN_SPEED, 25 MHz */
+	sim_stuff_bits(resp, 84, 12, 0x0f5);	/* CCC */
+	sim_stuff_bits(resp, 80, 4, 9);		/* READ_BL_LEN, 512 */
+	/* The size of a high capacity card is in the EXT_CSD */
+	sim_stuff_bits(resp, 62, 12, 0xfff);	/* C_SIZE */
+	sim_stuff_bits(resp, 47, 3, 7);		/* C_SIZE_MULT */
+	sim_stuff_bits(resp, 26, 3, 2);		/* R2W_FACTOR */
+	sim_stuff_bits(resp, 22, 4, 9);		/* WRITE_BL_LEN, 512 */
+}
+
+static void mmc_sim_init_ext_csd(struct mmc_sim_host *host)
+{
+	u8 *ext_csd = host->ext_csd;
+
+	memset(ext_csd, 0, sizeof(host->ext_csd));
+	ext_csd[EXT_CSD_REV] = 3;
+	ext_csd[EXT_CSD_CARD_TYPE] = EXT_CSD_CARD_TYPE_52 |
+				     EXT_CSD_CARD_TYPE_26;
+	ext_csd[EXT_CSD_SEC_CNT + 0] = host->sectors >> 0;
+	ext_csd[EXT_CSD_SEC_CNT + 1] = host->sectors >> 8;
+	ext_csd[EXT_CSD_SEC_CNT + 2] = host->sectors >> 16;
+	ext_csd[EXT_CSD_SEC_CNT + 3] = host->sectors >> 24;
+	ext_csd[EXT_CSD_S_A_TIMEOUT] = 0x11;
+}
+
+/*
+ * Commands without data, answered at once.  The card only does MMC: the
+ * SD and SDIO probes time out as they would.
+ */
+static void mmc_sim_command(struct mmc_sim_host *host,
+			    struct mmc_command *cmd)
+{
+	cmd->error = 0;
+	memset(cmd->resp, 0, sizeof(cmd->resp));
+
+	switch (cmd->opcode) {
+	case MMC_GO_IDLE_STATE:
+		host->state = SIM_STATE_IDLE;
+		host->rca = SIM_RCA_NONE;
+		break;
+
+	case MMC_SEND_OP_COND:
+		cmd->resp[0] = SIM_OCR;
+		if (cmd->arg)
+			cmd->resp[0] |= MMC_CARD_BUSY | 1 << 30;
+		break;
+
+	case MMC_ALL_SEND_CID:
+		if (host->state != SIM_STATE_IDLE) {
+			cmd->error = -ETIMEDOUT;
+			break;
+		}
+		mmc_sim_cid(cmd->resp);
+		host->state = SIM_STATE_IDENT;
+		break;
+
+	case MMC_SET_RELATIVE_ADDR:
+		host->rca = cmd->arg >> 16;
+		host->state = SIM_STATE_STBY;
+		cmd->resp[0] = sim_status(host);
+		break;
+
+	case MMC_SEND_CSD:
+		mmc_sim_csd(cmd->resp);
+		break;
+
+	case MMC_SEND_CID:
+		mmc_sim_cid(cmd->resp);
+		break;
+
+	case MMC_SELECT_CARD:
+		cmd->resp[0] = sim_status(host);
+		if (host->rca && cmd->arg >> 16 == host->rca)
+			host->state = SIM_STATE_TRAN;
+		else if (host->state == SIM_STATE_TRAN)
+			host->state = SIM_STATE_STBY;
+		break;
+
+	case MMC_SLEEP_AWAKE:
+		/* CMD5 is the SDIO probe before there is an RCA */
+		if (!host->rca) {
+			cmd->error = -ETIMEDOUT;
+			break;
+		}
+		cmd->resp[0] = sim_status(host);
+		break;
+
+	case MMC_SWITCH:
+		if ((cmd->arg >> 24 & 3) == MMC_SWITCH_MODE_WRITE_BYTE)
+			host->ext_csd[cmd->arg >> 16 & 0xff] =
+				cmd->arg >> 8 & 0xff;
+		cmd->resp[0] = sim_status(host);
+		break;
+
+	case MMC_SEND_STATUS:
+	case MMC_SET_BLOCKLEN:
+	case MMC_STOP_TRANSMISSION:
+		cmd->resp[0] = sim_status(host);
+		break;
+
+	default:
+		/* SD_SEND_IF_COND, MMC_APP_CMD, SD_IO_SEND_OP_COND... */
+		cmd->error = -ETIMEDOUT;
+		break;
+	}
+}
+
+/*
+ * How long a transfer of @bytes keeps the bus and the card busy: the
+ * bytes at the clock and width set by the core, after the card's access
+ * time for a read, or alongside its programming for a write.
+ */
+static u64 mmc_sim_data_ns(struct mmc_sim_host *host, int write,
+			   unsigned int bytes)
+{
+	struct mmc_ios *ios = &host->mmc->ios;
+	unsigned int clock = max(ios->clock, 400000u);
+	u64 ns, bus_ns, prog_ns;
+
+	bus_ns = div_u64((u64)bytes * 8 * NSEC_PER_SEC,
+			 clock * (1 << ios->bus_width));
+	ns = (u64)cmd_us * NSEC_PER_USEC;
+
+	if (!write)
+		return ns + (u64)read_us * NSEC_PER_USEC + bus_ns;
+
+	prog_ns = write_kbps > 0 ?
+		div_u64((u64)bytes * NSEC_PER_MSEC, write_kbps) : 0;
+	return ns + (u64)write_us * NSEC_PER_USEC + max(bus_ns, prog_ns);
+}
+
+static enum hrtimer_restart mmc_sim_timer(struct hrtimer *timer)
+{
+	struct mmc_sim_host *host = container_of(timer, struct mmc_sim_host,
+						 timer);
+	struct mmc_request *mrq = host->mrq;
+	struct mmc_data *data = mrq->data;
+	unsigned int bytes = data->blocks * data->blksz;
+	u8 *p = host->store + ((size_t)mrq->cmd->arg << 9);
+
+	if (!data->error) {
+		if (data->flags & MMC_DATA_READ)
+			sg_copy_from_buffer(data->sg, data->sg_len, p, bytes);
+		else
+			sg_copy_to_buffer(data->sg, data->sg_len, p, bytes);
+		data->bytes_xfered = bytes;
+	}
+	if (mrq->stop)
+		mrq->stop->resp[0] = sim_status(host);
+
+	host->mrq = NULL;
+	host->last_done = sim_now();
+	mmc_request_done(host->mmc, mrq);
+
+	return HRTIMER_NORESTART;
+}
+
+static void mmc_sim_request(struct mmc_host *mmc, struct mmc_request *mrq)
+{
+	struct mmc_sim_host *host = mmc_priv(mmc);
+	struct mmc_command *cmd = mrq->cmd;
+	struct mmc_data *data = mrq->data;
+	unsigned int bytes;
+	u64 now, ns;
+	int write;
+
+	host->stats.cmds++;
+
+	if (!data) {
+		mmc_sim_command(host, cmd);
+		mmc_request_done(mmc, mrq);
+		return;
+	}
+
+	cmd->error = 0;
+	cmd->resp[0] = sim_status(host);
+	bytes = data->blocks * data->blksz;
+
+	if (cmd->opcode == MMC_SEND_EXT_CSD) {
+		sg_copy_from_buffer(data->sg, data->sg_len, host->ext_csd,
+				    min_t(unsigned int, bytes,
+					  sizeof(host->ext_csd)));
+		data->bytes_xfered = bytes;
+		mmc_request_done(mmc, mrq);
+		return;
+	}
+
+	switch (cmd->opcode) {
+	case MMC_READ_SINGLE_BLOCK:
+	case MMC_READ_MULTIPLE_BLOCK:
+		write = 0;
+		break;
+	case MMC_WRITE_BLOCK:
+	case MMC_WRITE_MULTIPLE_BLOCK:
+		write = 1;
+		break;
+	default:
+		cmd->error = -ETIMEDOUT;
+		mmc_request_done(mmc, mrq);
+		return;
+	}
+
+	/* The card is sector addressed */
+	if (data->blksz != 512 || cmd->arg >= host->sectors ||
+	    data->blocks > host->sectors - cmd->arg) {
+		cmd->resp[0] |= R1_OUT_OF_RANGE;
+		data->error = -EIO;
+		host->stats.range_errors++;
+		mmc_request_done(mmc, mrq);
+		return;
+	}
+
+	now = sim_now();
+	if (host->last_done && now - host->last_done < SIM_TURNAROUND_MAX_NS) {
+		host->stats.turnaround_ns += now - host->last_done;
+		host->stats.turnarounds++;
+	}
+
+	if (write) {
+		host->stats.writes++;
+		host->stats.write_bytes += bytes;
+	} else {
+		host->stats.reads++;
+		host->stats.read_bytes += bytes;
+	}
+
+	if (sim_inject(crc_rate)) {
+		data->error = -EILSEQ;
+		host->stats.crc_errors++;
+	}
+
+	ns = mmc_sim_data_ns(host, write, bytes);
+	host->stats.busy_ns += ns;
+
+	host->mrq = mrq;
+	hrtimer_start(&host->timer, ns_to_ktime(ns), HRTIMER_MODE_REL);
+}
+
+static void mmc_sim_set_ios(struct mmc_host *mmc, struct mmc_ios *ios)
+{
+	struct mmc_sim_host *host = mmc_priv(mmc);
+
+	if (ios->power_mode == MMC_POWER_OFF) {
+		host->state = SIM_STATE_IDLE;
+		host->rca = SIM_RCA_NONE;
+	}
+}
+
+static int mmc_sim_get_ro(struct mmc_host *mmc)
+{
+	return 0;
+}
+
+static const struct mmc_host_ops mmc_sim_ops = {
+	.request	= mmc_sim_request,
+	.set_ios	= mmc_sim_set_ios,
+	.get_ro		= mmc_sim_get_ro,
+};
+
+/*
+ * /proc/mmc_sim: the counters.  Writing anything to it clears them.
+ */
+static int mmc_sim_read_proc(char *page, char **start, off_t off,
+			     int count, int *eof, void *data)
+{
+	struct mmc_sim_host *host = data;
+	struct mmc_sim_stats *stats = &host->stats;
+	char *buf = page;
+
+	if (off) {
+		*eof = 1;
+		return 0;
+	}
+
+	buf += sprintf(buf, "commands...... %lu\n", stats->cmds);
+	buf += sprintf(buf, "reads......... %lu\n", stats->reads);
+	buf += sprintf(buf, "writes........ %lu\n", stats->writes);
+	buf += sprintf(buf, "readBytes..... %llu\n", stats->read_bytes);
+	buf += sprintf(buf, "writeBytes.... %llu\n", stats->write_bytes);
+	buf += sprintf(buf, "busyUs........ %llu\n",
+		       div_u64(stats->busy_ns, 1000));
+	buf += sprintf(buf, "turnarounds... %lu\n", stats->turnarounds);
+	buf += sprintf(buf, "turnaroundUs.. %llu\n",
+		       div_u64(stats->turnaround_ns, 1000));
+	buf += sprintf(buf, "crcErrors..... %lu\n", stats->crc_errors);
+	buf += sprintf(buf, "rangeErrors... %lu\n", stats->range_errors);
+
+	*eof = 1;
+	return buf - page;
+}
+
+static int mmc_sim_write_proc(struct file *file, const char __user *buffer,
+			      unsigned long count, void *data)
+{
+	struct mmc_sim_host *host = data;
+
+	memset(&host->stats, 0, sizeof(host->stats));
+	return count;
+}
+
+static int __devinit mmc_sim_probe(struct platform_device *pdev)
+{
+	struct mmc_host *mmc;
+	struct mmc_sim_host *host;
+	struct proc_dir_entry *entry;
+	int ret;
+
+	mmc = mmc_alloc_host(sizeof(struct mmc_sim_host), &pdev->dev);
+	if (!mmc)
+		return -ENOMEM;
+
+	host = mmc_priv(mmc);
+	host->mmc = mmc;
+	host->sectors = (unsigned long)size_mb << (20 - 9);
+	host->store = vmalloc((size_t)size_mb << 20);
+	if (!host->store) {
+		ret = -ENOMEM;
+		goto out_free_host;
+	}
+	memset(host->store, 0xff, (size_t)size_mb << 20);
+	mmc_sim_init_ext_csd(host);
+	hrtimer_init(&host->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	host->timer.function = mmc_sim_timer;
+
+	mmc->ops = &mmc_sim_ops;
+	mmc->f_min = 400000;
+	mmc->f_max = 52000000;
+	mmc->ocr_avail = MMC_VDD_32_33 | MMC_VDD_33_34;
+	mmc->caps = MMC_CAP_MMC_HIGHSPEED | MMC_CAP_NONREMOVABLE;
+	if (bus_width == 8)
+		mmc->caps |= MMC_CAP_8_BIT_DATA;
+	else if (bus_width == 4)
+		mmc->caps |= MMC_CAP_4_BIT_DATA;
+
+	/* The same limits as sdhci, with ADMA or with SDMA */
+	max_segs = clamp(max_segs, 1u, 128u);
+	mmc->max_hw_segs = max_segs;
+	mmc->max_phys_segs = 128;
+	mmc->max_req_size = 524288;
+	mmc->max_seg_size = max_segs > 1 ? 65536 : mmc->max_req_size;
+	mmc->max_blk_size = 512;
+	mmc->max_blk_count = 65535;
+
+	entry = create_proc_entry("mmc_sim", S_IRUGO | S_IWUSR, NULL);
+	if (entry) {
+		entry->read_proc = mmc_sim_read_proc;
+		entry->write_proc = mmc_sim_write_proc;
+		entry->data = host;
+	}
+
+	platform_set_drvdata(pdev, mmc);
+
+	ret = mmc_add_host(mmc);
+	if (ret)
+		goto out_remove_proc;
+
+	printk(KERN_INFO "%s: simulated %u MiB card, %u-bit bus, "
+	       "%u segments\n", mmc_hostname(mmc), size_mb, bus_width,
+	       max_segs);
+	return 0;
+
+ out_remove_proc:
+	remove_proc_entry("mmc_sim", NULL);
+	vfree(host->store);
+ out_free_host:
+	mmc_free_host(mmc);
+	return ret;
+}
+
+static int __devexit mmc_sim_remove(struct platform_device *pdev)
+{
+	struct mmc_host *mmc = platform_get_drvdata(pdev);
+	struct mmc_sim_host *host = mmc_priv(mmc);
+
+	mmc_remove_host(mmc);
+	hrtimer_cancel(&host->timer);
+	remove_proc_entry("mmc_sim", NULL);
+	vfree(host->store);
+	mmc_free_host(mmc);
+	platform_set_drvdata(pdev, NULL);
+
+	return 0;
+}
+
+static struct platform_driver mmc_sim_driver = {
+	.probe		= mmc_sim_probe,
+	.remove		= __devexit_p(mmc_sim_remove),
+	.driver		= {
+		.name	= DRIVER_NAME,
+		.owner	= THIS_MODULE,
+	},
+};
+
+static int __init mmc_sim_init(void)
+{
+	int ret;
+
+	if (!size_mb || size_mb > 2048)
+		return -EINVAL;
+
+	ret = platform_driver_register(&mmc_sim_driver);
+	if (ret)
+		return ret;
+
+	mmc_sim_device = platform_device_register_simple(DRIVER_NAME, -1,
+							 NULL, 0);
+	if (IS_ERR(mmc_sim_device)) {
+		platform_driver_unregister(&mmc_sim_driver);
+		return PTR_ERR(mmc_sim_device);
+	}
+
+	return 0;
+}
+
+static void __exit mmc_sim_exit(void)
+{
+	platform_device_unregister(mmc_sim_device);
+	platform_driver_unregister(&mmc_sim_driver);
+}
+
+module_init(mmc_sim_init);
+module_exit(mmc_sim_exit);
+
+MODULE_DESCRIPTION("Simulated MMC host and card");
+MODULE_LICENSE("GPL");
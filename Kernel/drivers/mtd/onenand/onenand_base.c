@@ -43,6 +43,11 @@ MODULE_PARM_DESC(flex_bdry,	"SLC Boundary information for Flex-OneNAND"
 				"    : 0->Set boundary in unlocked status"
 				"    : 1->Set boundary in locked status");
 
+/* Load the next page ahead of sequential readers */
+static int load_ahead = 1;
+module_param_named(prefetch, load_ahead, bool, 0644);
+MODULE_PARM_DESC(prefetch, "Load ahead of sequential reads (default 1)");
+
 /**
  *  onenand_oob_128 - oob info for Flex-Onenand with 4KB page
  *  For now, we expose only 64 out of 80 ecc bytes
@@ -886,6 +891,70 @@ static void onenand_invalidate_bufferram(struct mtd_info *mtd, loff_t addr,
 	}
 }
 
+/**
+ * onenand_finish_prefetch - [GENERIC] Wait for the page loaded ahead
+ * @param mtd		MTD data structure
+ *
+ * Called with the chip held, before anything else is done with it.  If the
+ * load hit a bitflip, the page is just not marked valid: the read that wants
+ * it loads it again and reports the error, and the ECC statistics are left
+ * for that read to update.
+ */
+static void onenand_finish_prefetch(struct mtd_info *mtd)
+{
+	struct onenand_chip *this = mtd->priv;
+	struct mtd_ecc_stats stats;
+	int ret;
+
+	if (this->prefetch_addr < 0)
+		return;
+
+	stats = mtd->ecc_stats;
+	ret = this->wait(mtd, FL_READING);
+	if (mtd->ecc_stats.corrected != stats.corrected ||
+	    mtd->ecc_stats.failed != stats.failed) {
+		mtd->ecc_stats = stats;
+		ret = -EBADMSG;
+	}
+	onenand_update_bufferram(mtd, this->prefetch_addr, !ret);
+	this->prefetch_addr = -1;
+}
+
+/**
+ * onenand_prefetch - [GENERIC] Load ahead of a sequential reader
+ * @param mtd		MTD data structure
+ * @param from		where the read started
+ * @param end		where it ended
+ *
+ * When a read starts where the previous one ended, load the page after it
+ * into the free BufferRAM and return without waiting, so that the array load
+ * overlaps whatever the caller does until its next read.
+ */
+static void onenand_prefetch(struct mtd_info *mtd, loff_t from, loff_t end)
+{
+	struct onenand_chip *this = mtd->priv;
+	int sequential = (from == this->read_next);
+
+	this->read_next = end;
+
+	/* Only for plain reads, not OTP ones */
+	if (!load_ahead || this->state != FL_READING)
+		return;
+
+	if (!sequential || (end & (this->writesize - 1)) || end >= mtd->size)
+		return;
+
+	/* Not worth the DataRAM juggling at the DDP chip boundary */
+	if (ONENAND_IS_2PLANE(this) ||
+	    (ONENAND_IS_DDP(this) && end == (this->chipsize >> 1)))
+		return;
+
+	this->command(mtd, ONENAND_CMD_READ, end, this->writesize);
+	/* The command switched to the BufferRAM being loaded */
+	this->bufferram[ONENAND_CURRENT_BUFFERRAM(this)].blockpage = -1;
+	this->prefetch_addr = end;
+}
+
 /**
  * onenand_get_device - [GENERIC] Get chip for selected access
  * @param mtd		MTD device structure
@@ -919,6 +988,8 @@ static int onenand_get_device(struct mtd_info *mtd, int new_state)
 		remove_wait_queue(&this->wq, &wait);
 	}
 
+	onenand_finish_prefetch(mtd);
+
 	return 0;
 }
 
@@ -1045,6 +1116,7 @@ static int onenand_mlc_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 	int oobread = 0, oobcolumn, thisooblen, oobsize;
 	int ret = 0;
 	int writesize = this->writesize;
+	loff_t start = from;
 
 	DEBUG(MTD_DEBUG_LEVEL3, "onenand_mlc_read_ops_nolock: from = 0x%08x, len = %i\n", (unsigned int) from, (int) len);
 
@@ -1118,6 +1190,8 @@ static int onenand_mlc_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 	if (ret)
 		return ret;
 
+	onenand_prefetch(mtd, start, start + read);
+
 	if (mtd->ecc_stats.failed - stats.failed)
 		return -EBADMSG;
 
@@ -1145,6 +1219,7 @@ static int onenand_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 	int oobread = 0, oobcolumn, thisooblen, oobsize;
 	int ret = 0, boundary = 0;
 	int writesize = this->writesize;
+	loff_t start = from;
 
 	DEBUG(MTD_DEBUG_LEVEL3, "onenand_read_ops_nolock: from = 0x%08x, len = %i\n", (unsigned int) from, (int) len);
 
@@ -1248,6 +1323,8 @@ static int onenand_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 	if (ret)
 		return ret;
 
+	onenand_prefetch(mtd, start, start + read);
+
 	if (mtd->ecc_stats.failed - stats.failed)
 		return -EBADMSG;
 
@@ -1422,6 +1499,154 @@ static int onenand_read_oob(struct mtd_info *mtd, loff_t from,
 	return ret;
 }
 
+/**
+ * onenand_page_req_wait - [Internal] Wait for a page of onenand_read_pages
+ * @param mtd		MTD device structure
+ * @param req		the page being loaded into the current BufferRAM
+ */
+static void onenand_page_req_wait(struct mtd_info *mtd,
+		struct onenand_page_req *req)
+{
+	struct onenand_chip *this = mtd->priv;
+	struct mtd_ecc_stats stats = mtd->ecc_stats;
+	int ret;
+
+	ret = this->wait(mtd, FL_READING);
+	onenand_update_bufferram(mtd, req->addr, !ret);
+
+	if (ret == -EBADMSG || mtd->ecc_stats.failed != stats.failed)
+		req->ret = -EBADMSG;
+	else if (ret)
+		req->ret = ret;
+	else
+		req->ret = mtd->ecc_stats.corrected != stats.corrected ?
+			-EUCLEAN : 0;
+}
+
+/**
+ * onenand_read_pages_nolock - [Internal] Read a list of pages
+ * @param mtd		MTD device structure
+ * @param reqs		the pages
+ * @param count		number of pages
+ *
+ * Read-while-load across pages that need not be contiguous: the next page
+ * loads into one BufferRAM while the current one is copied out of the other.
+ */
+static void onenand_read_pages_nolock(struct mtd_info *mtd,
+		struct onenand_page_req *reqs, int count)
+{
+	struct onenand_chip *this = mtd->priv;
+	struct onenand_page_req *req, *next;
+	int writesize = this->writesize;
+	int i;
+
+	/* Do first load to bufferRAM */
+	if (onenand_check_bufferram(mtd, reqs[0].addr))
+		reqs[0].ret = 0;
+	else {
+		this->command(mtd, ONENAND_CMD_READ, reqs[0].addr, writesize);
+		onenand_page_req_wait(mtd, &reqs[0]);
+	}
+
+	for (i = 0; i < count; i++) {
+		req = &reqs[i];
+		next = (i + 1 < count) ? &reqs[i + 1] : NULL;
+
+		/* Start the next load, then point back at this page */
+		if (next) {
+			this->command(mtd, ONENAND_CMD_READ, next->addr, writesize);
+			ONENAND_SET_PREV_BUFFERRAM(this);
+			if (ONENAND_IS_DDP(this))
+				this->write_word(onenand_bufferram_address(this,
+						onenand_block(this, req->addr)),
+					this->base + ONENAND_REG_START_ADDRESS2);
+		}
+
+		/* While load is going, read from last bufferRAM */
+		if (req->datbuf)
+			this->read_bufferram(mtd, ONENAND_DATARAM, req->datbuf,
+					0, writesize);
+		if (req->oobbuf)
+			onenand_transfer_auto_oob(mtd, req->oobbuf, 0,
+					this->ecclayout->oobavail);
+
+		if (!next)
+			break;
+
+		ONENAND_SET_NEXT_BUFFERRAM(this);
+		if (ONENAND_IS_DDP(this))
+			this->write_word(onenand_bufferram_address(this,
+					onenand_block(this, next->addr)),
+				this->base + ONENAND_REG_START_ADDRESS2);
+		cond_resched();
+		/* Now wait for load */
+		onenand_page_req_wait(mtd, next);
+	}
+}
+
+/**
+ * onenand_read_pages - [MTD Interface] Read a list of whole pages
+ * @param mtd		MTD device structure
+ * @param reqs		the pages, in the order to read them
+ * @param count		number of pages
+ *
+ * For callers that know which pages they need next, e.g. a filesystem
+ * reading the chunks of a file or the tags of a block: each page keeps the
+ * next one loading.  Chips with a single DataRAM read one page at a time.
+ * Each request gets its own result in ->ret; returns -EINVAL if a request
+ * is not a page of the device, otherwise 0.
+ */
+int onenand_read_pages(struct mtd_info *mtd, struct onenand_page_req *reqs,
+		int count)
+{
+	struct onenand_chip *this = mtd->priv;
+	struct onenand_page_req *req;
+	struct mtd_oob_ops ops;
+	int i, ret;
+
+	for (i = 0; i < count; i++)
+		if ((reqs[i].addr & (this->writesize - 1)) ||
+		    reqs[i].addr >= mtd->size)
+			return -EINVAL;
+
+	if (!count)
+		return 0;
+
+	onenand_get_device(mtd, FL_READING);
+
+	if (ONENAND_IS_MLC(this) || ONENAND_IS_2PLANE(this)) {
+		for (i = 0; i < count; i++) {
+			req = &reqs[i];
+			/*
+			 * Each read may leave the next page loading, with the
+			 * clock held on for it: wait for it before the next
+			 * command, as onenand_get_device() would.
+			 */
+			onenand_finish_prefetch(mtd);
+			memset(&ops, 0, sizeof(ops));
+			ops.mode = MTD_OOB_AUTO;
+			ops.datbuf = req->datbuf;
+			ops.oobbuf = req->oobbuf;
+			ops.ooblen = req->oobbuf ? this->ecclayout->oobavail : 0;
+			if (!req->datbuf) {
+				req->ret = onenand_read_oob_nolock(mtd, req->addr, &ops);
+				continue;
+			}
+			ops.len = this->writesize;
+			ret = ONENAND_IS_MLC(this) ?
+				onenand_mlc_read_ops_nolock(mtd, req->addr, &ops) :
+				onenand_read_ops_nolock(mtd, req->addr, &ops);
+			req->ret = ret;
+		}
+	} else
+		onenand_read_pages_nolock(mtd, reqs, count);
+
+	onenand_release_device(mtd);
+
+	return 0;
+}
+EXPORT_SYMBOL(onenand_read_pages);
+
 /**
  * onenand_bbt_wait - [DEFAULT] wait until the command is done
  * @param mtd		MTD device structure
@@ -1660,6 +1885,7 @@ static int onenand_panic_write(struct mtd_info *mtd, loff_t to, size_t len,
 
 	/* Wait for any existing operation to clear */
 	onenand_panic_wait(mtd);
+	this->prefetch_addr = -1;
 
 	DEBUG(MTD_DEBUG_LEVEL3, "onenand_panic_write: to = 0x%08x, len = %i\n",
 	      (unsigned int) to, (int) len);
@@ -3483,6 +3709,8 @@ int onenand_scan(struct mtd_info *mtd, int maxchips)
 	}
 
 	this->state = FL_READY;
+	this->prefetch_addr = -1;
+	this->read_next = -1;
 	init_waitqueue_head(&this->wq);
 	spin_lock_init(&this->chip_lock);
 
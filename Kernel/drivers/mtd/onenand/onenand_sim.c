@@ -19,9 +19,15 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/vmalloc.h>
+#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/proc_fs.h>
 #include <linux/mtd/mtd.h>
 #include <linux/mtd/partitions.h>
 #include <linux/mtd/onenand.h>
+#include <linux/mtd/bbm.h>
 
 #include <linux/io.h>
 
@@ -118,6 +124,138 @@ do {									\
 			   __LINE__, ##args);				\
 } while (0)
 
+/*
+ * Performance model
+ *
+ * With timing set, every array operation keeps the core busy for tR, tPROG
+ * or tBERS from the time the command is written, and the interrupt and
+ * controller status registers read as busy until then, so the driver waits
+ * as it would on the real chip and can overlap the wait with other work.
+ * BufferRAM transfers cost the host bufferram_mbps, like the bus copy does.
+ * The defaults are the typical figures of the KFM/KFN SLC parts.
+ *
+ * Independently of timing, ECC errors and program/erase failures can be
+ * injected at a rate of one in N operations, and blocks can be made bad
+ * from the factory.  The counters are in /proc/onenand_sim.
+ */
+static int timing;
+module_param(timing, int, 0644);
+MODULE_PARM_DESC(timing, "Model the chip latencies (default 0: instant)");
+
+static int t_read_us = 30;
+module_param(t_read_us, int, 0644);
+MODULE_PARM_DESC(t_read_us, "tR, array to DataRAM load (us)");
+
+static int t_prog_us = 220;
+module_param(t_prog_us, int, 0644);
+MODULE_PARM_DESC(t_prog_us, "tPROG, page program (us)");
+
+static int t_erase_us = 2000;
+module_param(t_erase_us, int, 0644);
+MODULE_PARM_DESC(t_erase_us, "tBERS, block erase (us)");
+
+static int bufferram_mbps = 66;
+module_param(bufferram_mbps, int, 0644);
+MODULE_PARM_DESC(bufferram_mbps, "BufferRAM transfer rate (MB/s), 0 = free");
+
+static int ecc_1bit_rate;
+module_param(ecc_1bit_rate, int, 0644);
+MODULE_PARM_DESC(ecc_1bit_rate, "Report a corrected bit error on 1 in N reads");
+
+static int ecc_2bit_rate;
+module_param(ecc_2bit_rate, int, 0644);
+MODULE_PARM_DESC(ecc_2bit_rate, "Corrupt 1 in N reads beyond correction");
+
+static int prog_fail_rate;
+module_param(prog_fail_rate, int, 0644);
+MODULE_PARM_DESC(prog_fail_rate, "Fail 1 in N programs");
+
+static int erase_fail_rate;
+module_param(erase_fail_rate, int, 0644);
+MODULE_PARM_DESC(erase_fail_rate, "Fail 1 in N erases");
+
+#define MAX_BAD_BLOCKS		32
+static int bad_blocks[MAX_BAD_BLOCKS];
+static int nr_bad_blocks;
+module_param_array(bad_blocks, int, &nr_bad_blocks, 0444);
+MODULE_PARM_DESC(bad_blocks, "Factory bad blocks");
+
+struct onenand_sim_stats {
+	unsigned long reads;
+	unsigned long oob_reads;
+	unsigned long progs;
+	unsigned long erases;
+	unsigned long long read_ns;	/* modelled core busy time */
+	unsigned long long prog_ns;
+	unsigned long long erase_ns;
+	unsigned long long wait_ns;	/* host polling a busy core */
+	unsigned long long bufferram_ns;
+	unsigned long long bytes_in;	/* BufferRAM to host */
+	unsigned long long bytes_out;	/* host to BufferRAM */
+	unsigned long ecc_1bit;
+	unsigned long ecc_2bit;
+	unsigned long prog_fails;
+	unsigned long erase_fails;
+	unsigned long bad_block_ops;
+};
+
+static struct onenand_sim_stats stats;
+static u64 core_ready;		/* ns, when the current operation ends */
+static u64 wait_start;		/* ns, when the host started polling */
+
+static inline u64 sim_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static inline int sim_inject(int rate)
+{
+	return rate > 0 && (random32() % rate) == 0;
+}
+
+/*
+ * Start an array operation of @us microseconds and return how long it
+ * keeps the core busy.  Commands are serialised by the driver, so one
+ * should never be issued while the core is busy, but queue it if it is.
+ */
+static u64 sim_core_busy(int us)
+{
+	u64 now, ns;
+
+	if (!timing || us <= 0)
+		return 0;
+
+	now = sim_now();
+	ns = (u64) us * NSEC_PER_USEC;
+	core_ready = max(now, core_ready) + ns;
+	return ns;
+}
+
+static void sim_transfer(size_t count)
+{
+	unsigned long ns;
+
+	if (!timing || bufferram_mbps <= 0)
+		return;
+
+	/* 1 MB/s is 1000 ns per byte */
+	ns = count * 1000 / bufferram_mbps;
+	stats.bufferram_ns += ns;
+	if (ns >= 1000)
+		udelay(ns / 1000);
+	ndelay(ns % 1000);
+}
+
+static int sim_bad_block(int block)
+{
+	int i;
+
+	for (i = 0; i < nr_bad_blocks; i++)
+		if (bad_blocks[i] == block)
+			return 1;
+	return 0;
+}
+
 /**
  * onenand_lock_handle - Handle Lock scheme
  * @this:		OneNAND device structure
@@ -359,6 +497,118 @@ static void onenand_data_handle(struct onenand_chip *this, int cmd,
 	}
 }
 
+/**
+ * onenand_fail_handle - Decide whether a program or erase fails
+ * @cmd:		The command to be sent
+ * @block:		The block addressed
+ *
+ * Returns:		1 if the command is to fail without touching the array
+ *
+ * Programs and erases of bad blocks always fail, others at the injected rate.
+ */
+static int onenand_fail_handle(int cmd, int block)
+{
+	switch (cmd) {
+	case ONENAND_CMD_PROG:
+	case ONENAND_CMD_PROGOOB:
+		if (sim_bad_block(block)) {
+			stats.bad_block_ops++;
+			return 1;
+		}
+		if (sim_inject(prog_fail_rate)) {
+			stats.prog_fails++;
+			return 1;
+		}
+		break;
+
+	case ONENAND_CMD_ERASE:
+		if (sim_bad_block(block)) {
+			stats.bad_block_ops++;
+			return 1;
+		}
+		if (sim_inject(erase_fail_rate)) {
+			stats.erase_fails++;
+			return 1;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * onenand_model_handle - Account for the command in the performance model
+ * @this:		OneNAND device structure
+ * @cmd:		The command to be sent
+ * @block:		The block addressed
+ * @dataram:		Which dataram used
+ * @fail:		The program or erase failed
+ *
+ * Start the core busy time, and set the ECC and controller status, marking
+ * bad blocks and injecting bit errors into what was just loaded.
+ */
+static void onenand_model_handle(struct onenand_chip *this, int cmd,
+				 int block, int dataram, int fail)
+{
+	struct mtd_info *mtd = &info->mtd;
+	int main_offset = dataram ? mtd->writesize : 0;
+	int spare_offset = dataram ? mtd->oobsize : 0;
+	void __iomem *main_area = ONENAND_MAIN_AREA(this, main_offset);
+	void __iomem *spare = ONENAND_SPARE_AREA(this, spare_offset);
+	int ecc = 0;
+
+	switch (cmd) {
+	case ONENAND_CMD_READ:
+	case ONENAND_CMD_READOOB:
+		if (cmd == ONENAND_CMD_READ)
+			stats.reads++;
+		else
+			stats.oob_reads++;
+		stats.read_ns += sim_core_busy(t_read_us);
+
+		if (sim_bad_block(block)) {
+			writew(0, spare + ONENAND_BADBLOCK_POS);
+			stats.bad_block_ops++;
+		} else if (sim_inject(ecc_2bit_rate)) {
+			/* Past the bad block marker in the spare area */
+			if (cmd == ONENAND_CMD_READ)
+				writew(readw(main_area) ^ 0x0101, main_area);
+			else
+				writew(readw(spare + 2) ^ 0x0101, spare + 2);
+			ecc = ONENAND_ECC_2BIT;
+			stats.ecc_2bit++;
+		} else if (sim_inject(ecc_1bit_rate)) {
+			/* Corrected by the chip, the data is fine */
+			ecc = ONENAND_ECC_1BIT;
+			stats.ecc_1bit++;
+		}
+		writew(ecc, this->base + ONENAND_REG_ECC_STATUS);
+		writew(0, this->base + ONENAND_REG_CTRL_STATUS);
+		break;
+
+	case ONENAND_CMD_PROG:
+	case ONENAND_CMD_PROGOOB:
+		stats.progs++;
+		stats.prog_ns += sim_core_busy(t_prog_us);
+		writew(fail ? ONENAND_CTRL_ERROR : 0,
+		       this->base + ONENAND_REG_CTRL_STATUS);
+		break;
+
+	case ONENAND_CMD_ERASE:
+		stats.erases++;
+		stats.erase_ns += sim_core_busy(t_erase_us);
+		writew(fail ? ONENAND_CTRL_ERROR : 0,
+		       this->base + ONENAND_REG_CTRL_STATUS);
+		break;
+
+	default:
+		break;
+	}
+}
+
 /**
  * onenand_command_handle - Handle command
  * @this:		OneNAND device structure
@@ -371,6 +621,7 @@ static void onenand_command_handle(struct onenand_chip *this, int cmd)
 	unsigned long offset = 0;
 	int block = -1, page = -1, bufferram = -1;
 	int dataram = 0;
+	int fail;
 
 	switch (cmd) {
 	case ONENAND_CMD_UNLOCK:
@@ -409,11 +660,191 @@ static void onenand_command_handle(struct onenand_chip *this, int cmd)
 	if (page != -1)
 		offset += page << this->page_shift;
 
-	onenand_data_handle(this, cmd, dataram, offset);
+	fail = onenand_fail_handle(cmd, block);
+	if (!fail)
+		onenand_data_handle(this, cmd, dataram, offset);
+
+	onenand_model_handle(this, cmd, block, dataram, fail);
 
 	onenand_update_interrupt(this, cmd);
 }
 
+/**
+ * onenand_readw - [OneNAND Interface] Emulate read operation
+ * @addr:		address to read
+ *
+ * Read OneNAND register; the core reads as busy until the operation ends.
+ */
+static unsigned short onenand_readw(void __iomem *addr)
+{
+	struct onenand_chip *this = info->mtd.priv;
+	u64 now;
+
+	if (timing && (addr == this->base + ONENAND_REG_INTERRUPT ||
+		       addr == this->base + ONENAND_REG_CTRL_STATUS)) {
+		now = sim_now();
+		if (now < core_ready) {
+			if (!wait_start)
+				wait_start = now;
+			if (addr == this->base + ONENAND_REG_INTERRUPT)
+				return 0;
+			return ONENAND_CTRL_ONGO;
+		}
+		if (wait_start) {
+			stats.wait_ns += core_ready - wait_start;
+			wait_start = 0;
+		}
+	}
+
+	return readw(addr);
+}
+
+/**
+ * onenand_bufferram_offset - Offset of the current BufferRAM
+ * @mtd:		MTD data structure
+ * @area:		BufferRAM area
+ */
+static int onenand_bufferram_offset(struct mtd_info *mtd, int area)
+{
+	struct onenand_chip *this = mtd->priv;
+
+	if (ONENAND_CURRENT_BUFFERRAM(this)) {
+		if (area == ONENAND_DATARAM)
+			return this->writesize;
+		if (area == ONENAND_SPARERAM)
+			return mtd->oobsize;
+	}
+
+	return 0;
+}
+
+/**
+ * onenand_read_bufferram - [OneNAND Interface] Read the bufferram area
+ * @mtd:		MTD data structure
+ * @area:		BufferRAM area
+ * @buffer:		the databuffer to put data
+ * @offset:		offset to read from
+ * @count:		number of bytes to read
+ *
+ * As the default, but charging the transfer time.
+ */
+static int onenand_read_bufferram(struct mtd_info *mtd, int area,
+		unsigned char *buffer, int offset, size_t count)
+{
+	struct onenand_chip *this = mtd->priv;
+	void __iomem *bufferram;
+
+	stats.bytes_in += count;
+	sim_transfer(count);
+
+	bufferram = this->base + area + onenand_bufferram_offset(mtd, area);
+
+	if (ONENAND_CHECK_BYTE_ACCESS(count)) {
+		unsigned short word;
+
+		/* Align with word(16-bit) size */
+		count--;
+
+		/* Read word and save byte */
+		word = this->read_word(bufferram + offset + count);
+		buffer[count] = (word & 0xff);
+	}
+
+	memcpy(buffer, bufferram + offset, count);
+
+	return 0;
+}
+
+/**
+ * onenand_write_bufferram - [OneNAND Interface] Write the bufferram area
+ * @mtd:		MTD data structure
+ * @area:		BufferRAM area
+ * @buffer:		the databuffer to get data
+ * @offset:		offset to write to
+ * @count:		number of bytes to write
+ *
+ * As the default, but charging the transfer time.
+ */
+static int onenand_write_bufferram(struct mtd_info *mtd, int area,
+		const unsigned char *buffer, int offset, size_t count)
+{
+	struct onenand_chip *this = mtd->priv;
+	void __iomem *bufferram;
+
+	stats.bytes_out += count;
+	sim_transfer(count);
+
+	bufferram = this->base + area + onenand_bufferram_offset(mtd, area);
+
+	if (ONENAND_CHECK_BYTE_ACCESS(count)) {
+		unsigned short word;
+		int byte_offset;
+
+		/* Align with word(16-bit) size */
+		count--;
+
+		/* Calculate byte access offset */
+		byte_offset = offset + count;
+
+		/* Read word and save byte */
+		word = this->read_word(bufferram + byte_offset);
+		word = (word & ~0xff) | buffer[count];
+		this->write_word(word, bufferram + byte_offset);
+	}
+
+	memcpy(bufferram + offset, buffer, count);
+
+	return 0;
+}
+
+/*
+ * /proc/onenand_sim: the counters.  Writing anything to it clears them.
+ */
+static int onenand_sim_read_proc(char *page, char **start, off_t off,
+				 int count, int *eof, void *data)
+{
+	char *buf = page;
+
+	if (off) {
+		*eof = 1;
+		return 0;
+	}
+
+	buf += sprintf(buf, "timing........ %d\n", timing);
+	buf += sprintf(buf, "reads......... %lu\n", stats.reads);
+	buf += sprintf(buf, "oobReads...... %lu\n", stats.oob_reads);
+	buf += sprintf(buf, "programs...... %lu\n", stats.progs);
+	buf += sprintf(buf, "erases........ %lu\n", stats.erases);
+	buf += sprintf(buf, "readUs........ %llu\n",
+		       div_u64(stats.read_ns, 1000));
+	buf += sprintf(buf, "programUs..... %llu\n",
+		       div_u64(stats.prog_ns, 1000));
+	buf += sprintf(buf, "eraseUs....... %llu\n",
+		       div_u64(stats.erase_ns, 1000));
+	buf += sprintf(buf, "hostWaitUs.... %llu\n",
+		       div_u64(stats.wait_ns, 1000));
+	buf += sprintf(buf, "bufferRamUs... %llu\n",
+		       div_u64(stats.bufferram_ns, 1000));
+	buf += sprintf(buf, "bytesIn....... %llu\n", stats.bytes_in);
+	buf += sprintf(buf, "bytesOut...... %llu\n", stats.bytes_out);
+	buf += sprintf(buf, "ecc1bit....... %lu\n", stats.ecc_1bit);
+	buf += sprintf(buf, "ecc2bit....... %lu\n", stats.ecc_2bit);
+	buf += sprintf(buf, "programFails.. %lu\n", stats.prog_fails);
+	buf += sprintf(buf, "eraseFails.... %lu\n", stats.erase_fails);
+	buf += sprintf(buf, "badBlockOps... %lu\n", stats.bad_block_ops);
+
+	*eof = 1;
+	return buf - page;
+}
+
+static int onenand_sim_write_proc(struct file *file, const char __user *buffer,
+				  unsigned long count, void *data)
+{
+	memset(&stats, 0, sizeof(stats));
+	wait_start = 0;
+	return count;
+}
+
 /**
  * onenand_writew - [OneNAND Interface] Emulate write operation
  * @value:		value to write
@@ -496,6 +927,8 @@ static void flash_exit(struct onenand_flash *flash)
 
 static int __init onenand_sim_init(void)
 {
+	struct proc_dir_entry *proc;
+
 	/* Allocate all 0xff chars pointer */
 	ffchars = kmalloc(MAX_ONENAND_PAGESIZE, GFP_KERNEL);
 	if (!ffchars) {
@@ -515,6 +948,11 @@ static int __init onenand_sim_init(void)
 	/* Override write_word function */
 	info->onenand.write_word = onenand_writew;
 
+	/* And the reads, for the performance model */
+	info->onenand.read_word = onenand_readw;
+	info->onenand.read_bufferram = onenand_read_bufferram;
+	info->onenand.write_bufferram = onenand_write_bufferram;
+
 	if (flash_init(&info->flash)) {
 		printk(KERN_ERR "Unable to allocate flash.\n");
 		kfree(ffchars);
@@ -540,6 +978,12 @@ static int __init onenand_sim_init(void)
 
 	add_mtd_partitions(&info->mtd, info->parts, ARRAY_SIZE(os_partitions));
 
+	proc = create_proc_entry("onenand_sim", S_IRUGO | S_IWUSR, NULL);
+	if (proc) {
+		proc->read_proc = onenand_sim_read_proc;
+		proc->write_proc = onenand_sim_write_proc;
+	}
+
 	return 0;
 }
 
@@ -548,6 +992,7 @@ static void __exit onenand_sim_exit(void)
 	struct onenand_chip *this = info->mtd.priv;
 	struct onenand_flash *flash = this->priv;
 
+	remove_proc_entry("onenand_sim", NULL);
 	onenand_release(&info->mtd);
 	flash_exit(flash);
 	kfree(ffchars);
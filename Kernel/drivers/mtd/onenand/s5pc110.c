@@ -138,6 +138,11 @@ MODULE_PARM_DESC(flex_bdry,	"SLC Boundary information for Flex-OneNAND"
 				"    : 0->Set boundary in unlocked status"
 				"    : 1->Set boundary in locked status");
 
+/* Load the next page ahead of sequential readers */
+static int load_ahead = 1;
+module_param_named(prefetch, load_ahead, bool, 0644);
+MODULE_PARM_DESC(prefetch, "Load ahead of sequential reads (default 1)");
+
 #ifdef ONENAND_CLOCK_GATING
 static struct clk *onenand_clk;
 #endif
@@ -1252,6 +1257,81 @@ static void onenand_clock_gating(int status)
 }
 #endif
 
+/**
+ * onenand_finish_prefetch - [GENERIC] Wait for the page loaded ahead
+ * @param mtd		MTD data structure
+ *
+ * Called with the chip held, before anything else is done with it, so a
+ * suspend also waits for the load and lets the clock be gated.  If the
+ * load hit a bitflip, the page is just not marked valid: the read that wants
+ * it loads it again and reports the error, and the ECC statistics are left
+ * for that read to update.
+ */
+static void onenand_finish_prefetch(struct mtd_info *mtd)
+{
+	struct onenand_chip *this = mtd->priv;
+	struct mtd_ecc_stats stats;
+	int ret;
+
+	if (this->prefetch_addr < 0)
+		return;
+
+	stats = mtd->ecc_stats;
+	ret = this->wait(mtd, FL_READING);
+	if (mtd->ecc_stats.corrected != stats.corrected ||
+	    mtd->ecc_stats.failed != stats.failed) {
+		mtd->ecc_stats = stats;
+		ret = -EBADMSG;
+	}
+	onenand_update_bufferram(mtd, this->prefetch_addr, !ret);
+	this->prefetch_addr = -1;
+#ifdef ONENAND_CLOCK_GATING
+	onenand_clock_gating(ONENAND_CLOCK_OFF);
+#endif
+}
+
+/**
+ * onenand_prefetch - [GENERIC] Load ahead of a sequential reader
+ * @param mtd		MTD data structure
+ * @param from		where the read started
+ * @param end		where it ended
+ *
+ * When a read starts where the previous one ended, load the page after it
+ * into the free BufferRAM and return without waiting, so that the array load
+ * overlaps whatever the caller does until its next read.
+ */
+static void onenand_prefetch(struct mtd_info *mtd, loff_t from, loff_t end)
+{
+	struct onenand_chip *this = mtd->priv;
+	int sequential = (from == this->read_next);
+
+	this->read_next = end;
+
+	/* Only for plain reads, not OTP ones */
+	if (!load_ahead || this->state != FL_READING)
+		return;
+
+	if (!sequential || (end & (this->writesize - 1)) || end >= mtd->size)
+		return;
+
+	/* Not worth the DataRAM juggling at the DDP chip boundary */
+	if (ONENAND_IS_2PLANE(this) ||
+	    (ONENAND_IS_DDP(this) && end == (this->chipsize >> 1)))
+		return;
+
+	this->command(mtd, ONENAND_CMD_READ, end, this->writesize);
+	/* The command switched to the BufferRAM being loaded */
+	this->bufferram[ONENAND_CURRENT_BUFFERRAM(this)].blockpage = -1;
+	this->prefetch_addr = end;
+#ifdef ONENAND_CLOCK_GATING
+	/*
+	 * The load keeps the clock on past onenand_release_device() until
+	 * onenand_finish_prefetch() has waited for it.
+	 */
+	onenand_clock_gating(ONENAND_CLOCK_ON);
+#endif
+}
+
 /**
  * onenand_get_device - [GENERIC] Get chip for selected access
  * @param mtd		MTD device structure
@@ -1289,6 +1369,8 @@ static int onenand_get_device(struct mtd_info *mtd, int new_state)
 		remove_wait_queue(&this->wq, &wait);
 	}
 
+	onenand_finish_prefetch(mtd);
+
 	return 0;
 }
 
@@ -1417,8 +1499,9 @@ static int onenand_multiple_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 	u_char *oobbuf = ops->oobbuf;
 	int load = 0, column, thislen;
 	int oobload = 0, oobcolumn, thisooblen = 0, oobsize;
-	int ret = 0;
+	int ret = 0, cached;
 	int writesize = this->writesize;
+	loff_t start = from;
 
 	DEBUG(MTD_DEBUG_LEVEL3, "onenand_multiple_read_ops_nolock: from = 0x%08x, len = %i\n", (unsigned int) from, (int) len);
 
@@ -1441,12 +1524,16 @@ static int onenand_multiple_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 
 	/* First Load: issue normal load command to the first block */
 	{
-		this->command(mtd, ONENAND_CMD_READ, from, writesize);
-
 		thislen = min_t(int, writesize, len);
 		column = from & (writesize - 1);
 		if (column + thislen > writesize)
 			thislen = writesize - column;
+
+		/* A single page may still be in the DataRAM, e.g. loaded ahead */
+		cached = (thislen == len) && onenand_check_bufferram(mtd, from);
+		if (!cached)
+			this->command(mtd, ONENAND_CMD_READ, from, writesize);
+
 		load += thislen;
 		from += thislen;
 		if (oobbuf) {
@@ -1455,11 +1542,15 @@ static int onenand_multiple_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 			oobload += thisooblen;
 		}
 
-		ret = this->wait(mtd, FL_READING);
-		if (unlikely(ret))
-			ret = onenand_recover_lsb(mtd, from, ret);
-		if (ret == -EBADMSG)
-			ret = 0;
+		if (!cached) {
+			ret = this->wait(mtd, FL_READING);
+			if (unlikely(ret))
+				ret = onenand_recover_lsb(mtd, from, ret);
+			/* Superloads below replace what is in the DataRAM */
+			onenand_update_bufferram(mtd, start, !ret && load == len);
+			if (ret == -EBADMSG)
+				ret = 0;
+		}
 	}
 
 	/* Super load: Issue superload command to the second block ~ (Last - 1) block */
@@ -1522,6 +1613,8 @@ static int onenand_multiple_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 	if (ret)
 		return ret;
 
+	onenand_prefetch(mtd, start, start + load);
+
 	if (mtd->ecc_stats.failed - stats.failed)
 		return -EBADMSG;
 
@@ -1550,6 +1643,7 @@ static int onenand_simple_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 	int oobread = 0, oobcolumn, thisooblen, oobsize;
 	int ret = 0;
 	int writesize = this->writesize;
+	loff_t start = from;
 
 	DEBUG(MTD_DEBUG_LEVEL3, "onenand_simple_read_ops_nolock: from = 0x%08x, len = %i\n", (unsigned int) from, (int) len);
 
@@ -1623,6 +1717,8 @@ static int onenand_simple_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 	if (ret)
 		return ret;
 
+	onenand_prefetch(mtd, start, start + read);
+
 	if (mtd->ecc_stats.failed - stats.failed)
 		return -EBADMSG;
 
@@ -1651,6 +1747,7 @@ static int onenand_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 	int oobread = 0, oobcolumn, thisooblen, oobsize;
 	int ret = 0, boundary = 0;
 	int writesize = this->writesize;
+	loff_t start = from;
 
 	DEBUG(MTD_DEBUG_LEVEL3, "onenand_read_ops_nolock: from = 0x%08x, len = %i\n", (unsigned int) from, (int) len);
 
@@ -1754,6 +1851,8 @@ static int onenand_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 	if (ret)
 		return ret;
 
+	onenand_prefetch(mtd, start, start + read);
+
 	if (mtd->ecc_stats.failed - stats.failed)
 		return -EBADMSG;
 
@@ -1936,6 +2035,158 @@ static int onenand_read_oob(struct mtd_info *mtd, loff_t from,
 	return ret;
 }
 
+/**
+ * onenand_page_req_wait - [Internal] Wait for a page of onenand_read_pages
+ * @param mtd		MTD device structure
+ * @param req		the page being loaded into the current BufferRAM
+ */
+static void onenand_page_req_wait(struct mtd_info *mtd,
+		struct onenand_page_req *req)
+{
+	struct onenand_chip *this = mtd->priv;
+	struct mtd_ecc_stats stats = mtd->ecc_stats;
+	int ret;
+
+	ret = this->wait(mtd, FL_READING);
+	onenand_update_bufferram(mtd, req->addr, !ret);
+
+	if (ret == -EBADMSG || mtd->ecc_stats.failed != stats.failed)
+		req->ret = -EBADMSG;
+	else if (ret)
+		req->ret = ret;
+	else
+		req->ret = mtd->ecc_stats.corrected != stats.corrected ?
+			-EUCLEAN : 0;
+}
+
+/**
+ * onenand_read_pages_nolock - [Internal] Read a list of pages
+ * @param mtd		MTD device structure
+ * @param reqs		the pages
+ * @param count		number of pages
+ *
+ * Read-while-load across pages that need not be contiguous: the next page
+ * loads into one BufferRAM while the current one is copied out of the other.
+ */
+static void onenand_read_pages_nolock(struct mtd_info *mtd,
+		struct onenand_page_req *reqs, int count)
+{
+	struct onenand_chip *this = mtd->priv;
+	struct onenand_page_req *req, *next;
+	int writesize = this->writesize;
+	int i;
+
+	/* Do first load to bufferRAM */
+	if (onenand_check_bufferram(mtd, reqs[0].addr))
+		reqs[0].ret = 0;
+	else {
+		this->command(mtd, ONENAND_CMD_READ, reqs[0].addr, writesize);
+		onenand_page_req_wait(mtd, &reqs[0]);
+	}
+
+	for (i = 0; i < count; i++) {
+		req = &reqs[i];
+		next = (i + 1 < count) ? &reqs[i + 1] : NULL;
+
+		/* Start the next load, then point back at this page */
+		if (next) {
+			this->command(mtd, ONENAND_CMD_READ, next->addr, writesize);
+			ONENAND_SET_PREV_BUFFERRAM(this);
+			if (ONENAND_IS_DDP(this))
+				this->write_word(onenand_bufferram_address(this,
+						onenand_block(this, req->addr)),
+					this->base + ONENAND_REG_START_ADDRESS2);
+		}
+
+		/* While load is going, read from last bufferRAM */
+		if (req->datbuf)
+			this->read_bufferram(mtd, ONENAND_DATARAM, req->datbuf,
+					0, writesize);
+		if (req->oobbuf)
+			onenand_transfer_auto_oob(mtd, req->oobbuf, 0,
+					this->ecclayout->oobavail);
+
+		if (!next)
+			break;
+
+		ONENAND_SET_NEXT_BUFFERRAM(this);
+		if (ONENAND_IS_DDP(this))
+			this->write_word(onenand_bufferram_address(this,
+					onenand_block(this, next->addr)),
+				this->base + ONENAND_REG_START_ADDRESS2);
+		cond_resched();
+		/* Now wait for load */
+		onenand_page_req_wait(mtd, next);
+	}
+}
+
+/**
+ * onenand_read_pages - [MTD Interface] Read a list of whole pages
+ * @param mtd		MTD device structure
+ * @param reqs		the pages, in the order to read them
+ * @param count		number of pages
+ *
+ * For callers that know which pages they need next, e.g. a filesystem
+ * reading the chunks of a file or the tags of a block: each page keeps the
+ * next one loading.  Chips with a single DataRAM read one page at a time.
+ * Each request gets its own result in ->ret; returns -EINVAL if a request
+ * is not a page of the device, otherwise 0.
+ */
+int onenand_read_pages(struct mtd_info *mtd, struct onenand_page_req *reqs,
+		int count)
+{
+	struct onenand_chip *this = mtd->priv;
+	struct onenand_page_req *req;
+	struct mtd_oob_ops ops;
+	int i, ret;
+
+	for (i = 0; i < count; i++)
+		if ((reqs[i].addr & (this->writesize - 1)) ||
+		    reqs[i].addr >= mtd->size)
+			return -EINVAL;
+
+	if (!count)
+		return 0;
+
+	onenand_get_device(mtd, FL_READING);
+
+	if (ONENAND_IS_SINGLE_DATARAM(this) || ONENAND_IS_2PLANE(this)) {
+		for (i = 0; i < count; i++) {
+			req = &reqs[i];
+			/*
+			 * Each read may leave the next page loading, with the
+			 * clock held on for it: wait for it before the next
+			 * command, as onenand_get_device() would.
+			 */
+			onenand_finish_prefetch(mtd);
+			memset(&ops, 0, sizeof(ops));
+			ops.mode = MTD_OOB_AUTO;
+			ops.datbuf = req->datbuf;
+			ops.oobbuf = req->oobbuf;
+			ops.ooblen = req->oobbuf ? this->ecclayout->oobavail : 0;
+			if (!req->datbuf) {
+				req->ret = onenand_read_oob_nolock(mtd, req->addr, &ops);
+				continue;
+			}
+			ops.len = this->writesize;
+			ret = ONENAND_IS_SINGLE_DATARAM(this) ?
+#ifdef ONENAND_SUPERLOAD
+				onenand_multiple_read_ops_nolock(mtd, req->addr, &ops) :
+#else
+				onenand_simple_read_ops_nolock(mtd, req->addr, &ops) :
+#endif
+				onenand_read_ops_nolock(mtd, req->addr, &ops);
+			req->ret = ret;
+		}
+	} else
+		onenand_read_pages_nolock(mtd, reqs, count);
+
+	onenand_release_device(mtd);
+
+	return 0;
+}
+EXPORT_SYMBOL(onenand_read_pages);
+
 /**
  * onenand_bbt_wait - [DEFAULT] wait until the command is done
  * @param mtd		MTD device structure
@@ -2178,6 +2429,7 @@ static int onenand_panic_write(struct mtd_info *mtd, loff_t to, size_t len,
 
 	/* Wait for any existing operation to clear */
 	onenand_panic_wait(mtd);
+	this->prefetch_addr = -1;
 
 	DEBUG(MTD_DEBUG_LEVEL3, "onenand_panic_write: to = 0x%08x, len = %i\n",
 	      (unsigned int) to, (int) len);
@@ -4065,6 +4317,8 @@ int onenand_scan(struct mtd_info *mtd, int maxchips)
 	}
 
 	this->state = FL_READY;
+	this->prefetch_addr = -1;
+	this->read_next = -1;
 	init_waitqueue_head(&this->wq);
 	spin_lock_init(&this->chip_lock);
 
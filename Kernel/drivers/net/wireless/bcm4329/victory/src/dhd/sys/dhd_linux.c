@@ -2045,6 +2045,8 @@ dhd_attach(osl_t *osh, struct dhd_bus *bus, uint bus_hdrlen)
 	dhd->early_suspend.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 20;
 	dhd->early_suspend.suspend = dhd_early_suspend;
 	dhd->early_suspend.resume = dhd_late_resume;
+	dhd->early_suspend.name = "dhd";
+	dhd->early_suspend.async = 1;
 	register_early_suspend(&dhd->early_suspend);
 #endif
 
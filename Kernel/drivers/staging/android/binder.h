@@ -37,6 +37,11 @@ enum {
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/*
+	 * Threads serving this node may run at the caller's SCHED_FIFO or
+	 * SCHED_RR priority; otherwise rt callers pass on their nice value.
+	 */
+	FLAT_BINDER_FLAG_INHERIT_RT = 0x800,
 };
 
 /*
@@ -112,6 +117,9 @@ enum transaction_flags {
 	TF_ROOT_OBJECT	= 0x04,	/* contents are the component's root object */
 	TF_STATUS_CODE	= 0x08,	/* contents are a 32-bit status code */
 	TF_ACCEPT_FDS	= 0x10,	/* allow replies with file descriptors */
+	TF_ZERO_COPY	= 0x20,	/* map page aligned data instead of copying */
+				/* it, the sender must not modify the data */
+				/* until the target frees the buffer */
 };
 
 struct binder_transaction_data {
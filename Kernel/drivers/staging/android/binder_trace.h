@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * enqueue, wakeup and dequeue of the same transaction id give the
+ * wakeup-to-run latency of a binder thread.
+ */
+TRACE_EVENT(binder_transaction_enqueue,
+	TP_PROTO(struct binder_transaction *t, struct binder_proc *proc,
+		 struct binder_thread *thread),
+	TP_ARGS(t, proc, thread),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(unsigned int, flags)
+		__field(unsigned int, sched_policy)
+		__field(int, prio)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->to_proc = proc->pid;
+		__entry->to_thread = thread ? thread->pid : 0;
+		__entry->flags = t->flags;
+		__entry->sched_policy = t->priority.sched_policy;
+		__entry->prio = t->priority.prio;
+	),
+	TP_printk("transaction=%d dest_proc=%d dest_thread=%d flags=0x%x "
+		  "pri=%u:%d",
+		  __entry->debug_id, __entry->to_proc, __entry->to_thread,
+		  __entry->flags, __entry->sched_policy, __entry->prio)
+);
+
+TRACE_EVENT(binder_wakeup,
+	TP_PROTO(struct binder_proc *proc, struct binder_thread *thread,
+		 int sync),
+	TP_ARGS(proc, thread, sync),
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, thread)
+		__field(int, sync)
+	),
+	TP_fast_assign(
+		__entry->proc = proc->pid;
+		__entry->thread = thread ? thread->pid : 0;
+		__entry->sync = sync;
+	),
+	TP_printk("proc=%d thread=%d sync=%d",
+		  __entry->proc, __entry->thread, __entry->sync)
+);
+
+TRACE_EVENT(binder_transaction_dequeue,
+	TP_PROTO(struct binder_transaction *t, struct binder_thread *thread,
+		 int from_proc_todo),
+	TP_ARGS(t, thread, from_proc_todo),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, proc)
+		__field(int, thread)
+		__field(int, from_proc_todo)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->proc = thread->proc->pid;
+		__entry->thread = thread->pid;
+		__entry->from_proc_todo = from_proc_todo;
+	),
+	TP_printk("transaction=%d proc=%d thread=%d from_proc_todo=%d",
+		  __entry->debug_id, __entry->proc, __entry->thread,
+		  __entry->from_proc_todo)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
@@ -19,11 +19,19 @@
 
 #include <linux/sched.h>
 #include <linux/module.h>
+#include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/lzo.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -82,36 +90,100 @@ static struct struct_marks_ver_mark marks_ver_mark = {
 	.second_start_addr=0x40000000
 };
 
-static char klog_buf[256];
+/*
+ * Writers copy the payload from user space into this buffer first, so they
+ * never fault or sleep while they own a part of the ring.
+ */
+static DEFINE_PER_CPU(unsigned char [LOGGER_ENTRY_MAX_PAYLOAD], logger_stage);
+
+/* limits for a log's memory, set with LOGGER_SET_LOG_BUF_SIZE or sysfs */
+#define LOGGER_MIN_SIZE		(64*1024)
+#define LOGGER_MAX_SIZE		(2*1024*1024)
+
+/* entries are compressed in chunks of this many plain bytes */
+#define LOGGER_CHUNK_SIZE	(16*1024)
+
+/*
+ * struct logger_chunk - LZO compressed entries that fell out of the ring
+ *
+ * Chunks are numbered in the order the entries were written, without
+ * gaps; 'seq' is shared with the chunk still being filled and the one
+ * being compressed.
+ */
+struct logger_chunk {
+	struct list_head	list;	/* entry in logger_log's archive */
+	unsigned long		seq;	/* sequence number */
+	size_t			len;	/* plain length */
+	size_t			clen;	/* compressed length */
+	unsigned char		data[0];
+};
 
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers do not sleep.  A writer reserves its entry by advancing w_reserve
+ * under 'lock', copies it into the ring without any lock and then commits it
+ * by advancing w_off, in the order the entries were reserved.  Readers only
+ * look at committed data, [head, w_off).  'lock' also protects head and the
+ * readers' offsets, and 'mutex' serializes the readers.
+ *
+ * With 'compress' set, the ring gets half of 'budget' and the entries it
+ * drops are collected in 'stage', compressed by compress_work and kept in
+ * 'archive' until the other half is used up.  Readers see them before the
+ * ring.  archive and archive_bytes are protected by archive_mutex, the
+ * staging buffers by 'lock'.  Locks nest as mutex, archive_mutex, lock.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	struct mutex		mutex;	/* mutex serializing readers */
+	spinlock_t		lock;	/* reservations, head and readers */
+	size_t			w_off;	/* end of committed entries */
+	size_t			w_reserve; /* next writer starts here */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	size_t			budget;	/* memory for ring and archive */
+	int			compress; /* keep dropped entries compressed */
+	struct mutex		archive_mutex;
+	struct list_head	archive; /* compressed chunks, oldest first */
+	size_t			archive_bytes;
+	size_t			archive_max;
+	unsigned char		*stage;	/* chunk being filled */
+	size_t			stage_len;
+	unsigned long		stage_seq;
+	unsigned char		*pending; /* chunk being compressed */
+	size_t			pending_len;
+	unsigned long		pending_seq;
+	unsigned char		*stage_buf[2];
+	unsigned char		*cbuf;	/* compression output */
+	void			*wrkmem; /* compression work memory */
+	struct work_struct	compress_work;
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. r_off is protected by log->lock, the rest by
+ * log->mutex.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	unsigned char		*buf;	/* entry being copied to user space */
+	int			archive; /* reading the archive, not the ring */
+	unsigned long		a_seq;	/* chunk being read from the archive */
+	size_t			a_off;	/* next entry in that chunk */
+	size_t			a_next;	/* entry after the one in 'buf' */
+	unsigned char		*chunk;	/* plain copy of a compressed chunk */
+	unsigned long		chunk_seq; /* chunk in 'chunk', if valid */
+	int			chunk_valid;
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -144,7 +216,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -163,15 +235,13 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log - copies exactly 'count' bytes from 'log' into reader->buf,
+ * from where they go to user space once log->lock has been dropped.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void do_read_log(struct logger_log *log, struct logger_reader *reader,
+			size_t count)
 {
 	size_t len;
 
@@ -181,22 +251,133 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log, whichever comes first.
 	 */
 	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	memcpy(reader->buf, log->buffer + reader->r_off, len);
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy(reader->buf + len, log->buffer, count - len);
 
 	reader->r_off = logger_offset(reader->r_off + count);
+}
 
+/*
+ * logger_committed - returns log->w_off; entries before it may be read once
+ * this returns.
+ */
+static inline size_t logger_committed(struct logger_log *log)
+{
+	size_t w_off = ACCESS_ONCE(log->w_off);
+
+	smp_rmb();
+	return w_off;
+}
+
+/*
+ * logger_archive_entry - copies the entry at reader->a_off of the plain
+ * chunk 'data' to reader->buf.  Returns its length, or zero if the reader
+ * is at the end of the chunk.
+ */
+static ssize_t logger_archive_entry(struct logger_reader *reader,
+				    const unsigned char *data, size_t len)
+{
+	const struct logger_entry *entry;
+	size_t count;
+
+	if (reader->a_off + sizeof(struct logger_entry) > len)
+		return 0;
+	entry = (const struct logger_entry *)(data + reader->a_off);
+	count = sizeof(struct logger_entry) + entry->len;
+	if (reader->a_off + count > len)
+		return 0;
+	memcpy(reader->buf, entry, count);
+	reader->a_next = reader->a_off + count;
 	return count;
 }
 
+/*
+ * logger_archive_peek - copies the next archived entry for 'reader' to
+ * reader->buf and returns its length.  Readers that were too slow skip
+ * to the oldest chunk still there.  At the end of the archive the reader
+ * continues in the ring, at the head, and zero is returned.
+ *
+ * Caller must hold log->mutex.
+ */
+static ssize_t logger_archive_peek(struct logger_log *log,
+				   struct logger_reader *reader)
+{
+	struct logger_chunk *chunk;
+	ssize_t ret = 0;
+
+	mutex_lock(&log->archive_mutex);
+again:
+	list_for_each_entry(chunk, &log->archive, list) {
+		size_t len = LOGGER_CHUNK_SIZE;
+
+		if (chunk->seq < reader->a_seq)
+			continue;
+		if (chunk->seq != reader->a_seq) {
+			reader->a_seq = chunk->seq;
+			reader->a_off = 0;
+		}
+		if (!reader->chunk_valid || reader->chunk_seq != chunk->seq) {
+			reader->chunk_valid = 0;
+			if (!reader->chunk) {
+				reader->chunk = kmalloc(LOGGER_CHUNK_SIZE,
+							GFP_KERNEL);
+				if (!reader->chunk) {
+					ret = -ENOMEM;
+					goto out;
+				}
+			}
+			if (lzo1x_decompress_safe(chunk->data, chunk->clen,
+						  reader->chunk, &len) ||
+			    len != chunk->len) {
+				reader->a_seq++;
+				goto again;
+			}
+			reader->chunk_seq = chunk->seq;
+			reader->chunk_valid = 1;
+		}
+		ret = logger_archive_entry(reader, reader->chunk, chunk->len);
+		if (ret)
+			goto out;
+		reader->a_seq++;
+		reader->a_off = 0;
+	}
+
+	spin_lock(&log->lock);
+	if (log->pending && log->pending_seq >= reader->a_seq) {
+		if (log->pending_seq != reader->a_seq) {
+			reader->a_seq = log->pending_seq;
+			reader->a_off = 0;
+		}
+		ret = logger_archive_entry(reader, log->pending,
+					   log->pending_len);
+		if (!ret) {
+			reader->a_seq++;
+			reader->a_off = 0;
+		}
+	}
+	if (!ret && log->compress && log->stage_seq >= reader->a_seq) {
+		if (log->stage_seq != reader->a_seq) {
+			reader->a_seq = log->stage_seq;
+			reader->a_off = 0;
+		}
+		ret = logger_archive_entry(reader, log->stage, log->stage_len);
+	}
+	if (!ret) {
+		reader->archive = 0;
+		reader->r_off = log->head;
+	}
+	spin_unlock(&log->lock);
+out:
+	mutex_unlock(&log->archive_mutex);
+	return ret;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -221,9 +402,10 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = !reader->archive &&
+			(logger_committed(log) == reader->r_off);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -246,8 +428,28 @@ start:
 
 	mutex_lock(&log->mutex);
 
+	if (reader->archive) {
+		ret = logger_archive_peek(log, reader);
+		if (ret < 0)
+			goto out;
+		if (ret) {
+			if (count < ret) {
+				ret = -EINVAL;
+				goto out;
+			}
+			reader->a_off = reader->a_next;
+			if (copy_to_user(buf, reader->buf, ret))
+				ret = -EFAULT;
+			goto out;
+		}
+	}
+
+	spin_lock(&log->lock);
+
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
+	if (unlikely(reader->archive ||
+		     logger_committed(log) == reader->r_off)) {
+		spin_unlock(&log->lock);
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
@@ -255,12 +457,17 @@ start:
 	/* get the size of the next entry */
 	ret = get_entry_len(log, reader->r_off);
 	if (count < ret) {
+		spin_unlock(&log->lock);
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	do_read_log(log, reader, ret);
+	spin_unlock(&log->lock);
+
+	if (copy_to_user(buf, reader->buf, ret))
+		ret = -EFAULT;
 
 out:
 	mutex_unlock(&log->mutex);
@@ -268,25 +475,6 @@ out:
 	return ret;
 }
 
-/*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
- */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
-{
-	size_t count = 0;
-
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
-}
-
 /*
  * clock_interval - is a < c < b in mod-space? Put another way, does the line
  * from a to b cross c?
@@ -305,85 +493,210 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * get_next_entry - return the offset of the first entry after 'off' that
+ * does not start in the interval (old, new].
  *
- * The caller needs to hold log->mutex.
+ * Caller must hold log->lock.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static size_t get_next_entry(struct logger_log *log, size_t off,
+			     size_t old, size_t new)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	do {
+		off = logger_offset(off + get_entry_len(log, off));
+	} while (clock_interval(old, new, off));
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	return off;
+}
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+/*
+ * logger_archive_stage - hands the filled staging chunk to compress_work and
+ * starts a new one.  If the previous chunk is still being compressed the
+ * staged entries are lost instead.
+ *
+ * The caller needs to hold log->lock.
+ */
+static void logger_archive_stage(struct logger_log *log)
+{
+	if (!log->pending) {
+		log->pending = log->stage;
+		log->pending_len = log->stage_len;
+		log->pending_seq = log->stage_seq;
+		log->stage = log->stage == log->stage_buf[0] ?
+			log->stage_buf[1] : log->stage_buf[0];
+		schedule_work(&log->compress_work);
+	}
+	log->stage_len = 0;
+	log->stage_seq++;
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * logger_archive_evicted - appends the entries in [from, to), which are about
+ * to be overwritten, to the staging chunk.  Their start in the archive is
+ * returned in '*seq' and '*off'.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void logger_archive_evicted(struct logger_log *log, size_t from,
+				   size_t to, unsigned long *seq, size_t *off)
 {
+	size_t count = logger_offset(to - from);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	if (log->stage_len + count > LOGGER_CHUNK_SIZE)
+		logger_archive_stage(log);
+	*seq = log->stage_seq;
+	*off = log->stage_len;
 
+	len = min(count, log->size - from);
+	memcpy(log->stage + log->stage_len, log->buffer + from, len);
 	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
+		memcpy(log->stage + log->stage_len + len, log->buffer,
+		       count - len);
+	log->stage_len += count;
+}
 
-	log->w_off = logger_offset(log->w_off + count);
+/*
+ * fix_up_readers - walk the list of all readers and "fix up" any who will be
+ * lapped by the 'len' bytes reserved at 'old'; also do the same for the
+ * default "start head".  We do this by "pulling forward" the readers and
+ * start head to the first entry after the new write head.  If the log keeps
+ * an archive, the dropped entries go there and lapped readers continue
+ * reading them from it.
+ *
+ * The caller needs to hold log->lock.
+ */
+static void fix_up_readers(struct logger_log *log, size_t old, size_t len)
+{
+	size_t new = logger_offset(old + len);
+	size_t head = log->head;
+	struct logger_reader *reader;
+	unsigned long a_seq = 0;
+	size_t a_off = 0;
+	int archived = 0;
+
+	if (clock_interval(old, new, head)) {
+		log->head = get_next_entry(log, head, old, new);
+		if (log->compress) {
+			logger_archive_evicted(log, head, log->head,
+					       &a_seq, &a_off);
+			archived = 1;
+		}
+	}
 
+	list_for_each_entry(reader, &log->readers, list) {
+		if (reader->archive ||
+		    !clock_interval(old, new, reader->r_off))
+			continue;
+		if (archived) {
+			reader->archive = 1;
+			reader->a_seq = a_seq;
+			reader->a_off = a_off +
+				logger_offset(reader->r_off - head);
+		} else
+			reader->r_off = get_next_entry(log, reader->r_off,
+						       old, new);
+	}
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * logger_reserve - reserves 'len' bytes of the ring for an entry and returns
+ * their offset.  Readers are pulled forward off the reserved space here, so
+ * its old contents are dead once this returns.
  *
- * Returns 'count' on success, negative error code on failure.
+ * The caller must have preemption disabled until logger_commit().
+ */
+static size_t logger_reserve(struct logger_log *log, size_t len)
+{
+	size_t off;
+
+	spin_lock(&log->lock);
+
+	/*
+	 * Entries between w_off and w_reserve are still being copied in.  Do
+	 * not overwrite them, nor the header right after the new entry, which
+	 * fix_up_readers() may have to read.
+	 */
+	while (logger_offset(log->w_reserve - logger_committed(log)) + len +
+	       sizeof(struct logger_entry) > log->size)
+		cpu_relax();
+
+	off = log->w_reserve;
+	fix_up_readers(log, off, len);
+	log->w_reserve = logger_offset(off + len);
+
+	spin_unlock(&log->lock);
+
+	return off;
+}
+
+/*
+ * logger_commit - makes the 'len' bytes reserved at 'off' visible to readers
+ * once every entry reserved before them has been committed.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static void logger_commit(struct logger_log *log, size_t off, size_t len)
+{
+	while (ACCESS_ONCE(log->w_off) != off)
+		cpu_relax();
+	smp_wmb();
+	log->w_off = logger_offset(off + len);
+}
+
+/*
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at 'off', which
+ * the caller has reserved with logger_reserve().
+ */
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+		memcpy(log->buffer, buf + len, count - len);
+}
 
-#if 1
-/* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
-	memset(klog_buf,0,255);
+/*
+ * copy_payload_from_user - gathers 'count' bytes of payload from 'iov' into
+ * 'buf'.  With 'atomic' set this must not fault, and fails with -EFAULT if
+ * a page is not present.  '*last' is set to the start of the last segment.
+ *
+ * Returns 'count' on success, negative error code on failure.
+ */
+static ssize_t copy_payload_from_user(unsigned char *buf,
+				      const struct iovec *iov,
+				      unsigned long nr_segs, size_t count,
+				      size_t *last, int atomic)
+{
+	size_t done = 0;
 
-	if(strncmp(log->buffer  + log->w_off,  "!@", 2) == 0) {
-		if (count < 255)
-			memcpy(klog_buf,log->buffer  + log->w_off, count);			
-		else
-			memcpy(klog_buf,log->buffer  + log->w_off, 255);			
+	*last = 0;
+	while (nr_segs-- > 0 && done < count) {
+		size_t len;
+		unsigned long left;
 
-		klog_buf[255]=0;
-}
-/* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
-#endif	
+		/* figure out how much of this vector we can keep */
+		len = min_t(size_t, iov->iov_len, count - done);
+		if (atomic) {
+			if (!access_ok(VERIFY_READ, iov->iov_base, len))
+				return -EFAULT;
+			pagefault_disable();
+			left = __copy_from_user_inatomic(buf + done,
+							 iov->iov_base, len);
+			pagefault_enable();
+		} else
+			left = copy_from_user(buf + done, iov->iov_base, len);
+		if (left)
+			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+		if (len)
+			*last = done;
+		done += len;
+		iov++;
+	}
 
-	return count;
+	return done;
 }
 
 /*
@@ -395,10 +708,11 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
+	unsigned char *payload, *slow = NULL;
+	size_t off, len, last;
+	ssize_t ret;
 
 	now = current_kernel_time();
 
@@ -412,51 +726,50 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Gather the payload on this cpu without faulting; if a page has to
+	 * be faulted in, gather it in a private buffer instead.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+	preempt_disable();
+	payload = __get_cpu_var(logger_stage);
+	ret = copy_payload_from_user(payload, iov, nr_segs, header.len,
+				     &last, 1);
+	if (unlikely(ret < 0)) {
+		preempt_enable();
+		slow = kmalloc(header.len, GFP_KERNEL);
+		if (!slow)
+			return -ENOMEM;
+		ret = copy_payload_from_user(slow, iov, nr_segs, header.len,
+					     &last, 0);
+		if (ret < 0) {
+			kfree(slow);
+			return ret;
 		}
-
-		iov++;
-		ret += nr;
+		payload = slow;
+		preempt_disable();
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	len = sizeof(struct logger_entry) + header.len;
+	off = logger_reserve(log, len);
+	do_write_log(log, off, &header, sizeof(struct logger_entry));
+	do_write_log(log, logger_offset(off + sizeof(struct logger_entry)),
+		     payload, header.len);
+	logger_commit(log, off, len);
 
 #if 1
 /* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
-    if(strncmp(klog_buf, "!@", 2) == 0)
-	{
-		printk("%s\n",klog_buf);
-	}		
+	if (header.len - last >= 2 && strncmp(payload + last, "!@", 2) == 0)
+		printk("%.*s\n", (int)min_t(size_t, header.len - last, 255),
+		       payload + last);
 /* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
-#endif	
-	
+#endif
+
+	preempt_enable();
+	kfree(slow);
+
+	/* wake up any blocked readers */
+	wake_up_interruptible(&log->wq);
+
 	return ret;
 }
 
@@ -486,14 +799,25 @@ static int logger_open(struct inode *inode, struct file *file)
 		reader = kmalloc(sizeof(struct logger_reader), GFP_KERNEL);
 		if (!reader)
 			return -ENOMEM;
+		reader->buf = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->buf) {
+			kfree(reader);
+			return -ENOMEM;
+		}
 
 		reader->log = log;
 		INIT_LIST_HEAD(&reader->list);
+		reader->chunk = NULL;
+		reader->chunk_valid = 0;
+		reader->a_seq = 0;
+		reader->a_off = 0;
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
+		/* start with the oldest archived entry */
+		reader->archive = log->compress;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -511,7 +835,13 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
+		kfree(reader->chunk);
+		kfree(reader->buf);
 		kfree(reader);
 	}
 
@@ -541,21 +871,332 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (reader->archive || logger_committed(log) != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+static void logger_update_marks(void);
+
+static unsigned char *logger_alloc_buffer(size_t size)
+{
+	return (unsigned char *)__get_free_pages(GFP_KERNEL | __GFP_NOWARN,
+						 get_order(size));
+}
+
+static void logger_free_buffer(unsigned char *buffer, size_t size)
+{
+	free_pages((unsigned long)buffer, get_order(size));
+}
+
+/*
+ * logger_archive_trim - drops the oldest chunks until the archive fits in
+ * archive_max again.
+ *
+ * Caller must hold log->archive_mutex.
+ */
+static void logger_archive_trim(struct logger_log *log)
+{
+	struct logger_chunk *chunk;
+
+	while (log->archive_bytes > log->archive_max &&
+	       !list_empty(&log->archive)) {
+		chunk = list_first_entry(&log->archive, struct logger_chunk,
+					 list);
+		list_del(&chunk->list);
+		log->archive_bytes -= chunk->clen;
+		kfree(chunk);
+	}
+}
+
+/*
+ * logger_compress_work - compresses log->pending into a new archive chunk.
+ * If that fails the entries are lost, like entries dropped from the ring.
+ */
+static void logger_compress_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      compress_work);
+	struct logger_chunk *chunk = NULL;
+	unsigned char *src;
+	unsigned long seq;
+	size_t len, clen;
+
+	/* the pending chunk stays put while we hold archive_mutex */
+	mutex_lock(&log->archive_mutex);
+	spin_lock(&log->lock);
+	src = log->pending;
+	len = log->pending_len;
+	seq = log->pending_seq;
+	spin_unlock(&log->lock);
+	if (!src)
+		goto out;
+
+	if (lzo1x_1_compress(src, len, log->cbuf, &clen, log->wrkmem) ==
+	    LZO_E_OK)
+		chunk = kmalloc(sizeof(*chunk) + clen, GFP_KERNEL);
+	if (chunk) {
+		chunk->seq = seq;
+		chunk->len = len;
+		chunk->clen = clen;
+		memcpy(chunk->data, log->cbuf, clen);
+		list_add_tail(&chunk->list, &log->archive);
+		log->archive_bytes += clen;
+		logger_archive_trim(log);
+	}
+
+	spin_lock(&log->lock);
+	log->pending = NULL;
+	spin_unlock(&log->lock);
+out:
+	mutex_unlock(&log->archive_mutex);
+}
+
+/*
+ * logger_resize_locked - moves the log into 'buffer' of 'size' bytes,
+ * keeping the newest entries that fit, and returns the old buffer.  Readers
+ * keep their place unless their entries were dropped.  If the log keeps an
+ * archive, the dropped entries go there and their readers continue reading
+ * them from it, as in fix_up_readers().
+ *
+ * The caller needs to hold log->lock and there must be no entries in
+ * flight.
+ */
+static unsigned char *logger_resize_locked(struct logger_log *log,
+					   unsigned char *buffer, size_t size)
+{
+	unsigned char *old = log->buffer;
+	struct logger_reader *reader;
+	size_t start = log->head;
+	size_t skip, used, len;
+
+	while (logger_offset(log->w_off - start) >= size)
+		start = logger_offset(start + get_entry_len(log, start));
+	skip = logger_offset(start - log->head);
+	used = logger_offset(log->w_off - start);
+
+	/* one entry at a time, as a shrink may drop more than a chunk */
+	if (log->compress) {
+		size_t off = log->head, next;
+		unsigned long a_seq;
+		size_t a_off;
+
+		while (off != start) {
+			next = logger_offset(off + get_entry_len(log, off));
+			logger_archive_evicted(log, off, next, &a_seq, &a_off);
+			list_for_each_entry(reader, &log->readers, list) {
+				if (reader->archive || reader->r_off != off)
+					continue;
+				reader->archive = 1;
+				reader->a_seq = a_seq;
+				reader->a_off = a_off;
+			}
+			off = next;
+		}
+	}
+
+	len = min(used, log->size - start);
+	memcpy(buffer, old + start, len);
+	if (used != len)
+		memcpy(buffer + len, old, used - len);
+
+	list_for_each_entry(reader, &log->readers, list) {
+		size_t d = logger_offset(reader->r_off - log->head);
+
+		if (!reader->archive)
+			reader->r_off = d >= skip ? d - skip : 0;
+	}
+
+	log->buffer = buffer;
+	log->size = size;
+	log->head = 0;
+	log->w_off = used;
+	log->w_reserve = used;
+	return old;
+}
+
+/*
+ * logger_configure - gives 'log' 'budget' bytes of memory, all for the ring,
+ * or with 'compress' half for the ring and half for compressed history.
+ *
+ * Caller must hold log->mutex.
+ */
+static int logger_configure(struct logger_log *log, unsigned long budget,
+			    int compress)
+{
+	size_t size = compress ? budget / 2 : budget;
+	unsigned char *buffer = NULL, *old_buffer = NULL;
+	size_t old_size = log->size;
+	unsigned char *stage_buf[2] = { NULL, NULL };
+	unsigned char *cbuf = NULL;
+	void *wrkmem = NULL;
+	struct logger_chunk *chunk, *tmp;
+	LIST_HEAD(dropped);
+	int ret = 0;
+
+	if (budget < LOGGER_MIN_SIZE || budget > LOGGER_MAX_SIZE ||
+	    !is_power_of_2(budget))
+		return -EINVAL;
+	compress = !!compress;
+
+	if (size != log->size) {
+		buffer = logger_alloc_buffer(size);
+		if (!buffer)
+			return -ENOMEM;
+	}
+
+	if (compress && !log->compress) {
+		stage_buf[0] = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+		stage_buf[1] = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+		cbuf = kmalloc(lzo1x_worst_compress(LOGGER_CHUNK_SIZE),
+			       GFP_KERNEL);
+		wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+		if (!stage_buf[0] || !stage_buf[1] || !cbuf || !wrkmem) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	} else if (!compress && log->compress) {
+		/* no new chunks after this, and none being compressed */
+		spin_lock(&log->lock);
+		log->compress = 0;
+		spin_unlock(&log->lock);
+		cancel_work_sync(&log->compress_work);
+
+		mutex_lock(&log->archive_mutex);
+		list_splice_init(&log->archive, &dropped);
+		log->archive_bytes = 0;
+		spin_lock(&log->lock);
+		log->pending = NULL;
+		log->stage = NULL;
+		log->stage_len = 0;
+		log->stage_seq++;
+		spin_unlock(&log->lock);
+		mutex_unlock(&log->archive_mutex);
+
+		stage_buf[0] = log->stage_buf[0];
+		stage_buf[1] = log->stage_buf[1];
+		cbuf = log->cbuf;
+		wrkmem = log->wrkmem;
+		log->stage_buf[0] = log->stage_buf[1] = NULL;
+		log->cbuf = NULL;
+		log->wrkmem = NULL;
+	}
+
+	spin_lock(&log->lock);
+	if (buffer) {
+		/* writers between reserve and commit do not sleep */
+		while (log->w_reserve != logger_committed(log))
+			cpu_relax();
+		old_buffer = logger_resize_locked(log, buffer, size);
+		buffer = NULL;
+	}
+	if (compress && !log->compress) {
+		log->stage_buf[0] = stage_buf[0];
+		log->stage_buf[1] = stage_buf[1];
+		log->stage = stage_buf[0];
+		log->stage_len = 0;
+		log->pending = NULL;
+		log->cbuf = cbuf;
+		log->wrkmem = wrkmem;
+		log->compress = 1;
+		stage_buf[0] = stage_buf[1] = cbuf = wrkmem = NULL;
+	}
+	spin_unlock(&log->lock);
+
+	mutex_lock(&log->archive_mutex);
+	log->budget = budget;
+	log->archive_max = compress ? budget - size : 0;
+	logger_archive_trim(log);
+	mutex_unlock(&log->archive_mutex);
+
+	logger_update_marks();
+out:
+	if (buffer)
+		logger_free_buffer(buffer, size);
+	if (old_buffer)
+		logger_free_buffer(old_buffer, old_size);
+	kfree(stage_buf[0]);
+	kfree(stage_buf[1]);
+	kfree(cbuf);
+	vfree(wrkmem);
+	list_for_each_entry_safe(chunk, tmp, &dropped, list)
+		kfree(chunk);
+	return ret;
+}
+
+/*
+ * logger_flush - empties the log, including its archive.
+ */
+static void logger_flush(struct logger_log *log)
+{
+	struct logger_reader *reader;
+	struct logger_chunk *chunk, *tmp;
+	LIST_HEAD(dropped);
+	size_t w_off;
+
+	mutex_lock(&log->mutex);
+	mutex_lock(&log->archive_mutex);
+	list_splice_init(&log->archive, &dropped);
+	log->archive_bytes = 0;
+
+	spin_lock(&log->lock);
+	w_off = logger_committed(log);
+	list_for_each_entry(reader, &log->readers, list) {
+		reader->r_off = w_off;
+		reader->archive = 0;
+	}
+	log->head = w_off;
+	log->pending = NULL;
+	log->stage_len = 0;
+	log->stage_seq++;
+	spin_unlock(&log->lock);
+
+	mutex_unlock(&log->archive_mutex);
+	mutex_unlock(&log->mutex);
+
+	list_for_each_entry_safe(chunk, tmp, &dropped, list)
+		kfree(chunk);
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	size_t w_off, r_off;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	switch (cmd) {
+	case LOGGER_FLUSH_LOG:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		logger_flush(log);
+		return 0;
+	case LOGGER_SET_LOG_BUF_SIZE:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		mutex_lock(&log->mutex);
+		ret = logger_configure(log, arg, log->compress);
+		mutex_unlock(&log->mutex);
+		return ret;
+	case LOGGER_GET_NEXT_ENTRY_LEN:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		reader = file->private_data;
+		mutex_lock(&log->mutex);
+		ret = reader->archive ? logger_archive_peek(log, reader) : 0;
+		mutex_unlock(&log->mutex);
+		if (ret)
+			return ret;
+		break;
+	}
+
+	spin_lock(&log->lock);
+	w_off = logger_committed(log);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -567,10 +1208,11 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		r_off = reader->archive ? log->head : reader->r_off;
+		if (w_off >= r_off)
+			ret = w_off - r_off;
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = (log->size - r_off) + w_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -578,24 +1220,15 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
+		r_off = reader->archive ? log->head : reader->r_off;
+		if (w_off != r_off)
+			ret = get_entry_len(log, r_off);
 		else
 			ret = 0;
 		break;
-	case LOGGER_FLUSH_LOG:
-		if (!(file->f_mode & FMODE_WRITE)) {
-			ret = -EBADF;
-			break;
-		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
-		ret = 0;
-		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -612,14 +1245,13 @@ static const struct file_operations logger_fops = {
 };
 
 /*
- * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * Defines a log structure with name 'NAME' and an initial size of 'SIZE'
+ * bytes, which must be a power of two between LOGGER_MIN_SIZE and
+ * LOGGER_MAX_SIZE.  The buffer is allocated by init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
+	.buffer = NULL, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -629,9 +1261,16 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.w_reserve = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.budget = SIZE, \
+	.archive_mutex = __MUTEX_INITIALIZER(VAR .archive_mutex), \
+	.archive = LIST_HEAD_INIT(VAR .archive), \
+	.compress_work = __WORK_INITIALIZER(VAR .compress_work, \
+					    logger_compress_work), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main,   LOGGER_LOG_MAIN,   512*1024)
@@ -652,17 +1291,104 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+/*
+ * GetLog finds the log buffers in a RAM dump through plat_log_mark, so it
+ * has to follow them when they are reallocated.
+ */
+static void logger_update_marks(void)
+{
+	plat_log_mark.p_main   = log_main.buffer;
+	plat_log_mark.p_radio  = log_radio.buffer;
+	plat_log_mark.p_events = log_events.buffer;
+	plat_log_mark.p_system = log_system.buffer;
+}
+
+static inline struct logger_log *dev_get_log(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct logger_log, misc);
+}
+
+static ssize_t buffer_size_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%zu\n", dev_get_log(dev)->budget);
+}
+
+static ssize_t buffer_size_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t size)
+{
+	struct logger_log *log = dev_get_log(dev);
+	unsigned long value;
+	int ret;
+
+	if (strict_strtoul(buf, 0, &value))
+		return -EINVAL;
+
+	mutex_lock(&log->mutex);
+	ret = logger_configure(log, value, log->compress);
+	mutex_unlock(&log->mutex);
+
+	return ret ? ret : size;
+}
+
+static ssize_t compress_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", dev_get_log(dev)->compress);
+}
+
+static ssize_t compress_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t size)
+{
+	struct logger_log *log = dev_get_log(dev);
+	unsigned long value;
+	int ret;
+
+	if (strict_strtoul(buf, 0, &value))
+		return -EINVAL;
+
+	mutex_lock(&log->mutex);
+	ret = logger_configure(log, log->budget, value);
+	mutex_unlock(&log->mutex);
+
+	return ret ? ret : size;
+}
+
+static DEVICE_ATTR(buffer_size, S_IRUGO | S_IWUSR, buffer_size_show,
+		   buffer_size_store);
+static DEVICE_ATTR(compress, S_IRUGO | S_IWUSR, compress_show,
+		   compress_store);
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->buffer = logger_alloc_buffer(log->size);
+	if (!log->buffer) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return -ENOMEM;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		logger_free_buffer(log->buffer, log->size);
+		log->buffer = NULL;
 		return ret;
 	}
 
+	/* the log works without them, they only allow to reconfigure it */
+	if (device_create_file(log->misc.this_device, &dev_attr_buffer_size) ||
+	    device_create_file(log->misc.this_device, &dev_attr_compress))
+		printk(KERN_WARNING "logger: failed to create sysfs "
+		       "attributes for log '%s'\n", log->misc.name);
+
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 	       (unsigned long) log->size >> 10, log->misc.name);
 
@@ -673,14 +1399,6 @@ static int __init logger_init(void)
 {
 	int ret;
 
-	/*
-	 *  Mark for GetLog (tkhwang)
-	 */
-	plat_log_mark.p_main   = _buf_log_main;
-	plat_log_mark.p_radio  = _buf_log_radio;
-	plat_log_mark.p_events = _buf_log_events;
-	plat_log_mark.p_system = _buf_log_system;
-
 	marks_ver_mark.log_mark_version = 1; 
 	
 	ret = init_log(&log_main);
@@ -700,6 +1418,11 @@ static int __init logger_init(void)
 		goto out;
 
 out:
+	/*
+	 *  Mark for GetLog (tkhwang)
+	 */
+	logger_update_marks();
+
 	return ret;
 }
 device_initcall(logger_init);
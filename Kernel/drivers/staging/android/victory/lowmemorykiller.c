@@ -16,6 +16,16 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept in per oom_adj buckets that follow fork, exit and
+ * oom_adj writes, so picking a victim only looks at the processes of the
+ * highest oom_adj that may be killed instead of at every process.
+ *
+ * /dev/lowmem_pressure lets user-space trim its caches before a kill
+ * happens. Reading it returns the lowest oom_adj that would be killed if
+ * free memory dropped by another pressure_margin percent, or
+ * OOM_ADJUST_MAX + 1 if none; poll() reports when that value changes,
+ * after which it is read again from offset 0.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +45,15 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -51,10 +70,33 @@ static size_t lowmem_minfree[6] = {
 	16 * 1024,	/* 64MB */
 };
 static int lowmem_minfree_size = 4;
+static uint32_t lowmem_pressure_margin = 25;	/* percent of minfree */
 
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+#define LOWMEM_BUCKETS		(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define lowmem_bucket(adj)	(&lowmem_buckets[(adj) - OOM_DISABLE])
+
+/*
+ * Processes by oom_adj, linked through task->lowmem_node.  Only thread
+ * group leaders that are not exiting are on a list.  lowmem_lock also
+ * protects the statistics and the pressure level below.
+ */
+static struct list_head lowmem_buckets[LOWMEM_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_lock);
+
+static struct {
+	unsigned long selections;	/* victim searches */
+	u64 select_ns;			/* time spent in them */
+	u64 select_ns_max;
+	unsigned long kills[LOWMEM_BUCKETS];
+} lowmem_stats;
+
+static int lowmem_pressure_adj = OOM_ADJUST_MAX + 1;
+static unsigned long lowmem_pressure_seq;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -80,18 +122,127 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-//static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
-static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+/*
+ * lowmem_task_update - puts a thread group leader into the bucket of its
+ * current oom_adj.  Exiting tasks and kernel threads stay off the buckets.
+ *
+ * Caller must hold lowmem_lock.  An exiting task cannot release its signal
+ * struct before its OOM_ADJ_TASK_EXIT notification took the lock.
+ */
+static void lowmem_task_update(struct task_struct *p)
+{
+	int adj;
+
+	if (p->flags & (PF_EXITING | PF_KTHREAD))
+		return;
+
+	adj = clamp_t(int, p->signal->oom_adj, OOM_DISABLE, OOM_ADJUST_MAX);
+	list_move_tail(&p->lowmem_node, lowmem_bucket(adj));
+}
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val,
+		    void *data)
+{
+	struct task_struct *task = data;
+
+	spin_lock(&lowmem_lock);
+	switch (val) {
+	case OOM_ADJ_TASK_FORK:
+	case OOM_ADJ_TASK_LEADER:
+		if (thread_group_leader(task))
+			lowmem_task_update(task);
+		break;
+	case OOM_ADJ_CHANGED:
+		lowmem_task_update(task->group_leader);
+		break;
+	case OOM_ADJ_TASK_EXIT:
+		list_del_init(&task->lowmem_node);
+		break;
+	}
+	spin_unlock(&lowmem_lock);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+/*
+ * lowmem_select - picks the largest process of the highest non-empty bucket
+ * at or above 'min_adj' and returns it with a reference held, or NULL.
+ *
+ * Caller must hold lowmem_lock.
+ */
+static struct task_struct *
+lowmem_select(int min_adj, int *tasksize_out, int *oom_adj_out)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
-	int rem = 0;
+	int selected_tasksize = 0;
 	int tasksize;
+	int adj;
+
+	for (adj = OOM_ADJUST_MAX; adj >= max(min_adj, OOM_DISABLE); adj--) {
+		list_for_each_entry(p, lowmem_bucket(adj), lowmem_node) {
+			struct mm_struct *mm;
+
+			task_lock(p);
+			mm = p->mm;
+			if (!mm) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			if (tasksize <= selected_tasksize)
+				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, adj, tasksize);
+		}
+		if (selected)
+			break;
+	}
+
+	if (selected) {
+		get_task_struct(selected);
+		*tasksize_out = selected_tasksize;
+		*oom_adj_out = adj;
+	}
+	return selected;
+}
+
+/*
+ * lowmem_set_pressure - publishes a new pressure level and wakes up the
+ * pollers of /dev/lowmem_pressure if it changed.
+ */
+static void lowmem_set_pressure(int adj)
+{
+	if (adj == ACCESS_ONCE(lowmem_pressure_adj))
+		return;
+
+	spin_lock(&lowmem_lock);
+	lowmem_pressure_adj = adj;
+	lowmem_pressure_seq++;
+	spin_unlock(&lowmem_lock);
+	wake_up_interruptible(&lowmem_pressure_wait);
+}
+
+static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct task_struct *selected;
+	int rem = 0;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
+	int pressure_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
-	int selected_oom_adj;
+	int selected_oom_adj = 0;
 	int array_size = ARRAY_SIZE(lowmem_adj);
+	ktime_t start;
+	u64 ns;
 	int other_free = global_page_state(NR_FREE_PAGES);
 //	int other_file = global_page_state(NR_FILE_PAGES);
 	int other_file = global_page_state(NR_INACTIVE_FILE) + global_page_state(NR_ACTIVE_FILE);
@@ -114,6 +265,12 @@ if (lowmem_deathpending &&
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
 	for (i = 0; i < array_size; i++) {
+		size_t warn = lowmem_minfree[i] *
+			(100 + lowmem_pressure_margin) / 100;
+
+		if (pressure_adj == OOM_ADJUST_MAX + 1 &&
+		    other_free < warn && other_file < warn)
+			pressure_adj = lowmem_adj[i];
 //#if 1
 //		if ((other_free + other_file) < lowmem_minfree[i])
 //#else
@@ -129,6 +286,8 @@ if (lowmem_deathpending &&
 //	if (min_adj == OOM_ADJUST_MAX + 1)
 //		return 0;
 
+	lowmem_set_pressure(pressure_adj);
+
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
@@ -146,43 +305,19 @@ if (lowmem_deathpending &&
 		return rem;
 	}
 
-	selected_oom_adj = min_adj;
+	start = ktime_get();
+	spin_lock(&lowmem_lock);
+	selected = lowmem_select(min_adj, &selected_tasksize,
+				 &selected_oom_adj);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	lowmem_stats.selections++;
+	lowmem_stats.select_ns += ns;
+	if (ns > lowmem_stats.select_ns_max)
+		lowmem_stats.select_ns_max = ns;
+	if (selected)
+		lowmem_stats.kills[selected_oom_adj - OOM_DISABLE]++;
+	spin_unlock(&lowmem_lock);
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
@@ -191,13 +326,13 @@ if (lowmem_deathpending &&
 //		task_free_register(&task_nb);
 		lowmem_deathpending_timeout = jiffies + HZ;
 		force_sig(SIGKILL, selected);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
 //	else
 //		rem= -1;
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -206,8 +341,127 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	file->private_data = (void *)(ACCESS_ONCE(lowmem_pressure_seq) - 1);
+	return 0;
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	char tmp[16];
+	int len;
+
+	spin_lock(&lowmem_lock);
+	file->private_data = (void *)lowmem_pressure_seq;
+	len = snprintf(tmp, sizeof(tmp), "%d\n", lowmem_pressure_adj);
+	spin_unlock(&lowmem_lock);
+
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_pressure_wait, wait);
+
+	if ((unsigned long)file->private_data !=
+	    ACCESS_ONCE(lowmem_pressure_seq))
+		return POLLIN | POLLRDNORM | POLLPRI;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.read = lowmem_pressure_read,
+	.poll = lowmem_pressure_poll,
+	.llseek = default_llseek,
+};
+
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
+static int lowmem_stats_show(struct seq_file *m, void *unused)
+{
+	unsigned long selections, kills = 0;
+	u64 select_ns, select_ns_max;
+	unsigned long per_adj[LOWMEM_BUCKETS];
+	int i;
+
+	spin_lock(&lowmem_lock);
+	selections = lowmem_stats.selections;
+	select_ns = lowmem_stats.select_ns;
+	select_ns_max = lowmem_stats.select_ns_max;
+	memcpy(per_adj, lowmem_stats.kills, sizeof(per_adj));
+	spin_unlock(&lowmem_lock);
+
+	if (selections)
+		do_div(select_ns, selections);
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		kills += per_adj[i];
+
+	seq_printf(m, "selections: %lu\n", selections);
+	seq_printf(m, "select_ns_avg: %llu\n", (unsigned long long)select_ns);
+	seq_printf(m, "select_ns_max: %llu\n",
+		   (unsigned long long)select_ns_max);
+	seq_printf(m, "kills: %lu\n", kills);
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		if (per_adj[i])
+			seq_printf(m, "kills_adj %d: %lu\n", i + OOM_DISABLE,
+				   per_adj[i]);
+	return 0;
+}
+
+static int lowmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lowmem_stats_show, NULL);
+}
+
+static const struct file_operations lowmem_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *lowmem_debugfs_dir;
+
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
+	/*
+	 * Register first, so that processes forked or exiting while we
+	 * walk the existing ones are not missed.
+	 */
+	register_oom_adj_notifier(&oom_adj_nb);
+	read_lock(&tasklist_lock);
+	spin_lock(&lowmem_lock);
+	for_each_process(p)
+		lowmem_task_update(p);
+	spin_unlock(&lowmem_lock);
+	read_unlock(&tasklist_lock);
+
+	if (misc_register(&lowmem_pressure_misc))
+		printk(KERN_ERR "lowmemorykiller: failed to register "
+		       "pressure device\n");
+
+	lowmem_debugfs_dir = debugfs_create_dir("lowmemorykiller", NULL);
+	if (IS_ERR(lowmem_debugfs_dir))
+		lowmem_debugfs_dir = NULL;
+	if (lowmem_debugfs_dir)
+		debugfs_create_file("stats", S_IRUGO, lowmem_debugfs_dir,
+				    NULL, &lowmem_stats_fops);
+
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
@@ -217,6 +471,9 @@ static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
+	debugfs_remove_recursive(lowmem_debugfs_dir);
+	misc_deregister(&lowmem_pressure_misc);
+	unregister_oom_adj_notifier(&oom_adj_nb);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -225,6 +482,8 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_margin, lowmem_pressure_margin, uint,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
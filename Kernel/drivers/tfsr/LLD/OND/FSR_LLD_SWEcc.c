@@ -62,6 +62,57 @@
 /*****************************************************************************/
 #undef  LOOP_FOR_ECC
 
+/*****************************************************************************/
+/* Local #defines                                                            */
+/*****************************************************************************/
+/* Parity of the low byte of n */
+#define SWECC_PARITY(n)             ((gnRowEccTbl[(n) & 0xFF] >> 6) & 0x01)
+
+/*****************************************************************************/
+/* Global variable definitions                                               */
+/*****************************************************************************/
+
+/* 
+ * gnRowEccTbl gives for every byte value the row parities of the ECC 
+ * in bits 5..0 (P4 P4' P2 P2' P1 P1', as they are laid out in S_ECC 0),
+ * with P' already set for the parity of the byte, and that parity in bit 6
+ */
+PRIVATE const UINT8     gnRowEccTbl[256] =
+                            {
+                              0x00, 0x55, 0x56, 0x03, 0x59, 0x0C, 0x0F, 0x5A,
+                              0x5A, 0x0F, 0x0C, 0x59, 0x03, 0x56, 0x55, 0x00,
+                              0x65, 0x30, 0x33, 0x66, 0x3C, 0x69, 0x6A, 0x3F,
+                              0x3F, 0x6A, 0x69, 0x3C, 0x66, 0x33, 0x30, 0x65,
+                              0x66, 0x33, 0x30, 0x65, 0x3F, 0x6A, 0x69, 0x3C,
+                              0x3C, 0x69, 0x6A, 0x3F, 0x65, 0x30, 0x33, 0x66,
+                              0x03, 0x56, 0x55, 0x00, 0x5A, 0x0F, 0x0C, 0x59,
+                              0x59, 0x0C, 0x0F, 0x5A, 0x00, 0x55, 0x56, 0x03,
+                              0x69, 0x3C, 0x3F, 0x6A, 0x30, 0x65, 0x66, 0x33,
+                              0x33, 0x66, 0x65, 0x30, 0x6A, 0x3F, 0x3C, 0x69,
+                              0x0C, 0x59, 0x5A, 0x0F, 0x55, 0x00, 0x03, 0x56,
+                              0x56, 0x03, 0x00, 0x55, 0x0F, 0x5A, 0x59, 0x0C,
+                              0x0F, 0x5A, 0x59, 0x0C, 0x56, 0x03, 0x00, 0x55,
+                              0x55, 0x00, 0x03, 0x56, 0x0C, 0x59, 0x5A, 0x0F,
+                              0x6A, 0x3F, 0x3C, 0x69, 0x33, 0x66, 0x65, 0x30,
+                              0x30, 0x65, 0x66, 0x33, 0x69, 0x3C, 0x3F, 0x6A,
+                              0x6A, 0x3F, 0x3C, 0x69, 0x33, 0x66, 0x65, 0x30,
+                              0x30, 0x65, 0x66, 0x33, 0x69, 0x3C, 0x3F, 0x6A,
+                              0x0F, 0x5A, 0x59, 0x0C, 0x56, 0x03, 0x00, 0x55,
+                              0x55, 0x00, 0x03, 0x56, 0x0C, 0x59, 0x5A, 0x0F,
+                              0x0C, 0x59, 0x5A, 0x0F, 0x55, 0x00, 0x03, 0x56,
+                              0x56, 0x03, 0x00, 0x55, 0x0F, 0x5A, 0x59, 0x0C,
+                              0x69, 0x3C, 0x3F, 0x6A, 0x30, 0x65, 0x66, 0x33,
+                              0x33, 0x66, 0x65, 0x30, 0x6A, 0x3F, 0x3C, 0x69,
+                              0x03, 0x56, 0x55, 0x00, 0x5A, 0x0F, 0x0C, 0x59,
+                              0x59, 0x0C, 0x0F, 0x5A, 0x00, 0x55, 0x56, 0x03,
+                              0x66, 0x33, 0x30, 0x65, 0x3F, 0x6A, 0x69, 0x3C,
+                              0x3C, 0x69, 0x6A, 0x3F, 0x65, 0x30, 0x33, 0x66,
+                              0x65, 0x30, 0x33, 0x66, 0x3C, 0x69, 0x6A, 0x3F,
+                              0x3F, 0x6A, 0x69, 0x3C, 0x66, 0x33, 0x30, 0x65,
+                              0x00, 0x55, 0x56, 0x03, 0x59, 0x0C, 0x0F, 0x5A,
+                              0x5A, 0x0F, 0x0C, 0x59, 0x03, 0x56, 0x55, 0x00
+                            };
+
 /*****************************************************************************/
 /* Local Function Declarations                                               */
 /*****************************************************************************/
@@ -84,27 +135,62 @@ PUBLIC VOID
 FSR_OND_ECC_GenS (volatile UINT16 *pEcc, 
                            UINT8  *pBuf)
 {
-    UINT32  nTmp;
-    UINT32  nEcc  = 0;
-    UINT32  nXorT = 0;
-    UINT32  nP8   = 0;
-    UINT32  nP16  = 0;
-    UINT32  nP32  = 0;
-    UINT8  *pDat8;
+    UINT32  nW0;
+    UINT32  nW1;
+    UINT32  nXorT;
+    UINT32  nPar;
+    UINT32  nEcc;
+    UINT32  nP8;
+    UINT32  nP16;
+    UINT32  nP32;
 
     FSR_STACK_VAR;
 
     FSR_STACK_END;
 
-    pDat8 = pBuf;
+    /*
+     * The 8 bytes are handled as two words, byte n in bits 8n+7..8n
+     * whatever the byte order of the CPU, so that every parity below
+     * is a few XORs of words instead of a XOR of bytes.
+     */
+    nW0   = (UINT32) pBuf[0]         | ((UINT32) pBuf[1] <<  8) |
+            ((UINT32) pBuf[2] << 16) | ((UINT32) pBuf[3] << 24);
+    nW1   = (UINT32) pBuf[4]         | ((UINT32) pBuf[5] <<  8) |
+            ((UINT32) pBuf[6] << 16) | ((UINT32) pBuf[7] << 24);
+
+    /* byte n of nXorT is now pBuf[n] ^ pBuf[n + 4] */
+    nXorT = nW0 ^ nW1;
+
+    /* 
+     * Column bit set : P8 covers byte 1, 3, 5, 7, P16 byte 2, 3, 6, 7
+     * and P32 byte 4, 5, 6, 7
+     */
+    nP8   = nXorT & 0xFF00FF00;
+    nP16  = nXorT & 0xFFFF0000;
+    nP32  = nW1;
 
-    nXorT = (UINT8)(pDat8[0] ^ pDat8[1] ^ pDat8[2] ^ pDat8[3] ^ pDat8[4] ^ pDat8[5] ^ pDat8[6] ^ pDat8[7]);
+    nP8  ^= nP8  >> 16;
+    nP8  ^= nP8  >>  8;
+    nP8   = SWECC_PARITY(nP8);
+
+    nP16 ^= nP16 >> 16;
+    nP16 ^= nP16 >>  8;
+    nP16  = SWECC_PARITY(nP16);
+
+    nP32 ^= nP32 >> 16;
+    nP32 ^= nP32 >>  8;
+    nP32  = SWECC_PARITY(nP32);
+
+    /* 
+     * Row bit set : from the XOR of all 8 bytes 
+     */
+    nXorT ^= nXorT >> 16;
+    nXorT ^= nXorT >>  8;
 
-    nP8   = (UINT8)(pDat8[1] ^ pDat8[3] ^ pDat8[5] ^ pDat8[7]);
-    nP16  = (UINT8)(pDat8[2] ^ pDat8[3] ^ pDat8[6] ^ pDat8[7]);
-    nP32  = (UINT8)(pDat8[4] ^ pDat8[5] ^ pDat8[6] ^ pDat8[7]);
+    nEcc  = gnRowEccTbl[nXorT & 0xFF];
+    nPar  = (nEcc >> 6) & 0x01;
+    nEcc &= 0x3F;
 
-    
     /*
      * <Generate ECC code of spare data about 6 byte>
      *
@@ -115,54 +201,12 @@ FSR_OND_ECC_GenS (volatile UINT16 *pEcc,
      * +-------+-------------------------------+-------+-------+-------+-------+
      * S_ECC 1 |            (reserved)         | P32   | P32'  | P16   | P16'  | 
      * +-------+-------------------------------+-------+-------+-------+-------+
+     *
+     * P' is P when the parity of all data is even, and ~P when it is odd
      */
-    /* 
-     * Column bit set
-     */
-    nTmp  = (nP32  <<  4) ^ nP32;                   /********/
-    nTmp  = (nTmp  <<  2) ^ nTmp;                   /* p32  */
-    nTmp  = (nTmp  <<  1) ^ nTmp;                   /*      */
-    nEcc |= (nTmp  <<  4) & 0x800;                  /********/
-
-    nTmp  = (nP16  <<  4) ^ nP16;                   /********/
-    nTmp  = (nTmp  <<  2) ^ nTmp;                   /* p16  */
-    nTmp  = (nTmp  <<  1) ^ nTmp;                   /*      */
-    nEcc |= (nTmp  <<  2) & 0x200;                  /********/
-
-    nTmp  = (nP8   <<  4) ^ nP8;                    /********/
-    nTmp  = (nTmp  <<  2) ^ nTmp;                   /*  p8  */
-    nEcc |= ((nTmp <<  1) ^ nTmp) & 0x80;           /********/
-
-    /* 
-     * Row bit set 
-     */
-    nTmp  = (nXorT   & 0xF0);                       /********/
-    nTmp ^= (nTmp    >> 2);                         /*  P4  */
-    nEcc |= ((nTmp   << 1) ^ nTmp) & 0x20;          /********/
-
-    nTmp  = (nXorT   & 0xCC);                       /********/
-    nTmp ^= (nTmp    >> 4);                         /*  p2  */
-    //nTmp  = (nTmp    << 2);                         /*      */
-    nEcc |= ((nTmp   << 1) ^ nTmp) & 0x08;          /********/
-                     
-    nTmp  = (nXorT   & 0xAA);                       /********/
-    nTmp ^= (nTmp    >> 4);                         /*  p1  */
-    nTmp ^= (nTmp    >> 2);                         /*      */
-    nEcc |= (nTmp    & 0x02);                       /********/
-
-
-    nXorT ^= (nXorT  >> 4);                         /********/
-    nXorT ^= (nXorT  >> 2);                         /*nXorT */
-    nXorT  = (UINT8)(((nXorT >> 1) ^ nXorT) & 0x01);/********/
-
-    if (nXorT)
-    {
-        nEcc |= (nEcc ^ 0xAAAA) >> 1;
-    }
-    else
-    {
-        nEcc |= nEcc >> 1;
-    }
+    nEcc |= (nP8  <<  7) | ((nP8  ^ nPar) <<  6);
+    nEcc |= (nP16 <<  9) | ((nP16 ^ nPar) <<  8);
+    nEcc |= (nP32 << 11) | ((nP32 ^ nPar) << 10);
 
     /* It is policy of samsung elec. to save invert value */
     nEcc = (UINT16) (~nEcc | 0xF000);
@@ -279,26 +323,12 @@ FSR_OND_ECC_CompS (UINT8  *pEcc2,
     nEccComp |= ((UINT16)(~pEcc1[1] ^ ~pEcc2[1]) << 8);
 #endif
 
-#if defined (LOOP_FOR_ECC)
-    /* find the number of '1' */
-    for(nCnt = 0; nCnt < 12; nCnt++) 
-    {
-        nEccSum += ((nEccComp >> nCnt) & 0x01);
-    }
-#else
-    nEccSum += ( nEccComp        & 0x01);
-    nEccSum += ((nEccComp >>  1) & 0x01);
-    nEccSum += ((nEccComp >>  2) & 0x01);
-    nEccSum += ((nEccComp >>  3) & 0x01);
-    nEccSum += ((nEccComp >>  4) & 0x01);
-    nEccSum += ((nEccComp >>  5) & 0x01);
-    nEccSum += ((nEccComp >>  6) & 0x01);
-    nEccSum += ((nEccComp >>  7) & 0x01);
-    nEccSum += ((nEccComp >>  8) & 0x01);
-    nEccSum += ((nEccComp >>  9) & 0x01);
-    nEccSum += ((nEccComp >> 10) & 0x01);
-    nEccSum += ((nEccComp >> 11) & 0x01);
-#endif
+    /* find the number of '1' in the 12 bits, 2, 4 and then 8 bits at a time */
+    nEccSum  = nEccComp & 0x0FFF;
+    nEccSum -= (nEccSum >> 1) & 0x0555;
+    nEccSum  = (nEccSum & 0x0333) + ((nEccSum >> 2) & 0x0333);
+    nEccSum  = (nEccSum + (nEccSum >> 4)) & 0x0F0F;
+    nEccSum  = (nEccSum + (nEccSum >> 8)) & 0x001F;
 
 
     switch (nEccSum) 
@@ -22,6 +22,7 @@
 #define IO_DIRECTION		2
 #define STL_IOSTAT_PROC_NAME	"stl-iostat"
 #define BML_IOSTAT_PROC_NAME	"bml-iostat"
+#define BML_LATENCY_PROC_NAME	"bml-latency"
 
 #ifdef FSR_TIMER
 #define DECLARE_TIMER	struct timeval start, stop
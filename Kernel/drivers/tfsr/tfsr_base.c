@@ -36,6 +36,7 @@ static stl_info_t stl_info_list[FSR_MAX_VOLUMES * MAX_FLASH_PARTITIONS];
 int (*sec_stl_delete)(dev_t dev, u32 start, u32 nums, u32 b_size) = NULL;
 EXPORT_SYMBOL(sec_stl_delete);
 
+#ifndef CONFIG_TINY_FSR_RAMSIM
 extern struct FlexONDShMem *gpstFNDShMem[4];
 EXPORT_SYMBOL(gpstFNDShMem);
 extern struct OneNANDShMem *gpstONDShMem[4];
@@ -45,6 +46,7 @@ EXPORT_SYMBOL(gpstOND4kShMem);
 
 extern struct BmlShCxt gstShCxt;
 EXPORT_SYMBOL(gstShCxt);
+#endif
 
 /**
  * fsr_get_vol_spec - get a volume instance
@@ -232,6 +232,22 @@ static inline unsigned int fsr_stl_page_size(stl_info_t *ssp)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
 #include <linux/blkdev.h>
 
+/* service time histogram: bucket i counts requests done in < 2^i usecs */
+#define BML_LAT_BUCKETS		16
+
+struct bml_stats
+{
+	unsigned long		requests;	/* completed requests */
+	unsigned long		batches;	/* BML read calls issued */
+	unsigned long		merged;		/* requests that joined a batch */
+	unsigned long		errors;
+	unsigned long long	sectors;
+	unsigned long long	total_us;	/* summed service time */
+	unsigned long		max_us;
+	unsigned long long	wait_us;	/* summed time spent queued */
+	unsigned long		hist[BML_LAT_BUCKETS];
+};
+
 struct fsr_dev 
 {
 	struct request		*req;        
@@ -242,6 +258,8 @@ struct fsr_dev
 	struct gendisk		*gd;
 	int			dev_id;
 	struct scatterlist	*sg;
+	struct task_struct	*thread;
+	struct bml_stats	stats;
 };
 #else
 /* Kernel 2.4 */
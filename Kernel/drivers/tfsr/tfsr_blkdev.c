@@ -20,6 +20,12 @@
 #include <linux/fs.h>
 #include <linux/version.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/kthread.h>
+#include <linux/highmem.h>
+#include <linux/scatterlist.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 15)
 #include <linux/platform_device.h>
 #else
@@ -53,22 +59,30 @@ EXPORT_SYMBOL(bml_module_resume);
 #endif /* end of CONFIG_PM */
 
 /**
- * transger data from BML to buffer cache
+ * bounce buffer shared by all bml devices; BML serializes volume access
+ * anyway, so one buffer costs nothing in parallelism
+ */
+#define BML_BUF_SECTORS         256
+#define BML_MAX_BATCH           16
+
+static DEFINE_MUTEX(bml_buf_mutex);
+static char *bml_buf;
+
+/**
+ * transfer data from BML to a buffer
  * @param volume        : device number
  * @param partno        : 0~15: partition, other: whole device
- * @param req           : request description
- * @return              1 on success, 0 on failure
+ * @param sector        : first sector relative to the device
+ * @param nsect         : number of sectors
+ * @param buf           : destination buffer
+ * @return              0 on success, -errno on failure
  *
- * It will erase a block before it do write the data
+ * The whole range is read by one BML call, so the per-call overhead is
+ * paid once per batch instead of once per segment.
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-static int bml_transfer(u32 volume, u32 partno, const struct request *req, u32 data_len)
-#else
-static int bml_transfer(u32 volume, u32 partno, const struct request *req)
-#endif
+static int bml_transfer(u32 volume, u32 partno, unsigned long sector,
+		unsigned long nsect, char *buf)
 {
-	unsigned long sector, nsect;
-	char *buf;
 	FSRVolSpec *vs;
 	FSRPartI *ps;
 	u32 nPgsPerUnit = 0, n1stVpn = 0, spp_shift, spp_mask;
@@ -76,20 +90,6 @@ static int bml_transfer(u32 volume, u32 partno, const struct request *req)
 	
 	DEBUG(DL3,"TINY[I]: volume(%d), partno(%d)\n", volume, partno);
 
-	if (!blk_fs_request(req))
-	{
-		return 0;
-	}
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	sector = blk_rq_pos(req);
-	nsect = data_len >> 9;
-#else
-	sector = req->sector;
-	nsect = req->current_nr_sectors;
-#endif
-	buf = req->buffer;
-	
 	vs = fsr_get_vol_spec(volume);
 	ps = fsr_get_part_spec(volume);
 	spp_shift = ffs(vs->nSctsPerPg) - 1;
@@ -106,28 +106,20 @@ static int bml_transfer(u32 volume, u32 partno, const struct request *req)
 		}
 	}
 
-	switch (rq_data_dir(req)) 
+	/*
+	 * If sector and nsect are aligned with vs->nSctsPerPg,
+	 * you have to use a FSR_BML_Read() function using page unit,
+	 * If not, use a FSR_BML_ReadScts() function using sector unit.
+	 */
+	if ((!(sector & spp_mask) && !(nsect & spp_mask))) 
 	{
-		case READ:
-			/*
-			 * If sector and nsect are aligned with vs->nSctsPerPg,
-			 * you have to use a FSR_BML_Read() function using page unit,
-			 * If not, use a FSR_BML_ReadScts() function using sector unit.
-			 */
-			if ((!(sector & spp_mask) && !(nsect & spp_mask))) 
-			{
-				ret = FSR_BML_Read(volume, n1stVpn + (sector >> spp_shift),
-						nsect >> spp_shift, buf, NULL, FSR_BML_FLAG_ECC_ON);
-			} 
-			else 
-			{
-				ret = FSR_BML_ReadScts(volume, n1stVpn + (sector >> spp_shift),
-						sector & spp_mask, nsect, buf, NULL, FSR_BML_FLAG_ECC_ON);
-			}
-			break;
-		default:
-			ERRPRINTK("Unknown request 0x%x\n", (u32) rq_data_dir(req));
-			return -EINVAL;
+		ret = FSR_BML_Read(volume, n1stVpn + (sector >> spp_shift),
+				nsect >> spp_shift, buf, NULL, FSR_BML_FLAG_ECC_ON);
+	} 
+	else 
+	{
+		ret = FSR_BML_ReadScts(volume, n1stVpn + (sector >> spp_shift),
+				sector & spp_mask, nsect, buf, NULL, FSR_BML_FLAG_ECC_ON);
 	}
 
 	/* I/O error */
@@ -139,119 +131,187 @@ static int bml_transfer(u32 volume, u32 partno, const struct request *req)
 	
 	DEBUG(DL3,"TINY[O]: volume(%d), partno(%d)\n", volume, partno);
 
-	return 1;
+	return 0;
 }
 
 /**
- * request function which is do read/write sector
- * @param rq    : request queue which is created by blk_init_queue()
- * @return              none
+ * read a batch of sector-adjacent requests with a single BML call
+ * @param dev           : fsr block device
+ * @param batch         : requests in sector order
+ * @param nr            : number of requests
+ * @param sector        : first sector of batch[0]
+ * @param nsect         : total sectors of the batch
+ * @return              0 on success, -errno on failure
+ *
+ * A lone request whose scatterlist is a single lowmem segment is read in
+ * place; everything else goes through the bounce buffer and is copied out
+ * along each request's scatterlist.
  */
-static void bml_request(struct request_queue *rq)
+static int bml_read_batch(struct fsr_dev *dev, struct request **batch,
+		int nr, unsigned long sector, unsigned long nsect)
 {
-	u32 minor, volume, partno, spp_mask;
-	struct request *req;
-	struct fsr_dev *dev;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25)
-	int ret;
-#endif
-	int trans_ret;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	int error = 0;
-	u32 len = 0;
-#endif
+	u32 minor = dev->gd->first_minor;
+	u32 volume = fsr_vol(minor), partno = fsr_part(minor);
+	unsigned long offset = 0;
+	int i, nents, ret;
 
-	FSRVolSpec *vs;
+	nents = blk_rq_map_sg(dev->queue, batch[0], dev->sg);
+	if (nr == 1 && nents == 1 && !PageHighMem(sg_page(dev->sg)))
+	{
+		ret = bml_transfer(volume, partno, sector, nsect, sg_virt(dev->sg));
+		if (!ret)
+		{
+			flush_dcache_page(sg_page(dev->sg));
+		}
+		return ret;
+	}
 
-	DEBUG(DL3,"TINY[I]\n");
+	mutex_lock(&bml_buf_mutex);
+	ret = bml_transfer(volume, partno, sector, nsect, bml_buf);
+	for (i = 0; !ret && i < nr; i++)
+	{
+		if (i)
+		{
+			nents = blk_rq_map_sg(dev->queue, batch[i], dev->sg);
+		}
+		sg_copy_from_buffer(dev->sg, nents, bml_buf + offset,
+				blk_rq_bytes(batch[i]));
+		offset += blk_rq_bytes(batch[i]);
+	}
+	mutex_unlock(&bml_buf_mutex);
 
-	dev = rq->queuedata;
-	if (dev->req)
-		return;
+	return ret;
+}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	while ((dev->req = req = blk_peek_request(rq)) != NULL)
-#else
-	while ((dev->req = req = elv_next_request(rq)) != NULL) 
-#endif
+/**
+ * account a finished request; called with the queue lock held
+ * @param dev           : fsr block device
+ * @param req           : the request about to be completed
+ * @param svc_us        : time spent in bml_read_batch
+ * @param error         : completion status
+ */
+static void bml_account(struct fsr_dev *dev, struct request *req,
+		unsigned long svc_us, int error)
+{
+	struct bml_stats *st = &dev->stats;
+	int b = fls(svc_us);
+
+	st->requests++;
+	st->sectors += blk_rq_sectors(req);
+	st->total_us += svc_us;
+	st->wait_us += jiffies_to_usecs(jiffies - req->start_time);
+	if (svc_us > st->max_us)
 	{
-		spin_unlock_irq(rq->queue_lock);
-		
-		minor = dev->gd->first_minor;
-		volume = fsr_vol(minor);
-		partno = fsr_part(minor);
-		vs = fsr_get_vol_spec(volume);
-		spp_mask = vs->nSctsPerPg - 1;
-		
-		DEBUG(DL3,"TINY[I]: volume(%d), partno(%d)\n", volume, partno);
+		st->max_us = svc_us;
+	}
+	st->hist[min(b, BML_LAT_BUCKETS - 1)]++;
+	if (error)
+	{
+		st->errors++;
+	}
+}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-		len = blk_rq_cur_bytes(req);
-		if (!( blk_rq_pos(req) & spp_mask) && ( blk_rq_cur_sectors(req) != blk_rq_sectors(req)))
-		{
-			blk_rq_map_sg(rq, req, dev->sg);
-			if (!((dev->sg->length >> SECTOR_BITS) & 0x7))
-			{
-				len = dev->sg->length;
-			}
-			if (len > blk_rq_bytes(req))
-			{
-				len = blk_rq_bytes(req);
-			}
+/**
+ * per device worker which serves the request queue
+ * @param arg           : fsr block device
+ * @return              0
+ *
+ * Every fetched request pulls in the following requests as long as they
+ * continue it on the flash and fit into the bounce buffer, then the batch
+ * is read by one BML call with the queue lock dropped.  A batch that fails
+ * is read again request by request, so an unreadable page fails only the
+ * requests that cover it.
+ */
+static int bml_thread(void *arg)
+{
+	struct fsr_dev *dev = arg;
+	struct request_queue *rq = dev->queue;
+	struct request *req, *next, *batch[BML_MAX_BATCH];
+	unsigned long sector, nsect, svc_us;
+	ktime_t start;
+	int i, nr, error, errors[BML_MAX_BATCH];
 
-		}
-		trans_ret = bml_transfer(volume, partno, req, len);
-#else
-		if (!(req->sector & spp_mask) && (req->current_nr_sectors != req->nr_sectors))
+	/* we might get involved when memory gets low, so use PF_MEMALLOC */
+	current->flags |= PF_MEMALLOC;
+
+	spin_lock_irq(rq->queue_lock);
+
+	while (!kthread_should_stop())
+	{
+		req = blk_fetch_request(rq);
+		if (!req)
 		{
-			blk_rq_map_sg(rq, req, dev->sg);
-			if (!((dev->sg->length >> SECTOR_BITS) & 0x7))
-			{
-				req->current_nr_sectors = dev->sg->length >> SECTOR_BITS;
-			}
-			if (req->current_nr_sectors > req->nr_sectors)
-			{
-				req->current_nr_sectors = req->nr_sectors;
-			}
+			set_current_state(TASK_INTERRUPTIBLE);
+			spin_unlock_irq(rq->queue_lock);
+			schedule();
+			spin_lock_irq(rq->queue_lock);
+			continue;
 		}
-		trans_ret = bml_transfer(volume, partno, req);
-#endif
-		
-		spin_lock_irq(rq->queue_lock);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-		if (trans_ret)
+
+		/* only read is supported: the devices carry read-only cramfs */
+		if (!blk_fs_request(req) || rq_data_dir(req) != READ ||
+			blk_rq_sectors(req) > BML_BUF_SECTORS)
 		{
-			error = 0;
-		} else
+			ERRPRINTK("Unsupported request 0x%x\n", (u32) rq_data_dir(req));
+			dev->stats.errors++;
+			__blk_end_request_all(req, -EIO);
+			continue;
+		}
+
+		nr = 0;
+		batch[nr++] = req;
+		sector = blk_rq_pos(req);
+		nsect = blk_rq_sectors(req);
+		while (nr < BML_MAX_BATCH && (next = blk_peek_request(rq)) &&
+			blk_fs_request(next) && rq_data_dir(next) == READ &&
+			blk_rq_pos(next) == sector + nsect &&
+			nsect + blk_rq_sectors(next) <= BML_BUF_SECTORS)
 		{
-			error = -EIO;
+			blk_start_request(next);
+			batch[nr++] = next;
+			nsect += blk_rq_sectors(next);
 		}
-		/* don't need to check if request is finished */
-		if (blk_rq_sectors(req) <= (len >> 9))
-			list_del_init(&req->queuelist);
-		__blk_end_request(req, error, len);
-
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 25)
-		req->hard_cur_sectors = req->current_nr_sectors;
-		end_request(req, trans_ret);
-#else	
-		ret = end_that_request_chunk(req, trans_ret, req->current_nr_sectors << SECTOR_BITS);
-		if (!ret)
+		dev->req = req;
+
+		spin_unlock_irq(rq->queue_lock);
+
+		start = ktime_get();
+		error = bml_read_batch(dev, batch, nr, sector, nsect);
+		for (i = 0; i < nr; i++)
 		{
-			add_disk_randomness(req->rq_disk);
-			blkdev_dequeue_request(req);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 16)
-			end_that_request_last(req, trans_ret);
-#else
-			end_that_request_last(req);
-#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 16) */
+			errors[i] = error && nr > 1 ?
+				bml_read_batch(dev, &batch[i], 1, blk_rq_pos(batch[i]),
+					blk_rq_sectors(batch[i])) : error;
 		}
-#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 25) */
+		svc_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+		spin_lock_irq(rq->queue_lock);
 
-		DEBUG(DL3,"TINY[O]: volume(%d), partno(%d)\n", volume, partno);
+		dev->req = NULL;
+		dev->stats.batches++;
+		dev->stats.merged += nr - 1;
+		for (i = 0; i < nr; i++)
+		{
+			bml_account(dev, batch[i], svc_us, errors[i]);
+			__blk_end_request_all(batch[i], errors[i]);
+		}
 	}
 
-	DEBUG(DL3,"TINY[O]\n");
+	spin_unlock_irq(rq->queue_lock);
+
+	return 0;
+}
+
+/**
+ * request function which hands the queue over to the worker
+ * @param rq    : request queue which is created by blk_init_queue()
+ * @return              none
+ */
+static void bml_request(struct request_queue *rq)
+{
+	struct fsr_dev *dev = rq->queuedata;
+
+	wake_up_process(dev->thread);
 }
 
 /**
@@ -287,6 +347,9 @@ static int bml_add_disk(u32 volume, u32 partno)
 	dev->queue = blk_init_queue(bml_request, &dev->lock);
 	dev->queue->queuedata = dev;
 	dev->req = NULL;
+	blk_queue_max_sectors(dev->queue, BML_BUF_SECTORS);
+	/* no seek cost on OneNAND, let the elevator know */
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, dev->queue);
 
 	/* alloc scatterlist */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
@@ -327,6 +390,18 @@ static int bml_add_disk(u32 volume, u32 partno)
 	}
 	
 	minor = fsr_minor(volume, partno);
+
+	dev->thread = kthread_run(bml_thread, dev, "%s%d", DEVICE_NAME, minor);
+	if (IS_ERR(dev->thread))
+	{
+		put_disk(dev->gd);
+		blk_cleanup_queue(dev->queue);
+		kfree(dev->sg);
+		list_del(&dev->list);
+		kfree(dev);
+		ERRPRINTK("Can't start thread for minor %d\r\n", minor);
+		return -ENOMEM;
+	}
 	
 	dev->gd->major = MAJOR_NR;
 	dev->gd->first_minor = minor;
@@ -377,6 +452,7 @@ static void bml_del_disk(struct fsr_dev *dev)
 		put_disk(dev->gd);
 	}
 
+	kthread_stop(dev->thread);
 	kfree(dev->sg);
 
 	if (dev->queue)
@@ -466,6 +542,88 @@ static void bml_blkdev_free(void)
 	up(&bml_list_mutex);
 }
 
+#ifdef CONFIG_PROC_FS
+static struct proc_dir_entry *bml_proc_dir;
+
+/**
+ * show request and latency statistics of every bml device
+ */
+static int bml_latency_show(struct seq_file *m, void *v)
+{
+	struct fsr_dev *dev;
+	struct bml_stats st;
+	int b;
+
+	down(&bml_list_mutex);
+	list_for_each_entry(dev, &bml_list, list)
+	{
+		spin_lock_irq(&dev->lock);
+		st = dev->stats;
+		spin_unlock_irq(&dev->lock);
+
+		seq_printf(m, "%s: requests %lu batches %lu merged %lu "
+			"errors %lu sectors %llu\n", dev->gd->disk_name,
+			st.requests, st.batches, st.merged, st.errors, st.sectors);
+		if (!st.requests)
+		{
+			continue;
+		}
+		seq_printf(m, "  service avg %llu us max %lu us, queued avg %llu us\n",
+			div_u64(st.total_us, st.requests), st.max_us,
+			div_u64(st.wait_us, st.requests));
+		for (b = 0; b < BML_LAT_BUCKETS; b++)
+		{
+			if (!st.hist[b])
+			{
+				continue;
+			}
+			seq_printf(m, "  %s %6u us %10lu\n",
+				b == BML_LAT_BUCKETS - 1 ? ">=" : "< ",
+				b == BML_LAT_BUCKETS - 1 ? 1u << (b - 1) : 1u << b,
+				st.hist[b]);
+		}
+	}
+	up(&bml_list_mutex);
+
+	return 0;
+}
+
+static int bml_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bml_latency_show, NULL);
+}
+
+static const struct file_operations bml_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= bml_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void bml_proc_init(void)
+{
+	bml_proc_dir = proc_mkdir(TINYFSR_PROC_DIR, NULL);
+	if (bml_proc_dir)
+	{
+		proc_create(BML_LATENCY_PROC_NAME, S_IRUGO, bml_proc_dir,
+				&bml_latency_fops);
+	}
+}
+
+static void bml_proc_exit(void)
+{
+	if (bml_proc_dir)
+	{
+		remove_proc_entry(BML_LATENCY_PROC_NAME, bml_proc_dir);
+		remove_proc_entry(TINYFSR_PROC_DIR, NULL);
+	}
+}
+#else
+static inline void bml_proc_init(void) { }
+static inline void bml_proc_exit(void) { }
+#endif /* CONFIG_PROC_FS */
+
 /**
  * suspend the bml devices
  * @param dev           device structure
@@ -575,15 +733,24 @@ int __init bml_blkdev_init(void)
 #ifdef CONFIG_PM
 #endif
 
+	bml_buf = vmalloc(BML_BUF_SECTORS << SECTOR_BITS);
+	if (!bml_buf)
+	{
+		ERRPRINTK("TiyFSR: Can't allocate bounce buffer\n");
+		return -ENOMEM;
+	}
+
 	if (register_blkdev(MAJOR_NR, DEVICE_NAME)) 
 	{
 		ERRPRINTK("TiyFSR: unable to get major %d\n", MAJOR_NR);
+		vfree(bml_buf);
 		return -EAGAIN;
 	}
 	
 	if (bml_blkdev_create()) 
 	{
 		unregister_blkdev(MAJOR_NR, DEVICE_NAME);
+		vfree(bml_buf);
 		ERRPRINTK("TiyFSR: Can't created bml_blkdev_create()\n");
 		return -ENOMEM;
 	}
@@ -596,6 +763,7 @@ int __init bml_blkdev_init(void)
 		ERRPRINTK("TinyFSR: Can't register driver(major:%d)\n", MAJOR_NR);
 		bml_blkdev_free();
 		unregister_blkdev(MAJOR_NR, DEVICE_NAME);
+		vfree(bml_buf);
 		return -ENODEV;
 	}
 
@@ -608,9 +776,12 @@ int __init bml_blkdev_init(void)
 #endif
 		bml_blkdev_free();
 		unregister_blkdev(MAJOR_NR, DEVICE_NAME);
+		vfree(bml_buf);
 		return -ENODEV;
 	}
 
+	bml_proc_init();
+
 	DEBUG(DL3,"TINY[O]\n");
 
 	return 0;
@@ -641,8 +812,10 @@ void __exit bml_blkdev_exit(void)
 #else
 	driver_unregister(&tfsr_driver);
 #endif
+	bml_proc_exit();
 	bml_blkdev_free();
 	unregister_blkdev(MAJOR_NR, DEVICE_NAME);
+	vfree(bml_buf);
 }
 
 MODULE_LICENSE("GPL");
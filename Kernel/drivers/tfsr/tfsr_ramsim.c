@@ -0,0 +1,229 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+/**
+ * @file        drivers/tfsr/tfsr_ramsim.c
+ * @brief       RAM-backed stand-in for the BML and the OneNAND underneath
+ *              it, to exercise the bml block devices without the flash
+ *
+ * There is one volume of two SLC partitions.  Every 32-bit word of it holds
+ * its own offset in the volume divided by four, so a reader can check that
+ * what it got came from where it asked.  A read costs ramsim_call_us plus
+ * ramsim_load_us for each page it touches, spent busy-waiting like the LLD
+ * does while the OneNAND loads a page; the defaults are rough OneNAND
+ * figures, not measurements.  Like the real BML, reads of the volume are
+ * serialized.  Reads touching ramsim_bad_page fail the way an uncorrectable
+ * ECC error does.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/delay.h>
+#include <linux/vmalloc.h>
+
+#include "tfsr_base.h"
+
+#define RAMSIM_SCTS_PER_PG      4
+#define RAMSIM_PGS_PER_UNIT     64
+#define RAMSIM_PG_SIZE          (RAMSIM_SCTS_PER_PG << SECTOR_BITS)
+
+static unsigned int ramsim_units = 128;
+module_param(ramsim_units, uint, 0444);
+MODULE_PARM_DESC(ramsim_units, "Size of the volume in 128KB units (default 128)");
+
+static unsigned int ramsim_call_us = 40;
+module_param(ramsim_call_us, uint, 0644);
+MODULE_PARM_DESC(ramsim_call_us, "Cost of a BML read call in usecs (default 40)");
+
+static unsigned int ramsim_load_us = 50;
+module_param(ramsim_load_us, uint, 0644);
+MODULE_PARM_DESC(ramsim_load_us, "Cost of a page load in usecs (default 50)");
+
+static int ramsim_bad_page = -1;
+module_param(ramsim_bad_page, int, 0644);
+MODULE_PARM_DESC(ramsim_bad_page, "Page whose reads fail, -1 for none (default)");
+
+/* what the block devices asked of the BML */
+static unsigned long ramsim_calls;
+module_param(ramsim_calls, ulong, 0444);
+MODULE_PARM_DESC(ramsim_calls, "BML read calls so far");
+
+static unsigned long ramsim_pages;
+module_param(ramsim_pages, ulong, 0444);
+MODULE_PARM_DESC(ramsim_pages, "Pages loaded so far");
+
+static DEFINE_MUTEX(ramsim_mutex);
+static u32 *ramsim_data;
+
+static inline u32 ramsim_vol_pages(void)
+{
+	return ramsim_units * RAMSIM_PGS_PER_UNIT;
+}
+
+/**
+ * copy sectors out of the volume and account for the call
+ * @param sector        : first sector
+ * @param nsect         : number of sectors
+ * @param buf           : destination buffer
+ * @return              FSR_BML_SUCCESS, FSR_BML_INVALID_PARAM or
+ *                      FSR_BML_READ_ERROR
+ */
+static INT32 ramsim_read(u32 sector, u32 nsect, UINT8 *buf)
+{
+	u32 first, pages, us;
+	INT32 ret = FSR_BML_SUCCESS;
+
+	if (!buf || !nsect || sector + nsect < sector ||
+		sector + nsect > ramsim_vol_pages() * RAMSIM_SCTS_PER_PG)
+	{
+		return FSR_BML_INVALID_PARAM;
+	}
+
+	first = sector / RAMSIM_SCTS_PER_PG;
+	pages = (sector + nsect - 1) / RAMSIM_SCTS_PER_PG - first + 1;
+	us = ramsim_call_us + pages * ramsim_load_us;
+	if (ramsim_bad_page >= 0 && (u32) ramsim_bad_page - first < pages)
+	{
+		ret = FSR_BML_READ_ERROR;
+	}
+
+	mutex_lock(&ramsim_mutex);
+	memcpy(buf, (char *) ramsim_data + (sector << SECTOR_BITS),
+		nsect << SECTOR_BITS);
+	ramsim_calls++;
+	ramsim_pages += pages;
+	mdelay(us / 1000);
+	udelay(us % 1000);
+	mutex_unlock(&ramsim_mutex);
+
+	return ret;
+}
+
+INT32 FSR_BML_Init(UINT32 nFlag)
+{
+	unsigned long i, words;
+
+	if (ramsim_data)
+	{
+		return FSR_BML_ALREADY_INITIALIZED;
+	}
+
+	/* two partitions of at least one unit each */
+	ramsim_units = max(ramsim_units, 2u);
+	words = (unsigned long) ramsim_vol_pages() * RAMSIM_PG_SIZE / sizeof(u32);
+	ramsim_data = vmalloc(words * sizeof(u32));
+	if (!ramsim_data)
+	{
+		return FSR_BML_OAM_ACCESS_ERROR;
+	}
+	for (i = 0; i < words; i++)
+	{
+		ramsim_data[i] = i;
+	}
+
+	printk(KERN_INFO "TinyFSR: RAM-backed BML, %u KB\n",
+		ramsim_vol_pages() * RAMSIM_PG_SIZE / 1024);
+
+	return FSR_BML_SUCCESS;
+}
+
+INT32 FSR_BML_Open(UINT32 nVol, UINT32 nFlag)
+{
+	return nVol == 0 && ramsim_data ? FSR_BML_SUCCESS : FSR_BML_INVALID_PARAM;
+}
+
+INT32 FSR_BML_Close(UINT32 nVol, UINT32 nFlag)
+{
+	return nVol == 0 ? FSR_BML_SUCCESS : FSR_BML_INVALID_PARAM;
+}
+
+INT32 FSR_BML_GetVolSpec(UINT32 nVol, FSRVolSpec *pstVolSpec, UINT32 nFlag)
+{
+	if (nVol != 0 || !pstVolSpec)
+	{
+		return FSR_BML_INVALID_PARAM;
+	}
+
+	memset(pstVolSpec, 0x00, sizeof(FSRVolSpec));
+	pstVolSpec->nPgsPerSLCUnit = RAMSIM_PGS_PER_UNIT;
+	pstVolSpec->nPgsPerMLCUnit = RAMSIM_PGS_PER_UNIT;
+	pstVolSpec->nSctsPerPg = RAMSIM_SCTS_PER_PG;
+	pstVolSpec->nNumOfWays = 1;
+	pstVolSpec->nNumOfUsUnits = ramsim_units;
+	pstVolSpec->nSparePerSct = OOB_SIZE;
+	pstVolSpec->nDiesPerDev = 1;
+	pstVolSpec->nPlnsPerDie = 1;
+
+	return FSR_BML_SUCCESS;
+}
+
+INT32 FSR_BML_GetFullPartI(UINT32 nVol, FSRPartI *pstPartI)
+{
+	FSRPartEntry *pe;
+
+	if (nVol != 0 || !pstPartI)
+	{
+		return FSR_BML_INVALID_PARAM;
+	}
+
+	memset(pstPartI, 0x00, sizeof(FSRPartI));
+	pstPartI->nNumOfPartEntry = 2;
+
+	pe = &pstPartI->stPEntry[0];
+	pe->nID = FSR_PARTID_STL0;
+	pe->nAttr = FSR_BML_PI_ATTR_SLC | FSR_BML_PI_ATTR_RO;
+	pe->n1stVun = 0;
+	pe->nNumOfUnits = ramsim_units / 2;
+
+	pe = &pstPartI->stPEntry[1];
+	pe->nID = FSR_PARTID_STL1;
+	pe->nAttr = FSR_BML_PI_ATTR_SLC | FSR_BML_PI_ATTR_RO;
+	pe->n1stVun = ramsim_units / 2;
+	pe->nNumOfUnits = ramsim_units - ramsim_units / 2;
+
+	return FSR_BML_SUCCESS;
+}
+
+INT32 FSR_BML_GetVirUnitInfo(UINT32 nVol, UINT32 nVun, UINT32 *pn1stVpn,
+		UINT32 *pnPgsPerUnit)
+{
+	if (nVol != 0 || nVun >= ramsim_units)
+	{
+		return FSR_BML_INVALID_PARAM;
+	}
+
+	*pn1stVpn = nVun * RAMSIM_PGS_PER_UNIT;
+	*pnPgsPerUnit = RAMSIM_PGS_PER_UNIT;
+
+	return FSR_BML_SUCCESS;
+}
+
+INT32 FSR_BML_Read(UINT32 nVol, UINT32 nVpn, UINT32 nNumOfPgs, UINT8 *pMBuf,
+		FSRSpareBuf *pSBuf, UINT32 nFlag)
+{
+	if (nVol != 0 || nVpn >= ramsim_vol_pages() ||
+		nNumOfPgs > ramsim_vol_pages())
+	{
+		return FSR_BML_INVALID_PARAM;
+	}
+
+	return ramsim_read(nVpn * RAMSIM_SCTS_PER_PG,
+		nNumOfPgs * RAMSIM_SCTS_PER_PG, pMBuf);
+}
+
+INT32 FSR_BML_ReadScts(UINT32 nVol, UINT32 nVpn, UINT32 n1stSecOff,
+		UINT32 nNumOfScts, UINT8 *pBuf, FSRSpareBuf *pSBuf, UINT32 nFlag)
+{
+	if (nVol != 0 || n1stSecOff >= RAMSIM_SCTS_PER_PG ||
+		nVpn >= ramsim_vol_pages())
+	{
+		return FSR_BML_INVALID_PARAM;
+	}
+
+	return ramsim_read(nVpn * RAMSIM_SCTS_PER_PG + n1stSecOff,
+		nNumOfScts, pBuf);
+}
@@ -1452,6 +1452,8 @@ static int s3cfb_probe(struct platform_device *pdev)
 	fbdev->early_suspend.suspend = s3cfb_early_suspend;
 	fbdev->early_suspend.resume = s3cfb_late_resume;
 	fbdev->early_suspend.level = EARLY_SUSPEND_LEVEL_DISABLE_FB;
+	fbdev->early_suspend.name = "s3cfb";
+	fbdev->early_suspend.async = 1;
 	//if, is in USER_SLEEP status and no active auto expiring wake lock
 	//if (has_wake_lock(WAKE_LOCK_SUSPEND) == 0 && get_suspend_state() == PM_SUSPEND_ON)
 	register_early_suspend(&fbdev->early_suspend);
@@ -51,6 +51,9 @@ extern const char *yaffs_guts_c_version;
 #include <linux/interrupt.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/vmalloc.h>
 
 #include "asm/div64.h"
 
@@ -117,20 +120,36 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 #include "yaffs_mtdif.h"
 #include "yaffs_mtdif1.h"
 #include "yaffs_mtdif2.h"
+#include "yaffs_nand.h"
 
 unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
+unsigned int yaffs_short_op_caches = 64;	/* chunks per device, read at mount */
+unsigned int yaffs_scan_threads = 2;		/* tags read-ahead at mount, 0 = off */
+unsigned int yaffs_bg_checkpoint_delay = 30;	/* seconds idle, 0 = never */
+unsigned int yaffs_bg_gc_free_blocks = 8;	/* spare erased blocks, 0 = no bg gc */
+unsigned int yaffs_bg_gc_idle = 10;		/* seconds idle, 0 = never */
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
+module_param(yaffs_short_op_caches, uint, 0644);
+module_param(yaffs_scan_threads, uint, 0644);
+module_param(yaffs_bg_checkpoint_delay, uint, 0644);
+module_param(yaffs_bg_gc_free_blocks, uint, 0644);
+module_param(yaffs_bg_gc_idle, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
+MODULE_PARM(yaffs_short_op_caches, "i");
+MODULE_PARM(yaffs_scan_threads, "i");
+MODULE_PARM(yaffs_bg_checkpoint_delay, "i");
+MODULE_PARM(yaffs_bg_gc_free_blocks, "i");
+MODULE_PARM(yaffs_bg_gc_idle, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -378,6 +397,23 @@ static void yaffs_GrossUnlock(yaffs_Device *dev)
 	up(&dev->grossLock);
 }
 
+/* readpage, lookup and readdir only need the chunk map and namespace to
+ * hold still, so they don't wait for the gross lock held by writers and
+ * the garbage collector.  See the locking notes in yaffs_guts.c.
+ */
+static void yaffs_ReadLock(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_OS, ("yaffs read locking %p\n", current));
+	down_read(&dev->mapLock);
+	T(YAFFS_TRACE_OS, ("yaffs read locked %p\n", current));
+}
+
+static void yaffs_ReadUnlock(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_OS, ("yaffs read unlocking %p\n", current));
+	up_read(&dev->mapLock);
+}
+
 
 /*-----------------------------------------------------------------*/
 /* Directory search context allows us to unlock access to yaffs during
@@ -395,7 +431,9 @@ static void yaffs_GrossUnlock(yaffs_Device *dev)
  *
  * A seach context lives for the duration of a readdir.
  *
- * All these functions must be called while yaffs is locked.
+ * All these functions must be called while yaffs is locked, for reading at
+ * least.  The list of contexts itself is protected by dev->stateLock since
+ * readdirs run concurrently.
  */
 
 struct yaffs_SearchContext {
@@ -425,7 +463,9 @@ static struct yaffs_SearchContext * yaffs_NewSearch(yaffs_Object *dir)
                                 dir->variant.directoryVariant.children.next,
 				yaffs_Object,siblings);
 		YINIT_LIST_HEAD(&sc->others);
+		spin_lock(&dev->stateLock);
 		ylist_add(&sc->others,&dev->searchContexts);
+		spin_unlock(&dev->stateLock);
 	}
 	return sc;
 }
@@ -436,7 +476,9 @@ static struct yaffs_SearchContext * yaffs_NewSearch(yaffs_Object *dir)
 static void yaffs_EndSearch(struct yaffs_SearchContext * sc)
 {
 	if(sc){
+		spin_lock(&sc->dev->stateLock);
 		ylist_del(&sc->others);
+		spin_unlock(&sc->dev->stateLock);
 		YFREE(sc);
 	}
 }
@@ -481,6 +523,7 @@ static void yaffs_RemoveObjectCallback(yaffs_Object *obj)
          * If any are currently on the object being removed, then advance
          * the search context to the next object to prevent a hanging pointer.
          */
+         spin_lock(&obj->myDev->stateLock);
          ylist_for_each(i, search_contexts) {
                 if (i) {
                         sc = ylist_entry(i, struct yaffs_SearchContext,others);
@@ -488,6 +531,7 @@ static void yaffs_RemoveObjectCallback(yaffs_Object *obj)
                                 yaffs_SearchAdvance(sc);
                 }
 	}
+         spin_unlock(&obj->myDev->stateLock);
 
 }
 
@@ -502,11 +546,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user *buffer,
 
 	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_ReadLock(dev);
 
 	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
 
-	yaffs_GrossUnlock(dev);
+	yaffs_ReadUnlock(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -526,11 +570,11 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	int ret;
 	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_ReadLock(dev);
 
 	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
 
-	yaffs_GrossUnlock(dev);
+	yaffs_ReadUnlock(dev);
 
 	if (!alias) {
 		ret = -ENOMEM;
@@ -566,7 +610,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_ReadLock(dev);
 
 	T(YAFFS_TRACE_OS,
 		("yaffs_lookup for %d:%s\n",
@@ -577,8 +621,8 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 
 	obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
 
-	/* Can't hold gross lock when calling yaffs_get_inode() */
-	yaffs_GrossUnlock(dev);
+	/* Can't hold the lock when calling yaffs_get_inode() */
+	yaffs_ReadUnlock(dev);
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -643,6 +687,7 @@ static void yaffs_clear_inode(struct inode *inode)
 	if (obj) {
 		dev = obj->myDev;
 		yaffs_GrossLock(dev);
+		yaffs_LockMap(dev);
 
 		/* Clear the association between the inode and
 		 * the yaffs_Object.
@@ -657,6 +702,7 @@ static void yaffs_clear_inode(struct inode *inode)
 
 		yaffs_HandleDeferedFree(obj);
 
+		yaffs_UnlockMap(dev);
 		yaffs_GrossUnlock(dev);
 	}
 
@@ -680,7 +726,9 @@ static void yaffs_delete_inode(struct inode *inode)
 	if (obj) {
 		dev = obj->myDev;
 		yaffs_GrossLock(dev);
+		yaffs_LockMap(dev);
 		yaffs_DeleteObject(obj);
+		yaffs_UnlockMap(dev);
 		yaffs_GrossUnlock(dev);
 	}
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 13))
@@ -740,13 +788,13 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	yaffs_ReadLock(dev);
 
 	ret = yaffs_ReadDataFromFile(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_ReadUnlock(dev);
 
 	if (ret >= 0)
 		ret = 0;
@@ -1255,7 +1303,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_DentryToObject(f->f_dentry);
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_ReadLock(dev);
 
 	offset = f->f_pos;
 
@@ -1271,10 +1319,10 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			("yaffs_readdir: entry . ino %d \n",
 			(int)inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_ReadUnlock(dev);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0)
 			goto out;
-		yaffs_GrossLock(dev);
+		yaffs_ReadLock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1282,11 +1330,11 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			("yaffs_readdir: entry .. ino %d \n",
 			(int)f->f_dentry->d_parent->d_inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_ReadUnlock(dev);
 		if (filldir(dirent, "..", 2, offset,
 			f->f_dentry->d_parent->d_inode->i_ino, DT_DIR) < 0)
 			goto out;
-		yaffs_GrossLock(dev);
+		yaffs_ReadLock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1315,7 +1363,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 			  ("yaffs_readdir: %s inode %d\n", name,
 			   yaffs_GetObjectInode(l)));
 
-                        yaffs_GrossUnlock(dev);
+                        yaffs_ReadUnlock(dev);
 
 			if (filldir(dirent,
 					name,
@@ -1325,7 +1373,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 					this_type) < 0)
 				goto out;
 
-                        yaffs_GrossLock(dev);
+                        yaffs_ReadLock(dev);
 
 			offset++;
 			f->f_pos++;
@@ -1334,7 +1382,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	}
 
 unlock_out:
-	yaffs_GrossUnlock(dev);
+	yaffs_ReadUnlock(dev);
 out:
         yaffs_EndSearch(sc);
 
@@ -1390,6 +1438,7 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 	dev = parent->myDev;
 
 	yaffs_GrossLock(dev);
+	yaffs_LockMap(dev);
 
 	switch (mode & S_IFMT) {
 	default:
@@ -1421,6 +1470,7 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 	}
 
 	/* Can not call yaffs_get_inode() with gross lock held */
+	yaffs_UnlockMap(dev);
 	yaffs_GrossUnlock(dev);
 
 	if (obj) {
@@ -1472,17 +1522,20 @@ static int yaffs_unlink(struct inode *dir, struct dentry *dentry)
 	dev = yaffs_InodeToObject(dir)->myDev;
 
 	yaffs_GrossLock(dev);
+	yaffs_LockMap(dev);
 
 	retVal = yaffs_Unlink(yaffs_InodeToObject(dir), dentry->d_name.name);
 
 	if (retVal == YAFFS_OK) {
 		dentry->d_inode->i_nlink--;
 		dir->i_version++;
+		yaffs_UnlockMap(dev);
 		yaffs_GrossUnlock(dev);
 		mark_inode_dirty(dentry->d_inode);
 		update_dir_time(dir);
 		return 0;
 	}
+	yaffs_UnlockMap(dev);
 	yaffs_GrossUnlock(dev);
 	return -ENOTEMPTY;
 }
@@ -1504,6 +1557,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 	dev = obj->myDev;
 
 	yaffs_GrossLock(dev);
+	yaffs_LockMap(dev);
 
 	if (!S_ISDIR(inode->i_mode))		/* Don't link directories */
 		link = yaffs_Link(yaffs_InodeToObject(dir), dentry->d_name.name,
@@ -1519,6 +1573,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 			atomic_read(&old_dentry->d_inode->i_count)));
 	}
 
+	yaffs_UnlockMap(dev);
 	yaffs_GrossUnlock(dev);
 
 	if (link){
@@ -1541,8 +1596,10 @@ static int yaffs_symlink(struct inode *dir, struct dentry *dentry,
 
 	dev = yaffs_InodeToObject(dir)->myDev;
 	yaffs_GrossLock(dev);
+	yaffs_LockMap(dev);
 	obj = yaffs_MknodSymLink(yaffs_InodeToObject(dir), dentry->d_name.name,
 				S_IFLNK | S_IRWXUGO, uid, gid, symname);
+	yaffs_UnlockMap(dev);
 	yaffs_GrossUnlock(dev);
 
 	if (obj) {
@@ -1594,6 +1651,7 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	dev = yaffs_InodeToObject(old_dir)->myDev;
 
 	yaffs_GrossLock(dev);
+	yaffs_LockMap(dev);
 
 	/* Check if the target is an existing directory that is not empty. */
 	target = yaffs_FindObjectByName(yaffs_InodeToObject(new_dir),
@@ -1616,6 +1674,7 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 				yaffs_InodeToObject(new_dir),
 				new_dentry->d_name.name);
 	}
+	yaffs_UnlockMap(dev);
 	yaffs_GrossUnlock(dev);
 
 	if (retVal == YAFFS_OK) {
@@ -1647,12 +1706,14 @@ static int yaffs_setattr(struct dentry *dentry, struct iattr *attr)
 	if (error == 0) {
 		dev = yaffs_InodeToObject(inode)->myDev;
 		yaffs_GrossLock(dev);
+		yaffs_LockMap(dev);
 		if (yaffs_SetAttributes(yaffs_InodeToObject(inode), attr) ==
 				YAFFS_OK) {
 			error = 0;
 		} else {
 			error = -EPERM;
 		}
+		yaffs_UnlockMap(dev);
 		yaffs_GrossUnlock(dev);
 		if (!error)
 			error = inode_setattr(inode, attr);
@@ -1805,13 +1866,13 @@ static struct inode *yaffs_iget(struct super_block *sb, unsigned long ino)
 	 * need to lock again.
 	 */
 
-	yaffs_GrossLock(dev);
+	yaffs_ReadLock(dev);
 
 	obj = yaffs_FindObjectByNumber(dev, inode->i_ino);
 
 	yaffs_FillInodeFromObject(inode, obj);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_ReadUnlock(dev);
 
 	unlock_new_inode(inode);
 	return inode;
@@ -1832,17 +1893,276 @@ static void yaffs_read_inode(struct inode *inode)
 	T(YAFFS_TRACE_OS,
 		("yaffs_read_inode for %d\n", (int)inode->i_ino));
 
-	yaffs_GrossLock(dev);
+	yaffs_ReadLock(dev);
 
 	obj = yaffs_FindObjectByNumber(dev, inode->i_ino);
 
 	yaffs_FillInodeFromObject(inode, obj);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_ReadUnlock(dev);
 }
 
 #endif
 
+/*
+ * Mount scan read-ahead.
+ *
+ * Without a checkpoint, yaffs_ScanBackwards() reads the tags of every chunk
+ * of every block in use.  yaffs_scan_threads workers read them a block at a
+ * time, up to YAFFS_SCAN_WINDOW blocks ahead of the scan, so that the flash
+ * reads overlap with building the objects and with each other.
+ */
+#define YAFFS_SCAN_WINDOW	32
+#define YAFFS_MAX_SCAN_THREADS	8
+
+struct yaffs_ScanReadAhead {
+	yaffs_Device *dev;
+	const yaffs_BlockIndex *blockIndex;
+	int nBlocks;
+
+	spinlock_t lock;
+	int next;		/* Next block for a worker to read */
+	int consumed;		/* The scan is done with blocks before this */
+	int stop;
+	int slotBlock[YAFFS_SCAN_WINDOW];	/* Block read into each slot */
+	wait_queue_head_t wait;	/* Workers and the scan both wait here */
+
+	yaffs_ExtendedTags *tags;	/* nChunksPerBlock per slot */
+	int nThreads;
+	struct task_struct *thread[YAFFS_MAX_SCAN_THREADS];
+};
+
+static int yaffs_ScanSlotFree(struct yaffs_ScanReadAhead *ra, int n)
+{
+	int ret;
+
+	spin_lock(&ra->lock);
+	ret = ra->stop || n < ra->consumed + YAFFS_SCAN_WINDOW;
+	spin_unlock(&ra->lock);
+	return ret;
+}
+
+static int yaffs_ScanSlotReady(struct yaffs_ScanReadAhead *ra, int n)
+{
+	int ret;
+
+	spin_lock(&ra->lock);
+	ret = ra->slotBlock[n % YAFFS_SCAN_WINDOW] == n;
+	spin_unlock(&ra->lock);
+	return ret;
+}
+
+static int yaffs_ScanReadAheadThread(void *data)
+{
+	struct yaffs_ScanReadAhead *ra = data;
+	yaffs_Device *dev = ra->dev;
+	yaffs_ExtendedTags *tags;
+	int n, c, chunk, stop;
+
+	for (;;) {
+		spin_lock(&ra->lock);
+		n = ra->next;
+		stop = ra->stop || n >= ra->nBlocks;
+		if (!stop)
+			ra->next++;
+		spin_unlock(&ra->lock);
+		if (stop)
+			break;
+
+		wait_event(ra->wait, yaffs_ScanSlotFree(ra, n));
+
+		/* The scan goes from the newest block to the oldest */
+		chunk = ra->blockIndex[ra->nBlocks - 1 - n].block *
+			dev->nChunksPerBlock;
+		tags = &ra->tags[(n % YAFFS_SCAN_WINDOW) * dev->nChunksPerBlock];
+		for (c = 0; c < dev->nChunksPerBlock && !ra->stop; c++)
+			yaffs_ReadChunkWithTagsFromNAND(dev, chunk + c, NULL,
+							&tags[c]);
+
+		spin_lock(&ra->lock);
+		ra->slotBlock[n % YAFFS_SCAN_WINDOW] = n;
+		spin_unlock(&ra->lock);
+		wake_up_all(&ra->wait);
+	}
+
+	/* Stay around for kthread_stop() */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static int yaffs_StartScanReadAhead(yaffs_Device *dev,
+				    const yaffs_BlockIndex *blockIndex,
+				    int nBlocks)
+{
+	struct yaffs_ScanReadAhead *ra;
+	struct task_struct *t;
+	int i;
+
+	if (!yaffs_scan_threads)
+		return 0;
+
+	ra = kzalloc(sizeof(*ra), GFP_KERNEL);
+	if (!ra)
+		return 0;
+	ra->tags = vmalloc(YAFFS_SCAN_WINDOW * dev->nChunksPerBlock *
+			   sizeof(yaffs_ExtendedTags));
+	if (!ra->tags) {
+		kfree(ra);
+		return 0;
+	}
+
+	ra->dev = dev;
+	ra->blockIndex = blockIndex;
+	ra->nBlocks = nBlocks;
+	spin_lock_init(&ra->lock);
+	init_waitqueue_head(&ra->wait);
+	for (i = 0; i < YAFFS_SCAN_WINDOW; i++)
+		ra->slotBlock[i] = -1;
+
+	for (i = 0; i < yaffs_scan_threads && i < YAFFS_MAX_SCAN_THREADS; i++) {
+		t = kthread_run(yaffs_ScanReadAheadThread, ra, "yaffs-scan/%d", i);
+		if (IS_ERR(t))
+			break;
+		ra->thread[ra->nThreads++] = t;
+	}
+
+	if (!ra->nThreads) {
+		vfree(ra->tags);
+		kfree(ra);
+		return 0;
+	}
+
+	dev->scanContext = ra;
+	return 1;
+}
+
+static const yaffs_ExtendedTags *yaffs_GetScanTags(yaffs_Device *dev, int n)
+{
+	struct yaffs_ScanReadAhead *ra = dev->scanContext;
+
+	/* The slots of the blocks before n can be reused */
+	spin_lock(&ra->lock);
+	ra->consumed = n;
+	spin_unlock(&ra->lock);
+	wake_up_all(&ra->wait);
+
+	wait_event(ra->wait, yaffs_ScanSlotReady(ra, n));
+
+	return &ra->tags[(n % YAFFS_SCAN_WINDOW) * dev->nChunksPerBlock];
+}
+
+static void yaffs_EndScanReadAhead(yaffs_Device *dev)
+{
+	struct yaffs_ScanReadAhead *ra = dev->scanContext;
+	int i;
+
+	spin_lock(&ra->lock);
+	ra->stop = 1;
+	spin_unlock(&ra->lock);
+	wake_up_all(&ra->wait);
+
+	for (i = 0; i < ra->nThreads; i++)
+		kthread_stop(ra->thread[i]);
+
+	vfree(ra->tags);
+	kfree(ra);
+	dev->scanContext = NULL;
+}
+
+/*
+ * Background thread.
+ *
+ * Garbage collection: while fewer than yaffs_bg_gc_free_blocks erased blocks
+ * are spare, collect a block at a time, so that writers only have to collect
+ * one themselves when they outrun us.  Writers wake us when the spare blocks
+ * run low.  Once nothing has been written for yaffs_bg_gc_idle seconds, also
+ * collect the blocks that are mostly garbage.
+ *
+ * Checkpoint: it is invalidated by the first write after it was made, and is
+ * otherwise only rewritten by sync or unmount, so after an unclean shutdown
+ * the next mount usually has to scan.  Once nothing has been written for
+ * yaffs_bg_checkpoint_delay seconds, flush the cache and write the
+ * checkpoint here instead.
+ *
+ * Our own writes don't count as activity.
+ */
+static long yaffs_BackgroundSleep(unsigned int delay, unsigned int gcIdle)
+{
+	if (!delay || (gcIdle && gcIdle < delay))
+		delay = gcIdle;
+
+	return (delay ? delay : 10) * HZ;
+}
+
+static int yaffs_BackgroundThread(void *data)
+{
+	yaffs_Device *dev = data;
+	struct super_block *sb = dev->superBlock;
+	unsigned long idleSince = jiffies;
+	unsigned long idle;
+	int lastWrites = -1;
+	int idleGCDone = 0;
+	int idleGC;
+	int collected = 0;
+	unsigned int delay;
+	unsigned int gcIdle;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		delay = yaffs_bg_checkpoint_delay;
+		gcIdle = yaffs_bg_gc_idle;
+
+		if (collected)
+			cond_resched();
+		else
+			schedule_timeout_interruptible(yaffs_BackgroundSleep(delay, gcIdle));
+		try_to_freeze();
+		collected = 0;
+
+		if (sb->s_flags & MS_RDONLY)
+			continue;
+
+		yaffs_GrossLock(dev);
+
+		if (dev->nPageWrites != lastWrites) {
+			idleSince = jiffies;
+			idleGCDone = 0;
+		}
+		idle = jiffies - idleSince;
+
+		dev->bgGCFreeBlocks = yaffs_bg_gc_free_blocks;
+		idleGC = gcIdle && !idleGCDone && idle >= gcIdle * HZ;
+		collected = yaffs_BackgroundGarbageCollect(dev, idleGC);
+		if (idleGC && !collected)
+			idleGCDone = 1;
+
+		if (!collected && delay && idle >= delay * HZ &&
+		    !dev->isCheckpointed && !dev->skipCheckpointWrite) {
+			T(YAFFS_TRACE_CHECKPOINT,
+			  ("yaffs: idle, writing checkpoint\n"));
+			yaffs_FlushEntireDeviceCache(dev);
+			yaffs_CheckpointSave(dev);
+		}
+		lastWrites = dev->nPageWrites;
+		yaffs_GrossUnlock(dev);
+	}
+
+	return 0;
+}
+
+/* Called by writers, with the gross lock held */
+static void yaffs_WakeBackgroundGC(yaffs_Device *dev)
+{
+	if (dev->bgThread)
+		wake_up_process(dev->bgThread);
+}
+
 static YLIST_HEAD(yaffs_dev_list);
 
 #if 0 /* not used */
@@ -1881,6 +2201,12 @@ static void yaffs_put_super(struct super_block *sb)
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	if (dev->bgThread) {
+		kthread_stop(dev->bgThread);
+		dev->bgThread = NULL;
+		dev->bgGCFreeBlocks = 0;
+	}
+
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushEntireDeviceCache(dev);
@@ -1997,6 +2323,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	char devname_buf[BDEVNAME_SIZE + 1];
 	struct mtd_info *mtd;
 	int err;
+	unsigned long mountTime;
 	char *data_str = (char *)data;
 
 	yaffs_options options;
@@ -2187,7 +2514,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	dev->nChunksPerBlock = YAFFS_CHUNKS_PER_BLOCK;
 	dev->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	dev->nReservedBlocks = 5;
-	dev->nShortOpCaches = (options.no_cache) ? 0 : 10;
+	dev->nShortOpCaches = (options.no_cache) ? 0 : yaffs_short_op_caches;
 	dev->inbandTags = options.inband_tags;
 
 	/* ... and the functions. */
@@ -2253,12 +2580,25 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         /* Directory search handling...*/
         YINIT_LIST_HEAD(&dev->searchContexts);
         dev->removeObjectCallback = yaffs_RemoveObjectCallback;
+	dev->wakeBackgroundGC = yaffs_WakeBackgroundGC;
 
 	init_MUTEX(&dev->grossLock);
+	init_rwsem(&dev->mapLock);
+	dev->mapLockDepth = 0;
+	mutex_init(&dev->lazyLoadLock);
+	spin_lock_init(&dev->stateLock);
+	dev->nPendingErrors = 0;
+	dev->pendingRetire = 0;
+
+	dev->startScanReadAhead = yaffs_StartScanReadAhead;
+	dev->getScanTags = yaffs_GetScanTags;
+	dev->endScanReadAhead = yaffs_EndScanReadAhead;
 
 	yaffs_GrossLock(dev);
 
+	mountTime = jiffies;
 	err = yaffs_GutsInitialise(dev);
+	mountTime = jiffies - mountTime;
 
 	T(YAFFS_TRACE_OS,
 	  ("yaffs_read_super: guts initialised %s\n",
@@ -2291,7 +2631,15 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	sb->s_root = root;
 	sb->s_dirt = !dev->isCheckpointed;
 	T(YAFFS_TRACE_ALWAYS,
-	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
+	  ("yaffs_read_super: isCheckpointed %d, mounted in %u ms\n",
+	   dev->isCheckpointed, jiffies_to_msecs(mountTime)));
+
+	dev->bgGCFreeBlocks = yaffs_bg_gc_free_blocks;
+	dev->bgThread = kthread_run(yaffs_BackgroundThread, dev, "yaffs-bg");
+	if (IS_ERR(dev->bgThread)) {
+		dev->bgThread = NULL;
+		dev->bgGCFreeBlocks = 0;
+	}
 
 	T(YAFFS_TRACE_OS, ("yaffs_read_super: done\n"));
 	return sb;
@@ -2417,6 +2765,12 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "garbageCollections. %d\n", dev->garbageCollections);
 	buf += sprintf(buf, "passiveGCs......... %d\n",
 		    dev->passiveGarbageCollections);
+	buf += sprintf(buf, "bgGCs.............. %d\n",
+		    dev->bgGarbageCollections);
+	buf += sprintf(buf, "bgGCCopies......... %d\n", dev->bgGCCopies);
+	buf += sprintf(buf, "fgGCStalls......... %d\n",
+		    dev->nForegroundGCStalls);
+	buf += sprintf(buf, "bgGCFreeBlocks..... %d\n", dev->bgGCFreeBlocks);
 	buf += sprintf(buf, "nRetriedWrites..... %d\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->nShortOpCaches);
 	buf += sprintf(buf, "nRetireBlocks...... %d\n", dev->nRetiredBlocks);
@@ -2425,6 +2779,11 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %d\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %d\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %d\n", dev->cacheHits);
+	buf += sprintf(buf, "cacheMisses........ %d\n", dev->cacheMisses);
+	buf += sprintf(buf, "cacheEvictions..... %d\n", dev->cacheEvictions);
+	buf += sprintf(buf, "cacheWriteBacks.... %d\n", dev->cacheWriteBacks);
+	buf += sprintf(buf, "cacheFlushes....... %d\n", dev->cacheFlushes);
+	buf += sprintf(buf, "nDirtyCacheChunks.. %d\n", dev->nDirtyCacheChunks);
 	buf += sprintf(buf, "nDeletedFiles...... %d\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %d\n", dev->nUnlinkedFiles);
 	buf +=
@@ -37,6 +37,60 @@ const char *yaffs_guts_c_version =
 
 #include "yaffs_ecc.h"
 
+/*
+ * Locking.
+ *
+ * The gross lock taken in yaffs_fs.c serialises everything that allocates,
+ * writes or erases flash, including garbage collection.  readpage, lookup
+ * and readdir run without it: they hold dev->mapLock for reading while they
+ * resolve and read chunks or walk directories.  Whoever holds the gross
+ * lock takes mapLock for writing, via yaffs_LockMap(), around each change
+ * such a reader could observe: remapping or deleting a chunk, erasing a
+ * block, growing or pruning a tnode tree, reassigning a short-op cache
+ * entry and changing the namespace.  Chunks are written to flash outside
+ * mapLock, so readers mostly wait only for the bookkeeping.
+ *
+ * Readers must not write shared state, so the few bits they need go under
+ * dev->stateLock (temp buffers, search contexts, chunk errors found while
+ * reading, the short-op cache hit counts) and dev->lazyLoadLock.
+ */
+#ifdef __KERNEL__
+#define yaffs_LockState(dev)		spin_lock(&(dev)->stateLock)
+#define yaffs_UnlockState(dev)		spin_unlock(&(dev)->stateLock)
+#define yaffs_LockLazyLoad(dev)		mutex_lock(&(dev)->lazyLoadLock)
+#define yaffs_UnlockLazyLoad(dev)	mutex_unlock(&(dev)->lazyLoadLock)
+#define yaffs_LazyLoadBarrier()		smp_rmb()
+
+/* Only the gross lock holder takes mapLock for writing, so the nesting
+ * depth needs no further protection.
+ */
+void yaffs_LockMap(yaffs_Device *dev)
+{
+	if (dev->mapLockDepth++ == 0)
+		down_write(&dev->mapLock);
+}
+
+void yaffs_UnlockMap(yaffs_Device *dev)
+{
+	if (--dev->mapLockDepth == 0)
+		up_write(&dev->mapLock);
+}
+#else
+#define yaffs_LockState(dev)		do { } while (0)
+#define yaffs_UnlockState(dev)		do { } while (0)
+#define yaffs_LockLazyLoad(dev)		do { } while (0)
+#define yaffs_UnlockLazyLoad(dev)	do { } while (0)
+#define yaffs_LazyLoadBarrier()		do { } while (0)
+
+void yaffs_LockMap(yaffs_Device *dev)
+{
+}
+
+void yaffs_UnlockMap(yaffs_Device *dev)
+{
+}
+#endif
+
 
 /* Robustification (if it ever comes about...) */
 static void yaffs_RetireBlock(yaffs_Device *dev, int blockInNAND);
@@ -213,6 +267,8 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 {
 	int i, j;
 
+	yaffs_LockState(dev);
+
 	dev->tempInUse++;
 	if (dev->tempInUse > dev->maxTemp)
 		dev->maxTemp = dev->tempInUse;
@@ -227,6 +283,7 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 					    dev->tempBuffer[j].line;
 			}
 
+			yaffs_UnlockState(dev);
 			return dev->tempBuffer[i].buffer;
 		}
 	}
@@ -245,6 +302,7 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 	 */
 
 	dev->unmanagedTempAllocations++;
+	yaffs_UnlockState(dev);
 	return YMALLOC(dev->nDataBytesPerChunk);
 
 }
@@ -254,22 +312,29 @@ void yaffs_ReleaseTempBuffer(yaffs_Device *dev, __u8 *buffer,
 {
 	int i;
 
+	yaffs_LockState(dev);
+
 	dev->tempInUse--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->tempBuffer[i].buffer == buffer) {
 			dev->tempBuffer[i].line = 0;
+			yaffs_UnlockState(dev);
 			return;
 		}
 	}
 
+	if (buffer)
+		dev->unmanagedTempDeallocations++;
+
+	yaffs_UnlockState(dev);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		T(YAFFS_TRACE_BUFFERS,
 		  (TSTR("Releasing unmanaged temp buffer in line %d" TENDSTR),
 		   lineNo));
 		YFREE(buffer);
-		dev->unmanagedTempDeallocations++;
 	}
 
 }
@@ -1083,6 +1148,52 @@ void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi)
 	}
 }
 
+/* Readers can't touch the block info, so chunk errors they run into are
+ * queued here and handled by the next yaffs_CheckGarbageCollection().
+ */
+void yaffs_QueueChunkError(yaffs_Device *dev, int blockInNAND, int retire)
+{
+	int i;
+
+	yaffs_LockState(dev);
+	for (i = 0; i < dev->nPendingErrors; i++)
+		if (dev->pendingErrorBlock[i] == blockInNAND)
+			break;
+	if (i < YAFFS_N_PENDING_ERRORS) {
+		if (i == dev->nPendingErrors) {
+			dev->pendingErrorBlock[i] = blockInNAND;
+			dev->nPendingErrors++;
+		}
+		if (retire)
+			dev->pendingRetire |= 1 << i;
+	}
+	yaffs_UnlockState(dev);
+}
+
+static void yaffs_HandlePendingChunkErrors(yaffs_Device *dev)
+{
+	int block[YAFFS_N_PENDING_ERRORS];
+	__u32 retire;
+	int i, n;
+	yaffs_BlockInfo *bi;
+
+	yaffs_LockState(dev);
+	n = dev->nPendingErrors;
+	retire = dev->pendingRetire;
+	memcpy(block, dev->pendingErrorBlock, n * sizeof(int));
+	dev->nPendingErrors = 0;
+	dev->pendingRetire = 0;
+	yaffs_UnlockState(dev);
+
+	for (i = 0; i < n; i++) {
+		bi = yaffs_GetBlockInfo(dev, block[i]);
+		if (retire & (1 << i))
+			bi->needsRetiring = 1;
+		else
+			yaffs_HandleChunkError(dev, bi);
+	}
+}
+
 static void yaffs_HandleWriteChunkError(yaffs_Device *dev, int chunkInNAND,
 		int erasedOk)
 {
@@ -2739,6 +2850,9 @@ static void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 		(TSTR("yaffs_BlockBecameDirty block %d state %d %s"TENDSTR),
 		blockNo, bi->blockState, (bi->needsRetiring) ? "needs retiring" : ""));
 
+	/* No reader may be reading a chunk of this block while it is erased */
+	yaffs_LockMap(dev);
+
 	bi->blockState = YAFFS_BLOCK_STATE_DIRTY;
 
 	if (!bi->needsRetiring) {
@@ -2785,6 +2899,8 @@ static void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 		T(YAFFS_TRACE_ERROR | YAFFS_TRACE_BAD_BLOCKS,
 		  (TSTR("**>> Block %d retired" TENDSTR), blockNo));
 	}
+
+	yaffs_UnlockMap(dev);
 }
 
 static int yaffs_FindBlockForAllocation(yaffs_Device *dev)
@@ -3146,6 +3262,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 						/* Ok, now fix up the Tnodes etc. */
 
+						yaffs_LockMap(dev);
 						if (tags.chunkId == 0) {
 							/* It's a header */
 							object->hdrChunk =  newChunk;
@@ -3157,6 +3274,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 							     tags.chunkId,
 							     newChunk, 0);
 						}
+						yaffs_UnlockMap(dev);
 					}
 				}
 
@@ -3176,6 +3294,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 			    yaffs_FindObjectByNumber(dev,
 						     dev->gcCleanupList[i]);
 			if (object) {
+				yaffs_LockMap(dev);
 				yaffs_FreeTnode(dev,
 						object->variant.fileVariant.
 						top);
@@ -3186,6 +3305,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 				    TENDSTR), object->objectId));
 				yaffs_DoGenericObjectDeletion(object);
 				object->myDev->nDeletedFiles--;
+				yaffs_UnlockMap(dev);
 			}
 
 		}
@@ -3228,6 +3348,7 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	int aggressive;
 	int gcOk = YAFFS_OK;
 	int maxTries = 0;
+	int stalled = 0;
 
 	int checkpointBlockAdjust;
 
@@ -3236,6 +3357,8 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 		return YAFFS_OK;
 	}
 
+	yaffs_HandlePendingChunkErrors(dev);
+
 	/* This loop should pass the first time.
 	 * We'll only see looping here if the erase of the collected block fails.
 	 */
@@ -3255,7 +3378,16 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 			aggressive = 0;
 		}
 
-		if (dev->gcBlock <= 0) {
+		if (dev->bgGCFreeBlocks && dev->wakeBackgroundGC &&
+		    dev->nErasedBlocks < (dev->nReservedBlocks + checkpointBlockAdjust + 2 +
+					  dev->bgGCFreeBlocks) &&
+		    dev->nErasedBlocks != dev->bgGCWokenAt) {
+			dev->bgGCWokenAt = dev->nErasedBlocks;
+			dev->wakeBackgroundGC(dev);
+		}
+
+		/* Leave the leasurely gc to the background collector if there is one */
+		if (dev->gcBlock <= 0 && (aggressive || !dev->bgGCFreeBlocks)) {
 			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, aggressive);
 			dev->gcChunk = 0;
 		}
@@ -3266,6 +3398,8 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 			dev->garbageCollections++;
 			if (!aggressive)
 				dev->passiveGarbageCollections++;
+			else
+				stalled = 1;
 
 			T(YAFFS_TRACE_GC,
 			  (TSTR
@@ -3285,9 +3419,77 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 		 (block > 0) &&
 		 (maxTries < 2));
 
+	if (stalled)
+		dev->nForegroundGCStalls++;
+
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/*
+ * Background garbage collection, for the OS to call from its own thread
+ * with the gross lock held.  Collects at most one whole block per call so
+ * that writers get the lock back in between:
+ *  - while fewer than bgGCFreeBlocks erased blocks are spare, the dirtiest
+ *    block, provided at least a quarter of it is garbage;
+ *  - if idle is set, also a block that is at least three quarters garbage,
+ *    which is cheap to copy and gives the next burst of writes room.
+ * Returns 1 if a block was collected, 0 if there was nothing worth doing.
+ */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int idle)
+{
+	yaffs_BlockInfo *bi;
+	int checkpointBlockAdjust;
+	int maxInUse;
+	int copies;
+	int block;
+	int urgent;
+	int gcOk;
+
+	dev->bgGCWokenAt = -1;
+
+	if (dev->isDoingGC || !dev->bgGCFreeBlocks)
+		return 0;
+
+	yaffs_HandlePendingChunkErrors(dev);
+
+	checkpointBlockAdjust = yaffs_CalcCheckpointBlocksRequired(dev) - dev->blocksInCheckpoint;
+	if (checkpointBlockAdjust < 0)
+		checkpointBlockAdjust = 0;
+
+	urgent = (dev->nErasedBlocks < (dev->nReservedBlocks + checkpointBlockAdjust + 2 +
+					dev->bgGCFreeBlocks));
+	if (!urgent && !idle)
+		return 0;
+
+	block = dev->gcBlock;
+	if (block <= 0) {
+		block = yaffs_FindBlockForGarbageCollection(dev, 1);
+		if (block <= 0)
+			return 0;
+
+		bi = yaffs_GetBlockInfo(dev, block);
+		maxInUse = urgent ? (dev->nChunksPerBlock * 3) / 4 : dev->nChunksPerBlock / 4;
+		if (!bi->gcPrioritise &&
+		    bi->pagesInUse - bi->softDeletions > maxInUse)
+			return 0;
+
+		dev->gcBlock = block;
+		dev->gcChunk = 0;
+	}
+
+	T(YAFFS_TRACE_GC,
+	  (TSTR("yaffs: background GC block %d erasedBlocks %d urgent %d" TENDSTR),
+	   block, dev->nErasedBlocks, urgent));
+
+	copies = dev->nGCCopies;
+	dev->garbageCollections++;
+	dev->bgGarbageCollections++;
+	gcOk = yaffs_GarbageCollectBlock(dev, block, 1);
+	dev->bgGCCopies += dev->nGCCopies - copies;
+
+	return (gcOk == YAFFS_OK) ? 1 : 0;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -3573,6 +3775,8 @@ void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn)
 	if (chunkId <= 0)
 		return;
 
+	yaffs_LockMap(dev);
+
 	dev->nDeletions++;
 	block = chunkId / dev->nChunksPerBlock;
 	page = chunkId % dev->nChunksPerBlock;
@@ -3623,6 +3827,7 @@ void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn)
 
 	}
 
+	yaffs_UnlockMap(dev);
 }
 
 static int yaffs_WriteChunkDataToObject(yaffs_Object *in, int chunkInInode,
@@ -3667,10 +3872,12 @@ static int yaffs_WriteChunkDataToObject(yaffs_Object *in, int chunkInInode,
 					      useReserve);
 
 	if (newChunkId >= 0) {
+		yaffs_LockMap(dev);
 		yaffs_PutChunkIntoFile(in, chunkInInode, newChunkId, 0);
 
 		if (prevChunkId > 0)
 			yaffs_DeleteChunk(dev, prevChunkId, 1, __LINE__);
+		yaffs_UnlockMap(dev);
 
 		yaffs_CheckFileSanity(in);
 	}
@@ -3817,12 +4024,14 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
 
 		if (newChunkId >= 0) {
 
+			yaffs_LockMap(dev);
 			in->hdrChunk = newChunkId;
 
 			if (prevChunkId > 0) {
 				yaffs_DeleteChunk(dev, prevChunkId, 1,
 						  __LINE__);
 			}
+			yaffs_UnlockMap(dev);
 
 			if (!yaffs_ObjectHasCachedWriteData(in))
 				in->dirty = 0;
@@ -3855,77 +4064,127 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   In Linux, the page cache provides read buffering aand the short op cache provides write
  *   buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Entries in use are hashed by object and chunk id so that finding one costs
+ *   the same however big the cache is.  Clean and dirty entries live on
+ *   separate LRU lists: the least recently used clean entry is reused first,
+ *   and only when every entry is dirty do we write back the least recently
+ *   used object, all of its dirty chunks at once and in chunk order.
+ *
+ *   Readers walk the hash chains with mapLock held for reading, so entries
+ *   only join or leave the hash under yaffs_LockMap().  The LRU lists are
+ *   only used by the gross lock holder.
  */
 
+static struct ylist_head *yaffs_ChunkCacheBucket(yaffs_Device *dev,
+						 int objectId, int chunkId)
+{
+	return &dev->srHash[(objectId * 31 + chunkId) & dev->srHashMask];
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
-	yaffs_ChunkCache *cache;
-	int nCaches = obj->myDev->nShortOpCaches;
+	struct ylist_head *i;
 
-	for (i = 0; i < nCaches; i++) {
-		cache = &dev->srCache[i];
-		if (cache->object == obj &&
-		    cache->dirty)
+	ylist_for_each(i, &dev->srDirty) {
+		if (ylist_entry(i, yaffs_ChunkCache, lruLink)->object == obj)
 			return 1;
 	}
 
 	return 0;
 }
 
+/* Make a loaded entry findable as chunkId of obj */
+static void yaffs_HashChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
+				 yaffs_Object *obj, int chunkId)
+{
+	yaffs_LockMap(dev);
+	cache->object = obj;
+	cache->chunkId = chunkId;
+	cache->dirty = 0;
+	ylist_add(&cache->hashLink,
+		  yaffs_ChunkCacheBucket(dev, obj->objectId, chunkId));
+	yaffs_UnlockMap(dev);
+
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srClean);
+}
+
+/* Forget the chunk an entry holds, dirty or not, and put it on the free list */
+static void yaffs_FreeChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	yaffs_LockMap(dev);
+	ylist_del_init(&cache->hashLink);
+	cache->object = NULL;
+	yaffs_UnlockMap(dev);
+
+	if (cache->dirty)
+		dev->nDirtyCacheChunks--;
+	cache->dirty = 0;
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srFree);
+}
+
+/* The chunk has been written through, keep it as a clean entry */
+static void yaffs_CleanChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	if (cache->dirty) {
+		cache->dirty = 0;
+		dev->nDirtyCacheChunks--;
+		ylist_del(&cache->lruLink);
+		ylist_add(&cache->lruLink, &dev->srClean);
+	}
+}
+
+static int yaffs_ChunkCacheCompare(const void *a, const void *b)
+{
+	return (*(yaffs_ChunkCache **)a)->chunkId -
+		(*(yaffs_ChunkCache **)b)->chunkId;
+}
 
 static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
-	int chunkWritten = 0;
-	int nCaches = obj->myDev->nShortOpCaches;
-
-	if (nCaches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
-				}
-			}
+	int chunkWritten = 1;
+	int n = 0;
+	int j;
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+	if (dev->nShortOpCaches < 1)
+		return;
 
-				chunkWritten =
-				    yaffs_WriteChunkDataToObject(cache->object,
-								 cache->chunkId,
-								 cache->data,
-								 cache->nBytes,
-								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+	ylist_for_each(i, &dev->srDirty) {
+		cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+		if (cache->object == obj)
+			dev->srFlushList[n++] = cache;
+	}
 
-		} while (cache && chunkWritten > 0);
+	if (!n)
+		return;
 
-		if (cache) {
-			/* Hoosterman, disk full while writing cache out. */
-			T(YAFFS_TRACE_ERROR,
-			  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
+	/* Write them out in chunk order so that they land next to each other */
+	yaffs_qsort(dev->srFlushList, n, sizeof(yaffs_ChunkCache *),
+		    yaffs_ChunkCacheCompare);
+	dev->cacheFlushes++;
 
-		}
+	for (j = 0; j < n && chunkWritten > 0; j++) {
+		cache = dev->srFlushList[j];
+		chunkWritten = yaffs_WriteChunkDataToObject(cache->object,
+							    cache->chunkId,
+							    cache->data,
+							    cache->nBytes,
+							    1);
+		dev->cacheWriteBacks++;
+		yaffs_FreeChunkCache(dev, cache);
 	}
 
+	if (chunkWritten <= 0) {
+		/* Hoosterman, disk full while writing cache out. */
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
+
+	}
 }
 
 /*yaffs_FlushEntireDeviceCache(dev)
@@ -3935,97 +4194,43 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
 {
-	yaffs_Object *obj;
-	int nCaches = dev->nShortOpCaches;
-	int i;
-
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
-	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < nCaches && !obj; i++) {
-			if (dev->srCache[i].object &&
-			    dev->srCache[i].dirty)
-				obj = dev->srCache[i].object;
-
-		}
-		if (obj)
-			yaffs_FlushFilesChunkCache(obj);
-
-	} while (obj);
-
+	/* Each flush takes at least one entry off the dirty list */
+	while (!ylist_empty(&dev->srDirty))
+		yaffs_FlushFilesChunkCache(ylist_entry(dev->srDirty.next,
+						       yaffs_ChunkCache,
+						       lruLink)->object);
 }
 
 
 /* Grab us a cache chunk for use.
  * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Then take the least recently used clean one.
+ * Otherwise flush the least recently used dirty object, which frees at least
+ * one entry.
+ * The entry returned is not hashed yet; yaffs_HashChunkCache() does that
+ * once its data is loaded.
  */
-static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
-{
-	int i;
-
-	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
-	}
-
-	return NULL;
-}
-
 static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 {
 	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
-
-	if (dev->nShortOpCaches > 0) {
-		/* Try find a non-dirty one... */
-
-		cache = yaffs_GrabChunkCacheWorker(dev);
 
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
-
-			/* With locking we can't assume we can use entry zero */
-
-			theObj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
-				}
-			}
-
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
-				cache = yaffs_GrabChunkCacheWorker(dev);
-			}
+	if (dev->nShortOpCaches < 1)
+		return NULL;
 
+	if (ylist_empty(&dev->srFree)) {
+		if (!ylist_empty(&dev->srClean)) {
+			cache = ylist_entry(dev->srClean.prev,
+					    yaffs_ChunkCache, lruLink);
+			dev->cacheEvictions++;
+			yaffs_FreeChunkCache(dev, cache);
+		} else {
+			cache = ylist_entry(dev->srDirty.prev,
+					    yaffs_ChunkCache, lruLink);
+			yaffs_FlushFilesChunkCache(cache->object);
 		}
-		return cache;
-	} else
-		return NULL;
+	}
 
+	return ylist_entry(dev->srFree.next, yaffs_ChunkCache, lruLink);
 }
 
 /* Find a cached chunk */
@@ -4033,42 +4238,40 @@ static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
 					      int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
+	struct ylist_head *i;
+	yaffs_ChunkCache *cache;
+
 	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
+		ylist_for_each(i, yaffs_ChunkCacheBucket(dev, obj->objectId,
+							 chunkId)) {
+			cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+			if (cache->object == obj &&
+			    cache->chunkId == chunkId) {
+				yaffs_LockState(dev);
 				dev->cacheHits++;
+				yaffs_UnlockState(dev);
 
-				return &dev->srCache[i];
+				return cache;
 			}
 		}
+		yaffs_LockState(dev);
+		dev->cacheMisses++;
+		yaffs_UnlockState(dev);
 	}
 	return NULL;
 }
 
-/* Mark the chunk for the least recently used algorithym */
+/* Move the chunk to the front of its LRU list */
 static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 				int isAWrite)
 {
-
-	if (dev->nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
-
-			dev->srLastUse = 0;
-		}
-
-		dev->srLastUse++;
-
-		cache->lastUse = dev->srLastUse;
-
-		if (isAWrite)
-			cache->dirty = 1;
+	if (isAWrite && !cache->dirty) {
+		cache->dirty = 1;
+		dev->nDirtyCacheChunks++;
 	}
+
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, cache->dirty ? &dev->srDirty : &dev->srClean);
 }
 
 /* Invalidate a single cache page.
@@ -4081,7 +4284,7 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_FreeChunkCache(object->myDev, cache);
 	}
 }
 
@@ -4090,15 +4293,20 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
  */
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 {
-	int i;
 	yaffs_Device *dev = in->myDev;
+	struct ylist_head *i;
+	struct ylist_head *n;
+	yaffs_ChunkCache *cache;
 
-	if (dev->nShortOpCaches > 0) {
-		/* Invalidate it. */
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
-		}
+	ylist_for_each_safe(i, n, &dev->srClean) {
+		cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+		if (cache->object == in)
+			yaffs_FreeChunkCache(dev, cache);
+	}
+	ylist_for_each_safe(i, n, &dev->srDirty) {
+		cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+		if (cache->object == in)
+			yaffs_FreeChunkCache(dev, cache);
 	}
 }
 
@@ -4709,50 +4917,26 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 		cache = yaffs_FindChunkCache(in, chunk);
 
-		/* If the chunk is already in the cache or it is less than a whole chunk
-		 * or we're using inband tags then use the cache (if there is caching)
-		 * else bypass the cache.
+		/* If the chunk is in the cache, copy it from there.
+		 * Readers don't hold the gross lock, so they never fill the
+		 * cache: a partial chunk or one with inband tags goes through
+		 * a temp buffer instead.  On Linux the page cache does the read
+		 * caching anyway.
 		 */
-		if (cache || nToCopy != dev->nDataBytesPerChunk || dev->inbandTags) {
-			if (dev->nShortOpCaches > 0) {
-
-				/* If we can't find the data in the cache, then load it up. */
-
-				if (!cache) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_ReadChunkDataFromObject(in, chunk,
-								      cache->
-								      data);
-					cache->nBytes = 0;
-				}
-
-				yaffs_UseChunkCache(dev, cache, 0);
-
-				cache->locked = 1;
-
-
-				memcpy(buffer, &cache->data[start], nToCopy);
-
-				cache->locked = 0;
-			} else {
-				/* Read into the local buffer then copy..*/
-
-				__u8 *localBuffer =
-				    yaffs_GetTempBuffer(dev, __LINE__);
-				yaffs_ReadChunkDataFromObject(in, chunk,
-							      localBuffer);
+		if (cache) {
+			memcpy(buffer, &cache->data[start], nToCopy);
+		} else if (nToCopy != dev->nDataBytesPerChunk || dev->inbandTags) {
+			/* Read into the local buffer then copy..*/
 
-				memcpy(buffer, &localBuffer[start], nToCopy);
+			__u8 *localBuffer =
+			    yaffs_GetTempBuffer(dev, __LINE__);
+			yaffs_ReadChunkDataFromObject(in, chunk,
+						      localBuffer);
 
+			memcpy(buffer, &localBuffer[start], nToCopy);
 
-				yaffs_ReleaseTempBuffer(dev, localBuffer,
-							__LINE__);
-			}
-
+			yaffs_ReleaseTempBuffer(dev, localBuffer,
+						__LINE__);
 		} else {
 
 			/* A full chunk. Read directly into the supplied buffer. */
@@ -4849,14 +5033,15 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 				if (!cache
 				    && yaffs_CheckSpaceForAllocation(in->
 								     myDev)) {
+					/* Load the data before readers can
+					 * find the entry.
+					 */
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->
 								      data);
+					yaffs_HashChunkCache(dev, cache, in,
+							     chunk);
 				} else if (cache &&
 					!cache->dirty &&
 					!yaffs_CheckSpaceForAllocation(in->myDev)) {
@@ -4868,14 +5053,10 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 
 				if (cache) {
 					yaffs_UseChunkCache(dev, cache, 1);
-					cache->locked = 1;
-
 
 					memcpy(&cache->data[start], buffer,
 					       nToCopy);
 
-
-					cache->locked = 0;
 					cache->nBytes = nToWriteBack;
 
 					if (writeThrough) {
@@ -4885,7 +5066,8 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 						     cache->chunkId,
 						     cache->data, cache->nBytes,
 						     1);
-						cache->dirty = 0;
+						yaffs_CleanChunkCache(dev,
+								      cache);
 					}
 
 				} else {
@@ -5384,10 +5566,6 @@ static void yaffs_HandleShadowedObject(yaffs_Device *dev, int objId,
 
 }
 
-typedef struct {
-	int seq;
-	int block;
-} yaffs_BlockIndex;
 
 
 static void yaffs_HardlinkFixup(yaffs_Device *dev, yaffs_Object *hardList)
@@ -6048,8 +6226,16 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		in->lazyLoaded ? "not yet" : "already"));
 #endif
 
+	if (!in->lazyLoaded) {
+		/* Pairs with clearing lazyLoaded after the details are set */
+		yaffs_LazyLoadBarrier();
+		return;
+	}
+
+	/* Several readers may get here at once */
+	yaffs_LockLazyLoad(dev);
+
 	if (in->lazyLoaded && in->hdrChunk > 0) {
-		in->lazyLoaded = 0;
 		chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 		result = yaffs_ReadChunkWithTagsFromNAND(dev, in->hdrChunk, chunkData, &tags);
@@ -6083,6 +6269,13 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 
 		yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
 	}
+
+#ifdef __KERNEL__
+	smp_wmb();
+#endif
+	in->lazyLoaded = 0;
+
+	yaffs_UnlockLazyLoad(dev);
 }
 
 static int yaffs_ScanBackwards(yaffs_Device *dev)
@@ -6118,6 +6311,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	yaffs_BlockIndex *blockIndex = NULL;
 	int altBlockIndex = 0;
+	int readAhead = 0;
+	const yaffs_ExtendedTags *blockTags = NULL;
 
 	if (!dev->isYaffs2) {
 		T(YAFFS_TRACE_SCAN,
@@ -6248,6 +6443,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	T(YAFFS_TRACE_SCAN_DEBUG,
 	  (TSTR("%d blocks to be scanned" TENDSTR), nBlocksToScan));
 
+	/* The OS may read the tags in the background while we build objects */
+	if (dev->startScanReadAhead && nBlocksToScan > 0)
+		readAhead = dev->startScanReadAhead(dev, blockIndex,
+						    nBlocksToScan);
+
 	/* For each block.... backwards */
 	for (blockIterator = endIterator; !alloc_failed && blockIterator >= startIterator;
 			blockIterator--) {
@@ -6260,6 +6460,10 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		bi = yaffs_GetBlockInfo(dev, blk);
 
+		if (readAhead)
+			blockTags = dev->getScanTags(dev,
+						     endIterator - blockIterator);
+
 
 		state = bi->blockState;
 
@@ -6277,8 +6481,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (blockTags)
+				tags = blockTags[c];
+			else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev,
+							chunk, NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -6727,6 +6934,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	}
 
+	if (readAhead)
+		dev->endScanReadAhead(dev);
+
 	if (altBlockIndex)
 		YFREE_ALT(blockIndex);
 	else
@@ -7438,6 +7648,10 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	/* More device initialisation */
 	dev->garbageCollections = 0;
 	dev->passiveGarbageCollections = 0;
+	dev->bgGarbageCollections = 0;
+	dev->bgGCCopies = 0;
+	dev->nForegroundGCStalls = 0;
+	dev->bgGCWokenAt = -1;
 	dev->currentDirtyChecker = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
@@ -7458,6 +7672,12 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		init_failed = 1;
 
 	dev->srCache = NULL;
+	dev->srHash = NULL;
+	dev->srFlushList = NULL;
+	YINIT_LIST_HEAD(&dev->srFree);
+	YINIT_LIST_HEAD(&dev->srClean);
+	YINIT_LIST_HEAD(&dev->srDirty);
+	dev->nDirtyCacheChunks = 0;
 	dev->gcCleanupList = NULL;
 
 
@@ -7465,31 +7685,49 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	    dev->nShortOpCaches > 0) {
 		int i;
 		void *buf;
-		int srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
+		int nBuckets = 1;
 
 		if (dev->nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+
+		/* About one entry per hash bucket */
+		while (nBuckets < dev->nShortOpCaches)
+			nBuckets <<= 1;
+		dev->srHashMask = nBuckets - 1;
+
 		dev->srCache =  YMALLOC(srCacheBytes);
+		dev->srHash = YMALLOC(nBuckets * sizeof(struct ylist_head));
+		dev->srFlushList = YMALLOC(dev->nShortOpCaches *
+					   sizeof(yaffs_ChunkCache *));
 
-		buf = (__u8 *) dev->srCache;
+		buf = (dev->srHash && dev->srFlushList) ?
+			(__u8 *) dev->srCache : NULL;
 
 		if (dev->srCache)
 			memset(dev->srCache, 0, srCacheBytes);
 
+		for (i = 0; i < nBuckets && buf; i++)
+			YINIT_LIST_HEAD(&dev->srHash[i]);
+
 		for (i = 0; i < dev->nShortOpCaches && buf; i++) {
 			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+			ylist_add_tail(&dev->srCache[i].lruLink, &dev->srFree);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->totalBytesPerChunk);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->srLastUse = 0;
 	}
 
 	dev->cacheHits = 0;
+	dev->cacheMisses = 0;
+	dev->cacheEvictions = 0;
+	dev->cacheWriteBacks = 0;
+	dev->cacheFlushes = 0;
 
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->nChunksPerBlock * sizeof(__u32));
@@ -7608,6 +7846,12 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 			YFREE(dev->srCache);
 			dev->srCache = NULL;
 		}
+		if (dev->srHash)
+			YFREE(dev->srHash);
+		dev->srHash = NULL;
+		if (dev->srFlushList)
+			YFREE(dev->srFlushList);
+		dev->srFlushList = NULL;
 
 		YFREE(dev->gcCleanupList);
 
@@ -7654,9 +7898,7 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 	/* This is what we report to the outside world */
 
 	int nFree;
-	int nDirtyCacheChunks;
 	int blocksForCheckpoint;
-	int i;
 
 #if 1
 	nFree = dev->nFreeChunks;
@@ -7666,14 +7908,9 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 
 	nFree += dev->nDeletedFiles;
 
-	/* Now count the number of dirty chunks in the cache and subtract those */
-
-	for (nDirtyCacheChunks = 0, i = 0; i < dev->nShortOpCaches; i++) {
-		if (dev->srCache[i].dirty)
-			nDirtyCacheChunks++;
-	}
+	/* Now subtract the number of dirty chunks in the cache */
 
-	nFree -= nDirtyCacheChunks;
+	nFree -= dev->nDirtyCacheChunks;
 
 	nFree -= ((dev->nReservedBlocks + 1) * dev->nChunksPerBlock);
 
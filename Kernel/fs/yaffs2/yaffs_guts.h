@@ -88,10 +88,15 @@
 
 /* */
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	1024
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Chunk errors seen by readers that don't hold the gross lock are queued
+ * until the next garbage collection check.
+ */
+#define YAFFS_N_PENDING_ERRORS		8
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -113,12 +118,12 @@
 
 /* ChunkCache is used for short read/write operations.*/
 typedef struct {
+	struct ylist_head hashLink;	/* In a dev->srHash bucket while in use */
+	struct ylist_head lruLink;	/* In dev->srFree, srClean or srDirty */
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
-	int locked;		/* Can't push out or flush while locked. */
 #ifdef CONFIG_YAFFS_YAFFS2
 	__u8 *data;
 #else
@@ -530,6 +535,12 @@ typedef struct {
 	int maxLine;
 } yaffs_TempBuffer;
 
+/* Blocks to scan at mount, sorted by sequence number */
+typedef struct {
+	int seq;
+	int block;
+} yaffs_BlockIndex;
+
 /*----------------- Device ---------------------------------*/
 
 struct yaffs_DeviceStruct {
@@ -604,6 +615,30 @@ struct yaffs_DeviceStruct {
 	/* Callback to mark the superblock dirsty */
 	void (*markSuperBlockDirty)(void *superblock);
 
+	/* Optional read-ahead of tags for yaffs_ScanBackwards().
+	 * startScanReadAhead is given the blocks sorted by sequence number and
+	 * returns non-zero if it will read the tags of all their chunks,
+	 * last block first.  getScanTags(dev, n) then returns the tags of the
+	 * n'th block in that order, waiting for them if need be.
+	 */
+	int (*startScanReadAhead)(struct yaffs_DeviceStruct *dev,
+				  const yaffs_BlockIndex *blockIndex,
+				  int nBlocks);
+	const yaffs_ExtendedTags *(*getScanTags)(struct yaffs_DeviceStruct *dev,
+						 int n);
+	void (*endScanReadAhead)(struct yaffs_DeviceStruct *dev);
+	void *scanContext;
+
+	/* Optional background garbage collection.  While bgGCFreeBlocks is
+	 * non-zero the OS calls yaffs_BackgroundGarbageCollect() from its own
+	 * thread to keep that many erased blocks spare on top of the reserve,
+	 * and the write path only collects once it is about to run out.
+	 * wakeBackgroundGC is called when a writer finds fewer spare blocks.
+	 */
+	int bgGCFreeBlocks;
+	void (*wakeBackgroundGC)(struct yaffs_DeviceStruct *dev);
+	int bgGCWokenAt;	/* nErasedBlocks at the last wakeBackgroundGC */
+
 	int wideTnodesDisabled; /* Set to disable wide tnodes */
 
 	YCHAR *pathDividers;	/* String of legal path dividers */
@@ -637,13 +672,27 @@ struct yaffs_DeviceStruct {
 
 	struct semaphore sem;	/* Semaphore for waiting on erasure.*/
 	struct semaphore grossLock;	/* Gross locking semaphore */
-	struct rw_semaphore dirLock; /* Lock the directory structure */
+	struct rw_semaphore mapLock;	/* Held for reading by readers that run
+					 * without grossLock, for writing by the
+					 * grossLock holder while it changes
+					 * something they look at.
+					 */
+	int mapLockDepth;		/* Nesting of mapLock by grossLock holder */
+	struct mutex lazyLoadLock;	/* Serialises lazy loading of objects */
+	spinlock_t stateLock;		/* Temp buffers, search contexts,
+					 * pending chunk errors and cache
+					 * hit counts.
+					 */
+	int pendingErrorBlock[YAFFS_N_PENDING_ERRORS];
+	int nPendingErrors;
+	__u32 pendingRetire;		/* Bit i: retire pendingErrorBlock[i] */
 	__u8 *spareBuffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 
 				 */
 	void (*putSuperFunc) (struct super_block *sb);
         struct ylist_head searchContexts;
+	struct task_struct *bgThread;	/* Writes the checkpoint when idle */
 
 #endif
 
@@ -725,6 +774,9 @@ struct yaffs_DeviceStruct {
 	int nGCCopies;
 	int garbageCollections;
 	int passiveGarbageCollections;
+	int bgGarbageCollections;	/* Blocks collected in the background */
+	int bgGCCopies;			/* Chunks they copied */
+	int nForegroundGCStalls;	/* Writes that had to collect a block */
 	int nRetriedWrites;
 	int nRetiredBlocks;
 	int eccFixed;
@@ -749,9 +801,19 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
-
-	int cacheHits;
+	struct ylist_head *srHash;	/* Entries in use, by object and chunk */
+	int srHashMask;
+	struct ylist_head srFree;	/* Unused entries */
+	struct ylist_head srClean;	/* Clean entries, most recently used first */
+	struct ylist_head srDirty;	/* Dirty entries, most recently used first */
+	yaffs_ChunkCache **srFlushList;	/* For sorting an object's dirty chunks */
+	int nDirtyCacheChunks;
+
+	int cacheHits;		/* Under stateLock, as readers count too */
+	int cacheMisses;
+	int cacheEvictions;	/* Clean entries reused for another chunk */
+	int cacheWriteBacks;	/* Dirty chunks written out */
+	int cacheFlushes;	/* Batches of an object's dirty chunks written */
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -856,6 +918,8 @@ void yaffs_FlushEntireDeviceCache(yaffs_Device *dev);
 int yaffs_CheckpointSave(yaffs_Device *dev);
 int yaffs_CheckpointRestore(yaffs_Device *dev);
 
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int idle);
+
 /* Directory operations */
 yaffs_Object *yaffs_MknodDirectory(yaffs_Object *parent, const YCHAR *name,
 				__u32 mode, __u32 uid, __u32 gid);
@@ -905,6 +969,10 @@ void yaffs_InitialiseTags(yaffs_ExtendedTags *tags);
 void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn);
 int yaffs_CheckFF(__u8 *buffer, int nBytes);
 void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi);
+void yaffs_QueueChunkError(yaffs_Device *dev, int blockInNAND, int retire);
+
+void yaffs_LockMap(yaffs_Device *dev);
+void yaffs_UnlockMap(yaffs_Device *dev);
 
 __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo);
 void yaffs_ReleaseTempBuffer(yaffs_Device *dev, __u8 *buffer, int lineNo);
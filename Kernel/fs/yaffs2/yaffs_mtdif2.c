@@ -135,7 +135,8 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		ops.len = data ? dev->nDataBytesPerChunk : sizeof(pt);
 		ops.ooboffs = 0;
 		ops.datbuf = data;
-		ops.oobbuf = dev->spareBuffer;
+		/* Not dev->spareBuffer: readers may run concurrently */
+		ops.oobbuf = (void *)&pt;
 		retval = mtd->read_oob(mtd, addr, &ops);
 	}
 #else
@@ -165,7 +166,9 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		}
 	} else {
 		if (tags) {
+#if (LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 17))
 			memcpy(&pt, dev->spareBuffer, sizeof(pt));
+#endif
 			yaffs_UnpackTags2(tags, &pt);
 		}
 	}
@@ -43,12 +43,10 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 									realignedChunkInNAND,
 									buffer,
 									tags);
+	/* This may run without the gross lock, so leave the block info alone */
 	if (tags &&
-	   tags->eccResult > YAFFS_ECC_RESULT_NO_ERROR) {
-
-		yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, chunkInNAND/dev->nChunksPerBlock);
-		yaffs_HandleChunkError(dev, bi);
-	}
+	   tags->eccResult > YAFFS_ECC_RESULT_NO_ERROR)
+		yaffs_QueueChunkError(dev, chunkInNAND/dev->nChunksPerBlock, 0);
 
 	return result;
 }
@@ -332,8 +332,8 @@ static void yaffs_HandleReadDataError(yaffs_Device *dev, int chunkInNAND)
 {
 	int blockInNAND = chunkInNAND / dev->nChunksPerBlock;
 
-	/* Mark the block for retirement */
-	yaffs_GetBlockInfo(dev, blockInNAND + dev->blockOffset)->needsRetiring = 1;
+	/* Mark the block for retirement, once the gross lock holder gets to it */
+	yaffs_QueueChunkError(dev, blockInNAND + dev->blockOffset, 1);
 	T(YAFFS_TRACE_ERROR | YAFFS_TRACE_BAD_BLOCKS,
 	  (TSTR("**>>Block %d marked for retirement" TENDSTR), blockInNAND));
 
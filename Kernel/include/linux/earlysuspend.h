@@ -18,6 +18,8 @@
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 #include <linux/list.h>
+#include <linux/completion.h>
+#include <linux/types.h>
 #endif
 
 /* The early_suspend structure defines suspend and resume hooks to be called
@@ -29,6 +31,13 @@
  * the suspend handlers have already been called without a matching call to the
  * resume handlers, the suspend handler will be called directly from
  * register_early_suspend. This direct call can violate the normal level order.
+ *
+ * A handler with async set is called from an async thread, in parallel with
+ * the other async handlers around it. It is only ordered against the
+ * handlers named in depends, a NULL terminated list of names: they suspend
+ * after it and resume before it, and must have a higher level. A handler
+ * without async waits for all handlers called before it, and the ones after
+ * it wait for it, as if none were async.
  */
 enum {
 	EARLY_SUSPEND_LEVEL_BLANK_SCREEN = 50,
@@ -41,6 +50,14 @@ struct early_suspend {
 	int level;
 	void (*suspend)(struct early_suspend *h);
 	void (*resume)(struct early_suspend *h);
+	const char *name;
+	const char *const *depends;
+	unsigned int async:1;
+
+	/* private to kernel/power/earlysuspend.c */
+	struct completion done;
+	s64 call_us[2];			/* last suspend and resume */
+	s64 done_us[2];			/* since the handlers were started */
 #endif
 };
 
@@ -25,6 +25,26 @@ extern int onenand_scan(struct mtd_info *mtd, int max_chips);
 /* Free resources held by the OneNAND device */
 extern void onenand_release(struct mtd_info *mtd);
 
+/**
+ * struct onenand_page_req - one page for onenand_read_pages()
+ * @addr:		page aligned offset on the device
+ * @datbuf:		buffer for the page's main data, or NULL
+ * @oobbuf:		buffer for its free OOB bytes (ecclayout->oobavail),
+ *			or NULL
+ * @ret:		[OUT] 0, -EUCLEAN if bitflips were corrected, or
+ *			-EBADMSG
+ */
+struct onenand_page_req {
+	loff_t		addr;
+	u_char		*datbuf;
+	u_char		*oobbuf;
+	int		ret;
+};
+
+/* Read a list of pages, loading the next while copying out the last */
+extern int onenand_read_pages(struct mtd_info *mtd,
+		struct onenand_page_req *reqs, int count);
+
 /*
  * onenand_state_t - chip states
  * Enumeration for OneNAND flash chip state
@@ -69,6 +89,9 @@ struct onenand_bufferram {
  * @writesize:		[INTERN] a real page size
  * @bufferram_index:	[INTERN] BufferRAM index
  * @bufferram:		[INTERN] BufferRAM info
+ * @prefetch_addr:	[INTERN] page being loaded ahead of a sequential read,
+ *			or -1
+ * @read_next:		[INTERN] where the last read ended
  * @readw:		[REPLACEABLE] hardware specific function for read short
  * @writew:		[REPLACEABLE] hardware specific function for write short
  * @command:		[REPLACEABLE] hardware specific function for writing
@@ -117,6 +140,8 @@ struct onenand_chip {
 
 	unsigned int		bufferram_index;
 	struct onenand_bufferram	bufferram[MAX_BUFFERRAM];
+	loff_t			prefetch_addr;
+	loff_t			read_next;
 
 	int (*command)(struct mtd_info *mtd, int cmd, loff_t address, size_t len);
 	int (*wait)(struct mtd_info *mtd, int state);
@@ -13,6 +13,18 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
+
+/*
+ * Events of the oom_adj notifier chain, for low memory killers that keep
+ * their own view of the processes by oom_adj.  The data is the task.
+ */
+enum oom_adj_event {
+	OOM_ADJ_TASK_FORK,	/* new task, not yet running */
+	OOM_ADJ_TASK_EXIT,	/* task is exiting, PF_EXITING is set */
+	OOM_ADJ_TASK_LEADER,	/* task became its group leader in exec */
+	OOM_ADJ_CHANGED,	/* the task's signal->oom_adj was written */
+};
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -29,6 +41,9 @@ extern void clear_zonelist_oom(struct zonelist *zonelist, gfp_t gfp_flags);
 extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask, int order);
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+extern void oom_adj_notify(enum oom_adj_event event, struct task_struct *p);
 
 extern bool oom_killer_disabled;
 
@@ -1492,6 +1492,10 @@ struct task_struct {
 	struct mutex perf_event_mutex;
 	struct list_head perf_event_list;
 #endif
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* entry in the low memory killer's oom_adj buckets */
+	struct list_head lowmem_node;
+#endif
 #ifdef CONFIG_NUMA
 	struct mempolicy *mempolicy;	/* Protected by alloc_lock */
 	short il_next;
@@ -13,10 +13,13 @@
  *
  */
 
+#include <linux/async.h>
+#include <linux/debugfs.h>
 #include <linux/earlysuspend.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/seq_file.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #include <linux/workqueue.h>
@@ -55,6 +58,18 @@ enum {
 };
 static int state;
 
+/* async handlers of the current call_handlers() */
+static LIST_HEAD(early_suspend_domain);
+static int handlers_resuming;
+static ktime_t handlers_start;
+
+/* statistics, in microseconds */
+static s64 early_suspend_us;
+static s64 late_resume_us;
+static ktime_t screen_on_requested;
+static s64 screen_on_us;
+static s64 screen_on_max_us;
+
 static void sync_system(struct work_struct *work)
 {
 	pr_info("%s +\n", __func__);
@@ -68,6 +83,7 @@ void register_early_suspend(struct early_suspend *handler)
 {
 	struct list_head *pos;
 
+	init_completion(&handler->done);
 	mutex_lock(&early_suspend_lock);
 	list_for_each(pos, &early_suspend_handlers) {
 		struct early_suspend *e;
@@ -90,14 +106,106 @@ void unregister_early_suspend(struct early_suspend *handler)
 }
 EXPORT_SYMBOL(unregister_early_suspend);
 
+/* whether @h names @on in its depends */
+static int early_suspend_depends(struct early_suspend *h,
+				 struct early_suspend *on)
+{
+	const char *const *name;
+
+	if (!h->depends || !on->name)
+		return 0;
+	for (name = h->depends; *name; name++)
+		if (!strcmp(*name, on->name))
+			return 1;
+	return 0;
+}
+
+/*
+ * Only handlers started before @h are waited for, so a dependency on a
+ * handler with a level not above that of @h is ignored rather than a
+ * deadlock.
+ */
+static void wait_for_dependencies(struct early_suspend *h, int resume)
+{
+	struct early_suspend *pos = h;
+
+	if (resume) {
+		list_for_each_entry_continue(pos, &early_suspend_handlers, link)
+			if (early_suspend_depends(h, pos))
+				wait_for_completion(&pos->done);
+	} else {
+		list_for_each_entry_continue_reverse(pos,
+				&early_suspend_handlers, link)
+			if (early_suspend_depends(pos, h))
+				wait_for_completion(&pos->done);
+	}
+}
+
+static void call_handler(struct early_suspend *h, int resume)
+{
+	void (*fn)(struct early_suspend *h) = resume ? h->resume : h->suspend;
+	ktime_t start;
+
+	wait_for_dependencies(h, resume);
+	start = ktime_get();
+	if (fn)
+		fn(h);
+	h->call_us[resume] = ktime_us_delta(ktime_get(), start);
+	h->done_us[resume] = ktime_us_delta(ktime_get(), handlers_start);
+	complete_all(&h->done);
+}
+
+static void call_handler_async(void *data, async_cookie_t cookie)
+{
+	call_handler(data, handlers_resuming);
+}
+
+static void start_handler(struct early_suspend *h, int resume)
+{
+	if (h->async) {
+		async_schedule_domain(call_handler_async, h,
+				      &early_suspend_domain);
+		return;
+	}
+	if (resume ? h->resume : h->suspend) {
+		async_synchronize_full_domain(&early_suspend_domain);
+		call_handler(h, resume);
+	} else {
+		complete_all(&h->done);
+	}
+}
+
+/*
+ * Call the suspend handlers in level order, or the resume handlers in
+ * reverse, async ones in parallel.  Returns once all are done.  Caller
+ * must hold early_suspend_lock.
+ */
+static s64 call_handlers(int resume)
+{
+	struct early_suspend *pos;
+
+	list_for_each_entry(pos, &early_suspend_handlers, link)
+		INIT_COMPLETION(pos->done);
+	handlers_resuming = resume;
+	handlers_start = ktime_get();
+	if (resume) {
+		list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
+			start_handler(pos, resume);
+	} else {
+		list_for_each_entry(pos, &early_suspend_handlers, link)
+			start_handler(pos, resume);
+	}
+	async_synchronize_full_domain(&early_suspend_domain);
+	return ktime_us_delta(ktime_get(), handlers_start);
+}
+
 #ifdef CONFIG_CPU_FREQ
-extern bool g_dvfs_fix_lock_limit;
+static DEFINE_DVFS_QOS_REQUEST(lpaudio_qos, "lpaudio");
 bool gbGovernorTransition = false;
 #endif
 
 static void early_suspend(struct work_struct *work)
 {
-	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
 #ifdef CONFIG_CPU_FREQ
@@ -122,10 +230,7 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
-	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL)
-			pos->suspend(pos);
-	}
+	early_suspend_us = call_handlers(0);
 	mutex_unlock(&early_suspend_lock);
 
 	if (debug_mask & DEBUG_SUSPEND)
@@ -140,8 +245,7 @@ static void early_suspend(struct work_struct *work)
 #ifdef CONFIG_CPU_FREQ
 	if(is_conservative_gov()) {
 		/*Fix the upper transition scaling*/
-		g_dvfs_fix_lock_limit = true;
-		s5pc110_lock_dvfs_high_level(DVFS_LOCK_TOKEN_5, LEV_800MHZ);
+		dvfs_qos_update_request(&lpaudio_qos, 800000, 800000, 0);
 		gbGovernorTransition = true;
 
 		error = cpufreq_get_policy(&policy, 0);
@@ -165,7 +269,6 @@ abort:
 
 static void late_resume(struct work_struct *work)
 {
-	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
 
@@ -190,8 +293,7 @@ static void late_resume(struct work_struct *work)
 #ifdef CONFIG_CPU_FREQ
 	// change cpufreq to original one
 	if(gbGovernorTransition) {
-		g_dvfs_fix_lock_limit = false;
-		s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_5);
+		dvfs_qos_release_request(&lpaudio_qos);
 		gbGovernorTransition = false;
 	}
 #endif /* CONFIG_CPU_FREQ */
@@ -200,11 +302,15 @@ static void late_resume(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
-	list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
-		if (pos->resume != NULL)
-			pos->resume(pos);
+	late_resume_us = call_handlers(1);
+	spin_lock_irqsave(&state_lock, irqflags);
+	screen_on_us = ktime_us_delta(ktime_get(), screen_on_requested);
+	if (screen_on_us > screen_on_max_us)
+		screen_on_max_us = screen_on_us;
+	spin_unlock_irqrestore(&state_lock, irqflags);
 	if (debug_mask & DEBUG_SUSPEND)
-		pr_info("late_resume: done\n");
+		pr_info("late_resume: done, handlers %lld us, since request "
+			"%lld us\n", late_resume_us, screen_on_us);
 abort:
 	mutex_unlock(&early_suspend_lock);
 }
@@ -234,6 +340,7 @@ void request_suspend_state(suspend_state_t new_state)
 		queue_work(suspend_work_queue, &early_suspend_work);
 	} else if (old_sleep && new_state == PM_SUSPEND_ON) {
 		state &= ~SUSPEND_REQUESTED;
+		screen_on_requested = ktime_get();
 		wake_lock(&main_wake_lock);
 		queue_work(suspend_work_queue, &late_resume_work);
 	}
@@ -245,3 +352,52 @@ suspend_state_t get_suspend_state(void)
 {
 	return requested_suspend_state;
 }
+
+#ifdef CONFIG_DEBUG_FS
+static int early_suspend_show(struct seq_file *s, void *unused)
+{
+	struct early_suspend *pos;
+
+	mutex_lock(&early_suspend_lock);
+	seq_printf(s, "%-32s %5s %5s %10s %10s %10s %10s\n", "handler",
+		   "level", "async", "susp us", "done us", "resume us",
+		   "done us");
+	list_for_each_entry(pos, &early_suspend_handlers, link) {
+		if (pos->name)
+			seq_printf(s, "%-32s", pos->name);
+		else
+			seq_printf(s, "%-32pf",
+				   pos->suspend ? pos->suspend : pos->resume);
+		seq_printf(s, " %5d %5d %10lld %10lld %10lld %10lld\n",
+			   pos->level, pos->async, pos->call_us[0],
+			   pos->done_us[0], pos->call_us[1], pos->done_us[1]);
+	}
+	seq_printf(s, "early_suspend: %lld us\n", early_suspend_us);
+	seq_printf(s, "late_resume: %lld us\n", late_resume_us);
+	seq_printf(s, "screen on: %lld us, max %lld us\n", screen_on_us,
+		   screen_on_max_us);
+	mutex_unlock(&early_suspend_lock);
+
+	return 0;
+}
+
+static int early_suspend_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, early_suspend_show, inode->i_private);
+}
+
+static const struct file_operations early_suspend_fops = {
+	.open		= early_suspend_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init early_suspend_debug_init(void)
+{
+	debugfs_create_file("early_suspend", S_IRUGO, NULL, NULL,
+			    &early_suspend_fops);
+	return 0;
+}
+late_initcall(early_suspend_debug_init);
+#endif /* CONFIG_DEBUG_FS */
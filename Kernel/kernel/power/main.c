@@ -17,12 +17,6 @@
 //#endif
 #include "power.h"
 
-
-static void do_dvfsunlock_timer(struct work_struct *work);
-static DEFINE_MUTEX (dvfslock_ctrl_mutex);
-static DECLARE_DELAYED_WORK(dvfslock_crtl_unlock_work, do_dvfsunlock_timer);
-
-
 DEFINE_MUTEX(pm_mutex);
 
 unsigned int pm_flags;
@@ -121,60 +115,42 @@ power_attr(pm_test);
 
 /**
  * store_dvfslock_ctrl - make dvfs lock through application
+ *
+ * 0 drops the lock.  Otherwise the low 16 bits are how long to hold it
+ * in ms, at 1GHz if any of the high bits is set and at the top level if
+ * not.  A new lock replaces the one held and restarts the time.
  */
 extern int g_dbs_timer_started;
-int dvfsctrl_locked;
 int gdDvfsctrl = 0;
+static DEFINE_DVFS_QOS_REQUEST(launcher_qos, "launcher");
 static ssize_t dvfslock_ctrl(const char *buf, size_t count)
 {
 	unsigned int ret = -EINVAL;
-	int dlevel;
+	unsigned int min_freq;
 	int dtime_msec;
 
-	//mutex_lock(&dvfslock_ctrl_mutex);
 	ret = sscanf(buf, "%u", &gdDvfsctrl);
 	if (ret != 1)
 		return -EINVAL;
 	
 	if (!g_dbs_timer_started)	 return -EINVAL;
 	if (gdDvfsctrl == 0) {
-		if (dvfsctrl_locked) {
-			s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_6);
-			dvfsctrl_locked = 0;
-			return -EINVAL;		
-		} else {
-			return -EINVAL;		
-		}
+		dvfs_qos_release_request(&launcher_qos);
+		return -EINVAL;
 	}
-	
-	if (dvfsctrl_locked) return 0;
 		
-	dlevel = gdDvfsctrl & 0xffff0000;
 	dtime_msec = gdDvfsctrl & 0x0000ffff;
 	if (dtime_msec <16) dtime_msec=16;
 	
-	if (dtime_msec  == 0) return -EINVAL;
-	if(dlevel) dlevel = LEV_800MHZ;
-	else dlevel = LEV_1000MHZ;
+	if (gdDvfsctrl & 0xffff0000) min_freq = 1000000;
+	else min_freq = MAXIMUM_FREQ;
 	
-	printk("+++++DBG dvfs lock level=%d, time=%d, scanVal=%08x\n",dlevel,dtime_msec, gdDvfsctrl);
-	s5pc110_lock_dvfs_high_level(DVFS_LOCK_TOKEN_6, dlevel);
-	dvfsctrl_locked=1;
-
-
-	schedule_delayed_work(&dvfslock_crtl_unlock_work, dtime_msec);
-
-	//mutex_unlock(&dvfslock_ctrl_mutex);
+	printk("+++++DBG dvfs lock freq=%u, time=%d, scanVal=%08x\n",min_freq,dtime_msec, gdDvfsctrl);
+	dvfs_qos_update_request(&launcher_qos, min_freq, 0, dtime_msec);
 
 	return -EINVAL;
 }
 
-static void do_dvfsunlock_timer(struct work_struct *work) {
-	//printk("----DBG dvfs unlock\n");
-	dvfsctrl_locked = 0;	
-	s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_6);
-}
-
 
 ssize_t dvfslock_ctrl_show(
 	struct kobject *kobj, struct kobj_attribute *attr, char *buf)
@@ -263,7 +263,7 @@ static void suspend_finish(void)
 bool gbClockFix = false;
 static bool userSpaceGovernor=false;
 static unsigned int g_cpuspeed=0;
-extern bool g_dvfs_fix_lock_limit;
+static DEFINE_DVFS_QOS_REQUEST(suspend_qos, "suspend");
 extern int s5pc110_pm_target(unsigned int target_freq);
 extern unsigned int s5pc110_getspeed(unsigned int cpu);
 #endif
@@ -290,8 +290,7 @@ int enter_state(suspend_state_t state)
 		userSpaceGovernor=true;
     	} else if(is_conservative_gov()) {
 		/*Fix the upper transition scaling*/
-		g_dvfs_fix_lock_limit = true;
-		s5pc110_lock_dvfs_high_level(DVFS_LOCK_TOKEN_7, LEV_800MHZ);
+		dvfs_qos_update_request(&suspend_qos, 800000, 800000, 0);
 		gbClockFix = true;
 
 		error = cpufreq_get_policy(&policy, 0);
@@ -341,8 +340,7 @@ int enter_state(suspend_state_t state)
 	}
 	// change cpufreq to original one
 	if(gbClockFix) {
-		g_dvfs_fix_lock_limit = false;
-		s5pc110_unlock_dvfs_high_level(DVFS_LOCK_TOKEN_7);
+		dvfs_qos_release_request(&suspend_qos);
 		gbClockFix = false;
 	}
 #else
@@ -14,6 +14,7 @@
  */
 
 #include <linux/ctype.h>
+#include <linux/dcache.h>
 #include <linux/module.h>
 #include <linux/wakelock.h>
 
@@ -29,22 +30,56 @@ enum {
 static int debug_mask = DEBUG_FAILURE;
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
-static DEFINE_MUTEX(tree_lock);
+/*
+ * Locks not held are freed, least recently used first, once there are
+ * more than this many user wake locks; their stats go to
+ * deleted_wake_locks.
+ */
+static int max_user_wake_locks = 100;
+module_param_named(max_locks, max_user_wake_locks, int,
+		   S_IRUGO | S_IWUSR | S_IWGRP);
+
+static DEFINE_MUTEX(table_lock);
+
+#define USER_WAKE_LOCK_HASH_BITS	6
+#define USER_WAKE_LOCK_HASH_SIZE	(1 << USER_WAKE_LOCK_HASH_BITS)
 
 struct user_wake_lock {
-	struct rb_node		node;
+	struct hlist_node	node;
+	struct list_head	lru;
 	struct wake_lock	wake_lock;
 	char			name[0];
 };
-struct rb_root user_wake_locks;
+static struct hlist_head user_wake_locks[USER_WAKE_LOCK_HASH_SIZE];
+static LIST_HEAD(user_wake_lock_lru);	/* least recently used first */
+static int user_wake_lock_count;
+
+static void user_wake_lock_gc(void)
+{
+	struct user_wake_lock *l, *n;
+
+	list_for_each_entry_safe(l, n, &user_wake_lock_lru, lru) {
+		if (user_wake_lock_count <= max_user_wake_locks)
+			break;
+		if (wake_lock_active(&l->wake_lock))
+			continue;
+		if (debug_mask & DEBUG_NEW)
+			pr_info("user_wake_lock_gc: free wake lock %s\n",
+				l->name);
+		hlist_del(&l->node);
+		list_del(&l->lru);
+		wake_lock_destroy(&l->wake_lock);
+		kfree(l);
+		user_wake_lock_count--;
+	}
+}
 
 static struct user_wake_lock *lookup_wake_lock_name(
 	const char *buf, int allocate, long *timeoutptr)
 {
-	struct rb_node **p = &user_wake_locks.rb_node;
-	struct rb_node *parent = NULL;
+	struct hlist_head *head;
+	struct hlist_node *p;
 	struct user_wake_lock *l;
-	int diff;
 	u64 timeout;
 	int name_len;
 	const char *arg;
@@ -77,26 +112,20 @@ static struct user_wake_lock *lookup_wake_lock_name(
 	else if (timeoutptr)
 		*timeoutptr = 0;
 
-	/* Lookup wake lock in rbtree */
-	while (*p) {
-		parent = *p;
-		l = rb_entry(parent, struct user_wake_lock, node);
-		diff = strncmp(buf, l->name, name_len);
-		if (!diff && l->name[name_len])
-			diff = -1;
+	/* Lookup wake lock in the hash table */
+	head = &user_wake_locks[full_name_hash(buf, name_len) &
+				(USER_WAKE_LOCK_HASH_SIZE - 1)];
+	hlist_for_each_entry(l, p, head, node) {
 		if (debug_mask & DEBUG_ERROR)
-			pr_info("lookup_wake_lock_name: compare %.*s %s %d\n",
-				name_len, buf, l->name, diff);
-
-		if (diff < 0)
-			p = &(*p)->rb_left;
-		else if (diff > 0)
-			p = &(*p)->rb_right;
-		else
+			pr_info("lookup_wake_lock_name: compare %.*s %s\n",
+				name_len, buf, l->name);
+		if (!strncmp(buf, l->name, name_len) && !l->name[name_len]) {
+			list_move_tail(&l->lru, &user_wake_lock_lru);
 			return l;
+		}
 	}
 
-	/* Allocate and add new wakelock to rbtree */
+	/* Allocate and add new wakelock to the hash table */
 	if (!allocate) {
 		if (debug_mask & DEBUG_ERROR)
 			pr_info("lookup_wake_lock_name: %.*s not found\n",
@@ -114,8 +143,9 @@ static struct user_wake_lock *lookup_wake_lock_name(
 	if (debug_mask & DEBUG_NEW)
 		pr_info("lookup_wake_lock_name: new wake lock %s\n", l->name);
 	wake_lock_init(&l->wake_lock, WAKE_LOCK_SUSPEND, l->name);
-	rb_link_node(&l->node, parent, p);
-	rb_insert_color(&l->node, &user_wake_locks);
+	hlist_add_head(&l->node, head);
+	list_add_tail(&l->lru, &user_wake_lock_lru);
+	user_wake_lock_count++;
 	return l;
 
 bad_arg:
@@ -130,19 +160,17 @@ ssize_t wake_lock_show(
 {
 	char *s = buf;
 	char *end = buf + PAGE_SIZE;
-	struct rb_node *n;
 	struct user_wake_lock *l;
 
-	mutex_lock(&tree_lock);
+	mutex_lock(&table_lock);
 
-	for (n = rb_first(&user_wake_locks); n != NULL; n = rb_next(n)) {
-		l = rb_entry(n, struct user_wake_lock, node);
+	list_for_each_entry(l, &user_wake_lock_lru, lru) {
 		if (wake_lock_active(&l->wake_lock))
 			s += scnprintf(s, end - s, "%s ", l->name);
 	}
 	s += scnprintf(s, end - s, "\n");
 
-	mutex_unlock(&tree_lock);
+	mutex_unlock(&table_lock);
 	return (s - buf);
 }
 
@@ -153,7 +181,7 @@ ssize_t wake_lock_store(
 	long timeout;
 	struct user_wake_lock *l;
 
-	mutex_lock(&tree_lock);
+	mutex_lock(&table_lock);
 	l = lookup_wake_lock_name(buf, 1, &timeout);
 	if (IS_ERR(l)) {
 		n = PTR_ERR(l);
@@ -167,8 +195,9 @@ ssize_t wake_lock_store(
 		wake_lock_timeout(&l->wake_lock, timeout);
 	else
 		wake_lock(&l->wake_lock);
+	user_wake_lock_gc();
 bad_name:
-	mutex_unlock(&tree_lock);
+	mutex_unlock(&table_lock);
 	return n;
 }
 
@@ -178,19 +207,17 @@ ssize_t wake_unlock_show(
 {
 	char *s = buf;
 	char *end = buf + PAGE_SIZE;
-	struct rb_node *n;
 	struct user_wake_lock *l;
 
-	mutex_lock(&tree_lock);
+	mutex_lock(&table_lock);
 
-	for (n = rb_first(&user_wake_locks); n != NULL; n = rb_next(n)) {
-		l = rb_entry(n, struct user_wake_lock, node);
+	list_for_each_entry(l, &user_wake_lock_lru, lru) {
 		if (!wake_lock_active(&l->wake_lock))
 			s += scnprintf(s, end - s, "%s ", l->name);
 	}
 	s += scnprintf(s, end - s, "\n");
 
-	mutex_unlock(&tree_lock);
+	mutex_unlock(&table_lock);
 	return (s - buf);
 }
 
@@ -200,7 +227,7 @@ ssize_t wake_unlock_store(
 {
 	struct user_wake_lock *l;
 
-	mutex_lock(&tree_lock);
+	mutex_lock(&table_lock);
 	l = lookup_wake_lock_name(buf, 0, NULL);
 	if (IS_ERR(l)) {
 		n = PTR_ERR(l);
@@ -211,8 +238,9 @@ ssize_t wake_unlock_store(
 		pr_info("wake_unlock_store: %s\n", l->name);
 
 	wake_unlock(&l->wake_lock);
+	user_wake_lock_gc();
 not_found:
-	mutex_unlock(&tree_lock);
+	mutex_unlock(&table_lock);
 	return n;
 }
 
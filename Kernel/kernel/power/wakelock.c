@@ -47,7 +47,14 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
-static int current_event_num;
+/*
+ * Active locks without a timeout are counted, those with one are also
+ * kept in a tree sorted by expiry, so that has_wake_lock() does not walk
+ * the active lists.
+ */
+static int untimed_wake_locks[WAKE_LOCK_TYPE_COUNT];
+static struct rb_root timed_wake_locks[WAKE_LOCK_TYPE_COUNT];
+static atomic_t current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct workqueue_struct *sync_work_queue;
 struct wake_lock main_wake_lock;
@@ -57,7 +64,6 @@ static struct wake_lock unknown_wakeup;
 
 #ifdef CONFIG_WAKELOCK_STAT
 static struct wake_lock deleted_wake_locks;
-static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
@@ -87,7 +93,8 @@ int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 }
 
 
-static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
+static int print_lock_stat(struct seq_file *m, struct wake_lock *lock,
+			   ktime_t now)
 {
 	int lock_count = lock->stat.count;
 	int expire_count = lock->stat.expire_count;
@@ -97,10 +104,8 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 
 	ktime_t prevent_suspend_time = lock->stat.prevent_suspend_time;
 	if (lock->flags & WAKE_LOCK_ACTIVE) {
-		ktime_t now, add_time;
+		ktime_t add_time;
 		int expired = get_expired_time(lock, &now);
-		if (!expired)
-			now = ktime_get();
 		add_time = ktime_sub(now, lock->stat.last_time);
 		lock_count++;
 		if (!expired)
@@ -110,7 +115,7 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 		total_time = ktime_add(total_time, add_time);
 		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)
 			prevent_suspend_time = ktime_add(prevent_suspend_time,
-					ktime_sub(now, last_sleep_time_update));
+				ktime_sub(now, lock->stat.prevent_suspend_start));
 		if (add_time.tv64 > max_time.tv64)
 			max_time = add_time;
 	}
@@ -128,18 +133,20 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 {
 	unsigned long irqflags;
 	struct wake_lock *lock;
+	ktime_t now;
 	int ret;
 	int type;
 
 	spin_lock_irqsave(&list_lock, irqflags);
+	now = ktime_get();
 
 	ret = seq_puts(m, "name\tcount\texpire_count\twake_count\tactive_since"
 			"\ttotal_time\tsleep_time\tmax_time\tlast_change\n");
 	list_for_each_entry(lock, &inactive_locks, link)
-		ret = print_lock_stat(m, lock);
+		ret = print_lock_stat(m, lock, now);
 	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
 		list_for_each_entry(lock, &active_wake_locks[type], link)
-			ret = print_lock_stat(m, lock);
+			ret = print_lock_stat(m, lock, now);
 	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
 	return 0;
@@ -164,43 +171,95 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 		lock->stat.max_time = duration;
 	lock->stat.last_time = ktime_get();
 	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-		duration = ktime_sub(now, last_sleep_time_update);
+		duration = ktime_sub(now, lock->stat.prevent_suspend_start);
 		lock->stat.prevent_suspend_time = ktime_add(
 			lock->stat.prevent_suspend_time, duration);
 		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 	}
 }
 
+/*
+ * Each lock keeps when it started to prevent suspend, so taking a lock
+ * while the main lock is released only touches that lock; the active list
+ * is walked when the main lock changes.
+ */
+static void prevent_suspend_stat_locked(struct wake_lock *lock, ktime_t now)
+{
+	ktime_t etime;
+
+	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)
+		return;
+	if (get_expired_time(lock, &etime))
+		return;
+	lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+	lock->stat.prevent_suspend_start = now;
+}
+
 static void update_sleep_wait_stats_locked(int done)
 {
 	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
-	int expired;
+	ktime_t now, etime, add;
 
 	now = ktime_get();
-	elapsed = ktime_sub(now, last_sleep_time_update);
 	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
-		expired = get_expired_time(lock, &etime);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-			if (expired)
-				add = ktime_sub(etime, last_sleep_time_update);
-			else
-				add = elapsed;
-			lock->stat.prevent_suspend_time = ktime_add(
-				lock->stat.prevent_suspend_time, add);
+		if (!done) {
+			prevent_suspend_stat_locked(lock, now);
+			continue;
 		}
-		if (done || expired)
-			lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
+		if (!(lock->flags & WAKE_LOCK_PREVENTING_SUSPEND))
+			continue;
+		if (get_expired_time(lock, &etime))
+			add = ktime_sub(etime, lock->stat.prevent_suspend_start);
 		else
-			lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+			add = ktime_sub(now, lock->stat.prevent_suspend_start);
+		lock->stat.prevent_suspend_time = ktime_add(
+			lock->stat.prevent_suspend_time, add);
+		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 	}
-	last_sleep_time_update = now;
 }
 #endif
 
+/*
+ * Count @lock as active, in the counters or the expiry tree, after its
+ * flags are set.  del_active_locked() takes it out again and must be
+ * called before they change.  Caller must acquire the list_lock spinlock.
+ */
+static void add_active_locked(struct wake_lock *lock, int type)
+{
+	struct rb_node **p = &timed_wake_locks[type].rb_node;
+	struct rb_node *parent = NULL;
+	struct wake_lock *l;
+
+	if (!(lock->flags & WAKE_LOCK_AUTO_EXPIRE)) {
+		untimed_wake_locks[type]++;
+		return;
+	}
+	while (*p) {
+		parent = *p;
+		l = rb_entry(parent, struct wake_lock, expire_node);
+		if ((long)(lock->expires - l->expires) < 0)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&lock->expire_node, parent, p);
+	rb_insert_color(&lock->expire_node, &timed_wake_locks[type]);
+}
+
+static void del_active_locked(struct wake_lock *lock, int type)
+{
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return;
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		rb_erase(&lock->expire_node, &timed_wake_locks[type]);
+	else
+		untimed_wake_locks[type]--;
+}
+
 
 static void expire_wake_lock(struct wake_lock *lock)
 {
+	del_active_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
@@ -236,21 +295,23 @@ static void print_active_locks(int type)
 
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	unsigned long now = jiffies;
+	struct wake_lock *lock;
+	struct rb_node *n;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	if (untimed_wake_locks[type])
+		return -1;
+	while ((n = rb_first(&timed_wake_locks[type]))) {
+		lock = rb_entry(n, struct wake_lock, expire_node);
+		if ((long)(lock->expires - now) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	n = rb_last(&timed_wake_locks[type]);
+	if (!n)
+		return 0;
+	return rb_entry(n, struct wake_lock, expire_node)->expires - now;
 }
 
 long has_wake_lock(int type)
@@ -292,7 +353,7 @@ static void suspend(struct work_struct *work)
 	} 
 #endif /* CONFIG_SVNET_WHITELIST */
 
-	entry_event_num = current_event_num;
+	entry_event_num = atomic_read(&current_event_num);
 	sys_sync();
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("suspend: enter suspend\n");
@@ -307,7 +368,7 @@ static void suspend(struct work_struct *work)
 			tm.tm_year + 2000, tm.tm_mon + 1, tm.tm_mday,
 			tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec);
 	}
-	if (current_event_num == entry_event_num) {
+	if (atomic_read(&current_event_num) == entry_event_num) {
 		if (debug_mask & DEBUG_SUSPEND)
 			pr_info("suspend: pm_suspend returned with no event\n");
 		wake_lock_timeout(&unknown_wakeup, HZ / 2);
@@ -390,7 +451,8 @@ void wake_lock_destroy(struct wake_lock *lock)
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
 	spin_lock_irqsave(&list_lock, irqflags);
-	lock->flags &= ~WAKE_LOCK_INITIALIZED;
+	del_active_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
+	lock->flags &= ~(WAKE_LOCK_INITIALIZED | WAKE_LOCK_ACTIVE);
 #ifdef CONFIG_WAKELOCK_STAT
 	if (lock->stat.count) {
 		deleted_wake_locks.stat.count += lock->stat.count;
@@ -418,6 +480,22 @@ static void wake_lock_internal(
 	unsigned long irqflags;
 	long expire_in;
 
+	/*
+	 * Taking a lock held without a timeout again without one only counts
+	 * as an event, which needs no spinlock.  Racing with wake_unlock()
+	 * is as if this came first.
+	 */
+	if (!has_timeout && !(debug_mask & DEBUG_WAKE_LOCK) &&
+#ifdef CONFIG_WAKELOCK_STAT
+	    !wait_for_wakeup &&
+#endif
+	    (lock->flags & (WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE)) ==
+	    WAKE_LOCK_ACTIVE) {
+		if ((lock->flags & WAKE_LOCK_TYPE_MASK) == WAKE_LOCK_SUSPEND)
+			atomic_inc(&current_event_num);
+		return;
+	}
+
 	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
@@ -435,6 +513,7 @@ static void wake_lock_internal(
 		lock->stat.last_time = ktime_get();
 	}
 #endif
+	del_active_locked(lock, type);
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
@@ -457,13 +536,14 @@ static void wake_lock_internal(
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
 		list_add(&lock->link, &active_wake_locks[type]);
 	}
+	add_active_locked(lock, type);
 	if (type == WAKE_LOCK_SUSPEND) {
-		current_event_num++;
+		atomic_inc(&current_event_num);
 #ifdef CONFIG_WAKELOCK_STAT
 		if (lock == &main_wake_lock)
 			update_sleep_wait_stats_locked(1);
 		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
+			prevent_suspend_stat_locked(lock, ktime_get());
 #endif
 		if (has_timeout)
 			expire_in = has_wake_lock_locked(type);
@@ -502,8 +582,14 @@ void wake_unlock(struct wake_lock *lock)
 {
 	int type;
 	unsigned long irqflags;
+
+	/* nothing to do for a lock not held, or expired already */
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return;
+
 	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
+	del_active_locked(lock, type);
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 0);
 #endif
@@ -607,8 +693,10 @@ static int __init wakelocks_init(void)
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
+	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++) {
 		INIT_LIST_HEAD(&active_wake_locks[i]);
+		timed_wake_locks[i] = RB_ROOT;
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
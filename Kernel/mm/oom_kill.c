@@ -456,6 +456,7 @@ out:
 #endif
 
 static BLOCKING_NOTIFIER_HEAD(oom_notify_list);
+static ATOMIC_NOTIFIER_HEAD(oom_adj_notify_list);
 
 int register_oom_notifier(struct notifier_block *nb)
 {
@@ -469,6 +470,27 @@ int unregister_oom_notifier(struct notifier_block *nb)
 }
 EXPORT_SYMBOL_GPL(unregister_oom_notifier);
 
+int register_oom_adj_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&oom_adj_notify_list, nb);
+}
+EXPORT_SYMBOL_GPL(register_oom_adj_notifier);
+
+int unregister_oom_adj_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&oom_adj_notify_list, nb);
+}
+EXPORT_SYMBOL_GPL(unregister_oom_adj_notifier);
+
+/*
+ * oom_adj_notify - tells the oom_adj notifier chain about a task that was
+ * created, is exiting or got a new oom_adj.  Callbacks must not sleep.
+ */
+void oom_adj_notify(enum oom_adj_event event, struct task_struct *p)
+{
+	atomic_notifier_call_chain(&oom_adj_notify_list, event, p);
+}
+
 /*
  * Try to acquire the OOM killer lock for the zones in zonelist.  Returns zero
  * if a parallel OOM killing is already taking place that includes a zone in